@@ -36,6 +36,7 @@
 #include <assert.h>
 #include <loader.h>
 #include <memory.h>
+#include <time.h>
 
 /** Check whether a Linux kernel image is valid.
  * @param loader        Loader internal data.
@@ -152,8 +153,11 @@ __noreturn void linux_arch_load(linux_loader_t *loader) {
     void *virt;
     phys_ptr_t phys, initrd_max;
     list_t memory_map;
+    uint64_t start;
     status_t ret;
 
+    start = trace_begin();
+
     static_assert(sizeof(linux_params_t) == PAGE_SIZE);
     static_assert(offsetof(linux_params_t, hdr) == LINUX_HEADER_OFFSET);
 
@@ -226,6 +230,8 @@ __noreturn void linux_arch_load(linux_loader_t *loader) {
         params->hdr.ramdisk_size = loader->initrd_size;
     }
 
+    trace_end(TRACE_PHASE_LOAD, start, load_size + loader->initrd_size, "linux");
+
     /* Set the video mode. */
     linux_video_set(loader);
 
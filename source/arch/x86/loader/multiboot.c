@@ -32,6 +32,7 @@
 
 #include <loader.h>
 #include <memory.h>
+#include <time.h>
 #include <ui.h>
 
 /** Allocation parameters for Multiboot information. */
@@ -121,11 +122,34 @@ static void load_kernel_kludge(multiboot_loader_t *loader) {
     loader->kernel_end = alloc_base + alloc_size;
 }
 
+/** Compare ELF program headers by file offset.
+ * @param a             Pointer to first header.
+ * @param b             Pointer to second header.
+ * @return              Comparison result. */
+static int compare_phdrs(const void *a, const void *b) {
+    const multiboot_elf_phdr_t *first = a;
+    const multiboot_elf_phdr_t *second = b;
+
+    return (first->p_offset > second->p_offset) - (first->p_offset < second->p_offset);
+}
+
+/** Compare pointers to ELF section headers by file offset.
+ * @param a             Pointer to first header pointer.
+ * @param b             Pointer to second header pointer.
+ * @return              Comparison result. */
+static int compare_shdrs(const void *a, const void *b) {
+    const multiboot_elf_shdr_t *first = *(multiboot_elf_shdr_t *const *)a;
+    const multiboot_elf_shdr_t *second = *(multiboot_elf_shdr_t *const *)b;
+
+    return (first->sh_offset > second->sh_offset) - (first->sh_offset < second->sh_offset);
+}
+
 /** Load an ELF Multiboot kernel.
  * @param loader        Loader internal data. */
 static void load_kernel_elf(multiboot_loader_t *loader) {
     multiboot_elf_phdr_t *phdrs __cleanup_free;
-    size_t size;
+    multiboot_elf_shdr_t **load __cleanup_free = NULL;
+    size_t size, count;
     status_t ret;
 
     if (loader->ehdr.e_phentsize != sizeof(*phdrs))
@@ -138,6 +162,11 @@ static void load_kernel_elf(multiboot_loader_t *loader) {
     if (ret != STATUS_SUCCESS)
         boot_error("Error reading kernel image: %pS", ret);
 
+    /* Segments are read in file order, since going backwards is expensive on
+     * some sources: TFTP must restart the transfer and compressed images must
+     * be decompressed again from the start. */
+    qsort(phdrs, loader->ehdr.e_phnum, sizeof(*phdrs), compare_phdrs);
+
     /* Load in the image data. */
     loader->kernel_end = 0;
     for (size_t i = 0; i < loader->ehdr.e_phnum; i++) {
@@ -177,6 +206,9 @@ static void load_kernel_elf(multiboot_loader_t *loader) {
     /* Load section headers. */
     if (loader->ehdr.e_shnum) {
         multiboot_elf_shdr_t *shdrs;
+        offset_t start, base, end;
+        phys_ptr_t span_phys;
+        void *span;
 
         if (loader->ehdr.e_shentsize != sizeof(*shdrs))
             boot_error("Invalid ELF section header size");
@@ -189,11 +221,41 @@ static void load_kernel_elf(multiboot_loader_t *loader) {
         loader->info->elf.size = loader->ehdr.e_shentsize;
         loader->info->elf.shndx = loader->ehdr.e_shstrndx;
 
-        ret = fs_read(loader->handle, shdrs, size, loader->ehdr.e_shoff);
-        if (ret != STATUS_SUCCESS)
-            boot_error("Error reading kernel image: %pS", ret);
+        /* The unloaded sections and the section header table normally follow
+         * the segment data, with the header table last. Read everything from
+         * the end of the segment data to the end of the header table into one
+         * block, rather than reading the header table and then going back for
+         * the sections, and load sections from within it. */
+        start = loader->ehdr.e_phoff + (loader->ehdr.e_phnum * loader->ehdr.e_phentsize);
+        for (size_t i = 0; i < loader->ehdr.e_phnum; i++) {
+            if (phdrs[i].p_type == ELF_PT_LOAD)
+                start = max(start, phdrs[i].p_offset + phdrs[i].p_filesz);
+        }
+
+        span = NULL;
+        span_phys = 0;
+        base = round_down(start, PAGE_SIZE);
+        end = loader->ehdr.e_shoff + size;
+        if (loader->ehdr.e_shoff >= start) {
+            span = memory_alloc(
+                round_up(end - base, PAGE_SIZE), 0, loader->kernel_end, 0,
+                MEMORY_TYPE_ALLOCATED, 0, &span_phys);
 
-        /* Load in all unloaded sections. */
+            ret = fs_read(loader->handle, span + (start - base), end - start, start);
+            if (ret != STATUS_SUCCESS)
+                boot_error("Error reading kernel image: %pS", ret);
+
+            memcpy(shdrs, span + (loader->ehdr.e_shoff - base), size);
+        } else {
+            ret = fs_read(loader->handle, shdrs, size, loader->ehdr.e_shoff);
+            if (ret != STATUS_SUCCESS)
+                boot_error("Error reading kernel image: %pS", ret);
+        }
+
+        load = malloc(loader->ehdr.e_shnum * sizeof(*load));
+        count = 0;
+
+        /* Find space for all unloaded sections. */
         for (size_t i = 0; i < loader->ehdr.e_shnum; i++) {
             phys_size_t alloc_size, alloc_align;
             void *dest;
@@ -202,6 +264,22 @@ static void load_kernel_elf(multiboot_loader_t *loader) {
             if (shdrs[i].sh_addr || !shdrs[i].sh_size)
                 continue;
 
+            /* Use the data already read if the section is within it and the
+             * address it ends up at meets the section's alignment. */
+            if (span && shdrs[i].sh_type != ELF_SHT_NOBITS
+                && shdrs[i].sh_offset >= start && shdrs[i].sh_offset + shdrs[i].sh_size <= end)
+            {
+                phys = span_phys + (shdrs[i].sh_offset - base);
+                if (shdrs[i].sh_addralign <= 1 || !(phys % shdrs[i].sh_addralign)) {
+                    dprintf(
+                        "multiboot: loading ELF section %zu to 0x%" PRIxPHYS " (size: 0x%x)\n",
+                        i, phys, shdrs[i].sh_size);
+
+                    shdrs[i].sh_addr = phys;
+                    continue;
+                }
+            }
+
             /* Allocate space. */
             alloc_size = round_up(shdrs[i].sh_size, PAGE_SIZE);
             alloc_align = round_up(shdrs[i].sh_addralign, PAGE_SIZE);
@@ -216,13 +294,28 @@ static void load_kernel_elf(multiboot_loader_t *loader) {
             if (shdrs[i].sh_type == ELF_SHT_NOBITS) {
                 memset(dest, 0, shdrs[i].sh_size);
             } else {
-                ret = fs_read(loader->handle, dest, shdrs[i].sh_size, shdrs[i].sh_offset);
-                if (ret != STATUS_SUCCESS)
-                    boot_error("Error reading kernel image: %pS", ret);
+                load[count++] = &shdrs[i];
             }
 
             shdrs[i].sh_addr = phys;
         }
+
+        /* Get the data for the remaining sections. Those within the block read
+         * above but not suitably aligned there are copied from it. Others are
+         * read straight into place in file order, but this does still go back
+         * in the file. */
+        qsort(load, count, sizeof(*load), compare_shdrs);
+        for (size_t i = 0; i < count; i++) {
+            void *dest = (void *)phys_to_virt(load[i]->sh_addr);
+
+            if (span && load[i]->sh_offset >= start && load[i]->sh_offset + load[i]->sh_size <= end) {
+                memcpy(dest, span + (load[i]->sh_offset - base), load[i]->sh_size);
+            } else {
+                ret = fs_read(loader->handle, dest, load[i]->sh_size, load[i]->sh_offset);
+                if (ret != STATUS_SUCCESS)
+                    boot_error("Error reading kernel image: %pS", ret);
+            }
+        }
     }
 
     /* Save entry point address. */
@@ -253,10 +346,26 @@ static uint32_t join_cmdline(multiboot_loader_t *loader, char *path, value_t *ar
     return phys;
 }
 
+/** Allocate memory to load a module to.
+ * @param handle        Handle to the module.
+ * @param size          Size of the module.
+ * @param _phys         On input, the minimum address to allocate at. On
+ *                      output, the physical address of the allocation.
+ * @return              Virtual address of allocation. */
+static void *alloc_module(fs_handle_t *handle, size_t size, void *_phys) {
+    phys_ptr_t *phys = _phys;
+
+    /* We page-align modules regardless of the page-align header flag, because
+     * our allocator works with page alignment. Some kernels break if modules
+     * are not placed after the kernel. */
+    return memory_alloc(round_up(size, PAGE_SIZE), 0, *phys, 0, MEMORY_TYPE_MODULES, 0, phys);
+}
+
 /** Load a Multiboot kernel.
  * @param _loader       Pointer to loader internal data. */
 static __noreturn void multiboot_loader_load(void *_loader) {
     multiboot_loader_t *loader = _loader;
+    uint64_t start = trace_begin();
     uint32_t info_phys;
     char *str;
     list_t memory_map;
@@ -305,33 +414,31 @@ static __noreturn void multiboot_loader_load(void *_loader) {
         /* Load each module. */
         list_foreach(&loader->modules, iter) {
             multiboot_module_t *module = list_entry(iter, multiboot_module_t, header);
-            size_t size;
             void *dest;
             phys_ptr_t phys;
             status_t ret;
 
-            /* We page-align modules regardless of the page-align header flag,
-             * because our allocator works with page alignment. Some kernels
-             * break if modules are not placed after the kernel. */
-            size = round_up(module->handle->size, PAGE_SIZE);
-            dest = memory_alloc(size, 0, loader->kernel_end, 0, MEMORY_TYPE_MODULES, 0, &phys);
+            /* Load the module straight into a chunk of memory allocated for
+             * it. alloc_module() takes the minimum address in phys. */
+            phys = loader->kernel_end;
+            ret = fs_load(module->handle, alloc_module, &phys, &dest);
+            if (ret != STATUS_SUCCESS)
+                boot_error("Error reading '%s': %pS", module->path, ret);
 
             dprintf(
-                "multiboot: loading module '%s' to 0x%" PRIxPHYS " (size: %" PRIu64 ")\n",
+                "multiboot: loaded module '%s' to 0x%" PRIxPHYS " (size: %" PRIu64 ")\n",
                 module->path, phys, module->handle->size);
 
-            ret = fs_read(module->handle, dest, module->handle->size, 0);
-            if (ret != STATUS_SUCCESS)
-                boot_error("Error reading '%s': %pS", module->path, ret);
-
             modules[i].mod_start = phys;
-            modules[i].mod_end = phys + size;
+            modules[i].mod_end = phys + round_up(module->handle->size, PAGE_SIZE);
             modules[i].cmdline = join_cmdline(loader, module->path, &module->args);
 
             i++;
         }
     }
 
+    trace_end(TRACE_PHASE_LOAD, start, 0, "multiboot");
+
     /* Set the video mode. */
     loader->mode = (loader->header.flags & MULTIBOOT_VIDEO_MODE)
         ? video_env_set(current_environ, "video_mode")
@@ -523,7 +630,9 @@ static bool config_cmd_multiboot(value_list_t *args) {
             list_init(&module->header);
             list_append(&loader->modules, &module->header);
 
-            ret = fs_open(module->path, NULL, FILE_TYPE_REGULAR, FS_OPEN_DECOMPRESS, &module->handle);
+            ret = fs_open(
+                module->path, NULL, FILE_TYPE_REGULAR, FS_OPEN_DECOMPRESS | FS_OPEN_SEQUENTIAL,
+                &module->handle);
             if (ret != STATUS_SUCCESS) {
                 config_error("Error opening '%s': %pS", module->path, ret);
                 goto err_modules;
@@ -51,6 +51,19 @@ mstime_t current_time(void) {
     return (x86_rdtsc() - tsc_start_time) / tsc_cycles_per_msec;
 }
 
+/** Get a high-resolution timestamp.
+ * @return              Current TSC value relative to loader start. */
+uint64_t current_timestamp(void) {
+    return x86_rdtsc() - tsc_start_time;
+}
+
+/** Convert a timestamp to microseconds.
+ * @param timestamp     Timestamp (or difference between timestamps).
+ * @return              Equivalent time in microseconds. */
+uint64_t timestamp_to_usecs(uint64_t timestamp) {
+    return (timestamp * 1000) / tsc_cycles_per_msec;
+}
+
 /** Initialize the TSC. */
 void x86_time_init(void) {
     x86_cpuid_t cpuid;
@@ -77,6 +77,7 @@
 #include <memory.h>
 #include <menu.h>
 #include <shell.h>
+#include <time.h>
 
 /** Structure containing details of a command to run. */
 typedef struct command_list_entry {
@@ -736,7 +737,7 @@ void environ_set_device(environ_t *env, device_t *device) {
     value.string = (char *)device->name;
     environ_insert(env, "device", &value);
 
-    if (device->mount) {
+    if (device_mount(device)) {
         if (device->mount->label) {
             value.string = device->mount->label;
             environ_insert(env, "device_label", &value);
@@ -1445,6 +1446,7 @@ static command_list_t *parse_config_file(fs_handle_t *handle, const char *path)
  * @param must_exist    Whether the file must exist.
  */
 static void load_config_file(const char *path, bool must_exist) {
+    uint64_t start = trace_begin();
     command_list_t *list;
     fs_handle_t *handle;
     status_t ret;
@@ -1483,6 +1485,8 @@ static void load_config_file(const char *path, bool must_exist) {
 
     ok = command_list_exec(list, env);
     command_list_destroy(list);
+    trace_end(TRACE_PHASE_CONFIG, start, 0, NULL);
+
     if (ok) {
         /* Select an environment to boot. */
         target = menu_select(env);
@@ -29,6 +29,7 @@
 #include <fs.h>
 #include <loader.h>
 #include <memory.h>
+#include <time.h>
 
 /** List of all registered devices. */
 static LIST_DECLARE(device_list);
@@ -55,6 +56,53 @@ status_t device_read(device_t *device, void *buf, size_t count, offset_t offset)
     return device->ops->read(device, buf, count, offset);
 }
 
+/**
+ * Get the filesystem on a device.
+ *
+ * Devices are not probed for filesystems when they are registered, since
+ * doing so for every disk and partition is slow on systems with many disks.
+ * Instead, a device is probed the first time that its filesystem is needed.
+ *
+ * @param device        Device to get the filesystem of.
+ *
+ * @return              Mount for the device, or NULL if the device does not
+ *                      contain a recognized filesystem.
+ */
+fs_mount_t *device_mount(device_t *device) {
+    if (!device->probed) {
+        device->probed = true;
+
+        if (device->ops && device->ops->probe)
+            device->ops->probe(device);
+    }
+
+    return device->mount;
+}
+
+/** Probe all devices so that all child devices and filesystems are known. */
+static void probe_all_devices(void) {
+    /* Child devices are added after their parent, so will be reached. */
+    list_foreach(&device_list, iter) {
+        device_t *device = list_entry(iter, device_t, header);
+
+        device_mount(device);
+    }
+}
+
+/** Look up a device by name among the currently registered devices.
+ * @param name          Name to look up.
+ * @return              Matching device, or NULL if not found. */
+static device_t *find_device(const char *name) {
+    list_foreach(&device_list, iter) {
+        device_t *device = list_entry(iter, device_t, header);
+
+        if (strcmp(device->name, name) == 0)
+            return device;
+    }
+
+    return NULL;
+}
+
 /**
  * Look up a device.
  *
@@ -63,12 +111,16 @@ status_t device_read(device_t *device, void *buf, size_t count, offset_t offset)
  * "label:<label>", will be looked up by filesystem label. Otherwise, will be
  * looked up by the device name.
  *
+ * Looking up by UUID or label requires all devices to be probed. Looking up a
+ * child device by name (e.g. "hd0,1") probes its parent if necessary.
+ *
  * @param name          String to look up.
  *
  * @return              Matching device, or NULL if no matches found.
  */
 device_t *device_lookup(const char *name) {
     bool uuid = false, label = false;
+    device_t *device;
 
     if (strncmp(name, "uuid:", 5) == 0) {
         uuid = true;
@@ -81,22 +133,39 @@ device_t *device_lookup(const char *name) {
     if (!name[0])
         return NULL;
 
-    list_foreach(&device_list, iter) {
-        device_t *device = list_entry(iter, device_t, header);
+    if (uuid || label) {
+        probe_all_devices();
+
+        list_foreach(&device_list, iter) {
+            device = list_entry(iter, device_t, header);
 
-        if (uuid || label) {
             if (!device->mount)
                 continue;
 
             if (strcmp((uuid) ? device->mount->uuid : device->mount->label, name) == 0)
                 return device;
-        } else {
-            if (strcmp(device->name, name) == 0)
-                return device;
         }
+
+        return NULL;
     }
 
-    return NULL;
+    device = find_device(name);
+    if (!device) {
+        const char *sep = strrchr(name, ',');
+
+        /* Child devices are not registered until their parent is probed. */
+        if (sep) {
+            char *parent_name __cleanup_free = strndup(name, sep - name);
+            device_t *parent = device_lookup(parent_name);
+
+            if (parent && !parent->probed) {
+                device_mount(parent);
+                device = find_device(name);
+            }
+        }
+    }
+
+    return device;
 }
 
 /**
@@ -109,13 +178,42 @@ device_t *device_lookup(const char *name) {
  *                      be initialized).
  */
 void device_register(device_t *device) {
-    if (device_lookup(device->name))
+    const char *sep;
+    list_t *after;
+
+    if (find_device(device->name))
         internal_error("Device named '%s' already exists", device->name);
 
     device->mount = NULL;
+    device->probed = false;
+    device->sequential = false;
 
     list_init(&device->header);
-    list_append(&device_list, &device->header);
+
+    /* Child devices ("<parent>,<id>") can be registered some time after their
+     * parent when it is probed. Keep them grouped after the parent so that the
+     * device list stays in tree order. */
+    after = device_list.prev;
+    sep = strrchr(device->name, ',');
+    if (sep) {
+        size_t len = sep - device->name;
+        bool found = false;
+
+        list_foreach(&device_list, iter) {
+            device_t *exist = list_entry(iter, device_t, header);
+
+            if (strncmp(exist->name, device->name, len) == 0 &&
+                (!exist->name[len] || exist->name[len] == ','))
+            {
+                after = iter;
+                found = true;
+            } else if (found) {
+                break;
+            }
+        }
+    }
+
+    list_add_after(after, &device->header);
 }
 
 /** Set the current device.
@@ -170,6 +268,7 @@ static void print_device_list(printf_t func, size_t indent) {
  * @return              Whether successful. */
 static bool config_cmd_lsdevice(value_list_t *args) {
     if (args->count == 0) {
+        probe_all_devices();
         print_device_list(printf, 0);
         return true;
     } else if (args->count == 1 && args->values[0].type == VALUE_TYPE_STRING) {
@@ -182,6 +281,8 @@ static bool config_cmd_lsdevice(value_list_t *args) {
             return false;
         }
 
+        device_mount(device);
+
         printf("name       = %s\n", device->name);
 
         snprintf(buf, sizeof(buf), "Unknown");
@@ -215,7 +316,10 @@ BUILTIN_COMMAND("lsdevice", "List available devices", config_cmd_lsdevice);
 
 /** Initialize the device manager. */
 void device_init(void) {
+    uint64_t start = trace_begin();
+
     target_device_probe();
+    trace_end(TRACE_PHASE_DEVICE, start, 0, NULL);
 
     /* Print out a list of all devices. */
     dprintf("device: detected devices:\n");
@@ -226,7 +330,7 @@ void device_init(void) {
         dprintf("device: boot device is %s\n", boot_device->name);
         environ_set_device(root_environ, boot_device);
 
-        if (boot_device->mount && boot_directory) {
+        if (device_mount(boot_device) && boot_directory) {
             fs_handle_t *handle __cleanup_close = NULL;
             status_t ret;
 
@@ -242,6 +346,6 @@ void device_init(void) {
         }
     }
 
-    if (!boot_device || !boot_device->mount)
+    if (!boot_device || !device_mount(boot_device))
         boot_error("Unable to find boot filesystem");
 }
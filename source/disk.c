@@ -20,14 +20,63 @@
  */
 
 #include <lib/string.h>
+#include <lib/utility.h>
 
 #include <assert.h>
+#include <config.h>
 #include <disk.h>
 #include <fs.h>
 #include <loader.h>
 #include <memory.h>
 
-static void probe_disk(disk_device_t *disk);
+/** Size of a block cache line. Must be a multiple of any disk block size. */
+#define DISK_CACHE_LINE_SIZE    4096
+
+/** Default size of the block cache (in bytes). */
+#define DISK_CACHE_DEFAULT_SIZE (256 * 1024)
+
+/** Number of block cache hash buckets (power of 2). */
+#define DISK_CACHE_HASH_SIZE    64
+
+/** Size of the chunks that large transfers are split into for pipelining. */
+#define DISK_PIPELINE_CHUNK_SIZE    (256 * 1024)
+
+/** Maximum number of chunks in flight at once. */
+#define DISK_PIPELINE_DEPTH         4
+
+/** Default maximum read-ahead window (in bytes). */
+#define DISK_READAHEAD_DEFAULT_SIZE (64 * 1024)
+
+/** Number of buffers in the bounce buffer pool. */
+#define DISK_BOUNCE_COUNT           DISK_PIPELINE_DEPTH
+
+/** Structure describing a block cache line. */
+typedef struct disk_cache_line {
+    list_t header;                      /**< Link to LRU list. */
+    list_t hash_link;                   /**< Link to hash bucket. */
+
+    disk_device_t *disk;                /**< Raw disk the line is from (NULL if unused). */
+    uint64_t num;                       /**< Line number on the disk. */
+    void *data;                         /**< Cached data. */
+    bool readahead;                     /**< Whether read ahead and not yet used. */
+} disk_cache_line_t;
+
+/** Block cache state. */
+static size_t disk_cache_size = DISK_CACHE_DEFAULT_SIZE;
+static disk_cache_line_t *disk_cache_lines;
+static void *disk_cache_data;
+static LIST_DECLARE(disk_cache_lru);
+static list_t disk_cache_hash[DISK_CACHE_HASH_SIZE];
+
+/** Read-ahead state. */
+static size_t disk_readahead_size = DISK_READAHEAD_DEFAULT_SIZE;
+static size_t disk_readahead_max;
+static void *disk_readahead_buf;
+
+/** Bounce buffer pool for transfers to unaligned buffers. */
+static void *disk_bounce_pool;
+static size_t disk_bounce_size;
+static size_t disk_bounce_align;
 
 /** Next disk IDs. */
 static uint8_t next_disk_ids[DISK_TYPE_FLOPPY + 1];
@@ -39,84 +88,534 @@ static const char *const disk_type_names[] = {
     [DISK_TYPE_FLOPPY] = "floppy",
 };
 
-/** Read from a disk.
- * @param device        Device to read from.
+/**
+ * Block cache.
+ */
+
+/** Get the raw disk underlying a disk device.
+ * @param disk          Disk or partition.
+ * @param _lba          Where to store LBA of the device's start on the raw
+ *                      disk.
+ * @return              Raw disk device. */
+static disk_device_t *get_raw_disk(disk_device_t *disk, uint64_t *_lba) {
+    uint64_t lba = 0;
+
+    while (disk_device_is_partition(disk)) {
+        lba += disk->offset;
+        disk = disk->parent;
+    }
+
+    *_lba = lba;
+    return disk;
+}
+
+/** Free the block cache. */
+static void disk_cache_destroy(void) {
+    if (disk_cache_lines) {
+        free_large(disk_readahead_buf);
+        free_large(disk_cache_data);
+        free(disk_cache_lines);
+
+        disk_cache_lines = NULL;
+        disk_cache_data = NULL;
+        disk_readahead_buf = NULL;
+        list_init(&disk_cache_lru);
+    }
+}
+
+/** Allocate the block cache if it does not already exist.
+ * @return              Whether the cache is available. */
+static bool disk_cache_init(void) {
+    size_t count;
+
+    if (disk_cache_lines) {
+        return true;
+    } else if (!disk_cache_size) {
+        return false;
+    }
+
+    count = disk_cache_size / DISK_CACHE_LINE_SIZE;
+    disk_cache_lines = malloc(sizeof(*disk_cache_lines) * count);
+    disk_cache_data = malloc_large(count * DISK_CACHE_LINE_SIZE);
+
+    for (size_t i = 0; i < DISK_CACHE_HASH_SIZE; i++)
+        list_init(&disk_cache_hash[i]);
+
+    for (size_t i = 0; i < count; i++) {
+        disk_cache_line_t *line = &disk_cache_lines[i];
+
+        list_init(&line->header);
+        list_init(&line->hash_link);
+        line->disk = NULL;
+        line->data = disk_cache_data + (i * DISK_CACHE_LINE_SIZE);
+        line->readahead = false;
+
+        list_append(&disk_cache_lru, &line->header);
+    }
+
+    /* Limit the read-ahead window so that a single read-ahead cannot flush
+     * most of the cache. */
+    disk_readahead_max = min(disk_readahead_size / DISK_CACHE_LINE_SIZE, count / 4);
+    if (disk_readahead_max > 1)
+        disk_readahead_buf = malloc_large(disk_readahead_max * DISK_CACHE_LINE_SIZE);
+
+    return true;
+}
+
+/**
+ * Get the bounce buffer pool.
+ *
+ * Gets the pool of bounce buffers used for transfers to buffers that are not
+ * suitably aligned for a disk. The pool contains DISK_BOUNCE_COUNT buffers
+ * which are each at least DISK_PIPELINE_CHUNK_SIZE bytes, and which are placed
+ * consecutively starting from the returned address. It is allocated once and
+ * only reallocated if a disk with a larger block size or alignment needs it.
+ *
+ * @param disk          Raw disk that will be transferred from.
+ * @param _size         Where to store the size of each buffer.
+ *
+ * @return              Address of the first buffer.
+ */
+static void *disk_bounce_get(disk_device_t *disk, size_t *_size) {
+    size_t align = round_up(max(disk->align, 1), PAGE_SIZE);
+    size_t size = round_up(max(DISK_PIPELINE_CHUNK_SIZE, disk->block_size), align);
+
+    if (!disk_bounce_pool || size > disk_bounce_size || align > disk_bounce_align) {
+        if (disk_bounce_pool)
+            memory_free(disk_bounce_pool, disk_bounce_size * DISK_BOUNCE_COUNT);
+
+        disk_bounce_size = max(size, disk_bounce_size);
+        disk_bounce_align = max(align, disk_bounce_align);
+        disk_bounce_pool = memory_alloc(
+            disk_bounce_size * DISK_BOUNCE_COUNT, disk_bounce_align, 0, 0,
+            MEMORY_TYPE_INTERNAL, MEMORY_ALLOC_HIGH, NULL);
+    }
+
+    *_size = disk_bounce_size;
+    return disk_bounce_pool;
+}
+
+/** Check whether a buffer can be transferred into directly.
+ * @param disk          Raw disk that will be transferred from.
+ * @param buf           Buffer to check.
+ * @return              Whether the buffer is suitably aligned. */
+static inline bool disk_buffer_aligned(disk_device_t *disk, void *buf) {
+    return !disk->align || !((ptr_t)buf & (disk->align - 1));
+}
+
+/** Get the hash bucket for a cache line.
+ * @param disk          Raw disk the line is from.
+ * @param num           Line number.
+ * @return              Hash bucket. */
+static inline list_t *disk_cache_bucket(disk_device_t *disk, uint64_t num) {
+    return &disk_cache_hash[(num ^ ((ptr_t)disk >> 4)) & (DISK_CACHE_HASH_SIZE - 1)];
+}
+
+/** Look up a line in the block cache.
+ * @param disk          Raw disk the line is from.
+ * @param num           Line number.
+ * @return              Pointer to line if cached, NULL if not. */
+static disk_cache_line_t *disk_cache_lookup(disk_device_t *disk, uint64_t num) {
+    list_foreach(disk_cache_bucket(disk, num), iter) {
+        disk_cache_line_t *line = list_entry(iter, disk_cache_line_t, hash_link);
+
+        if (line->disk == disk && line->num == num)
+            return line;
+    }
+
+    return NULL;
+}
+
+/** Take the least recently used line for reuse.
+ * @return              Line which has been removed from the cache. */
+static disk_cache_line_t *disk_cache_evict(void) {
+    disk_cache_line_t *line;
+
+    line = list_last(&disk_cache_lru, disk_cache_line_t, header);
+    list_remove(&line->hash_link);
+
+    if (line->disk && line->readahead)
+        line->disk->readahead_waste++;
+
+    line->disk = NULL;
+    line->readahead = false;
+    return line;
+}
+
+/** Insert a line into the block cache.
+ * @param line          Line to insert (previously returned by
+ *                      disk_cache_evict()).
+ * @param disk          Raw disk the line is from.
+ * @param num           Line number.
+ * @param readahead     Whether the line was read ahead of being needed. */
+static void disk_cache_insert(disk_cache_line_t *line, disk_device_t *disk, uint64_t num, bool readahead) {
+    line->disk = disk;
+    line->num = num;
+    line->readahead = readahead;
+    list_append(disk_cache_bucket(disk, num), &line->hash_link);
+    list_prepend(&disk_cache_lru, &line->header);
+}
+
+/**
+ * Get the size of the read-ahead window for a cache miss.
+ *
+ * Sequential streams are detected by a miss on the line immediately after the
+ * end of the previous read. The window starts at a single line and doubles on
+ * each sequential miss, up to the configured maximum. If the caller has hinted
+ * that it is reading sequentially, the maximum is used straight away.
+ *
+ * @param disk          Raw disk being read.
+ * @param sequential    Whether the caller hinted that it is reading
+ *                      sequentially.
+ * @param num           Line number that missed.
+ *
+ * @return              Number of lines to read, including the missed line.
+ */
+static size_t disk_readahead_window(disk_device_t *disk, bool sequential, uint64_t num) {
+    size_t blocks_per_line = DISK_CACHE_LINE_SIZE / disk->block_size;
+    uint64_t total = round_up(disk->blocks, blocks_per_line) / blocks_per_line;
+    size_t window;
+
+    if (!disk_readahead_buf) {
+        window = 1;
+    } else if (sequential) {
+        window = disk_readahead_max;
+    } else if (num == disk->readahead_next && disk->readahead_window) {
+        window = min(disk->readahead_window * 2, disk_readahead_max);
+    } else {
+        window = 1;
+    }
+
+    disk->readahead_window = window;
+
+    /* Don't read past the end of the disk or over lines that are already
+     * cached. */
+    window = min(window, total - num);
+    for (size_t i = 1; i < window; i++) {
+        if (disk_cache_lookup(disk, num + i)) {
+            window = i;
+            break;
+        }
+    }
+
+    return window;
+}
+
+/** Get a line from the block cache, reading it in if not present.
+ * @param disk          Raw disk to get from.
+ * @param num           Line number.
+ * @param sequential    Whether the caller hinted that it is reading
+ *                      sequentially.
+ * @param _line         Where to store pointer to cache line.
+ * @return              Status code describing the result of the operation. */
+static status_t disk_cache_get(disk_device_t *disk, uint64_t num, bool sequential, disk_cache_line_t **_line) {
+    size_t blocks_per_line = DISK_CACHE_LINE_SIZE / disk->block_size;
+    disk_cache_line_t *line;
+    size_t window;
+    uint64_t lba;
+    status_t ret;
+
+    line = disk_cache_lookup(disk, num);
+    if (line) {
+        if (line->readahead) {
+            line->readahead = false;
+            disk->readahead_hits++;
+        }
+
+        /* Move to the head of the LRU list. */
+        list_prepend(&disk_cache_lru, &line->header);
+        disk->cache_hits++;
+
+        *_line = line;
+        return STATUS_SUCCESS;
+    }
+
+    disk->cache_misses++;
+
+    lba = num * blocks_per_line;
+    window = disk_readahead_window(disk, sequential, num);
+
+    if (window > 1) {
+        /* Read the whole window with one transfer and then distribute it into
+         * cache lines. If this fails, fall back to reading just the line we
+         * need in case the failure was caused by reading ahead. */
+        ret = disk->ops->read_blocks(
+            disk, disk_readahead_buf, min(window * blocks_per_line, disk->blocks - lba), lba);
+        if (ret == STATUS_SUCCESS) {
+            for (size_t i = window; i > 0; i--) {
+                line = disk_cache_evict();
+                memcpy(line->data, disk_readahead_buf + ((i - 1) * DISK_CACHE_LINE_SIZE), DISK_CACHE_LINE_SIZE);
+                disk_cache_insert(line, disk, num + i - 1, i > 1);
+            }
+
+            disk->readahead_next = num + window;
+
+            *_line = line;
+            return STATUS_SUCCESS;
+        }
+
+        disk->readahead_window = 0;
+    }
+
+    /* Reuse the least recently used line. */
+    line = disk_cache_evict();
+
+    ret = disk->ops->read_blocks(disk, line->data, min(blocks_per_line, disk->blocks - lba), lba);
+    if (ret != STATUS_SUCCESS)
+        return ret;
+
+    disk_cache_insert(line, disk, num, false);
+    disk->readahead_next = num + 1;
+
+    *_line = line;
+    return STATUS_SUCCESS;
+}
+
+/** Read from a disk through the block cache.
+ * @param disk          Disk to read from.
  * @param buf           Buffer to read into.
- * @param count         Number of bytes to read.
+ * @param count         Maximum number of bytes to read.
  * @param offset        Offset in the disk to read from.
- * @return              Whether the read was successful. */
-static status_t disk_device_read(device_t *device, void *buf, size_t count, offset_t offset) {
-    disk_device_t *disk = (disk_device_t *)device;
-    void *tmp __cleanup_free = NULL;
-    uint64_t start, end;
-    size_t size;
+ * @param _size         Where to store number of bytes read (transfers are
+ *                      truncated at the end of a cache line).
+ * @return              Status code describing the result of the operation. */
+static status_t disk_cache_read(disk_device_t *disk, void *buf, size_t count, offset_t offset, size_t *_size) {
+    disk_device_t *raw;
+    disk_cache_line_t *line;
+    uint64_t lba;
+    size_t line_offset;
     status_t ret;
 
-    if (offset + count > disk->blocks * disk->block_size)
-        return STATUS_END_OF_FILE;
+    raw = get_raw_disk(disk, &lba);
+    offset += lba * disk->block_size;
+
+    ret = disk_cache_get(raw, offset / DISK_CACHE_LINE_SIZE, disk->device.sequential, &line);
+    if (ret != STATUS_SUCCESS)
+        return ret;
 
-    /* Now work out the start block and the end block. Subtract one from count
-     * to prevent end from going onto the next block when the offset plus the
-     * count is an exact multiple of the block size. */
-    start = offset / disk->block_size;
-    end = (offset + (count - 1)) / disk->block_size;
-
-    /* If we're not starting on a block boundary, we need to do a partial
-     * transfer on the initial block to get up to a block boundary. If the
-     * transfer only goes across one block, this will handle it. */
-    if (offset % disk->block_size) {
-        tmp = malloc(disk->block_size);
-
-        /* Read the block into the temporary buffer. */
-        ret = disk->ops->read_blocks(disk, tmp, 1, start);
-        if (ret != STATUS_SUCCESS)
+    line_offset = offset % DISK_CACHE_LINE_SIZE;
+    *_size = min(count, DISK_CACHE_LINE_SIZE - line_offset);
+    memcpy(buf, line->data + line_offset, *_size);
+    return STATUS_SUCCESS;
+}
+
+/**
+ * Asynchronous reads.
+ */
+
+/**
+ * Start an asynchronous read from a disk.
+ *
+ * Starts reading blocks from a disk. If the disk backend does not support
+ * asynchronous I/O, the read is performed synchronously and the request will
+ * be complete upon return. The request must be completed with
+ * disk_device_complete() before the buffer is used, or the request structure
+ * is reused.
+ *
+ * @param disk          Disk or partition to read from.
+ * @param request       Request structure to use.
+ * @param buf           Buffer to read into.
+ * @param count         Number of blocks to read.
+ * @param lba           Block number to start reading from.
+ *
+ * @return              Status code describing the result of the operation.
+ */
+status_t disk_device_submit(disk_device_t *disk, disk_request_t *request, void *buf, size_t count, uint64_t lba) {
+    disk_device_t *raw;
+    uint64_t offset;
+    status_t ret;
+
+    raw = get_raw_disk(disk, &offset);
+
+    request->disk = raw;
+    request->buf = buf;
+    request->count = count;
+    request->lba = lba + offset;
+    request->pending = false;
+    request->data = NULL;
+
+    if (raw->ops->submit_read) {
+        ret = raw->ops->submit_read(raw, request);
+        if (ret != STATUS_NOT_SUPPORTED)
             return ret;
+    }
 
-        size = (start == end) ? count : disk->block_size - (size_t)(offset % disk->block_size);
-        memcpy(buf, tmp + (offset % disk->block_size), size);
-        buf += size;
-        count -= size;
-        start++;
+    request->status = raw->ops->read_blocks(raw, buf, count, request->lba);
+    return STATUS_SUCCESS;
+}
+
+/** Check whether an asynchronous read has completed.
+ * @param request       Request to check.
+ * @return              Whether the request has completed. */
+bool disk_device_poll(disk_request_t *request) {
+    if (!request->pending)
+        return true;
+
+    return request->disk->ops->poll(request->disk, request);
+}
+
+/** Wait for an asynchronous read to complete.
+ * @param request       Request to wait for.
+ * @return              Status code describing the result of the read. */
+status_t disk_device_complete(disk_request_t *request) {
+    while (!disk_device_poll(request))
+        arch_pause();
+
+    return request->status;
+}
+
+/**
+ * Read a large block-aligned transfer from a disk.
+ *
+ * If the disk supports asynchronous reads, the transfer is split into chunks
+ * with several in flight at once. If the buffer does not meet the disk's
+ * alignment requirement, data is read into the bounce buffer pool, and each
+ * chunk is copied out while the following chunks are being read.
+ *
+ * @param disk          Disk or partition to read from.
+ * @param buf           Buffer to read into.
+ * @param count         Number of blocks to read.
+ * @param lba           Block number to start reading from.
+ *
+ * @return              Status code describing the result of the operation.
+ */
+static status_t disk_pipeline_read(disk_device_t *disk, void *buf, size_t count, uint64_t lba) {
+    disk_request_t requests[DISK_PIPELINE_DEPTH];
+    void *bounce = NULL;
+    size_t chunk, bounce_size, submitted, completed, head, tail, in_flight;
+    disk_device_t *raw;
+    uint64_t offset;
+    bool aligned;
+    status_t ret;
+
+    raw = get_raw_disk(disk, &offset);
+    aligned = disk_buffer_aligned(raw, buf);
+
+    if (aligned && !raw->ops->submit_read)
+        return disk->ops->read_blocks(disk, buf, count, lba);
+
+    if (aligned) {
+        chunk = max(DISK_PIPELINE_CHUNK_SIZE / disk->block_size, 1);
+    } else {
+        bounce = disk_bounce_get(raw, &bounce_size);
+        chunk = bounce_size / disk->block_size;
     }
 
-    /* Handle any full blocks. */
-    while (count / disk->block_size) {
-        void *dest;
+    ret = STATUS_SUCCESS;
+    submitted = completed = head = tail = in_flight = 0;
 
-        /* Some disk backends (e.g. EFI) cannot handle unaligned buffers. */
-        if ((ptr_t)buf % 8) {
-            if (!tmp)
-                tmp = malloc(disk->block_size);
+    while (true) {
+        /* Keep the pipeline full. Stop submitting after an error, but still
+         * wait for everything in flight to finish. */
+        while (ret == STATUS_SUCCESS && in_flight < DISK_PIPELINE_DEPTH && submitted < count) {
+            size_t size = min(chunk, count - submitted);
+            void *dest = (aligned)
+                ? buf + (submitted * disk->block_size)
+                : bounce + (head * bounce_size);
 
-            dest = tmp;
-            size = 1;
-        } else {
-            dest = buf;
-            size = count / disk->block_size;
-        }
+            ret = disk_device_submit(disk, &requests[head], dest, size, lba + submitted);
+            if (ret != STATUS_SUCCESS)
+                break;
 
-        ret = disk->ops->read_blocks(disk, dest, size, start);
-        if (ret != STATUS_SUCCESS)
-            return ret;
+            submitted += size;
+            head = (head + 1) % DISK_PIPELINE_DEPTH;
+            in_flight++;
+        }
 
-        if (dest != buf)
-            memcpy(buf, dest, disk->block_size);
+        if (!in_flight)
+            break;
+
+        /* Wait for the oldest request and copy out its data. */
+        if (disk_device_complete(&requests[tail]) != STATUS_SUCCESS) {
+            if (ret == STATUS_SUCCESS)
+                ret = requests[tail].status;
+        } else if (!aligned && ret == STATUS_SUCCESS) {
+            memcpy(
+                buf + (completed * disk->block_size), requests[tail].buf,
+                requests[tail].count * disk->block_size);
+        }
 
-        buf += size * disk->block_size;
-        count -= size * disk->block_size;
-        start += size;
+        completed += requests[tail].count;
+        tail = (tail + 1) % DISK_PIPELINE_DEPTH;
+        in_flight--;
     }
 
-    /* Handle anything that's left. */
-    if (count) {
-        if (!tmp)
-            tmp = malloc(disk->block_size);
+    return ret;
+}
+
+/**
+ * Disk device operations.
+ */
 
-        ret = disk->ops->read_blocks(disk, tmp, 1, start);
-        if (ret != STATUS_SUCCESS)
-            return ret;
+/**
+ * Read from a disk.
+ *
+ * Small and partial-block transfers, which are typically filesystem metadata,
+ * are satisfied from the block cache. Large block-aligned transfers bypass the
+ * cache and are read directly into the destination buffer, or through the
+ * bounce buffer pool if it is not suitably aligned.
+ *
+ * @param device        Device to read from.
+ * @param buf           Buffer to read into.
+ * @param count         Number of bytes to read.
+ * @param offset        Offset in the disk to read from.
+ *
+ * @return              Whether the read was successful.
+ */
+static status_t disk_device_read(device_t *device, void *buf, size_t count, offset_t offset) {
+    disk_device_t *disk = (disk_device_t *)device;
+    bool cached;
+    status_t ret;
+
+    if (offset + count > disk->blocks * disk->block_size)
+        return STATUS_END_OF_FILE;
+
+    cached = disk->block_size <= DISK_CACHE_LINE_SIZE && disk_cache_init();
+
+    while (count) {
+        uint64_t lba = offset / disk->block_size;
+        size_t block_offset = offset % disk->block_size;
+        size_t size;
+
+        if (!block_offset && count >= DISK_CACHE_LINE_SIZE) {
+            /* Handle full blocks directly. */
+            size = count / disk->block_size;
+
+            ret = disk_pipeline_read(disk, buf, size, lba);
+            if (ret != STATUS_SUCCESS)
+                return ret;
+
+            size *= disk->block_size;
+        } else {
+            /* Partial or small transfer, go through the cache if possible. If
+             * reading a whole line fails (e.g. the disk size is not known
+             * exactly), fall back to reading just the blocks that we need
+             * into a bounce buffer. */
+            ret = (cached)
+                ? disk_cache_read(disk, buf, count, offset, &size)
+                : STATUS_NOT_SUPPORTED;
+            if (ret != STATUS_SUCCESS) {
+                uint64_t raw_lba;
+                size_t bounce_size, blocks;
+                void *bounce;
+
+                bounce = disk_bounce_get(get_raw_disk(disk, &raw_lba), &bounce_size);
+                blocks = min(
+                    round_up(block_offset + count, disk->block_size) / disk->block_size,
+                    bounce_size / disk->block_size);
+
+                ret = disk->ops->read_blocks(disk, bounce, blocks, lba);
+                if (ret != STATUS_SUCCESS)
+                    return ret;
+
+                size = min(count, (blocks * disk->block_size) - block_offset);
+                memcpy(buf, bounce + block_offset, size);
+            }
+        }
 
-        memcpy(buf, tmp, count);
+        buf += size;
+        offset += size;
+        count -= size;
     }
 
     return STATUS_SUCCESS;
@@ -131,10 +630,20 @@ static void disk_device_identify(device_t *device, device_identify_t type, char
     disk_device_t *disk = (disk_device_t *)device;
 
     if (type == DEVICE_IDENTIFY_LONG) {
-        size_t ret = snprintf(buf, size,
+        disk_device_t *raw;
+        uint64_t lba;
+        size_t ret;
+
+        /* Partitions share the cache of their parent. */
+        raw = get_raw_disk(disk, &lba);
+
+        ret = snprintf(buf, size,
             "block size = %zu\n"
-            "blocks     = %" PRIu64 "\n",
-            disk->block_size, disk->blocks);
+            "blocks     = %" PRIu64 "\n"
+            "cache      = %" PRIu64 " hits, %" PRIu64 " misses\n"
+            "read-ahead = %" PRIu64 " hits, %" PRIu64 " wasted\n",
+            disk->block_size, disk->blocks, raw->cache_hits, raw->cache_misses,
+            raw->readahead_hits, raw->readahead_waste);
         buf += ret;
         size -= ret;
     }
@@ -143,10 +652,13 @@ static void disk_device_identify(device_t *device, device_identify_t type, char
         disk->ops->identify(disk, type, buf, size);
 }
 
+static void disk_device_probe(device_t *device);
+
 /** Disk device operations. */
 static device_ops_t disk_device_ops = {
     .read = disk_device_read,
     .identify = disk_device_identify,
+    .probe = disk_device_probe,
 };
 
 /** Read blocks from a partition.
@@ -182,8 +694,9 @@ static disk_ops_t partition_disk_ops = {
  * @param parent        Parent of the partition.
  * @param id            ID of the partition.
  * @param lba           Start LBA.
- * @param blocks        Size in blocks. */
-static void add_partition(disk_device_t *parent, uint8_t id, uint64_t lba, uint64_t blocks) {
+ * @param blocks        Size in blocks.
+ * @param no_fs         Whether the partition does not contain a filesystem. */
+static void add_partition(disk_device_t *parent, uint8_t id, uint64_t lba, uint64_t blocks, bool no_fs) {
     disk_device_t *partition;
     char *name;
 
@@ -194,9 +707,17 @@ static void add_partition(disk_device_t *parent, uint8_t id, uint64_t lba, uint6
     partition->ops = &partition_disk_ops;
     partition->blocks = blocks;
     partition->block_size = parent->block_size;
+    partition->align = parent->align;
     partition->id = id;
+    partition->cache_hits = 0;
+    partition->cache_misses = 0;
+    partition->readahead_next = 0;
+    partition->readahead_window = 0;
+    partition->readahead_hits = 0;
+    partition->readahead_waste = 0;
     partition->parent = parent;
     partition->offset = lba;
+    partition->no_fs = no_fs;
 
     name = malloc(16);
     snprintf(name, 16, "%s,%u", parent->device.name, id);
@@ -207,19 +728,22 @@ static void add_partition(disk_device_t *parent, uint8_t id, uint64_t lba, uint6
 
     device_register(&partition->device);
 
-    /* Check if this is the boot partition. */
+    /* Check if this is the boot partition. If so, probe it straight away,
+     * other partitions are probed when they are first used. */
     if (boot_device == &parent->device && parent->ops->is_boot_partition) {
-        if (parent->ops->is_boot_partition(parent, id, lba))
+        if (parent->ops->is_boot_partition(parent, id, lba)) {
             boot_device = &partition->device;
+            device_mount(boot_device);
+        }
     }
-
-    probe_disk(partition);
 }
 
 /** Probe a disk device's contents.
- * @param disk          Disk device to probe. */
-static void probe_disk(disk_device_t *disk) {
-    if (!disk->blocks)
+ * @param device        Disk device to probe. */
+static void disk_device_probe(device_t *device) {
+    disk_device_t *disk = (disk_device_t *)device;
+
+    if (!disk->blocks || disk->no_fs)
         return;
 
     /* Probe for filesystems. */
@@ -245,8 +769,15 @@ void disk_device_register(disk_device_t *disk, bool boot) {
     char *name;
 
     list_init(&disk->partitions);
+    disk->cache_hits = 0;
+    disk->cache_misses = 0;
+    disk->readahead_next = 0;
+    disk->readahead_window = 0;
+    disk->readahead_hits = 0;
+    disk->readahead_waste = 0;
     disk->parent = NULL;
     disk->partition_ops = NULL;
+    disk->no_fs = false;
 
     /* Assign an ID for the disk and name it. */
     disk->id = next_disk_ids[disk->type]++;
@@ -259,8 +790,48 @@ void disk_device_register(disk_device_t *disk, bool boot) {
     disk->device.name = name;
     device_register(&disk->device);
 
-    if (boot)
+    /* Only the boot device is probed now, other devices are probed when they
+     * are first used. */
+    if (boot) {
         boot_device = &disk->device;
+        device_mount(boot_device);
+    }
+}
+
+/**
+ * Configuration commands.
+ */
+
+/** Set the size of the disk block cache.
+ * @param args          Argument list.
+ * @return              Whether successful. */
+static bool config_cmd_diskcache(value_list_t *args) {
+    if (args->count != 1 || args->values[0].type != VALUE_TYPE_INTEGER) {
+        config_error("Invalid arguments");
+        return false;
+    }
 
-    probe_disk(disk);
+    /* The cache will be reallocated at the new size on the next read. */
+    disk_cache_destroy();
+    disk_cache_size = round_down(args->values[0].integer * 1024, DISK_CACHE_LINE_SIZE);
+    return true;
 }
+
+BUILTIN_COMMAND("diskcache", "Set the size of the disk block cache", config_cmd_diskcache);
+
+/** Set the maximum disk read-ahead window.
+ * @param args          Argument list.
+ * @return              Whether successful. */
+static bool config_cmd_diskreadahead(value_list_t *args) {
+    if (args->count != 1 || args->values[0].type != VALUE_TYPE_INTEGER) {
+        config_error("Invalid arguments");
+        return false;
+    }
+
+    /* The read-ahead buffer is allocated along with the cache. */
+    disk_cache_destroy();
+    disk_readahead_size = round_down(args->values[0].integer * 1024, DISK_CACHE_LINE_SIZE);
+    return true;
+}
+
+BUILTIN_COMMAND("diskreadahead", "Set the maximum disk read-ahead window", config_cmd_diskreadahead);
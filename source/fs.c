@@ -21,6 +21,8 @@
 
 #include <fs/decompress.h>
 
+#include <lib/ctype.h>
+#include <lib/list.h>
 #include <lib/string.h>
 #include <lib/utility.h>
 
@@ -29,6 +31,31 @@
 #include <device.h>
 #include <fs.h>
 #include <memory.h>
+#include <time.h>
+
+/** Number of directory entry cache hash buckets (power of 2). */
+#define DENTRY_HASH_SIZE        64
+
+/** Maximum number of cached directory entries per mount. */
+#define DENTRY_CACHE_MAX        512
+
+/** Cached result of looking up a name in a directory. */
+typedef struct fs_dentry {
+    list_t link;                        /**< Link to hash bucket. */
+    fs_handle_t *parent;                /**< Directory the entry was looked up in. */
+    fs_handle_t *handle;                /**< Handle to the entry (NULL if not found). */
+    uint32_t hash;                      /**< Hash of the name. */
+    char name[];                        /**< Name of the entry. */
+} fs_dentry_t;
+
+/** Per-mount directory entry cache. */
+typedef struct fs_dentry_cache {
+    list_t buckets[DENTRY_HASH_SIZE];   /**< Hash buckets. */
+    size_t count;                       /**< Number of cached entries. */
+} fs_dentry_cache_t;
+
+/** Nesting depth of fs_read() calls, to only trace the outermost read. */
+static unsigned fs_read_depth;
 
 /** Initialize a file handle.
  * @param handle        Handle to initialize.
@@ -56,6 +83,18 @@ static status_t post_open(fs_handle_t *handle, file_type_t type, unsigned flags,
         return (type == FILE_TYPE_DIR) ? STATUS_NOT_DIR : STATUS_NOT_FILE;
     }
 
+    /* Access pattern hints are passed on to the device by fs_read(). This is
+     * set on the underlying handle, so if the file is compressed it applies to
+     * the reads the decompressor makes for its input. The hint is per-open,
+     * so it can only be applied to a handle that nobody else is using. If the
+     * filesystem has given us a handle that is shared, drop any hint that a
+     * previous open set on it. */
+    if (handle->count > 1 || handle->flags & FS_HANDLE_CACHED) {
+        handle->flags &= ~FS_HANDLE_SEQUENTIAL;
+    } else if (flags & FS_OPEN_SEQUENTIAL && handle->type == FILE_TYPE_REGULAR) {
+        handle->flags |= FS_HANDLE_SEQUENTIAL;
+    }
+
     /* Check if the file is compressed. */
     if (flags & FS_OPEN_DECOMPRESS && handle->type == FILE_TYPE_REGULAR) {
         if (decompress_open(handle, _handle))
@@ -89,6 +128,10 @@ status_t fs_open_entry(const fs_entry_t *entry, file_type_t type, unsigned flags
     if (!ops->open_entry)
         return STATUS_NOT_SUPPORTED;
 
+    /* Don't bother opening if we already know it's the wrong type. */
+    if (type != FILE_TYPE_NONE && entry->type != FILE_TYPE_NONE && entry->type != type)
+        return (type == FILE_TYPE_DIR) ? STATUS_NOT_DIR : STATUS_NOT_FILE;
+
     ret = ops->open_entry(entry, &handle);
     if (ret != STATUS_SUCCESS)
         return ret;
@@ -96,6 +139,116 @@ status_t fs_open_entry(const fs_entry_t *entry, file_type_t type, unsigned flags
     return post_open(handle, type, flags, _handle);
 }
 
+/** Hash a directory entry name.
+ * @param mount         Mount the entry is on.
+ * @param parent        Directory containing the entry.
+ * @param name          Name of the entry.
+ * @return              Hash of the name. */
+static uint32_t dentry_hash(fs_mount_t *mount, fs_handle_t *parent, const char *name) {
+    uint32_t hash = 2166136261u;
+
+    while (*name) {
+        hash ^= (mount->case_insensitive) ? tolower(*name) : *name;
+        hash *= 16777619;
+        name++;
+    }
+
+    return hash ^ (uint32_t)((ptr_t)parent >> 4);
+}
+
+/**
+ * Look up an entry in the directory entry cache.
+ *
+ * Looks up a directory entry in the cache. Entries are only cached for
+ * directories that will remain alive as long as the mount does, which are the
+ * root directory and directories that are themselves in the cache, since the
+ * handle pointer is used as part of the key.
+ *
+ * @param parent        Directory to look up in.
+ * @param name          Name of the entry.
+ * @param hash          Hash of the name.
+ *
+ * @return              Pointer to cached entry if found, NULL if not.
+ */
+static fs_dentry_t *dentry_lookup(fs_handle_t *parent, const char *name, uint32_t hash) {
+    fs_mount_t *mount = parent->mount;
+    list_t *bucket;
+
+    if (!mount->dentries)
+        return NULL;
+
+    bucket = &mount->dentries->buckets[hash & (DENTRY_HASH_SIZE - 1)];
+
+    list_foreach(bucket, iter) {
+        fs_dentry_t *dentry = list_entry(iter, fs_dentry_t, link);
+        int result;
+
+        if (dentry->hash != hash || dentry->parent != parent)
+            continue;
+
+        result = (mount->case_insensitive)
+            ? strcasecmp(dentry->name, name)
+            : strcmp(dentry->name, name);
+
+        if (!result)
+            return dentry;
+    }
+
+    return NULL;
+}
+
+/** Add an entry to the directory entry cache.
+ * @param parent        Directory the entry was looked up in.
+ * @param name          Name of the entry.
+ * @param hash          Hash of the name.
+ * @param handle        Handle to the entry, or NULL if it was not found. The
+ *                      cache takes a new reference to the handle. Only
+ *                      directories are cached. */
+static void dentry_insert(fs_handle_t *parent, const char *name, uint32_t hash, fs_handle_t *handle) {
+    fs_mount_t *mount = parent->mount;
+    fs_dentry_t *dentry;
+    size_t len;
+
+    if (parent != mount->root && !(parent->flags & FS_HANDLE_CACHED))
+        return;
+
+    /* Cached handles are never closed, so caching files would keep any state
+     * they hold (e.g. block map buffers) around for the lifetime of the mount.
+     * Files are rarely opened more than once anyway, it is the directories on
+     * the way to them that are looked up repeatedly. */
+    if (handle && handle->type != FILE_TYPE_DIR)
+        return;
+
+    if (!mount->dentries) {
+        mount->dentries = malloc(sizeof(*mount->dentries));
+        mount->dentries->count = 0;
+
+        for (size_t i = 0; i < DENTRY_HASH_SIZE; i++)
+            list_init(&mount->dentries->buckets[i]);
+    }
+
+    /* Cached handles are held for the lifetime of the mount, so rather than
+     * evicting entries just stop adding new ones once the cache is full. */
+    if (mount->dentries->count >= DENTRY_CACHE_MAX)
+        return;
+
+    len = strlen(name);
+    dentry = malloc(sizeof(*dentry) + len + 1);
+    dentry->parent = parent;
+    dentry->handle = handle;
+    dentry->hash = hash;
+    memcpy(dentry->name, name, len + 1);
+
+    if (handle) {
+        fs_retain(handle);
+        handle->flags |= FS_HANDLE_CACHED;
+    }
+
+    list_init(&dentry->link);
+    list_append(&mount->dentries->buckets[hash & (DENTRY_HASH_SIZE - 1)], &dentry->link);
+    mount->dentries->count++;
+}
+
 /** Structure containing data for fs_open(). */
 typedef struct fs_open_data {
     const char *name;                   /**< Name of entry being searched for. */
@@ -124,6 +277,53 @@ static bool fs_open_cb(const fs_entry_t *entry, void *_data) {
     }
 }
 
+/** Look up an entry in a directory.
+ * @param parent        Directory to look up in.
+ * @param name          Name of the entry.
+ * @param _handle       Where to store pointer to opened handle.
+ * @return              Status code describing the result of the operation. */
+static status_t lookup_entry(fs_handle_t *parent, const char *name, fs_handle_t **_handle) {
+    fs_mount_t *mount = parent->mount;
+    fs_dentry_t *dentry;
+    uint32_t hash;
+    status_t ret;
+
+    hash = dentry_hash(mount, parent, name);
+
+    dentry = dentry_lookup(parent, name, hash);
+    if (dentry) {
+        if (!dentry->handle)
+            return STATUS_NOT_FOUND;
+
+        fs_retain(dentry->handle);
+        *_handle = dentry->handle;
+        return STATUS_SUCCESS;
+    }
+
+    if (mount->ops->lookup) {
+        ret = mount->ops->lookup(parent, name, _handle);
+    } else {
+        fs_open_data_t data;
+
+        data.name = name;
+        data.ret = STATUS_NOT_FOUND;
+
+        ret = mount->ops->iterate(parent, fs_open_cb, &data);
+        if (ret == STATUS_SUCCESS)
+            ret = data.ret;
+        if (ret == STATUS_SUCCESS)
+            *_handle = data.handle;
+    }
+
+    if (ret == STATUS_SUCCESS) {
+        dentry_insert(parent, name, hash, *_handle);
+    } else if (ret == STATUS_NOT_FOUND) {
+        dentry_insert(parent, name, hash, NULL);
+    }
+
+    return ret;
+}
+
 /**
  * Open a handle to a file/directory.
  *
@@ -137,6 +337,9 @@ static bool fs_open_cb(const fs_entry_t *entry, void *_data) {
  * included on an absolute path, the lookup will take place from the root of the
  * current device.
  *
+ * A path beginning with "http://" is a URL. It is passed whole to the first
+ * HTTP device ("http0"), if the platform provides one.
+ *
  * @param path          Path to entry to open.
  * @param from          If not NULL, a directory to look up relative to.
  * @param type          Required type of the entry, or FILE_TYPE_NONE for any.
@@ -159,25 +362,43 @@ status_t fs_open(
     /* Duplicate the path string so we can modify it. */
     dup = orig = strdup(path);
 
-    if (dup[0] == '(') {
+    if (strncmp(dup, "http://", 7) == 0) {
+        device = device_lookup("http0");
+        if (!device)
+            return STATUS_NOT_FOUND;
+
+        mount = device_mount(device);
+        if (!mount || !mount->ops->open_path)
+            return STATUS_NOT_FOUND;
+
+        ret = mount->ops->open_path(mount, dup, NULL, &handle);
+        if (ret != STATUS_SUCCESS)
+            return ret;
+
+        return post_open(handle, type, flags, _handle);
+    } else if (dup[0] == '(') {
         dup++;
         tok = strsep(&dup, ")");
         if (!tok || !tok[0] || dup[0] != '/')
             return STATUS_INVALID_ARG;
 
         device = device_lookup(tok);
-        if (!device || !device->mount)
+        if (!device)
             return STATUS_NOT_FOUND;
 
-        mount = device->mount;
+        mount = device_mount(device);
+        if (!mount)
+            return STATUS_NOT_FOUND;
     } else if (from) {
         mount = from->mount;
     } else {
         device = (current_environ) ? current_environ->device : boot_device;
-        if (!device || !device->mount)
+        if (!device)
             return STATUS_NOT_FOUND;
 
-        mount = device->mount;
+        mount = device_mount(device);
+        if (!mount)
+            return STATUS_NOT_FOUND;
     }
 
     if (dup[0] == '/') {
@@ -207,7 +428,7 @@ status_t fs_open(
 
         /* Loop through each element of the path string. */
         while (true) {
-            fs_open_data_t data;
+            fs_handle_t *child;
 
             tok = strsep(&dup, "/");
             if (!tok) {
@@ -226,18 +447,12 @@ status_t fs_open(
             }
 
             /* Search the directory for the entry. */
-            data.name = tok;
-            data.ret = STATUS_NOT_FOUND;
-            ret = mount->ops->iterate(handle, fs_open_cb, &data);
-
+            ret = lookup_entry(handle, tok, &child);
             fs_close(handle);
-
-            if (ret == STATUS_SUCCESS)
-                ret = data.ret;
             if (ret != STATUS_SUCCESS)
                 return ret;
 
-            handle = data.handle;
+            handle = child;
         }
     }
 
@@ -268,6 +483,11 @@ void fs_close(fs_handle_t *handle) {
  * @param offset        Offset into the file.
  * @return              Status code describing the result of the operation. */
 status_t fs_read(fs_handle_t *handle, void *buf, size_t count, offset_t offset) {
+    device_t *device = (handle->mount) ? handle->mount->device : NULL;
+    bool sequential = false;
+    uint64_t start;
+    status_t ret;
+
     if (handle->type != FILE_TYPE_REGULAR)
         return STATUS_NOT_FILE;
 
@@ -277,11 +497,99 @@ status_t fs_read(fs_handle_t *handle, void *buf, size_t count, offset_t offset)
     if (!count)
         return STATUS_SUCCESS;
 
+    start = trace_begin();
+    fs_read_depth++;
+
+    if (device) {
+        sequential = device->sequential;
+        if (handle->flags & FS_HANDLE_SEQUENTIAL)
+            device->sequential = true;
+    }
+
     if (handle->flags & FS_HANDLE_COMPRESSED) {
-        return decompress_read(handle, buf, count, offset);
+        ret = decompress_read(handle, buf, count, offset);
     } else {
-        return handle->mount->ops->read(handle, buf, count, offset);
+        ret = handle->mount->ops->read(handle, buf, count, offset);
+    }
+
+    if (device)
+        device->sequential = sequential;
+
+    /* Reads made by a filesystem or the decompression code are accounted to
+     * the read that caused them. */
+    if (!--fs_read_depth && ret == STATUS_SUCCESS)
+        trace_end(TRACE_PHASE_READ, start, count, (handle->mount) ? handle->mount->device->name : NULL);
+
+    return ret;
+}
+
+/**
+ * Load the whole of a file.
+ *
+ * Loads the entire content of a file into memory. The destination is obtained
+ * from the supplied allocation function once the size of the data is known,
+ * allowing the filesystem to place the data directly in its final location
+ * rather than going via an intermediate buffer. If no allocation function is
+ * given, the data is loaded into a buffer allocated with malloc_large(), which
+ * should be freed with free_large(); filesystems that already hold the file
+ * content in such a buffer can then hand it over without copying.
+ *
+ * The file is read in a single sequential pass, so the device will read ahead
+ * regardless of whether the file was opened with FS_OPEN_SEQUENTIAL.
+ *
+ * @param handle        Handle to the file.
+ * @param alloc         Function to allocate the destination, or NULL to use a
+ *                      buffer allocated by malloc_large().
+ * @param arg           Data argument to pass to the allocation function.
+ * @param _buf          Where to store pointer to the loaded data.
+ *
+ * @return              Status code describing the result of the operation. If
+ *                      the load fails after the allocation function has been
+ *                      called, the allocation is left to the caller to free.
+ */
+status_t fs_load(fs_handle_t *handle, fs_load_alloc_t alloc, void *arg, void **_buf) {
+    uint8_t flags;
+    uint64_t start;
+    void *buf;
+    status_t ret;
+
+    if (handle->type != FILE_TYPE_REGULAR)
+        return STATUS_NOT_FILE;
+
+    if (handle->size != (size_t)handle->size)
+        return STATUS_NO_MEMORY;
+
+    if (!(handle->flags & FS_HANDLE_COMPRESSED) && handle->mount->ops->load) {
+        start = trace_begin();
+        fs_read_depth++;
+
+        ret = handle->mount->ops->load(handle, alloc, arg, _buf);
+
+        if (!--fs_read_depth && ret == STATUS_SUCCESS)
+            trace_end(TRACE_PHASE_READ, start, handle->size, handle->mount->device->name);
+
+        return ret;
     }
+
+    /* Compressed files are inflated straight into the destination, and disk
+     * filesystems read runs of contiguous blocks directly into it, so a single
+     * whole-file read is the cheapest option for everything else. */
+    buf = (alloc) ? alloc(handle, handle->size, arg) : malloc_large(handle->size);
+
+    flags = handle->flags;
+    handle->flags |= FS_HANDLE_SEQUENTIAL;
+    ret = fs_read(handle, buf, handle->size, 0);
+    handle->flags = (handle->flags & ~FS_HANDLE_SEQUENTIAL) | (flags & FS_HANDLE_SEQUENTIAL);
+
+    if (ret != STATUS_SUCCESS) {
+        if (!alloc)
+            free_large(buf);
+
+        return ret;
+    }
+
+    *_buf = buf;
+    return STATUS_SUCCESS;
 }
 
 /** Iterate over entries in a directory.
@@ -303,29 +611,46 @@ status_t fs_iterate(fs_handle_t *handle, fs_iterate_cb_t cb, void *arg) {
  * @param device        Device to probe.
  * @return              Pointer to mount if found, NULL if not. */
 fs_mount_t *fs_probe(device_t *device) {
+    uint64_t start = trace_begin();
+    void *buf __cleanup_free_large;
+    fs_mount_t *mount = NULL;
+
+    /* Read the start of the device once so that each filesystem can check for
+     * its signature without having to do its own reads. If this fails (e.g.
+     * the device is smaller than the probe area), try mounting every type. */
+    buf = malloc_large(FS_PROBE_SIZE);
+    if (device_read(device, buf, FS_PROBE_SIZE, 0) != STATUS_SUCCESS) {
+        free_large(buf);
+        buf = NULL;
+    }
+
     builtin_foreach(BUILTIN_TYPE_FS, fs_ops_t, ops) {
-        fs_mount_t *mount;
         status_t ret;
 
+        if (buf && ops->probe && !ops->probe(buf, FS_PROBE_SIZE))
+            continue;
+
         ret = ops->mount(device, &mount);
-        switch (ret) {
-        case STATUS_SUCCESS:
+        if (ret == STATUS_SUCCESS) {
             dprintf("fs: mounted %s on %s ('%s') (uuid: %s)\n", ops->name, device->name, mount->label, mount->uuid);
 
             mount->ops = ops;
             mount->device = device;
-            return mount;
-        case STATUS_UNKNOWN_FS:
-        case STATUS_END_OF_FILE:
-            /* End of file usually means no media. */
+            mount->dentries = NULL;
             break;
-        default:
+        }
+
+        mount = NULL;
+
+        /* End of file usually means no media. */
+        if (ret != STATUS_UNKNOWN_FS && ret != STATUS_END_OF_FILE) {
             dprintf("fs: error while probing device %s: %pS\n", device->name, ret);
-            return NULL;
+            break;
         }
     }
 
-    return NULL;
+    trace_end(TRACE_PHASE_MOUNT, start, 0, device->name);
+    return mount;
 }
 
 /**
@@ -368,17 +693,30 @@ BUILTIN_COMMAND("cd", "Set the current directory", config_cmd_cd);
  * @return              Whether to continue iteration. */
 static bool config_cmd_ls_cb(const fs_entry_t *entry, void *arg) {
     fs_handle_t *handle __cleanup_close = NULL;
+    file_type_t type = entry->type;
+    offset_t size = entry->size;
     status_t ret;
 
-    ret = fs_open_entry(entry, FILE_TYPE_NONE, 0, &handle);
-    if (ret != STATUS_SUCCESS) {
-        printf("Warning: Failed to open entry '%s': %pS\n", entry->name, ret);
-        return true;
+    /* Only open the entry if the directory record doesn't tell us what it is.
+     * Where only the size is missing, don't open it just for that. */
+    if (type == FILE_TYPE_NONE) {
+        ret = fs_open_entry(entry, FILE_TYPE_NONE, 0, &handle);
+        if (ret != STATUS_SUCCESS) {
+            printf("Warning: Failed to open entry '%s': %pS\n", entry->name, ret);
+            return true;
+        }
+
+        type = handle->type;
+        size = handle->size;
     }
 
-    printf(
-        "%-5s %-10" PRIu64 " %s\n",
-        (handle->type == FILE_TYPE_DIR) ? "Dir" : "File", handle->size, entry->name);
+    if (size == FS_ENTRY_SIZE_UNKNOWN) {
+        printf("%-5s %-10s %s\n", (type == FILE_TYPE_DIR) ? "Dir" : "File", "-", entry->name);
+    } else {
+        printf(
+            "%-5s %-10" PRIu64 " %s\n",
+            (type == FILE_TYPE_DIR) ? "Dir" : "File", size, entry->name);
+    }
 
     return true;
 }
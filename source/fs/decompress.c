@@ -18,33 +18,207 @@
  * @file
  * @brief               File decompression support.
  *
- * This file implements support for transparent decompression of gzip-compressed
- * files. We use the miniz/tinfl library for decompressing the DEFLATE stream.
- * Note that we do not support files with a decompressed size greater than 4GB,
- * as the ISIZE field in the gzip header is 32 bits and defined to be the
- * decompressed size mod 2^32. Since we rely on being able to get the total
- * size of a file in various places, we cannot correctly handle files that are
- * larger than 4GB unless we decompress the entire file when opening it to get
- * its size.
+ * This file implements support for transparent decompression of compressed
+ * files. Supported formats are gzip (using the miniz/tinfl library for the
+ * DEFLATE stream), LZ4 (both the frame format and the legacy format used by
+ * Linux) and Zstandard. Each format is identified by its magic number when a
+ * file is opened with FS_OPEN_DECOMPRESS.
  *
- * We use a bunch of global state for decompression, as tinfl requires a large
- * (32K) temporary buffer to work on. Rather than allocate this per-handle,
- * just keep it globally. This means we have to re-decompress when switching
- * between files, but the typical access pattern in the loader is to work on a
- * whole file in one go.
+ * We need to know the decompressed size of a file when opening it, as we rely
+ * on being able to get the total size of a file in various places. For gzip
+ * this comes from the ISIZE field in the trailer, which is 32 bits and defined
+ * to be the decompressed size mod 2^32, so we do not support files with a
+ * decompressed size greater than 4GB. Zstandard files must have the content
+ * size in the frame header (the default when compressing a file with the zstd
+ * tool). LZ4 files without a content size in the header (the default for the
+ * lz4 tool unless --content-size is given) have to be scanned through on open
+ * to determine their size.
+ *
+ * Each handle has its own decompression state, allocated on the first read
+ * from it, so switching between compressed files does not require starting
+ * over. Decompressed data is produced into a dictionary buffer, which holds as
+ * much previous output as the format needs for back-references. To avoid
+ * re-decompressing the whole stream when seeking backwards (the loaders
+ * commonly read a header and then re-read the file from an earlier offset),
+ * snapshots of the decompressor state are saved at intervals through the
+ * output which can be resumed from, if the state is small enough to make this
+ * worthwhile. Reads of an entire file bypass the dictionary buffer and
+ * decompress directly into the destination.
  */
 
 #include <fs/decompress.h>
 
+#include <lib/lz4.h>
 #include <lib/string.h>
 #include <lib/tinfl.h>
 #include <lib/utility.h>
+#include <lib/zstd.h>
 
 #include <assert.h>
 #include <endian.h>
 #include <memory.h>
 #include <fs.h>
 #include <loader.h>
+#include <time.h>
+
+/** Maximum header size. */
+#define MAX_HEADER_SIZE         512
+
+/** Alignment of reads from the source file. */
+#define INPUT_ALIGN             4096
+
+/** Minimum size of the input window. */
+#define INPUT_WINDOW_SIZE       0x10000
+
+/** Initial interval in the output between seek checkpoints. */
+#define CHECKPOINT_INTERVAL     0x100000
+
+/** Maximum number of seek checkpoints per handle. */
+#define CHECKPOINT_MAX          8
+
+/** Maximum size of the state saved by a checkpoint. */
+#define CHECKPOINT_SIZE_MAX     0x40000
+
+/** Saved decompression state that can be resumed from. */
+typedef struct decompress_checkpoint {
+    uint32_t payload_offset;            /**< Offset in the payload. */
+    uint32_t dict_offset;               /**< Offset in dictionary buffer. */
+    uint32_t output_offset;             /**< Offset in the output file. */
+
+    /** Decompressor context, followed by dictionary buffer contents. */
+    uint8_t data[] __aligned(8);
+} decompress_checkpoint_t;
+
+/** Decompression state for a handle. */
+typedef struct decompress_state {
+    uint32_t payload_offset;            /**< Current offset in the payload. */
+    uint32_t dict_offset;               /**< Current offset in dictionary buffer. */
+    uint32_t dict_avail;                /**< Available data in dictionary buffer. */
+    uint32_t output_offset;             /**< Current offset in the output file. */
+
+    void *context;                      /**< Format-specific decompressor context. */
+    uint8_t *dict_buffer;               /**< Dictionary buffer (allocated when needed). */
+
+    uint8_t *input_buffer;              /**< Input window buffer. */
+    uint32_t input_buffer_size;         /**< Size of the input window buffer. */
+    uint32_t input_start;               /**< File offset of the input window. */
+    uint32_t input_size;                /**< Amount of valid data in the input window. */
+
+    /** Seek checkpoints, in order of output offset. */
+    decompress_checkpoint_t *checkpoints[CHECKPOINT_MAX];
+    size_t num_checkpoints;             /**< Number of checkpoints. */
+    uint32_t checkpoint_interval;       /**< Current interval between checkpoints. */
+    uint32_t next_checkpoint;           /**< Output offset of the next checkpoint. */
+} decompress_state_t;
+
+struct decompress_ops;
+
+/** Decompression wrapper handle structure. */
+typedef struct decompress_handle {
+    fs_handle_t handle;                 /**< Handle header structure. */
+
+    fs_handle_t *source;                /**< Source handle. */
+    const struct decompress_ops *ops;   /**< Operations for the compression format. */
+    uint32_t payload_start;             /**< Start of the payload in the file. */
+    uint32_t payload_size;              /**< Total payload size. */
+    uint32_t dict_size;                 /**< Size of dictionary buffer needed. */
+    uint32_t block_size;                /**< Maximum decompressed block size. */
+    uint32_t input_size;                /**< Maximum contiguous input needed at once. */
+    uint32_t format_flags;              /**< Format-specific flags. */
+    decompress_state_t *state;          /**< Decompression state (allocated on first read). */
+} decompress_handle_t;
+
+/** Compression format operations. */
+typedef struct decompress_ops {
+    const char *name;                   /**< Name of the format. */
+    size_t context_size;                /**< Size of the decompressor context. */
+
+    /** Identify a file and initialize the handle for it.
+     * @param handle        Handle being opened. The payload_start,
+     *                      payload_size, dict_size, block_size and input_size
+     *                      fields should be set if the file is recognised.
+     * @param buf           Buffer containing the start of the file.
+     * @param size          Amount of data in the buffer.
+     * @param _size         Where to store the decompressed size.
+     * @return              Whether the file is in this format. */
+    bool (*open)(decompress_handle_t *handle, const uint8_t *buf, size_t size, uint32_t *_size);
+
+    /** Reset the decompressor context to the start of the stream.
+     * @param handle        Handle to reset. */
+    void (*reset)(decompress_handle_t *handle);
+
+    /** Decompress more data into the dictionary buffer.
+     * @param handle        Handle to decompress from.
+     * @param _offset       Offset in the dictionary buffer to decompress to.
+     *                      Can be changed by the decompressor, for example to
+     *                      wrap around or to move the history it needs to the
+     *                      start of the buffer.
+     * @param _size         Where to store amount of data decompressed.
+     * @return              Status code describing the result of the operation. */
+    status_t (*decompress)(decompress_handle_t *handle, uint32_t *_offset, uint32_t *_size);
+
+    /** Decompress the whole file into a buffer.
+     * @param handle        Handle to decompress from. The context will have
+     *                      been reset.
+     * @param buf           Buffer to decompress into (the size of the file).
+     * @return              Status code describing the result of the operation. */
+    status_t (*decompress_all)(decompress_handle_t *handle, void *buf);
+} decompress_ops_t;
+
+/** Get input data for the decompressor.
+ * @param handle        Handle being read from.
+ * @param min_size      Minimum amount of contiguous input needed.
+ * @param _in           Where to store pointer to input at the current offset.
+ * @param _in_size      Where to store amount of input available.
+ * @return              Status code describing the result of the operation. */
+static status_t get_input(decompress_handle_t *handle, uint32_t min_size, const uint8_t **_in, uint32_t *_in_size) {
+    decompress_state_t *state = handle->state;
+    uint32_t payload_end = handle->payload_start + handle->payload_size;
+    uint32_t file_offset;
+    status_t ret;
+
+    file_offset = handle->payload_start + state->payload_offset;
+    if (min_size > payload_end - file_offset) {
+        dprintf("fs: warning: unexpected end of compressed data\n");
+        return STATUS_DEVICE_ERROR;
+    }
+
+    /* Read in a new input window if we don't have the data we need. Windows
+     * are aligned in the file, rather than relative to the payload start, so
+     * that reads are made on block boundaries. */
+    if (file_offset < state->input_start || file_offset + min_size > state->input_start + state->input_size) {
+        state->input_start = round_down(file_offset, INPUT_ALIGN);
+        state->input_size = min(state->input_buffer_size, payload_end - state->input_start);
+
+        ret = fs_read(handle->source, state->input_buffer, state->input_size, state->input_start);
+        if (ret != STATUS_SUCCESS) {
+            state->input_size = 0;
+            return ret;
+        }
+    }
+
+    *_in = &state->input_buffer[file_offset - state->input_start];
+    *_in_size = state->input_start + state->input_size - file_offset;
+    return STATUS_SUCCESS;
+}
+
+/** Move history in the dictionary buffer to make space for a block.
+ * @param handle        Handle being read from.
+ * @param history       Amount of history that must be kept.
+ * @param _offset       Current offset in the buffer (updated). */
+static void make_block_space(decompress_handle_t *handle, uint32_t history, uint32_t *_offset) {
+    uint8_t *dict = handle->state->dict_buffer;
+
+    if (*_offset + handle->block_size > handle->dict_size) {
+        history = min(history, *_offset);
+        memmove(dict, &dict[*_offset - history], history);
+        *_offset = history;
+    }
+}
+
+/**
+ * Gzip support.
+ */
 
 /** Fixed part of the header of a gzip file. */
 typedef struct gzip_header {
@@ -71,80 +245,40 @@ typedef struct gzip_header {
 /** Compression methods. */
 #define GZIP_METHOD_DEFLATE     8
 
-/** Maximum header size. */
-#define MAX_HEADER_SIZE         512
-
 /** Size of the dictionary buffer. */
-#define DICT_BUFFER_SIZE        TINFL_LZ_DICT_SIZE
-
-/** Size of the payload buffer. */
-#define PAYLOAD_BUFFER_SIZE     4096
-
-/** Decompression wrapper handle structure. */
-typedef struct decompress_handle {
-    fs_handle_t handle;                 /**< Handle header structure. */
-
-    fs_handle_t *source;                /**< Source handle. */
-    uint32_t payload_start;             /**< Start of the payload in the file. */
-    uint32_t payload_size;              /**< Total payload size. */
-} decompress_handle_t;
-
-/** Handle current decompression state refers to. */
-static decompress_handle_t *current_decompress_handle;
-
-/** Current decompression state. */
-static uint32_t payload_offset;         /**< Current offset in the payload. */
-static uint32_t dict_offset;            /**< Current offset in dictionary buffer. */
-static uint32_t dict_avail;             /**< Available data in dictionary buffer. */
-static uint32_t output_offset;          /**< Current offset in the output file. */
-static tinfl_decompressor decompressor; /**< Decompression state. */
-
-/** Temporary payload input buffer. */
-static uint8_t payload_buffer[PAYLOAD_BUFFER_SIZE] __aligned(8);
-
-/** Temporary buffer to decompress to, tinfl requires a large buffer. */
-static uint8_t dict_buffer[DICT_BUFFER_SIZE];
+#define GZIP_DICT_SIZE          TINFL_LZ_DICT_SIZE
 
 /** Skip a variable-length field in the gzip header.
  * @param handle        Compressed file handle.
+ * @param buf           Buffer containing the header.
+ * @param size          Size of data in the buffer.
  * @return              Whether successfully skipped. */
-static inline bool skip_variable_field(decompress_handle_t *handle) {
+static inline bool skip_variable_field(decompress_handle_t *handle, const uint8_t *buf, size_t size) {
     do {
-        if (handle->payload_start >= MAX_HEADER_SIZE) {
+        if (handle->payload_start >= size) {
             dprintf("fs: warning: gzip header is too large\n");
             return false;
         }
-    } while (payload_buffer[handle->payload_start++]);
+    } while (buf[handle->payload_start++]);
 
     return true;
 }
 
-/** Open a handle for decompression.
- * @param source        Handle to source file.
- * @param _handle       Where to store pointer to decompression wrapper handle.
- * @return              Whether this is a compressed file. */
-bool decompress_open(fs_handle_t *source, fs_handle_t **_handle) {
-    gzip_header_t *header;
-    decompress_handle_t *handle;
-    uint32_t size;
+/** Identify a gzip file.
+ * @param handle        Handle being opened.
+ * @param buf           Buffer containing the start of the file.
+ * @param size          Amount of data in the buffer.
+ * @param _size         Where to store the decompressed size.
+ * @return              Whether the file is in this format. */
+static bool gzip_open(decompress_handle_t *handle, const uint8_t *buf, size_t size, uint32_t *_size) {
+    const gzip_header_t *header = (const gzip_header_t *)buf;
+    fs_handle_t *source = handle->source;
+    uint32_t trailer[2];
     status_t ret;
 
-    assert(source->type == FILE_TYPE_REGULAR);
-
-    /* We're about to trash the temporary buffer. */
-    current_decompress_handle = NULL;
-
-    /* Read in a large chunk to identify the file. We do this because the header
-     * is variable length so we cannot read just a fixed length, and on disk
-     * devices reads will always be at least 512 bytes (the block size), so
-     * reading byte by byte would be terribly inefficient. */
-    ret = fs_read(source, payload_buffer, min(source->size, MAX_HEADER_SIZE), 0);
-    if (ret != STATUS_SUCCESS)
+    if (size < sizeof(*header) + sizeof(trailer)) {
         return false;
-
-    /* Check if this is a gzip header. */
-    header = (gzip_header_t *)payload_buffer;
-    if (header->magic[0] != GZIP_MAGIC0 || header->magic[1] != GZIP_MAGIC1) {
+    } else if (header->magic[0] != GZIP_MAGIC0 || header->magic[1] != GZIP_MAGIC1) {
         return false;
     } else if (header->method != GZIP_METHOD_DEFLATE) {
         dprintf("fs: warning: cannot handle gzip compression method %u\n", header->method);
@@ -154,9 +288,6 @@ bool decompress_open(fs_handle_t *source, fs_handle_t **_handle) {
         return false;
     }
 
-    handle = malloc(sizeof(*handle));
-    handle->source = source;
-
     /* Find the beginning of the payload in the file. */
     handle->payload_start = sizeof(gzip_header_t);
 
@@ -166,41 +297,666 @@ bool decompress_open(fs_handle_t *source, fs_handle_t **_handle) {
         /* Read length. */
         ret = fs_read(source, &xlen, sizeof(xlen), handle->payload_start);
         if (ret != STATUS_SUCCESS)
-            goto err_free;
+            return false;
 
         handle->payload_start += 2 + le16_to_cpu(xlen);
     }
 
     if (header->flags & GZIP_ORIG_NAME) {
-        if (!skip_variable_field(handle))
-            goto err_free;
+        if (!skip_variable_field(handle, buf, size))
+            return false;
     }
 
     if (header->flags & GZIP_COMMENT) {
-        if (!skip_variable_field(handle))
-            goto err_free;
+        if (!skip_variable_field(handle, buf, size))
+            return false;
     }
 
     if (header->flags & GZIP_HEADER_CRC)
         handle->payload_start += 2;
 
     /* There is a CRC32 and size at the end of the payload. */
-    handle->payload_size = source->size - handle->payload_start - 8;
+    if (handle->payload_start + sizeof(trailer) > source->size)
+        return false;
+
+    handle->payload_size = source->size - handle->payload_start - sizeof(trailer);
+    handle->dict_size = GZIP_DICT_SIZE;
+    handle->block_size = 0;
+    handle->input_size = 1;
 
     /* Read in the decompressed file size. */
-    ret = fs_read(source, &size, sizeof(size), source->size - 4);
+    ret = fs_read(source, trailer, sizeof(trailer), source->size - sizeof(trailer));
     if (ret != STATUS_SUCCESS)
-        goto err_free;
+        return false;
 
-    size = le32_to_cpu(size);
+    *_size = le32_to_cpu(trailer[1]);
+    return true;
+}
 
-    fs_handle_init(&handle->handle, source->mount, FILE_TYPE_REGULAR, size);
-    handle->handle.flags |= FS_HANDLE_COMPRESSED;
+/** Reset gzip decompression state.
+ * @param handle        Handle to reset. */
+static void gzip_reset(decompress_handle_t *handle) {
+    tinfl_init((tinfl_decompressor *)handle->state->context);
+}
+
+/** Call tinfl to decompress some data.
+ * @param handle        Handle being read from.
+ * @param out_start     Start of output buffer.
+ * @param out           Location to decompress to.
+ * @param _out_size     Space available in the output buffer, updated to the
+ *                      amount of data decompressed.
+ * @param flags         Extra flags for tinfl.
+ * @return              Status code describing the result of the operation. */
+static status_t gzip_inflate(decompress_handle_t *handle, uint8_t *out_start, uint8_t *out, size_t *_out_size, int flags) {
+    decompress_state_t *state = handle->state;
+    const uint8_t *in;
+    uint32_t avail;
+    size_t in_size;
+    tinfl_status status;
+    status_t ret;
+
+    ret = get_input(handle, 1, &in, &avail);
+    if (ret != STATUS_SUCCESS)
+        return ret;
+
+    in_size = avail;
+    if (state->input_start + state->input_size < handle->payload_start + handle->payload_size)
+        flags |= TINFL_FLAG_HAS_MORE_INPUT;
+
+    status = tinfl_decompress(state->context, in, &in_size, out_start, out, _out_size, flags);
+    if (status < TINFL_STATUS_DONE) {
+        dprintf("fs: warning: error %d decompressing data\n", status);
+        return STATUS_DEVICE_ERROR;
+    }
+
+    /* We are only called when the caller still needs more output. If the
+     * stream has ended (e.g. a multi-member file, or a trailer size that does
+     * not match the data) then tinfl will keep returning done without making
+     * any progress, so treat this as an error rather than looping forever. */
+    if (status == TINFL_STATUS_DONE && !*_out_size) {
+        dprintf("fs: warning: compressed data ended before expected size\n");
+        return STATUS_DEVICE_ERROR;
+    }
+
+    state->payload_offset += in_size;
+    return STATUS_SUCCESS;
+}
+
+/** Decompress gzip data into the dictionary buffer.
+ * @param handle        Handle to decompress from.
+ * @param _offset       Offset in the dictionary buffer to decompress to.
+ * @param _size         Where to store amount of data decompressed.
+ * @return              Status code describing the result of the operation. */
+static status_t gzip_decompress(decompress_handle_t *handle, uint32_t *_offset, uint32_t *_size) {
+    uint8_t *dict = handle->state->dict_buffer;
+    size_t out_size;
+    status_t ret;
+
+    /* tinfl uses the buffer as a circular buffer. */
+    if (*_offset == GZIP_DICT_SIZE)
+        *_offset = 0;
+
+    out_size = GZIP_DICT_SIZE - *_offset;
+
+    ret = gzip_inflate(handle, dict, &dict[*_offset], &out_size, 0);
+    if (ret != STATUS_SUCCESS)
+        return ret;
+
+    *_size = out_size;
+    return STATUS_SUCCESS;
+}
+
+/** Decompress a whole gzip file into a buffer.
+ * @param handle        Handle to decompress from.
+ * @param buf           Buffer to decompress into.
+ * @return              Status code describing the result of the operation. */
+static status_t gzip_decompress_all(decompress_handle_t *handle, void *buf) {
+    size_t total = handle->handle.size;
+    size_t done = 0;
+
+    /* Use the output buffer itself as the dictionary. */
+    while (done < total) {
+        size_t out_size = total - done;
+        status_t ret;
+
+        ret = gzip_inflate(handle, buf, buf + done, &out_size, TINFL_FLAG_USING_NON_WRAPPING_OUTPUT_BUF);
+        if (ret != STATUS_SUCCESS)
+            return ret;
+
+        done += out_size;
+    }
+
+    return STATUS_SUCCESS;
+}
+
+/** Gzip decompression operations. */
+static const decompress_ops_t gzip_decompress_ops = {
+    .name = "gzip",
+    .context_size = sizeof(tinfl_decompressor),
+    .open = gzip_open,
+    .reset = gzip_reset,
+    .decompress = gzip_decompress,
+    .decompress_all = gzip_decompress_all,
+};
+
+/**
+ * LZ4 support.
+ */
+
+/** LZ4 magic numbers. */
+#define LZ4_MAGIC               0x184d2204
+#define LZ4_LEGACY_MAGIC        0x184c2102
+
+/** LZ4 frame flags. */
+#define LZ4_FLG_VERSION_MASK    0xc0
+#define LZ4_FLG_VERSION         0x40
+#define LZ4_FLG_BLOCK_INDEP     (1<<5)
+#define LZ4_FLG_BLOCK_CHECKSUM  (1<<4)
+#define LZ4_FLG_CONTENT_SIZE    (1<<3)
+#define LZ4_FLG_DICT_ID         (1<<0)
+
+/** LZ4 block size flags. */
+#define LZ4_BLOCK_UNCOMPRESSED  (1u<<31)
+
+/** Format flag indicating the legacy LZ4 format. */
+#define LZ4_LEGACY              (1<<8)
+
+/** Block size used by the legacy format. */
+#define LZ4_LEGACY_BLOCK_SIZE   (8 * 1024 * 1024)
+
+/** Get the maximum compressed size of an LZ4 block. */
+#define lz4_compress_bound(s)   ((s) + ((s) / 255) + 16)
 
-    *_handle = &handle->handle;
+/** Parse an LZ4 block header.
+ * @param handle        Handle being read from.
+ * @param header        Block header value.
+ * @param _size         Where to store block size (0 if end of stream).
+ * @param _compressed   Where to store whether the block is compressed.
+ * @param _skip         Where to store total size of the block (including the
+ *                      header and checksum).
+ * @return              Whether the header is valid. */
+static bool lz4_block_header(decompress_handle_t *handle, uint32_t header, uint32_t *_size, bool *_compressed, uint32_t *_skip) {
+    header = le32_to_cpu(header);
+
+    if (handle->format_flags & LZ4_LEGACY) {
+        /* Legacy streams can be concatenated, skip the next magic. */
+        if (header == LZ4_LEGACY_MAGIC) {
+            *_size = 0;
+            *_skip = sizeof(header);
+            *_compressed = true;
+            return true;
+        }
+
+        *_size = header;
+        *_compressed = true;
+        *_skip = sizeof(header) + header;
+    } else {
+        *_size = header & ~LZ4_BLOCK_UNCOMPRESSED;
+        *_compressed = !(header & LZ4_BLOCK_UNCOMPRESSED);
+        *_skip = sizeof(header) + *_size;
+
+        if (*_size && handle->format_flags & LZ4_FLG_BLOCK_CHECKSUM)
+            *_skip += sizeof(uint32_t);
+    }
+
+    return *_skip <= handle->input_size;
+}
+
+/** Scan through an LZ4 file to determine its decompressed size.
+ * @param handle        Handle being opened.
+ * @param _size         Where to store decompressed size.
+ * @return              Whether the size was successfully determined. */
+static bool lz4_scan_size(decompress_handle_t *handle, uint32_t *_size) {
+    uint8_t *buf __cleanup_free_large;
+    uint32_t offset = handle->payload_start;
+    uint32_t end = handle->payload_start + handle->payload_size;
+    uint64_t total = 0;
+
+    dprintf("fs: scanning LZ4 file to determine size\n");
+
+    buf = malloc_large(handle->input_size);
+
+    while (offset + sizeof(uint32_t) <= end) {
+        uint32_t header, size, skip;
+        bool compressed;
+        status_t ret;
+
+        ret = fs_read(handle->source, &header, sizeof(header), offset);
+        if (ret != STATUS_SUCCESS || !lz4_block_header(handle, header, &size, &compressed, &skip))
+            return false;
+
+        if (!size) {
+            /* End mark of the frame format. */
+            if (!(handle->format_flags & LZ4_LEGACY))
+                break;
+        } else if (compressed) {
+            size_t block_size;
+
+            if (size > end - offset - sizeof(header))
+                return false;
+
+            ret = fs_read(handle->source, buf, size, offset + sizeof(header));
+            if (ret != STATUS_SUCCESS || !lz4_block_size(buf, size, &block_size))
+                return false;
+
+            total += block_size;
+        } else {
+            total += size;
+        }
+
+        offset += skip;
+    }
+
+    if (total > UINT32_MAX)
+        return false;
+
+    *_size = total;
     return true;
+}
+
+/** Identify an LZ4 file.
+ * @param handle        Handle being opened.
+ * @param buf           Buffer containing the start of the file.
+ * @param size          Amount of data in the buffer.
+ * @param _size         Where to store the decompressed size.
+ * @return              Whether the file is in this format. */
+static bool lz4_open(decompress_handle_t *handle, const uint8_t *buf, size_t size, uint32_t *_size) {
+    uint32_t magic;
+    uint64_t content_size = 0;
+
+    if (size < sizeof(magic))
+        return false;
+
+    magic = le32_to_cpu(*(const uint32_t *)buf);
+    if (magic == LZ4_LEGACY_MAGIC) {
+        handle->format_flags = LZ4_LEGACY;
+        handle->payload_start = sizeof(magic);
+        handle->block_size = LZ4_LEGACY_BLOCK_SIZE;
+        handle->dict_size = LZ4_LEGACY_BLOCK_SIZE;
+    } else if (magic == LZ4_MAGIC) {
+        uint8_t flags, block_desc;
+
+        if (size < 7)
+            return false;
+
+        flags = buf[4];
+        block_desc = buf[5];
+        handle->payload_start = 7;
+
+        if ((flags & LZ4_FLG_VERSION_MASK) != LZ4_FLG_VERSION) {
+            dprintf("fs: warning: unsupported LZ4 frame version\n");
+            return false;
+        } else if (flags & LZ4_FLG_DICT_ID) {
+            dprintf("fs: warning: LZ4 files using a dictionary are not supported\n");
+            return false;
+        } else if (((block_desc >> 4) & 7) < 4) {
+            return false;
+        }
+
+        handle->format_flags = flags;
+        handle->block_size = 1 << (((block_desc >> 4) & 7) * 2 + 8);
+        handle->dict_size = handle->block_size;
+        if (!(flags & LZ4_FLG_BLOCK_INDEP))
+            handle->dict_size += LZ4_WINDOW_SIZE;
+
+        if (flags & LZ4_FLG_CONTENT_SIZE) {
+            if (size < 15)
+                return false;
+
+            content_size = le64_to_cpu(*(const uint64_t *)&buf[6]);
+            handle->payload_start += sizeof(content_size);
+        }
+    } else {
+        return false;
+    }
+
+    if (handle->payload_start > handle->source->size)
+        return false;
+
+    handle->payload_size = handle->source->size - handle->payload_start;
+    handle->input_size = lz4_compress_bound(handle->block_size) + (2 * sizeof(uint32_t));
+
+    if (handle->format_flags & LZ4_FLG_CONTENT_SIZE && !(handle->format_flags & LZ4_LEGACY)) {
+        if (content_size > UINT32_MAX)
+            return false;
+
+        *_size = content_size;
+        return true;
+    } else {
+        return lz4_scan_size(handle, _size);
+    }
+}
+
+/** Reset LZ4 decompression state.
+ * @param handle        Handle to reset. */
+static void lz4_reset(decompress_handle_t *handle) {
+    /* Nothing to do - all state is in the payload offset and dictionary. */
+}
+
+/** Decompress the next LZ4 block.
+ * @param handle        Handle to decompress from.
+ * @param dest_start    Start of the output buffer (history).
+ * @param dest          Location to decompress to.
+ * @param dest_size     Space available at the destination.
+ * @param _size         Where to store amount of data decompressed.
+ * @return              Status code describing the result of the operation. */
+static status_t lz4_decompress_next(
+    decompress_handle_t *handle, uint8_t *dest_start, uint8_t *dest, size_t dest_size,
+    uint32_t *_size)
+{
+    decompress_state_t *state = handle->state;
+    uint32_t avail, size, skip;
+    const uint8_t *in;
+    bool compressed;
+    status_t ret;
+
+    do {
+        ret = get_input(handle, sizeof(uint32_t), &in, &avail);
+        if (ret != STATUS_SUCCESS)
+            return ret;
+
+        if (!lz4_block_header(handle, *(const uint32_t *)in, &size, &compressed, &skip)) {
+            dprintf("fs: warning: invalid LZ4 block header\n");
+            return STATUS_DEVICE_ERROR;
+        } else if (!size && !(handle->format_flags & LZ4_LEGACY)) {
+            dprintf("fs: warning: unexpected end of LZ4 data\n");
+            return STATUS_DEVICE_ERROR;
+        }
+
+        ret = get_input(handle, skip, &in, &avail);
+        if (ret != STATUS_SUCCESS)
+            return ret;
+
+        in += sizeof(uint32_t);
+        state->payload_offset += skip;
+    } while (!size);
+
+    if (handle->format_flags & (LZ4_FLG_BLOCK_INDEP | LZ4_LEGACY))
+        dest_start = dest;
+
+    if (!compressed) {
+        if (size > dest_size)
+            return STATUS_DEVICE_ERROR;
+
+        memcpy(dest, in, size);
+        *_size = size;
+    } else {
+        size_t out_size;
+
+        if (!lz4_decompress_block(in, size, dest_start, dest, dest_size, &out_size)) {
+            dprintf("fs: warning: error decompressing LZ4 data\n");
+            return STATUS_DEVICE_ERROR;
+        }
+
+        *_size = out_size;
+    }
+
+    return STATUS_SUCCESS;
+}
+
+/** Decompress LZ4 data into the dictionary buffer.
+ * @param handle        Handle to decompress from.
+ * @param _offset       Offset in the dictionary buffer to decompress to.
+ * @param _size         Where to store amount of data decompressed.
+ * @return              Status code describing the result of the operation. */
+static status_t lz4_decompress(decompress_handle_t *handle, uint32_t *_offset, uint32_t *_size) {
+    uint8_t *dict = handle->state->dict_buffer;
+
+    make_block_space(handle, handle->dict_size - handle->block_size, _offset);
+    return lz4_decompress_next(handle, dict, &dict[*_offset], handle->block_size, _size);
+}
+
+/** Decompress a whole LZ4 file into a buffer.
+ * @param handle        Handle to decompress from.
+ * @param buf           Buffer to decompress into.
+ * @return              Status code describing the result of the operation. */
+static status_t lz4_decompress_all(decompress_handle_t *handle, void *buf) {
+    size_t total = handle->handle.size;
+    size_t done = 0;
+
+    while (done < total) {
+        uint32_t size;
+        status_t ret;
+
+        ret = lz4_decompress_next(handle, buf, buf + done, total - done, &size);
+        if (ret != STATUS_SUCCESS)
+            return ret;
+
+        done += size;
+    }
+
+    return STATUS_SUCCESS;
+}
+
+/** LZ4 decompression operations. */
+static const decompress_ops_t lz4_decompress_ops = {
+    .name = "LZ4",
+    .context_size = 0,
+    .open = lz4_open,
+    .reset = lz4_reset,
+    .decompress = lz4_decompress,
+    .decompress_all = lz4_decompress_all,
+};
+
+/**
+ * Zstandard support.
+ */
+
+/** Identify a Zstandard file.
+ * @param handle        Handle being opened.
+ * @param buf           Buffer containing the start of the file.
+ * @param size          Amount of data in the buffer.
+ * @param _size         Where to store the decompressed size.
+ * @return              Whether the file is in this format. */
+static bool zstd_open(decompress_handle_t *handle, const uint8_t *buf, size_t size, uint32_t *_size) {
+    zstd_frame_t frame;
+
+    if (!zstd_parse_frame_header(buf, size, &frame)) {
+        return false;
+    } else if (frame.dict_id) {
+        dprintf("fs: warning: Zstandard files using a dictionary are not supported\n");
+        return false;
+    } else if (frame.content_size == ZSTD_CONTENT_SIZE_UNKNOWN) {
+        dprintf("fs: warning: Zstandard files without a content size are not supported\n");
+        return false;
+    } else if (frame.content_size > UINT32_MAX || frame.header_size > handle->source->size) {
+        return false;
+    }
+
+    /* Back-references cannot go further than the start of the file, so we
+     * don't need to keep more history than the file size. */
+    handle->payload_start = frame.header_size;
+    handle->payload_size = handle->source->size - frame.header_size;
+    handle->block_size = min(frame.window_size, (uint64_t)ZSTD_BLOCK_SIZE_MAX);
+    handle->dict_size = min(frame.window_size, frame.content_size) + handle->block_size;
+    handle->input_size = ZSTD_BLOCK_HEADER_SIZE + ZSTD_BLOCK_SIZE_MAX;
+
+    *_size = frame.content_size;
+    return true;
+}
+
+/** Reset Zstandard decompression state.
+ * @param handle        Handle to reset. */
+static void zstd_reset_context(decompress_handle_t *handle) {
+    zstd_reset((zstd_context_t *)handle->state->context);
+}
+
+/** Decompress the next Zstandard block.
+ * @param handle        Handle to decompress from.
+ * @param dest_start    Start of the output buffer (history).
+ * @param dest          Location to decompress to.
+ * @param dest_size     Space available at the destination.
+ * @param _size         Where to store amount of data decompressed.
+ * @return              Status code describing the result of the operation. */
+static status_t zstd_decompress_next(
+    decompress_handle_t *handle, uint8_t *dest_start, uint8_t *dest, size_t dest_size,
+    uint32_t *_size)
+{
+    decompress_state_t *state = handle->state;
+    uint32_t avail, header, size;
+    const uint8_t *in;
+    size_t out_size;
+    status_t ret;
+
+    ret = get_input(handle, ZSTD_BLOCK_HEADER_SIZE, &in, &avail);
+    if (ret != STATUS_SUCCESS)
+        return ret;
+
+    header = in[0] | (in[1] << 8) | (in[2] << 16);
+    size = ZSTD_BLOCK_SIZE(header);
+
+    switch (ZSTD_BLOCK_TYPE(header)) {
+    case ZSTD_BLOCK_RAW:
+        ret = get_input(handle, ZSTD_BLOCK_HEADER_SIZE + size, &in, &avail);
+        if (ret != STATUS_SUCCESS)
+            return ret;
+
+        if (size > min(dest_size, (size_t)handle->block_size))
+            goto err;
+
+        memcpy(dest, &in[ZSTD_BLOCK_HEADER_SIZE], size);
+        out_size = size;
+        state->payload_offset += ZSTD_BLOCK_HEADER_SIZE + size;
+        break;
+    case ZSTD_BLOCK_RLE:
+        ret = get_input(handle, ZSTD_BLOCK_HEADER_SIZE + 1, &in, &avail);
+        if (ret != STATUS_SUCCESS)
+            return ret;
+
+        if (size > min(dest_size, (size_t)handle->block_size))
+            goto err;
+
+        memset(dest, in[ZSTD_BLOCK_HEADER_SIZE], size);
+        out_size = size;
+        state->payload_offset += ZSTD_BLOCK_HEADER_SIZE + 1;
+        break;
+    case ZSTD_BLOCK_COMPRESSED:
+        if (size > ZSTD_BLOCK_SIZE_MAX)
+            goto err;
+
+        ret = get_input(handle, ZSTD_BLOCK_HEADER_SIZE + size, &in, &avail);
+        if (ret != STATUS_SUCCESS)
+            return ret;
+
+        if (!zstd_decompress_block(
+                state->context, &in[ZSTD_BLOCK_HEADER_SIZE], size, dest_start, dest,
+                min(dest_size, (size_t)handle->block_size), &out_size))
+        {
+            goto err;
+        }
+
+        state->payload_offset += ZSTD_BLOCK_HEADER_SIZE + size;
+        break;
+    default:
+        goto err;
+    }
+
+    *_size = out_size;
+    return STATUS_SUCCESS;
+
+err:
+    dprintf("fs: warning: error decompressing Zstandard data\n");
+    return STATUS_DEVICE_ERROR;
+}
+
+/** Decompress Zstandard data into the dictionary buffer.
+ * @param handle        Handle to decompress from.
+ * @param _offset       Offset in the dictionary buffer to decompress to.
+ * @param _size         Where to store amount of data decompressed.
+ * @return              Status code describing the result of the operation. */
+static status_t zstd_decompress(decompress_handle_t *handle, uint32_t *_offset, uint32_t *_size) {
+    uint8_t *dict = handle->state->dict_buffer;
+
+    make_block_space(handle, handle->dict_size - handle->block_size, _offset);
+    return zstd_decompress_next(handle, dict, &dict[*_offset], handle->block_size, _size);
+}
+
+/** Decompress a whole Zstandard file into a buffer.
+ * @param handle        Handle to decompress from.
+ * @param buf           Buffer to decompress into.
+ * @return              Status code describing the result of the operation. */
+static status_t zstd_decompress_all(decompress_handle_t *handle, void *buf) {
+    size_t total = handle->handle.size;
+    size_t done = 0;
+
+    while (done < total) {
+        uint32_t size;
+        status_t ret;
+
+        ret = zstd_decompress_next(handle, buf, buf + done, total - done, &size);
+        if (ret != STATUS_SUCCESS)
+            return ret;
+
+        done += size;
+    }
+
+    return STATUS_SUCCESS;
+}
+
+/** Zstandard decompression operations. */
+static const decompress_ops_t zstd_decompress_ops = {
+    .name = "Zstandard",
+    .context_size = sizeof(zstd_context_t),
+    .open = zstd_open,
+    .reset = zstd_reset_context,
+    .decompress = zstd_decompress,
+    .decompress_all = zstd_decompress_all,
+};
+
+/**
+ * Main functions.
+ */
+
+/** Supported compression formats. */
+static const decompress_ops_t *decompress_formats[] = {
+    &gzip_decompress_ops,
+    &lz4_decompress_ops,
+    &zstd_decompress_ops,
+};
+
+/** Open a handle for decompression.
+ * @param source        Handle to source file.
+ * @param _handle       Where to store pointer to decompression wrapper handle.
+ * @return              Whether this is a compressed file. */
+bool decompress_open(fs_handle_t *source, fs_handle_t **_handle) {
+    uint8_t *buf __cleanup_free;
+    decompress_handle_t *handle;
+    size_t size;
+    status_t ret;
+
+    assert(source->type == FILE_TYPE_REGULAR);
+
+    /* Read in a large chunk to identify the file. We do this because headers
+     * can be variable length so we cannot read just a fixed length, and on disk
+     * devices reads will always be at least 512 bytes (the block size), so
+     * reading byte by byte would be terribly inefficient. */
+    size = min(source->size, MAX_HEADER_SIZE);
+    buf = malloc(MAX_HEADER_SIZE);
+    ret = fs_read(source, buf, size, 0);
+    if (ret != STATUS_SUCCESS)
+        return false;
+
+    handle = malloc(sizeof(*handle));
+    handle->source = source;
+    handle->state = NULL;
+
+    for (size_t i = 0; i < array_size(decompress_formats); i++) {
+        uint32_t decompressed_size;
+
+        handle->ops = decompress_formats[i];
+        handle->format_flags = 0;
+
+        if (handle->ops->open(handle, buf, size, &decompressed_size)) {
+            dprintf("fs: file is %s compressed (size: %" PRIu32 ")\n", handle->ops->name, decompressed_size);
+
+            fs_handle_init(&handle->handle, source->mount, FILE_TYPE_REGULAR, decompressed_size);
+            handle->handle.flags |= FS_HANDLE_COMPRESSED;
+
+            *_handle = &handle->handle;
+            return true;
+        }
+    }
 
-err_free:
     free(handle);
     return false;
 }
@@ -209,13 +965,131 @@ err_free:
  * @param _handle       Handle to close. */
 void decompress_close(fs_handle_t *_handle) {
     decompress_handle_t *handle = (decompress_handle_t *)_handle;
+    decompress_state_t *state = handle->state;
 
-    if (handle == current_decompress_handle)
-        current_decompress_handle = NULL;
+    if (state) {
+        for (size_t i = 0; i < state->num_checkpoints; i++)
+            free_large(state->checkpoints[i]);
+
+        free_large(state->dict_buffer);
+        free_large(state);
+    }
 
     fs_close(handle->source);
 }
 
+/** Reset decompression state to the beginning of the file.
+ * @param handle        Handle to reset. */
+static void reset_state(decompress_handle_t *handle) {
+    decompress_state_t *state = handle->state;
+
+    state->payload_offset = state->dict_offset = state->dict_avail = state->output_offset = 0;
+    handle->ops->reset(handle);
+}
+
+/** Save a checkpoint of the current decompression state.
+ * @param handle        Handle to save state for. */
+static void save_checkpoint(decompress_handle_t *handle) {
+    decompress_state_t *state = handle->state;
+    size_t context_size = handle->ops->context_size;
+    decompress_checkpoint_t *checkpoint;
+
+    assert(!state->dict_avail);
+
+    /* If we've run out of space, drop every other checkpoint and double the
+     * interval, so that we retain coverage of the whole file. */
+    if (state->num_checkpoints == CHECKPOINT_MAX) {
+        size_t i;
+
+        for (i = 0; i < CHECKPOINT_MAX / 2; i++) {
+            free_large(state->checkpoints[i * 2]);
+            state->checkpoints[i] = state->checkpoints[(i * 2) + 1];
+        }
+
+        state->num_checkpoints = i;
+        state->checkpoint_interval *= 2;
+        state->next_checkpoint = state->checkpoints[i - 1]->output_offset + state->checkpoint_interval;
+
+        if (state->output_offset < state->next_checkpoint)
+            return;
+    }
+
+    checkpoint = malloc_large(sizeof(*checkpoint) + context_size + handle->dict_size);
+    checkpoint->payload_offset = state->payload_offset;
+    checkpoint->dict_offset = state->dict_offset;
+    checkpoint->output_offset = state->output_offset;
+    memcpy(checkpoint->data, state->context, context_size);
+    memcpy(&checkpoint->data[context_size], state->dict_buffer, handle->dict_size);
+
+    state->checkpoints[state->num_checkpoints++] = checkpoint;
+    state->next_checkpoint = state->output_offset + state->checkpoint_interval;
+}
+
+/** Move decompression state to the best position to reach an offset.
+ * @param handle        Handle to seek.
+ * @param offset        Output offset that is going to be read. */
+static void seek_state(decompress_handle_t *handle, uint32_t offset) {
+    decompress_state_t *state = handle->state;
+    size_t context_size = handle->ops->context_size;
+    decompress_checkpoint_t *checkpoint = NULL;
+
+    /* Find the closest checkpoint before the offset. */
+    for (size_t i = 0; i < state->num_checkpoints; i++) {
+        if (state->checkpoints[i]->output_offset > offset)
+            break;
+
+        checkpoint = state->checkpoints[i];
+    }
+
+    if (offset >= state->output_offset) {
+        /* Only need to move forward if we have a checkpoint nearer. */
+        if (!checkpoint || checkpoint->output_offset <= state->output_offset + state->dict_avail)
+            return;
+    } else if (!checkpoint) {
+        reset_state(handle);
+        return;
+    }
+
+    state->payload_offset = checkpoint->payload_offset;
+    state->dict_offset = checkpoint->dict_offset;
+    state->dict_avail = 0;
+    state->output_offset = checkpoint->output_offset;
+    memcpy(state->context, checkpoint->data, context_size);
+    memcpy(state->dict_buffer, &checkpoint->data[context_size], handle->dict_size);
+}
+
+/** Allocate decompression state for a handle.
+ * @param handle        Handle to allocate for. */
+static void alloc_state(decompress_handle_t *handle) {
+    decompress_state_t *state;
+    size_t context_size, input_size;
+
+    /* Allocate the context and input buffer along with the state. The input
+     * window must be able to hold the largest contiguous input needed starting
+     * anywhere within an aligned block. */
+    context_size = handle->ops->context_size;
+    context_size = round_up(context_size, 8);
+    input_size = max(handle->input_size, INPUT_WINDOW_SIZE);
+    input_size = round_up(input_size, INPUT_ALIGN) + INPUT_ALIGN;
+
+    state = malloc_large(sizeof(*state) + context_size + input_size);
+    state->context = (void *)state + sizeof(*state);
+    state->dict_buffer = NULL;
+    state->input_buffer = state->context + context_size;
+    state->input_buffer_size = input_size;
+    state->input_start = state->input_size = 0;
+    state->num_checkpoints = 0;
+    state->checkpoint_interval = CHECKPOINT_INTERVAL;
+
+    /* Don't bother with checkpoints if they would be too large. */
+    state->next_checkpoint = (handle->ops->context_size + handle->dict_size <= CHECKPOINT_SIZE_MAX)
+        ? CHECKPOINT_INTERVAL
+        : UINT32_MAX;
+
+    handle->state = state;
+    reset_state(handle);
+}
+
 /** Read from a compressed file.
  * @param _handle       Handle to read from.
  * @param buf           Buffer to read into.
@@ -224,75 +1098,73 @@ void decompress_close(fs_handle_t *_handle) {
  * @return              Status code describing the result of the operation. */
 status_t decompress_read(fs_handle_t *_handle, void *buf, uint32_t count, uint32_t offset) {
     decompress_handle_t *handle = (decompress_handle_t *)_handle;
+    uint64_t start = trace_begin();
+    uint32_t total = count;
+    decompress_state_t *state;
+    status_t ret;
+
+    if (!handle->state)
+        alloc_state(handle);
 
-    if (current_decompress_handle != handle || offset < output_offset) {
-        /* Seek back to the beginning. */
-        payload_offset = dict_offset = dict_avail = output_offset = 0;
-        tinfl_init(&decompressor);
-        current_decompress_handle = handle;
+    state = handle->state;
+
+    /* Loading a whole file is the common case, which we can do without going
+     * through the dictionary buffer. */
+    if (!offset && count == handle->handle.size) {
+        reset_state(handle);
+        ret = handle->ops->decompress_all(handle, buf);
+
+        /* The dictionary buffer does not reflect the decompressor state, so we
+         * must start again for any further reads. */
+        reset_state(handle);
+
+        if (ret == STATUS_SUCCESS)
+            trace_end(TRACE_PHASE_DECOMPRESS, start, count, handle->ops->name);
+
+        return ret;
     }
 
+    if (!state->dict_buffer)
+        state->dict_buffer = malloc_large(handle->dict_size);
+
+    seek_state(handle, offset);
+
     while (true) {
         uint32_t skip, size;
-        size_t out_size, in_size;
-        tinfl_status status;
-        status_t ret;
 
         /* Return available data. Do this first in the loop in case we have any
          * remaining data left from a previous call. */
-        if (dict_avail) {
-            skip = min(dict_avail, offset - output_offset);
-            size = min(dict_avail - skip, count);
+        if (state->dict_avail) {
+            skip = min(state->dict_avail, offset - state->output_offset);
+            size = min(state->dict_avail - skip, count);
 
             if (size) {
-                memcpy(buf, &dict_buffer[dict_offset + skip], size);
+                memcpy(buf, &state->dict_buffer[state->dict_offset + skip], size);
                 buf += size;
                 offset += size;
                 count -= size;
             }
 
-            dict_offset = (dict_offset + skip + size) % DICT_BUFFER_SIZE;
-            output_offset += skip + size;
-            dict_avail -= skip + size;
+            state->dict_offset += skip + size;
+            state->output_offset += skip + size;
+            state->dict_avail -= skip + size;
         }
 
         if (!count)
             break;
 
-        assert(payload_offset < handle->payload_size);
-
-        /* Calculate size we have available in buffers. */
-        out_size = DICT_BUFFER_SIZE - dict_offset;
-        in_size = min(
-            handle->payload_size - payload_offset,
-            PAYLOAD_BUFFER_SIZE - (payload_offset % PAYLOAD_BUFFER_SIZE));
-
-        /* Need to read more data if we're on an input block boundary. FIXME:
-         * Could make this more efficient, since the payload start is likely
-         * not on a disk block boundary this is probably doing some partial
-         * block reads. */
-        if (!(payload_offset % PAYLOAD_BUFFER_SIZE)) {
-            ret = fs_read(handle->source, payload_buffer, in_size, handle->payload_start + payload_offset);
-            if (ret != STATUS_SUCCESS)
-                return ret;
-        }
-
-        /* Decompress the data. */
-        status = tinfl_decompress(
-            &decompressor, &payload_buffer[payload_offset % PAYLOAD_BUFFER_SIZE],
-            &in_size, dict_buffer, &dict_buffer[dict_offset], &out_size,
-            (in_size < handle->payload_size - payload_offset) ? TINFL_FLAG_HAS_MORE_INPUT : 0);
-        if (status < TINFL_STATUS_DONE) {
-            dprintf("fs: warning: error %d decompressing data\n", status);
+        if (state->output_offset >= state->next_checkpoint)
+            save_checkpoint(handle);
 
+        /* Decompress more data. */
+        ret = handle->ops->decompress(handle, &state->dict_offset, &state->dict_avail);
+        if (ret != STATUS_SUCCESS) {
             /* Don't know what state things are in, reset everything. */
-            current_decompress_handle = NULL;
-            return STATUS_DEVICE_ERROR;
+            reset_state(handle);
+            return ret;
         }
-
-        payload_offset += in_size;
-        dict_avail = out_size;
     }
 
+    trace_end(TRACE_PHASE_DECOMPRESS, start, total, handle->ops->name);
     return STATUS_SUCCESS;
 }
@@ -38,6 +38,9 @@
 /** Symbolic link recursion limit. */
 #define EXT2_SYMLINK_LIMIT 8
 
+/** Number of levels of block mapping blocks to cache per handle. */
+#define EXT2_MAP_LEVELS 3
+
 /**
  * Backwards-incompatible features supported.
  *
@@ -65,6 +68,8 @@ typedef struct ext2_mount {
     size_t group_desc_size;             /**< Size of a group descriptor. */
     size_t inode_size;                  /**< Size of an inode. */
     size_t symlink_count;               /**< Current symbolic link recursion count. */
+    void *dir_buf;                      /**< Block buffer for directory iteration. */
+    bool dir_buf_busy;                  /**< Whether dir_buf is in use. */
 } ext2_mount_t;
 
 /** Open ext2 file structure. */
@@ -73,6 +78,10 @@ typedef struct ext2_handle {
 
     uint32_t num;                       /**< Inode number. */
     ext2_inode_t inode;                 /**< Inode the handle refers to. */
+
+    /** Last extent tree/indirect block read at each level of the tree. */
+    void *map_bufs[EXT2_MAP_LEVELS];
+    uint32_t map_nums[EXT2_MAP_LEVELS]; /**< Raw block numbers of map_bufs. */
 } ext2_handle_t;
 
 /** Information about an ext2 directory entry. */
@@ -100,19 +109,60 @@ static status_t read_raw_block(ext2_mount_t *mount, void *buf, uint32_t num, siz
     return device_read(mount->mount.device, buf, count, disk_offset);
 }
 
+/**
+ * Read a block mapping block (extent tree node or indirect block).
+ *
+ * The last block read at each level of the mapping tree is kept, so that a
+ * sequential read only needs to read each block on the path to the data once.
+ * Levels deeper than EXT2_MAP_LEVELS share the last cache slot.
+ *
+ * @param handle        Handle that the block is being read for.
+ * @param level         Level of the block in the tree, 0 being the block
+ *                      referenced from the inode.
+ * @param num           Raw block number.
+ * @param _buf          Where to store pointer to block data. This is only
+ *                      valid until the next call for the same handle and
+ *                      level.
+ *
+ * @return              Status code describing the result of the operation.
+ */
+static status_t read_map_block(ext2_handle_t *handle, unsigned level, uint32_t num, void **_buf) {
+    ext2_mount_t *mount = (ext2_mount_t *)handle->handle.mount;
+    status_t ret;
+
+    level = min(level, EXT2_MAP_LEVELS - 1);
+
+    if (!handle->map_bufs[level]) {
+        handle->map_bufs[level] = malloc(mount->block_size);
+    } else if (handle->map_nums[level] == num) {
+        *_buf = handle->map_bufs[level];
+        return STATUS_SUCCESS;
+    }
+
+    ret = read_raw_block(mount, handle->map_bufs[level], num, 0, 0);
+    if (ret != STATUS_SUCCESS) {
+        handle->map_nums[level] = 0;
+        return ret;
+    }
+
+    handle->map_nums[level] = num;
+    *_buf = handle->map_bufs[level];
+    return STATUS_SUCCESS;
+}
+
 /** Recurse through the extent index tree to find a leaf.
- * @param mount         Mount being read from.
+ * @param handle        Handle to inode being read.
  * @param header        Extent header to start at.
  * @param block         Block number to get.
- * @param buf           Temporary buffer to use.
  * @param _header       Where to store pointer to header for leaf.
  * @return              Status code describing the result of the operation. */
 static status_t find_leaf_extent(
-    ext2_mount_t *mount, ext4_extent_header_t *header, uint32_t block, void *buf,
+    ext2_handle_t *handle, ext4_extent_header_t *header, uint32_t block,
     ext4_extent_header_t **_header)
 {
-    while (true) {
+    for (unsigned level = 0; ; level++) {
         ext4_extent_idx_t *index = (ext4_extent_idx_t *)&header[1];
+        void *buf;
         uint16_t i;
         status_t ret;
 
@@ -131,7 +181,7 @@ static status_t find_leaf_extent(
         if (!i)
             return STATUS_CORRUPT_FS;
 
-        ret = read_raw_block(mount, buf, le32_to_cpu(index[i - 1].ei_leaf), 0, 0);
+        ret = read_map_block(handle, level, le32_to_cpu(index[i - 1].ei_leaf), &buf);
         if (ret != STATUS_SUCCESS)
             return ret;
 
@@ -139,30 +189,58 @@ static status_t find_leaf_extent(
     }
 }
 
+/** Get the length of a run of contiguous blocks in a block number array.
+ * @param array         Array of little-endian block numbers.
+ * @param index         Index of the first block in the run.
+ * @param count         Total number of entries in the array.
+ * @param _num          Where to store raw block number of first block.
+ * @return              Number of blocks in the run. A run of sparse blocks
+ *                      (raw block number 0) is treated as contiguous. */
+static uint32_t get_block_run(const uint32_t *array, size_t index, size_t count, uint32_t *_num) {
+    uint32_t num = le32_to_cpu(array[index]);
+    uint32_t run = 1;
+
+    while (index + run < count) {
+        uint32_t next = le32_to_cpu(array[index + run]);
+
+        if (next != ((num) ? num + run : 0))
+            break;
+
+        run++;
+    }
+
+    *_num = num;
+    return run;
+}
+
 /** Get the raw block number from an inode block number.
  * @param handle        Handle to inode to get block number from.
  * @param block         Block number within the inode to get.
- * @param _num          Where to store raw block number.
+ * @param _num          Where to store raw block number (0 if sparse).
+ * @param _run          Where to store the number of blocks from the given
+ *                      block which are physically contiguous (or which are
+ *                      all sparse).
  * @return              Status code describing the result of the operation. */
-static status_t inode_block_to_raw(ext2_handle_t *handle, uint32_t block, uint32_t *_num) {
+static status_t inode_block_to_raw(ext2_handle_t *handle, uint32_t block, uint32_t *_num, uint32_t *_run) {
     ext2_mount_t *mount = (ext2_mount_t *)handle->handle.mount;
     ext2_inode_t *inode = &handle->inode;
     status_t ret;
 
     if (le32_to_cpu(inode->i_flags) & EXT4_EXTENTS_FL) {
-        void *buf __cleanup_free;
         ext4_extent_header_t *header;
         ext4_extent_t *extent;
-        uint16_t i;
+        uint32_t start, len;
+        uint16_t i, entries;
+        bool uninit;
 
-        buf = malloc(mount->block_size);
         header = (ext4_extent_header_t *)inode->i_block;
-        ret = find_leaf_extent(mount, header, block, buf, &header);
+        ret = find_leaf_extent(handle, header, block, &header);
         if (ret != STATUS_SUCCESS)
             return ret;
 
         extent = (ext4_extent_t *)&header[1];
-        for (i = 0; i < le16_to_cpu(header->eh_entries); i++) {
+        entries = le16_to_cpu(header->eh_entries);
+        for (i = 0; i < entries; i++) {
             if (block < le32_to_cpu(extent[i].ee_block))
                 break;
         }
@@ -170,25 +248,43 @@ static status_t inode_block_to_raw(ext2_handle_t *handle, uint32_t block, uint32
         if (!i)
             return STATUS_CORRUPT_FS;
 
-        block -= le32_to_cpu(extent[i - 1].ee_block);
+        start = le32_to_cpu(extent[i - 1].ee_block);
+        len = le16_to_cpu(extent[i - 1].ee_len);
+
+        /* Uninitialized extents are allocated but should read as zeros. */
+        uninit = len > EXT4_EXT_INIT_MAX_LEN;
+        if (uninit)
+            len -= EXT4_EXT_INIT_MAX_LEN;
+
+        block -= start;
+
+        if (block < len) {
+            *_num = (!uninit) ? le32_to_cpu(extent[i - 1].ee_start) + block : 0;
+            *_run = len - block;
+        } else {
+            /* In a hole. It extends up to the next extent, if we know where
+             * that is. */
+            *_num = 0;
+            *_run = (i < entries) ? le32_to_cpu(extent[i].ee_block) - start - block : 1;
+        }
 
-        *_num = (block < le16_to_cpu(extent[i - 1].ee_len))
-            ? block + le32_to_cpu(extent[i - 1].ee_start)
-            : 0;
         return STATUS_SUCCESS;
     } else {
-        uint32_t *buf __cleanup_free = NULL;
+        uint32_t *buf;
         uint32_t inodes_per_block, num;
 
         /* First check if it's a direct block. This is easy to handle, just need
          * to get it straight out of the inode structure. */
         if (block < EXT2_NDIR_BLOCKS) {
-            *_num = le32_to_cpu(inode->i_block[block]);
+            uint32_t direct[EXT2_NDIR_BLOCKS];
+
+            /* The inode structure is packed, copy out rather than taking the
+             * address of the array within it. */
+            memcpy(direct, inode->i_block, sizeof(direct));
+            *_run = get_block_run(direct, block, EXT2_NDIR_BLOCKS, _num);
             return STATUS_SUCCESS;
         }
 
-        buf = malloc(mount->block_size);
-
         block -= EXT2_NDIR_BLOCKS;
 
         /* Check whether the indirect block contains the block number we need.
@@ -199,14 +295,15 @@ static status_t inode_block_to_raw(ext2_handle_t *handle, uint32_t block, uint32
             num = le32_to_cpu(inode->i_block[EXT2_IND_BLOCK]);
             if (!num) {
                 *_num = 0;
+                *_run = inodes_per_block - block;
                 return STATUS_SUCCESS;
             }
 
-            ret = read_raw_block(mount, buf, num, 0, 0);
+            ret = read_map_block(handle, 0, num, (void **)&buf);
             if (ret != STATUS_SUCCESS)
                 return ret;
 
-            *_num = le32_to_cpu(buf[block]);
+            *_run = get_block_run(buf, block, inodes_per_block, _num);
             return STATUS_SUCCESS;
         }
 
@@ -220,10 +317,11 @@ static status_t inode_block_to_raw(ext2_handle_t *handle, uint32_t block, uint32
             num = le32_to_cpu(inode->i_block[EXT2_DIND_BLOCK]);
             if (!num) {
                 *_num = 0;
+                *_run = (inodes_per_block * inodes_per_block) - block;
                 return STATUS_SUCCESS;
             }
 
-            ret = read_raw_block(mount, buf, num, 0, 0);
+            ret = read_map_block(handle, 0, num, (void **)&buf);
             if (ret != STATUS_SUCCESS)
                 return ret;
 
@@ -231,14 +329,15 @@ static status_t inode_block_to_raw(ext2_handle_t *handle, uint32_t block, uint32
             num = le32_to_cpu(buf[block / inodes_per_block]);
             if (num == 0) {
                 *_num = 0;
+                *_run = inodes_per_block - (block % inodes_per_block);
                 return STATUS_SUCCESS;
             }
 
-            ret = read_raw_block(mount, buf, num, 0, 0);
+            ret = read_map_block(handle, 1, num, (void **)&buf);
             if (ret != STATUS_SUCCESS)
                 return ret;
 
-            *_num = le32_to_cpu(buf[block % inodes_per_block]);
+            *_run = get_block_run(buf, block % inodes_per_block, inodes_per_block, _num);
             return STATUS_SUCCESS;
         }
 
@@ -249,35 +348,6 @@ static status_t inode_block_to_raw(ext2_handle_t *handle, uint32_t block, uint32
     }
 }
 
-/** Read a block from an ext2 inode.
- * @param handle        Handle to inode to read from.
- * @param buf           Buffer to read into.
- * @param num           Block number to read.
- * @param offset        Offset within the block to read from.
- * @param count         Number of bytes to read (0 means whole block).
- * @return              Status code describing the result of the operation. */
-static status_t read_inode_block(ext2_handle_t *handle, void *buf, uint32_t num, size_t offset, size_t count) {
-    ext2_mount_t *mount = (ext2_mount_t *)handle->handle.mount;
-    uint32_t total, raw = 0;
-    status_t ret;
-
-    total = round_up(handle->handle.size, mount->block_size) / mount->block_size;
-    if (num >= total)
-        return STATUS_END_OF_FILE;
-
-    ret = inode_block_to_raw(handle, num, &raw);
-    if (ret != STATUS_SUCCESS)
-        return ret;
-
-    /* If the block number is 0, then it's a sparse block. */
-    if (raw == 0) {
-        memset(buf, 0, (count) ? count : mount->block_size);
-        return STATUS_SUCCESS;
-    } else {
-        return read_raw_block(mount, buf, raw, offset, count);
-    }
-}
-
 /** Read from an ext2 inode.
  * @param _handle       Handle to the inode.
  * @param buf           Buffer to read into.
@@ -287,25 +357,57 @@ static status_t read_inode_block(ext2_handle_t *handle, void *buf, uint32_t num,
 static status_t ext2_read(fs_handle_t *_handle, void *buf, size_t count, offset_t offset) {
     ext2_handle_t *handle = (ext2_handle_t *)_handle;
     ext2_mount_t *mount = (ext2_mount_t *)_handle->mount;
+    uint32_t total;
 
+    total = round_up(handle->handle.size, mount->block_size) / mount->block_size;
+
+    /* Rather than going block by block, resolve runs of physically contiguous
+     * blocks and read each run with a single device read. */
     while (count) {
         uint32_t block = offset / mount->block_size;
         size_t block_offset = offset % mount->block_size;
-        size_t block_count = min(count, mount->block_size - block_offset);
+        uint32_t raw, run;
+        size_t run_count;
         status_t ret;
 
-        ret = read_inode_block(handle, buf, block, block_offset, block_count);
+        if (block >= total)
+            return STATUS_END_OF_FILE;
+
+        ret = inode_block_to_raw(handle, block, &raw, &run);
         if (ret != STATUS_SUCCESS)
             return ret;
 
-        buf += block_count;
-        offset += block_count;
-        count -= block_count;
+        run = min(run, total - block);
+        run_count = min((offset_t)count, ((offset_t)run * mount->block_size) - block_offset);
+
+        /* If the block number is 0, then it's a sparse block. */
+        if (raw == 0) {
+            memset(buf, 0, run_count);
+        } else {
+            ret = device_read(
+                mount->mount.device, buf, run_count,
+                ((offset_t)raw * mount->block_size) + block_offset);
+            if (ret != STATUS_SUCCESS)
+                return ret;
+        }
+
+        buf += run_count;
+        offset += run_count;
+        count -= run_count;
     }
 
     return STATUS_SUCCESS;
 }
 
+/** Close an ext2 handle.
+ * @param _handle       Handle to close. */
+static void ext2_close(fs_handle_t *_handle) {
+    ext2_handle_t *handle = (ext2_handle_t *)_handle;
+
+    for (size_t i = 0; i < EXT2_MAP_LEVELS; i++)
+        free(handle->map_bufs[i]);
+}
+
 /** Open an inode from the filesystem.
  * @param mount         Mount to read from.
  * @param id            ID of node. If the node is a symbolic link, the link
@@ -341,6 +443,8 @@ static status_t open_inode(ext2_mount_t *mount, uint32_t id, ext2_handle_t *owne
 
     handle = malloc(sizeof(*handle));
     handle->num = id;
+    memset(handle->map_bufs, 0, sizeof(handle->map_bufs));
+    memset(handle->map_nums, 0, sizeof(handle->map_nums));
 
     ret = device_read(mount->mount.device, &handle->inode, inode_size, inode_offset);
     if (ret != STATUS_SUCCESS) {
@@ -371,6 +475,7 @@ static status_t open_inode(ext2_mount_t *mount, uint32_t id, ext2_handle_t *owne
             memcpy(dest, handle->inode.i_block, size);
         } else {
             ret = ext2_read(&handle->handle, dest, size, 0);
+            ext2_close(&handle->handle);
             if (ret != STATUS_SUCCESS) {
                 free(handle);
                 return ret;
@@ -395,74 +500,653 @@ static status_t open_inode(ext2_mount_t *mount, uint32_t id, ext2_handle_t *owne
     return STATUS_SUCCESS;
 }
 
-/** Open an entry on an ext2 filesystem.
- * @param _entry        Entry to open (obtained via iterate()).
+/** Open an inode found in a directory.
+ * @param owner         Directory that the inode was found in.
+ * @param num           Inode number.
  * @param _handle       Where to store pointer to opened handle.
  * @return              Status code describing the result of the operation. */
-static status_t ext2_open_entry(const fs_entry_t *_entry, fs_handle_t **_handle) {
-    ext2_entry_t *entry = (ext2_entry_t *)_entry;
-    ext2_handle_t *owner = (ext2_handle_t *)_entry->owner;
-    ext2_mount_t *mount = (ext2_mount_t *)_entry->owner->mount;
+static status_t open_child(ext2_handle_t *owner, uint32_t num, fs_handle_t **_handle) {
+    ext2_mount_t *mount = (ext2_mount_t *)owner->handle.mount;
 
-    if (entry->num == owner->num) {
+    if (num == owner->num) {
         fs_retain(&owner->handle);
         *_handle = &owner->handle;
         return STATUS_SUCCESS;
-    } else if (entry->num == EXT2_ROOT_INO) {
+    } else if (num == EXT2_ROOT_INO) {
         fs_retain(mount->mount.root);
         *_handle = mount->mount.root;
         return STATUS_SUCCESS;
     } else {
-        return open_inode(mount, entry->num, owner, _handle);
+        return open_inode(mount, num, owner, _handle);
     }
 }
 
-/** Iterate over ext2 directory entries.
+/** Open an entry on an ext2 filesystem.
+ * @param _entry        Entry to open (obtained via iterate()).
+ * @param _handle       Where to store pointer to opened handle.
+ * @return              Status code describing the result of the operation. */
+static status_t ext2_open_entry(const fs_entry_t *_entry, fs_handle_t **_handle) {
+    ext2_entry_t *entry = (ext2_entry_t *)_entry;
+
+    return open_child((ext2_handle_t *)_entry->owner, entry->num, _handle);
+}
+
+/** Read a block of a directory.
+ * @param handle        Handle to the directory.
+ * @param buf           Buffer to read into (block sized).
+ * @param block         Block number within the directory.
+ * @return              Status code describing the result of the operation. */
+static status_t read_dir_block(ext2_handle_t *handle, void *buf, uint32_t block) {
+    ext2_mount_t *mount = (ext2_mount_t *)handle->handle.mount;
+    offset_t offset = (offset_t)block * mount->block_size;
+
+    if (offset >= handle->handle.size)
+        return STATUS_CORRUPT_FS;
+
+    return ext2_read(
+        &handle->handle, buf, min((offset_t)mount->block_size, handle->handle.size - offset),
+        offset);
+}
+
+/**
+ * Iterate over ext2 directory entries.
+ *
+ * Directories are read one block at a time into a buffer kept in the mount,
+ * so the memory needed does not depend on the size of the directory, and no
+ * more is read than is needed to get to the point where the callback asks to
+ * stop.
+ *
  * @param _handle       Handle to directory.
  * @param cb            Callback to call on each entry.
  * @param arg           Data to pass to callback.
- * @return              Status code describing the result of the operation. */
+ *
+ * @return              Status code describing the result of the operation.
+ */
 static status_t ext2_iterate(fs_handle_t *_handle, fs_iterate_cb_t cb, void *arg) {
     ext2_handle_t *handle = (ext2_handle_t *)_handle;
-    char *buf __cleanup_free_large;
+    ext2_mount_t *mount = (ext2_mount_t *)_handle->mount;
+    char *tmp __cleanup_free = NULL;
     char *name __cleanup_free;
+    char *buf;
+    uint32_t blocks;
     bool cont;
-    offset_t offset;
     status_t ret;
 
-    /* Allocate buffers to read the data into. */
-    buf = malloc_large(handle->handle.size);
+    /* Use the mount's buffer unless a callback is iterating another directory
+     * while we are already using it. */
+    if (mount->dir_buf_busy) {
+        buf = tmp = malloc(mount->block_size);
+    } else {
+        if (!mount->dir_buf)
+            mount->dir_buf = malloc(mount->block_size);
+
+        buf = mount->dir_buf;
+        mount->dir_buf_busy = true;
+    }
+
     name = malloc(EXT2_NAME_MAX + 1);
+    blocks = round_up(handle->handle.size, mount->block_size) / mount->block_size;
+
+    ret = STATUS_SUCCESS;
+    cont = true;
+    for (uint32_t i = 0; cont && i < blocks; i++) {
+        size_t size, offset;
+
+        ret = read_dir_block(handle, buf, i);
+        if (ret != STATUS_SUCCESS)
+            break;
+
+        size = min((offset_t)mount->block_size, handle->handle.size - ((offset_t)i * mount->block_size));
+
+        offset = 0;
+        while (cont && offset + EXT2_DIRENT_SIZE <= size) {
+            ext2_dir_entry_t *entry = (ext2_dir_entry_t *)(buf + offset);
+            uint16_t rec_len = le16_to_cpu(entry->rec_len);
+
+            if (!rec_len) {
+                cont = false;
+                break;
+            } else if (offset + rec_len > size || EXT2_DIRENT_SIZE + entry->name_len > rec_len) {
+                break;
+            }
 
-    /* Read in all the directory entries. */
-    ret = ext2_read(_handle, buf, handle->handle.size, 0);
+            if (entry->inode && entry->file_type != EXT2_FT_UNKNOWN && entry->name_len != 0) {
+                ext2_entry_t child;
+
+                memcpy(name, entry->name, entry->name_len);
+                name[entry->name_len] = 0;
+
+                child.entry.owner = &handle->handle;
+                child.entry.name = name;
+                child.entry.size = FS_ENTRY_SIZE_UNKNOWN;
+                child.num = le32_to_cpu(entry->inode);
+
+                /* Symbolic links need to be resolved to find the type. The
+                 * size is only in the inode. */
+                switch (entry->file_type) {
+                case EXT2_FT_REG_FILE:
+                    child.entry.type = FILE_TYPE_REGULAR;
+                    break;
+                case EXT2_FT_DIR:
+                    child.entry.type = FILE_TYPE_DIR;
+                    break;
+                default:
+                    child.entry.type = FILE_TYPE_NONE;
+                    break;
+                }
+
+                cont = cb(&child.entry, arg);
+            }
+
+            offset += rec_len;
+        }
+    }
+
+    if (buf == mount->dir_buf)
+        mount->dir_buf_busy = false;
+
+    return ret;
+}
+
+/** Signature of a function to convert a string to hash input words. */
+typedef void (*str_to_hash_buf_t)(const char *str, size_t len, uint32_t *buf, size_t num);
+
+/** Convert a string to hash input words, treating characters as signed.
+ * @param str           String to convert.
+ * @param len           Remaining length of the string.
+ * @param buf           Buffer to fill.
+ * @param num           Number of words to fill. */
+static void str_to_hash_buf_signed(const char *str, size_t len, uint32_t *buf, size_t num) {
+    uint32_t pad, val;
+
+    pad = (uint32_t)len | ((uint32_t)len << 8);
+    pad |= pad << 16;
+
+    val = pad;
+    len = min(len, num * 4);
+    for (size_t i = 0; i < len; i++) {
+        val = (int32_t)(int8_t)str[i] + (val << 8);
+        if ((i % 4) == 3) {
+            *buf++ = val;
+            val = pad;
+            num--;
+        }
+    }
+
+    if (num) {
+        *buf++ = val;
+        num--;
+    }
+
+    while (num--)
+        *buf++ = pad;
+}
+
+/** Convert a string to hash input words, treating characters as unsigned.
+ * @param str           String to convert.
+ * @param len           Remaining length of the string.
+ * @param buf           Buffer to fill.
+ * @param num           Number of words to fill. */
+static void str_to_hash_buf_unsigned(const char *str, size_t len, uint32_t *buf, size_t num) {
+    uint32_t pad, val;
+
+    pad = (uint32_t)len | ((uint32_t)len << 8);
+    pad |= pad << 16;
+
+    val = pad;
+    len = min(len, num * 4);
+    for (size_t i = 0; i < len; i++) {
+        val = (uint32_t)(uint8_t)str[i] + (val << 8);
+        if ((i % 4) == 3) {
+            *buf++ = val;
+            val = pad;
+            num--;
+        }
+    }
+
+    if (num) {
+        *buf++ = val;
+        num--;
+    }
+
+    while (num--)
+        *buf++ = pad;
+}
+
+/** Rotate a 32-bit value left. */
+#define rol32(x, s)     (((x) << (s)) | ((x) >> (32 - (s))))
+
+/** Half MD4 round functions. */
+#define HALF_MD4_F(x, y, z)     ((z) ^ ((x) & ((y) ^ (z))))
+#define HALF_MD4_G(x, y, z)     (((x) & (y)) + (((x) ^ (y)) & (z)))
+#define HALF_MD4_H(x, y, z)     ((x) ^ (y) ^ (z))
+#define HALF_MD4_ROUND(f, a, b, c, d, x, s) \
+    (a += f(b, c, d) + (x), a = rol32(a, s))
+#define HALF_MD4_K2     013240474631u
+#define HALF_MD4_K3     015666365641u
+
+/** Perform the half MD4 transform.
+ * @param buf           Hash state.
+ * @param in            Input words. */
+static void half_md4_transform(uint32_t buf[4], const uint32_t in[8]) {
+    uint32_t a = buf[0], b = buf[1], c = buf[2], d = buf[3];
+
+    HALF_MD4_ROUND(HALF_MD4_F, a, b, c, d, in[0], 3);
+    HALF_MD4_ROUND(HALF_MD4_F, d, a, b, c, in[1], 7);
+    HALF_MD4_ROUND(HALF_MD4_F, c, d, a, b, in[2], 11);
+    HALF_MD4_ROUND(HALF_MD4_F, b, c, d, a, in[3], 19);
+    HALF_MD4_ROUND(HALF_MD4_F, a, b, c, d, in[4], 3);
+    HALF_MD4_ROUND(HALF_MD4_F, d, a, b, c, in[5], 7);
+    HALF_MD4_ROUND(HALF_MD4_F, c, d, a, b, in[6], 11);
+    HALF_MD4_ROUND(HALF_MD4_F, b, c, d, a, in[7], 19);
+
+    HALF_MD4_ROUND(HALF_MD4_G, a, b, c, d, in[1] + HALF_MD4_K2, 3);
+    HALF_MD4_ROUND(HALF_MD4_G, d, a, b, c, in[3] + HALF_MD4_K2, 5);
+    HALF_MD4_ROUND(HALF_MD4_G, c, d, a, b, in[5] + HALF_MD4_K2, 9);
+    HALF_MD4_ROUND(HALF_MD4_G, b, c, d, a, in[7] + HALF_MD4_K2, 13);
+    HALF_MD4_ROUND(HALF_MD4_G, a, b, c, d, in[0] + HALF_MD4_K2, 3);
+    HALF_MD4_ROUND(HALF_MD4_G, d, a, b, c, in[2] + HALF_MD4_K2, 5);
+    HALF_MD4_ROUND(HALF_MD4_G, c, d, a, b, in[4] + HALF_MD4_K2, 9);
+    HALF_MD4_ROUND(HALF_MD4_G, b, c, d, a, in[6] + HALF_MD4_K2, 13);
+
+    HALF_MD4_ROUND(HALF_MD4_H, a, b, c, d, in[3] + HALF_MD4_K3, 3);
+    HALF_MD4_ROUND(HALF_MD4_H, d, a, b, c, in[7] + HALF_MD4_K3, 9);
+    HALF_MD4_ROUND(HALF_MD4_H, c, d, a, b, in[2] + HALF_MD4_K3, 11);
+    HALF_MD4_ROUND(HALF_MD4_H, b, c, d, a, in[6] + HALF_MD4_K3, 15);
+    HALF_MD4_ROUND(HALF_MD4_H, a, b, c, d, in[1] + HALF_MD4_K3, 3);
+    HALF_MD4_ROUND(HALF_MD4_H, d, a, b, c, in[5] + HALF_MD4_K3, 9);
+    HALF_MD4_ROUND(HALF_MD4_H, c, d, a, b, in[0] + HALF_MD4_K3, 11);
+    HALF_MD4_ROUND(HALF_MD4_H, b, c, d, a, in[4] + HALF_MD4_K3, 15);
+
+    buf[0] += a;
+    buf[1] += b;
+    buf[2] += c;
+    buf[3] += d;
+}
+
+/** Perform the TEA transform.
+ * @param buf           Hash state.
+ * @param in            Input words. */
+static void tea_transform(uint32_t buf[4], const uint32_t in[4]) {
+    uint32_t sum = 0;
+    uint32_t b0 = buf[0], b1 = buf[1];
+
+    for (unsigned i = 0; i < 16; i++) {
+        sum += 0x9e3779b9;
+        b0 += ((b1 << 4) + in[0]) ^ (b1 + sum) ^ ((b1 >> 5) + in[1]);
+        b1 += ((b0 << 4) + in[2]) ^ (b0 + sum) ^ ((b0 >> 5) + in[3]);
+    }
+
+    buf[0] += b0;
+    buf[1] += b1;
+}
+
+/** Calculate the legacy directory hash of a name.
+ * @param name          Name to hash.
+ * @param len           Length of the name.
+ * @param is_signed     Whether to treat characters as signed.
+ * @return              Hash of the name. */
+static uint32_t legacy_hash(const char *name, size_t len, bool is_signed) {
+    uint32_t hash, hash0 = 0x12a3fe2d, hash1 = 0x37abe8f9;
+
+    for (size_t i = 0; i < len; i++) {
+        int32_t ch = (is_signed) ? (int32_t)(int8_t)name[i] : (int32_t)(uint8_t)name[i];
+
+        hash = hash1 + (hash0 ^ (uint32_t)(ch * 7152373));
+        if (hash & 0x80000000)
+            hash -= 0x7fffffff;
+
+        hash1 = hash0;
+        hash0 = hash;
+    }
+
+    return hash0 << 1;
+}
+
+/** Calculate the directory index hash of a name.
+ * @param mount         Mount the directory is on.
+ * @param version       Hash version.
+ * @param name          Name to hash.
+ * @param len           Length of the name.
+ * @return              Major hash of the name. */
+static uint32_t dx_hash(ext2_mount_t *mount, uint8_t version, const char *name, size_t len) {
+    str_to_hash_buf_t str_to_hash_buf = str_to_hash_buf_signed;
+    uint32_t buf[4], in[8];
+    uint32_t hash;
+
+    buf[0] = 0x67452301;
+    buf[1] = 0xefcdab89;
+    buf[2] = 0x98badcfe;
+    buf[3] = 0x10325476;
+
+    /* Use the filesystem's hash seed, if it has one. */
+    if (mount->sb.s_hash_seed[0] || mount->sb.s_hash_seed[1] ||
+        mount->sb.s_hash_seed[2] || mount->sb.s_hash_seed[3])
+    {
+        for (size_t i = 0; i < 4; i++)
+            buf[i] = le32_to_cpu(mount->sb.s_hash_seed[i]);
+    }
+
+    switch (version) {
+    case EXT2_HASH_LEGACY_UNSIGNED:
+        hash = legacy_hash(name, len, false);
+        break;
+    case EXT2_HASH_HALF_MD4_UNSIGNED:
+        str_to_hash_buf = str_to_hash_buf_unsigned;
+        /* Fall through. */
+    case EXT2_HASH_HALF_MD4:
+        while (true) {
+            str_to_hash_buf(name, len, in, 8);
+            half_md4_transform(buf, in);
+
+            if (len <= 32)
+                break;
+
+            len -= 32;
+            name += 32;
+        }
+
+        hash = buf[1];
+        break;
+    case EXT2_HASH_TEA_UNSIGNED:
+        str_to_hash_buf = str_to_hash_buf_unsigned;
+        /* Fall through. */
+    case EXT2_HASH_TEA:
+        while (true) {
+            str_to_hash_buf(name, len, in, 4);
+            tea_transform(buf, in);
+
+            if (len <= 16)
+                break;
+
+            len -= 16;
+            name += 16;
+        }
+
+        hash = buf[0];
+        break;
+    default:
+        hash = legacy_hash(name, len, true);
+        break;
+    }
+
+    hash &= ~1;
+    if (hash == (0x7fffffffu << 1))
+        hash = (0x7fffffffu - 1) << 1;
+
+    return hash;
+}
+
+/** Search a directory block for a name.
+ * @param buf           Block data.
+ * @param size          Size of the data.
+ * @param name          Name to search for.
+ * @param len           Length of the name.
+ * @return              Inode number of the entry, or 0 if not found. */
+static uint32_t search_dir_block(const char *buf, size_t size, const char *name, size_t len) {
+    size_t offset = 0;
+
+    while (offset + EXT2_DIRENT_SIZE <= size) {
+        const ext2_dir_entry_t *entry = (const ext2_dir_entry_t *)(buf + offset);
+        uint16_t rec_len = le16_to_cpu(entry->rec_len);
+
+        if (rec_len < EXT2_DIRENT_SIZE || offset + rec_len > size) {
+            break;
+        } else if (EXT2_DIRENT_SIZE + entry->name_len > rec_len) {
+            break;
+        }
+
+        if (entry->inode && entry->file_type != EXT2_FT_UNKNOWN &&
+            entry->name_len == len && !memcmp(entry->name, name, len))
+        {
+            return le32_to_cpu(entry->inode);
+        }
+
+        offset += rec_len;
+    }
+
+    return 0;
+}
+
+/** Look up a name by scanning every block of a directory.
+ * @param handle        Handle to the directory.
+ * @param name          Name to search for.
+ * @param len           Length of the name.
+ * @param _num          Where to store inode number of the entry.
+ * @return              Status code describing the result of the operation. */
+static status_t linear_lookup(ext2_handle_t *handle, const char *name, size_t len, uint32_t *_num) {
+    ext2_mount_t *mount = (ext2_mount_t *)handle->handle.mount;
+    char *buf __cleanup_free;
+    uint32_t blocks;
+    status_t ret;
+
+    buf = malloc(mount->block_size);
+    blocks = round_up(handle->handle.size, mount->block_size) / mount->block_size;
+
+    for (uint32_t i = 0; i < blocks; i++) {
+        ret = read_dir_block(handle, buf, i);
+        if (ret != STATUS_SUCCESS)
+            return ret;
+
+        *_num = search_dir_block(
+            buf, min((offset_t)mount->block_size, handle->handle.size - ((offset_t)i * mount->block_size)),
+            name, len);
+        if (*_num)
+            return STATUS_SUCCESS;
+    }
+
+    return STATUS_NOT_FOUND;
+}
+
+/** Get the entries from a directory index node.
+ * @param mount         Mount the directory is on.
+ * @param node          Node block data.
+ * @param offset        Offset of the entries in the node.
+ * @param _count        Where to store number of entries.
+ * @return              Pointer to entries, or NULL if the node is invalid. */
+static ext2_dx_entry_t *get_dx_entries(ext2_mount_t *mount, char *node, size_t offset, uint16_t *_count) {
+    ext2_dx_countlimit_t *countlimit = (ext2_dx_countlimit_t *)(node + offset);
+    uint16_t count = le16_to_cpu(countlimit->count);
+
+    if (!count || count > le16_to_cpu(countlimit->limit) ||
+        count > (mount->block_size - offset) / sizeof(ext2_dx_entry_t))
+    {
+        return NULL;
+    }
+
+    *_count = count;
+    return (ext2_dx_entry_t *)countlimit;
+}
+
+/** Find the index entry covering a hash value.
+ * @param entries       Entries in the node.
+ * @param count         Number of entries.
+ * @param hash          Hash to search for.
+ * @return              Index of the last entry with a hash less than or equal
+ *                      to the given hash. */
+static uint16_t search_dx_entries(ext2_dx_entry_t *entries, uint16_t count, uint32_t hash) {
+    uint16_t low = 1, high = count;
+
+    /* The first entry has no hash and covers everything below the second. */
+    while (low < high) {
+        uint16_t mid = low + ((high - low) / 2);
+
+        if (le32_to_cpu(entries[mid].hash) > hash) {
+            high = mid;
+        } else {
+            low = mid + 1;
+        }
+    }
+
+    return low - 1;
+}
+
+/** Get the block number from a directory index entry. */
+#define dx_entry_block(entry)   (le32_to_cpu((entry)->block) & 0x0fffffff)
+
+/**
+ * Look up a name using a hashed directory index.
+ *
+ * Large directories on ext3/4 are indexed by a tree of name hashes (htree).
+ * This walks the tree to find the single leaf block which should contain the
+ * name, rather than reading the whole directory. If the tree contains
+ * something that we do not understand, STATUS_NOT_SUPPORTED is returned so
+ * that the caller can fall back to a linear search, as the leaf blocks are
+ * still valid directory blocks.
+ *
+ * @param handle        Handle to the directory.
+ * @param name          Name to search for.
+ * @param len           Length of the name.
+ * @param _num          Where to store inode number of the entry.
+ *
+ * @return              Status code describing the result of the operation.
+ */
+static status_t dx_lookup(ext2_handle_t *handle, const char *name, size_t len, uint32_t *_num) {
+    ext2_mount_t *mount = (ext2_mount_t *)handle->handle.mount;
+    ext2_dx_entry_t *entries[EXT2_DX_MAX_LEVELS];
+    uint16_t counts[EXT2_DX_MAX_LEVELS], at[EXT2_DX_MAX_LEVELS];
+    ext2_dx_root_info_t *info;
+    char *buf __cleanup_free;
+    char *node;
+    unsigned levels, level;
+    uint32_t hash;
+    uint8_t version;
+    status_t ret;
+
+    /* One buffer for each level of the tree plus the leaf. */
+    buf = malloc((EXT2_DX_MAX_LEVELS + 1) * mount->block_size);
+
+    ret = read_dir_block(handle, buf, 0);
     if (ret != STATUS_SUCCESS)
         return ret;
 
-    cont = true;
-    offset = 0;
-    while (cont && offset < handle->handle.size) {
-        ext2_dir_entry_t *entry = (ext2_dir_entry_t *)(buf + offset);
+    /* The root information follows the "." and ".." entries. */
+    info = (ext2_dx_root_info_t *)(buf + 24);
+    if (info->reserved_zero || info->info_length < sizeof(*info) ||
+        info->indirect_levels >= EXT2_DX_MAX_LEVELS)
+    {
+        return STATUS_NOT_SUPPORTED;
+    }
+
+    version = info->hash_version;
+    if (version > EXT2_HASH_TEA) {
+        return STATUS_NOT_SUPPORTED;
+    } else if (le32_to_cpu(mount->sb.s_flags) & EXT2_FLAGS_UNSIGNED_HASH) {
+        version += EXT2_HASH_LEGACY_UNSIGNED;
+    }
+
+    hash = dx_hash(mount, version, name, len);
+    levels = info->indirect_levels + 1;
+
+    /* Walk down the tree to the leaf that covers the hash. */
+    entries[0] = get_dx_entries(mount, buf, 24 + info->info_length, &counts[0]);
+    if (!entries[0])
+        return STATUS_NOT_SUPPORTED;
+
+    at[0] = search_dx_entries(entries[0], counts[0], hash);
+
+    for (level = 1; level < levels; level++) {
+        node = buf + (level * mount->block_size);
+
+        ret = read_dir_block(handle, node, dx_entry_block(&entries[level - 1][at[level - 1]]));
+        if (ret != STATUS_SUCCESS)
+            return ret;
+
+        entries[level] = get_dx_entries(mount, node, EXT2_DIRENT_SIZE, &counts[level]);
+        if (!entries[level])
+            return STATUS_NOT_SUPPORTED;
+
+        at[level] = search_dx_entries(entries[level], counts[level], hash);
+    }
+
+    node = buf + (levels * mount->block_size);
+
+    while (true) {
+        uint32_t block = dx_entry_block(&entries[levels - 1][at[levels - 1]]);
 
-        if (entry->inode && entry->file_type != EXT2_FT_UNKNOWN && entry->name_len != 0) {
-            ext2_entry_t child;
+        ret = read_dir_block(handle, node, block);
+        if (ret != STATUS_SUCCESS)
+            return ret;
 
-            strncpy(name, entry->name, entry->name_len);
-            name[entry->name_len] = 0;
+        *_num = search_dir_block(node, mount->block_size, name, len);
+        if (*_num)
+            return STATUS_SUCCESS;
 
-            child.entry.owner = &handle->handle;
-            child.entry.name = name;
-            child.num = le32_to_cpu(entry->inode);
+        /* Names with colliding hashes may continue into the next leaf, which
+         * is marked by the low bit of its hash being set. Find the next
+         * entry in the tree and check whether it continues our hash. */
+        level = levels - 1;
+        while (++at[level] >= counts[level]) {
+            if (!level)
+                return STATUS_NOT_FOUND;
 
-            cont = cb(&child.entry, arg);
-        } else if (!le16_to_cpu(entry->rec_len)) {
-            cont = false;
+            level--;
         }
 
-        offset += le16_to_cpu(entry->rec_len);
+        if ((le32_to_cpu(entries[level][at[level]].hash) & ~1) != hash)
+            return STATUS_NOT_FOUND;
+
+        /* Descend to the first leaf below the entry. */
+        while (++level < levels) {
+            char *child = buf + (level * mount->block_size);
+
+            ret = read_dir_block(handle, child, dx_entry_block(&entries[level - 1][at[level - 1]]));
+            if (ret != STATUS_SUCCESS)
+                return ret;
+
+            entries[level] = get_dx_entries(mount, child, EXT2_DIRENT_SIZE, &counts[level]);
+            if (!entries[level])
+                return STATUS_CORRUPT_FS;
+
+            at[level] = 0;
+        }
     }
+}
 
-    return STATUS_SUCCESS;
+/** Look up an entry in an ext2 directory.
+ * @param _handle       Handle to directory.
+ * @param name          Name of the entry to look up.
+ * @param _child        Where to store pointer to opened handle.
+ * @return              Status code describing the result of the operation. */
+static status_t ext2_lookup(fs_handle_t *_handle, const char *name, fs_handle_t **_child) {
+    ext2_handle_t *handle = (ext2_handle_t *)_handle;
+    ext2_mount_t *mount = (ext2_mount_t *)_handle->mount;
+    size_t len = strlen(name);
+    uint32_t num = 0;
+    status_t ret;
+
+    if (len >= EXT2_NAME_MAX)
+        return STATUS_NOT_FOUND;
+
+    /* The "." and ".." entries are not in the index, they are at the start of
+     * the root block, so a linear search finds them in the first block. */
+    ret = STATUS_NOT_SUPPORTED;
+    if (le32_to_cpu(mount->sb.s_feature_compat) & EXT2_FEATURE_COMPAT_DIR_INDEX &&
+        le32_to_cpu(handle->inode.i_flags) & EXT2_INDEX_FL &&
+        strcmp(name, ".") != 0 && strcmp(name, "..") != 0)
+    {
+        ret = dx_lookup(handle, name, len, &num);
+        if (ret == STATUS_NOT_SUPPORTED)
+            dprintf("ext2: unsupported directory index on inode %" PRIu32 ", falling back to linear search\n", handle->num);
+    }
+
+    if (ret == STATUS_NOT_SUPPORTED)
+        ret = linear_lookup(handle, name, len, &num);
+
+    if (ret != STATUS_SUCCESS)
+        return ret;
+
+    return open_child(handle, num, _child);
+}
+
+/** Check for an ext2 filesystem signature.
+ * @param buf           Data from the start of the device.
+ * @param size          Size of the data.
+ * @return              Whether the device might contain an ext2 filesystem. */
+static bool ext2_probe(const void *buf, size_t size) {
+    const ext2_superblock_t *sb = buf + 1024;
+
+    return size >= 1024 + sizeof(*sb) && le16_to_cpu(sb->s_magic) == EXT2_MAGIC;
 }
 
 /** Mount an ext2 filesystem.
@@ -480,6 +1164,8 @@ static status_t ext2_mount(device_t *device, fs_mount_t **_mount) {
     mount->mount.device = device;
     mount->mount.case_insensitive = false;
     mount->symlink_count = 0;
+    mount->dir_buf = NULL;
+    mount->dir_buf_busy = false;
 
     /* Read in the superblock. */
     ret = device_read(device, &mount->sb, sizeof(mount->sb), 1024);
@@ -563,8 +1249,11 @@ err_free_mount:
 /** Ext2 filesystem operations structure. */
 BUILTIN_FS_OPS(ext2_fs_ops) = {
     .name = "ext2",
+    .probe = ext2_probe,
     .read = ext2_read,
+    .close = ext2_close,
     .open_entry = ext2_open_entry,
     .iterate = ext2_iterate,
+    .lookup = ext2_lookup,
     .mount = ext2_mount,
 };
@@ -22,10 +22,6 @@
  *  - Many fields of the on-disk structures are not correctly aligned. These
  *    will cause problems on architectures where non-aligned reads are not
  *    supported. Need unaligned access wrapper functions.
- *  - Could do with some optimization - we currently traverse the cluster chain
- *    on every read. We could potentially cache some information to help
- *    sequential reads, or perhaps read in a large chunks of the FAT at a time
- *    and store it in case the next cluster resides within the same chunk.
  */
 
 #include <fs/fat.h>
@@ -42,6 +38,12 @@
 #include <loader.h>
 #include <memory.h>
 
+/** Size of the cached window of the FAT. */
+#define FAT_WINDOW_SIZE         16384
+
+/** Initial number of entries in a cluster run map. */
+#define FAT_RUNS_INITIAL        256
+
 /** Mounted FAT filesystem. */
 typedef struct fat_mount {
     fs_mount_t mount;                   /**< Mount header. */
@@ -49,16 +51,38 @@ typedef struct fat_mount {
     uint32_t cluster_size;              /**< Size of a cluster (in bytes). */
     uint32_t total_clusters;            /**< Total number of clusters. */
     offset_t fat_offset;                /**< FAT offset (in bytes). */
+    uint32_t fat_size;                  /**< FAT size (in bytes). */
     offset_t root_offset;               /**< Root directory offset (in bytes). */
     offset_t data_offset;               /**< Data area offset (in bytes). */
     uint8_t fat_type;                   /**< Type of the filesystem (12, 16 or 32). */
     uint32_t end_marker;                /**< End marker for the FAT type. */
+
+    void *fat_window;                   /**< Cached window of the FAT. */
+    uint32_t fat_window_offset;         /**< Offset of the cached window in the FAT. */
 } fat_mount_t;
 
+/** Run of physically contiguous clusters in a file. */
+typedef struct fat_run {
+    uint32_t logical;                   /**< First logical cluster number. */
+    uint32_t physical;                  /**< First physical cluster number. */
+    uint32_t length;                    /**< Number of clusters in the run. */
+} fat_run_t;
+
 /** Handle to a FAT file/directory. */
 typedef struct fat_handle {
     fs_handle_t handle;                 /**< Handle header. */
     uint32_t cluster;                   /**< Start cluster number. */
+
+    /**
+     * Cluster run map.
+     *
+     * This is built up on demand as the file is read, so that the cluster
+     * chain only needs to be traversed once for each handle.
+     */
+    fat_run_t *runs;                    /**< Array of runs. */
+    uint32_t num_runs;                  /**< Number of runs in the map. */
+    uint32_t max_runs;                  /**< Allocated size of the array. */
+    uint32_t next_cluster;              /**< Next cluster to add to the map (0 if complete). */
 } fat_handle_t;
 
 /** FAT directory iteration state. */
@@ -82,6 +106,193 @@ typedef struct fat_iterate_state {
 #define fat_warn(h, fmt, ...) \
     dprintf("fat: %s: " fmt "\n", (h)->handle.mount->device->name, ##__VA_ARGS__)
 
+/** Initialize a FAT handle.
+ * @param handle        Handle to initialize.
+ * @param mount         Mount the handle is on.
+ * @param type          Type of the file.
+ * @param size          Size of the file.
+ * @param cluster       Start cluster number. */
+static void init_handle(fat_handle_t *handle, fat_mount_t *mount, file_type_t type, offset_t size, uint32_t cluster) {
+    fs_handle_init(&handle->handle, &mount->mount, type, size);
+
+    handle->cluster = cluster;
+    handle->runs = NULL;
+    handle->num_runs = 0;
+    handle->max_runs = 0;
+    handle->next_cluster = cluster;
+}
+
+/** Get an entry from the FAT.
+ * @param handle        Handle that the entry is being read for.
+ * @param cluster       Cluster number to get entry for.
+ * @param _entry        Where to store FAT entry.
+ * @return              Status code describing the result of the operation. */
+static status_t get_fat_entry(fat_handle_t *handle, uint32_t cluster, uint32_t *_entry) {
+    fat_mount_t *mount = (fat_mount_t *)handle->handle.mount;
+    uint32_t offset, window, entry;
+
+    /* Determine the offset in the FAT of the entry. */
+    switch (mount->fat_type) {
+    case 32:
+        offset = cluster << 2;
+        break;
+    case 16:
+        offset = cluster << 1;
+        break;
+    default:
+        /* FAT12 packs 2 entries across 3 bytes. This gives the required
+         * entry rounded down to a byte boundary. */
+        offset = cluster + (cluster >> 1);
+        break;
+    }
+
+    if (offset + (round_up(mount->fat_type, 8) / 8) > mount->fat_size) {
+        fat_warn(handle, "cluster number 0x%" PRIx32 " outside of FAT", cluster);
+        return STATUS_CORRUPT_FS;
+    }
+
+    /* Read in the window containing the entry if it isn't the one we have
+     * cached. The buffer has some extra space at the end so that a FAT12
+     * entry straddling the end of the window is fully contained. */
+    window = round_down(offset, FAT_WINDOW_SIZE);
+    if (!mount->fat_window || window != mount->fat_window_offset) {
+        uint32_t size = min(FAT_WINDOW_SIZE + sizeof(uint32_t), mount->fat_size - window);
+        status_t ret;
+
+        if (!mount->fat_window)
+            mount->fat_window = malloc_large(FAT_WINDOW_SIZE + sizeof(uint32_t));
+
+        ret = device_read(mount->mount.device, mount->fat_window, size, mount->fat_offset + window);
+        if (ret != STATUS_SUCCESS) {
+            /* Not aligned so will never match. */
+            mount->fat_window_offset = 1;
+            return ret;
+        }
+
+        mount->fat_window_offset = window;
+    }
+
+    entry = 0;
+    memcpy(&entry, mount->fat_window + offset - window, round_up(mount->fat_type, 8) / 8);
+
+    entry = le32_to_cpu(entry);
+    if (mount->fat_type == 12) {
+        /* Handle non-byte-aligned entries. */
+        if (cluster & 1)
+            entry >>= 4;
+        entry &= 0xfff;
+    } else if (mount->fat_type == 32) {
+        entry &= 0xfffffff;
+    }
+
+    *_entry = entry;
+    return STATUS_SUCCESS;
+}
+
+/** Add a cluster to the end of a handle's cluster run map.
+ * @param handle        Handle to add to.
+ * @param cluster       Physical cluster number. */
+static void add_cluster_run(fat_handle_t *handle, uint32_t cluster) {
+    fat_run_t *run;
+
+    if (handle->num_runs) {
+        run = &handle->runs[handle->num_runs - 1];
+
+        if (run->physical + run->length == cluster) {
+            run->length++;
+            return;
+        }
+    }
+
+    /* The map can get fairly large for a fragmented file, so allocate it
+     * outside of the heap. */
+    if (handle->num_runs == handle->max_runs) {
+        uint32_t max_runs = (handle->max_runs) ? handle->max_runs * 2 : FAT_RUNS_INITIAL;
+        fat_run_t *runs = malloc_large(max_runs * sizeof(*runs));
+
+        if (handle->runs) {
+            memcpy(runs, handle->runs, handle->num_runs * sizeof(*runs));
+            free_large(handle->runs);
+        }
+
+        handle->runs = runs;
+        handle->max_runs = max_runs;
+    }
+
+    run = &handle->runs[handle->num_runs];
+    run->logical = (handle->num_runs) ? run[-1].logical + run[-1].length : 0;
+    run->physical = cluster;
+    run->length = 1;
+
+    handle->num_runs++;
+}
+
+/** Find the cluster run containing a logical cluster.
+ * @param handle        Handle to find in.
+ * @param logical       Logical cluster number.
+ * @param _run          Where to store pointer to run. This is only valid until
+ *                      the next call for the same handle.
+ * @return              Status code describing the result of the operation. */
+static status_t find_cluster_run(fat_handle_t *handle, uint32_t logical, fat_run_t **_run) {
+    fat_mount_t *mount = (fat_mount_t *)handle->handle.mount;
+    fat_run_t *run;
+    uint32_t low, high;
+
+    /* Traverse the cluster chain until the map covers the cluster we want. */
+    while (true) {
+        uint32_t cluster, entry;
+        status_t ret;
+
+        if (handle->num_runs) {
+            run = &handle->runs[handle->num_runs - 1];
+            if (logical < run->logical + run->length)
+                break;
+        }
+
+        if (!handle->next_cluster) {
+            /* End of file reached (may get here for directories, which we do
+             * not know the total size for). */
+            return STATUS_END_OF_FILE;
+        }
+
+        cluster = handle->next_cluster;
+        ret = get_fat_entry(handle, cluster, &entry);
+        if (ret != STATUS_SUCCESS)
+            return ret;
+
+        add_cluster_run(handle, cluster);
+
+        if (entry >= mount->end_marker) {
+            handle->next_cluster = 0;
+        } else if (entry < 2 || entry >= mount->total_clusters) {
+            fat_warn(handle, "invalid cluster number 0x%" PRIx32, entry);
+            handle->next_cluster = 0;
+            return STATUS_CORRUPT_FS;
+        } else {
+            handle->next_cluster = entry;
+        }
+    }
+
+    /* Binary search for the run. */
+    low = 0;
+    high = handle->num_runs;
+    while (low < high) {
+        uint32_t mid = low + ((high - low) / 2);
+
+        run = &handle->runs[mid];
+        if (logical < run->logical) {
+            high = mid;
+        } else if (logical >= run->logical + run->length) {
+            low = mid + 1;
+        } else {
+            break;
+        }
+    }
+
+    *_run = run;
+    return STATUS_SUCCESS;
+}
+
 /** Read from a file.
  * @param _handle       Handle to the file.
  * @param buf           Buffer to read into.
@@ -91,7 +302,6 @@ typedef struct fat_iterate_state {
 static status_t fat_read(fs_handle_t *_handle, void *buf, size_t count, offset_t offset) {
     fat_handle_t *handle = (fat_handle_t *)_handle;
     fat_mount_t *mount = (fat_mount_t *)_handle->mount;
-    uint32_t start_logical, current_logical, current_physical;
 
     /* Special case for root directory on FAT12/16. */
     if (!handle->cluster) {
@@ -99,87 +309,45 @@ static status_t fat_read(fs_handle_t *_handle, void *buf, size_t count, offset_t
         return device_read(mount->mount.device, buf, count, mount->root_offset + offset);
     }
 
-    /* Determine the start logical cluster number. */
-    start_logical = offset / mount->cluster_size;
-
-    /* Traverse the cluster chain. */
-    current_logical = 0;
-    current_physical = handle->cluster;
+    /* Read each run of contiguous clusters with a single device read. */
     while (count) {
-        offset_t fat_offset;
-        uint32_t fat_entry;
+        uint32_t logical = offset / mount->cluster_size;
+        offset_t run_offset, device_offset;
+        size_t run_count;
+        fat_run_t *run;
         status_t ret;
 
-        if (current_logical >= start_logical) {
-            uint32_t cluster_offset = offset % mount->cluster_size;
-            uint32_t cluster_count = min(count, mount->cluster_size - cluster_offset);
-            offset_t device_offset = mount->data_offset
-                + ((offset_t)mount->cluster_size * (current_physical - 2))
-                + cluster_offset;
-
-            /* Read the required data from this cluster. */
-            ret = device_read(mount->mount.device, buf, cluster_count, device_offset);
-            if (ret != STATUS_SUCCESS)
-                return ret;
-
-            buf += cluster_count;
-            offset += cluster_count;
-            count -= cluster_count;
-
-            /* Don't bother trying to find next cluster if we have nothing more
-             * to read. */
-            if (!count)
-                break;
-        }
-
-        /* Determine the offset in the FAT of the current entry. */
-        fat_offset = mount->fat_offset;
-        switch (mount->fat_type) {
-        case 32:
-            fat_offset += current_physical << 2;
-            break;
-        case 16:
-            fat_offset += current_physical << 1;
-            break;
-        case 12:
-            /* FAT12 packs 2 entries across 3 bytes. This gives the required
-             * entry rounded down to a byte boundary. */
-            fat_offset += current_physical + (current_physical >> 1);
-            break;
-        }
-
-        /* Read the FAT entry. */
-        fat_entry = 0;
-        ret = device_read(mount->mount.device, &fat_entry, round_up(mount->fat_type, 8) / 8, fat_offset);
+        ret = find_cluster_run(handle, logical, &run);
         if (ret != STATUS_SUCCESS)
             return ret;
 
-        fat_entry = le32_to_cpu(fat_entry);
-        if (mount->fat_type == 12) {
-            /* Handle non-byte-aligned entries. */
-            if (current_physical & 1)
-                fat_entry >>= 4;
-            fat_entry &= 0xfff;
-        } else if (mount->fat_type == 32) {
-            fat_entry &= 0xfffffff;
-        }
+        run_offset = ((offset_t)(logical - run->logical) * mount->cluster_size)
+            + (offset % mount->cluster_size);
+        run_count = min((offset_t)count, ((offset_t)run->length * mount->cluster_size) - run_offset);
+        device_offset = mount->data_offset
+            + ((offset_t)mount->cluster_size * (run->physical - 2))
+            + run_offset;
 
-        if (fat_entry >= mount->end_marker) {
-            /* End of file reached (may get here for directories, which we do
-             * not know the total size for). */
-            return STATUS_END_OF_FILE;
-        } else if (fat_entry < 2 || fat_entry >= mount->total_clusters) {
-            fat_warn(handle, "invalid cluster number 0x%" PRIx32, fat_entry);
-            return STATUS_CORRUPT_FS;
-        }
+        ret = device_read(mount->mount.device, buf, run_count, device_offset);
+        if (ret != STATUS_SUCCESS)
+            return ret;
 
-        current_physical = fat_entry;
-        current_logical++;
+        buf += run_count;
+        offset += run_count;
+        count -= run_count;
     }
 
     return STATUS_SUCCESS;
 }
 
+/** Close a FAT handle.
+ * @param _handle       Handle to close. */
+static void fat_close(fs_handle_t *_handle) {
+    fat_handle_t *handle = (fat_handle_t *)_handle;
+
+    free_large(handle->runs);
+}
+
 /** Open an entry on a FAT filesystem.
  * @param _entry        Entry to open (obtained via iterate()).
  * @param _handle       Where to store pointer to opened handle.
@@ -203,12 +371,10 @@ static status_t fat_open_entry(const fs_entry_t *_entry, fs_handle_t **_handle)
     } else {
         fat_handle_t *handle = malloc(sizeof(*handle));
 
-        fs_handle_init(
-            &handle->handle, _entry->owner->mount,
+        init_handle(
+            handle, (fat_mount_t *)_entry->owner->mount,
             (state->entry.attributes & FAT_ATTRIBUTE_DIRECTORY) ? FILE_TYPE_DIR : FILE_TYPE_REGULAR,
-            le32_to_cpu(state->entry.file_size));
-
-        handle->cluster = cluster;
+            le32_to_cpu(state->entry.file_size), cluster);
 
         *_handle = &handle->handle;
     }
@@ -441,6 +607,11 @@ static status_t fat_iterate(fs_handle_t *_handle, fs_iterate_cb_t cb, void *arg)
         if (state.entry.attributes & FAT_ATTRIBUTE_VOLUME_ID)
             continue;
 
+        state.header.type = (state.entry.attributes & FAT_ATTRIBUTE_DIRECTORY)
+            ? FILE_TYPE_DIR
+            : FILE_TYPE_REGULAR;
+        state.header.size = le32_to_cpu(state.entry.file_size);
+
         cont = cb(&state.header, arg);
     }
 
@@ -477,6 +648,31 @@ static status_t get_volume_label(fat_handle_t *handle, char **_label) {
     return ret;
 }
 
+/** Check whether a BPB looks sane.
+ * @param bpb           BPB to check.
+ * @return              Whether the BPB might belong to a FAT filesystem. */
+static bool is_valid_bpb(const fat_bpb_t *bpb) {
+    uint32_t sector_size;
+
+    if (!bpb->num_fats || (bpb->media < 0xf8 && bpb->media != 0xf0))
+        return false;
+
+    sector_size = le16_to_cpu(bpb->bytes_per_sector);
+    return is_pow2(sector_size) && sector_size >= 512 && sector_size <= 4096
+        && is_pow2(bpb->sectors_per_cluster)
+        && le16_to_cpu(bpb->num_reserved_sectors);
+}
+
+/** Check for a FAT filesystem.
+ * @param buf           Data from the start of the device.
+ * @param size          Size of the data.
+ * @return              Whether the device might contain a FAT filesystem. */
+static bool fat_probe(const void *buf, size_t size) {
+    /* FAT has no magic number, so check that the BPB looks sane. This is the
+     * same check that fat_mount() does. */
+    return size >= sizeof(fat_bpb_t) && is_valid_bpb(buf);
+}
+
 /** Mount a FAT filesystem.
  * @param device        Device to mount.
  * @param _mount        Where to store pointer to mount structure.
@@ -499,17 +695,16 @@ static status_t fat_mount(device_t *device, fs_mount_t **_mount) {
     mount = malloc(sizeof(*mount));
     mount->mount.device = device;
     mount->mount.case_insensitive = true;
+    mount->fat_window = NULL;
 
     /* There is no easy check for whether a filesystem is FAT. Just assume that
      * it is not if any of the following checks fail. */
     ret = STATUS_UNKNOWN_FS;
 
-    if (!bpb.num_fats || (bpb.media < 0xf8 && bpb.media != 0xf0))
+    if (!is_valid_bpb(&bpb))
         goto err;
 
     sector_size = le16_to_cpu(bpb.bytes_per_sector);
-    if (!is_pow2(sector_size) || sector_size < 512 || sector_size > 4096)
-        goto err;
 
     mount->cluster_size = sector_size * bpb.sectors_per_cluster;
     if (!is_pow2(mount->cluster_size))
@@ -554,6 +749,7 @@ static status_t fat_mount(device_t *device, fs_mount_t **_mount) {
 
     /* Save byte offsets of FAT, root and data areas. */
     mount->fat_offset = fat_start_sector * sector_size;
+    mount->fat_size = fat_sectors * sector_size;
     mount->root_offset = root_start_sector * sector_size;
     mount->data_offset = data_start_sector * sector_size;
 
@@ -561,8 +757,9 @@ static status_t fat_mount(device_t *device, fs_mount_t **_mount) {
      * not have a fixed region, so use the specified cluster number, else set
      * it to 0 which fat_read() takes to refer to the root directory. */
     root = malloc(sizeof(*root));
-    fs_handle_init(&root->handle, &mount->mount, FILE_TYPE_DIR, root_sectors * sector_size);
-    root->cluster = (mount->fat_type == 32) ? le32_to_cpu(bpb.fat32.root_cluster) : 0;
+    init_handle(
+        root, mount, FILE_TYPE_DIR, root_sectors * sector_size,
+        (mount->fat_type == 32) ? le32_to_cpu(bpb.fat32.root_cluster) : 0);
     mount->mount.root = &root->handle;
 
     /* Get the volume label, stored in the root directory. */
@@ -579,6 +776,7 @@ static status_t fat_mount(device_t *device, fs_mount_t **_mount) {
     return STATUS_SUCCESS;
 
 err:
+    free_large(mount->fat_window);
     free(mount);
     return ret;
 }
@@ -586,7 +784,9 @@ err:
 /** FAT filesystem operations structure. */
 BUILTIN_FS_OPS(fat_fs_ops) = {
     .name = "FAT",
+    .probe = fat_probe,
     .read = fat_read,
+    .close = fat_close,
     .open_entry = fat_open_entry,
     .iterate = fat_iterate,
     .mount = fat_mount,
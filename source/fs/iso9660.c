@@ -33,10 +33,42 @@
 #include <loader.h>
 #include <memory.h>
 
+/** Structure containing a directory from the path table. */
+typedef struct iso9660_path {
+    uint32_t extent;                    /**< Extent block number. */
+    uint16_t parent;                    /**< Index of parent directory (1-based). */
+    char *name;                         /**< Name of the directory. */
+} iso9660_path_t;
+
+/** Structure containing an entry in a directory name index. */
+typedef struct iso9660_name {
+    char *name;                         /**< Name of the entry. */
+    uint32_t extent;                    /**< Extent block number. */
+    uint32_t size;                      /**< Size of the entry. */
+    uint32_t pos;                       /**< Position of the record in the directory. */
+    file_type_t type;                   /**< Type of the entry. */
+} iso9660_name_t;
+
+/** Structure containing a directory name index. */
+typedef struct iso9660_dir {
+    list_t link;                        /**< Link to mount's directory list. */
+    uint32_t extent;                    /**< Extent block number. */
+    uint32_t size;                      /**< Size of the directory. */
+    uint32_t parent;                    /**< Extent block number of parent. */
+    size_t count;                       /**< Number of entries. */
+    iso9660_name_t *entries;            /**< Entries, sorted by name. */
+} iso9660_dir_t;
+
 /** Structure containing details of an ISO9660 filesystem. */
 typedef struct iso9660_mount {
     fs_mount_t mount;                   /**< Mount header. */
     int joliet_level;                   /**< Joliet level. */
+
+    iso9660_path_t *paths;              /**< Directories from the path table. */
+    size_t path_count;                  /**< Number of path table entries. */
+    list_t dirs;                        /**< Directory name indexes. */
+    void *dir_buf;                      /**< Block buffer for directory iteration. */
+    bool dir_buf_busy;                  /**< Whether dir_buf is in use. */
 } iso9660_mount_t;
 
 /** Structure containing details of an ISO9660 handle. */
@@ -64,23 +96,31 @@ static status_t iso9660_read(fs_handle_t *_handle, void *buf, size_t count, offs
     return device_read(handle->handle.mount->device, buf, count, offset);
 }
 
-/** Create a handle from a directory record.
+/** Create a handle to an extent.
  * @param mount         Mount the node is from.
- * @param record        Record to create from.
+ * @param type          Type of the node.
+ * @param extent        Extent block number.
+ * @param size          Size of the node.
  * @return              Pointer to handle. */
-static fs_handle_t *open_record(iso9660_mount_t *mount, iso9660_directory_record_t *record) {
+static fs_handle_t *open_extent(iso9660_mount_t *mount, file_type_t type, uint32_t extent, uint32_t size) {
     iso9660_handle_t *handle;
 
     handle = malloc(sizeof(*handle));
+    fs_handle_init(&handle->handle, &mount->mount, type, size);
+    handle->extent = extent;
+    return &handle->handle;
+}
 
-    fs_handle_init(
-        &handle->handle, &mount->mount,
+/** Create a handle from a directory record.
+ * @param mount         Mount the node is from.
+ * @param record        Record to create from.
+ * @return              Pointer to handle. */
+static fs_handle_t *open_record(iso9660_mount_t *mount, iso9660_directory_record_t *record) {
+    return open_extent(
+        mount,
         (record->file_flags & (1 << 1)) ? FILE_TYPE_DIR : FILE_TYPE_REGULAR,
+        le32_to_cpu(record->extent_loc_le),
         le32_to_cpu(record->data_len_le));
-
-    handle->extent = le32_to_cpu(record->extent_loc_le);
-
-    return &handle->handle;
 }
 
 /** Open an entry on a ISO9660 filesystem.
@@ -107,29 +147,39 @@ static status_t iso9660_open_entry(const fs_entry_t *_entry, fs_handle_t **_hand
     return STATUS_SUCCESS;
 }
 
-/** Parse a name from a directory record.
- * @param record        Record to parse.
- * @param buf           Buffer to write into (maximum possible size).
+/** Get the size of a buffer large enough to hold any name on a mount.
+ * @param mount         Mount to get for.
+ * @return              Buffer size. */
+static inline size_t name_buf_size(iso9660_mount_t *mount) {
+    return 1 + ((mount->joliet_level)
+        ? ISO9660_JOLIET_MAX_NAME_LEN * MAX_UTF8_PER_UTF16
+        : ISO9660_MAX_NAME_LEN);
+}
+
+/** Parse a file or directory identifier.
+ * @param ident         Identifier to parse.
+ * @param ident_len     Length of the identifier.
+ * @param buf           Buffer to write into (of size name_buf_size()).
  * @param joliet        Joliet level. */
-static void parse_name(iso9660_directory_record_t *record, char *buf, int joliet) {
+static void parse_name(const uint8_t *ident, size_t ident_len, char *buf, int joliet) {
     size_t len;
 
     if (joliet) {
-        uint16_t *name = (uint16_t *)record->file_ident;
+        uint16_t name[ISO9660_JOLIET_MAX_NAME_LEN];
 
-        len = min(record->file_ident_len >> 1, ISO9660_JOLIET_MAX_NAME_LEN);
+        len = min(ident_len >> 1, ISO9660_JOLIET_MAX_NAME_LEN);
 
         /* Name is in big-endian UCS-2, convert to native-endian. */
         for (size_t i = 0; i < len; i++)
-            name[i] = be16_to_cpu(name[i]);
+            name[i] = ((uint16_t)ident[i * 2] << 8) | ident[(i * 2) + 1];
 
         /* Convert to UTF-8. */
         len = utf16_to_utf8((uint8_t *)buf, name, len);
     } else {
-        len = min(record->file_ident_len, ISO9660_MAX_NAME_LEN);
+        len = min(ident_len, ISO9660_MAX_NAME_LEN);
 
         for (size_t i = 0; i < len; i++)
-            buf[i] = tolower(record->file_ident[i]);
+            buf[i] = tolower(ident[i]);
     }
 
     /* If file version number is 1, strip it off. Don't want to strip all
@@ -144,77 +194,521 @@ static void parse_name(iso9660_directory_record_t *record, char *buf, int joliet
     buf[len] = 0;
 }
 
-/** Iterate over directory entries.
+/**
+ * Iterate over directory entries.
+ *
+ * Directories are read one block at a time into a buffer kept in the mount,
+ * so the memory needed does not depend on the size of the directory, and no
+ * more is read than is needed to get to the point where the callback asks to
+ * stop. Records never cross a block boundary.
+ *
  * @param _handle       Handle to directory.
  * @param cb            Callback to call on each entry.
  * @param arg           Data to pass to callback.
- * @return              Status code describing the result of the operation. */
+ *
+ * @return              Status code describing the result of the operation.
+ */
 static status_t iso9660_iterate(fs_handle_t *_handle, fs_iterate_cb_t cb, void *arg) {
     iso9660_handle_t *handle = (iso9660_handle_t *)_handle;
     iso9660_mount_t *mount = (iso9660_mount_t *)_handle->mount;
     size_t name_len;
     char *name __cleanup_free;
-    char *buf __cleanup_free;
-    uint32_t offset;
+    uint8_t *tmp __cleanup_free = NULL;
+    uint8_t *buf;
+    uint32_t start;
     bool cont;
     status_t ret;
 
+    /* Use the mount's buffer unless a callback is iterating another directory
+     * while we are already using it. */
+    if (mount->dir_buf_busy) {
+        buf = tmp = malloc(ISO9660_BLOCK_SIZE);
+    } else {
+        if (!mount->dir_buf)
+            mount->dir_buf = malloc(ISO9660_BLOCK_SIZE);
+
+        buf = mount->dir_buf;
+        mount->dir_buf_busy = true;
+    }
+
     /* Allocate a temporary buffer for names. */
-    name_len = 1 + (mount->joliet_level)
-        ? ISO9660_JOLIET_MAX_NAME_LEN * MAX_UTF8_PER_UTF16
-        : ISO9660_MAX_NAME_LEN;
+    name_len = name_buf_size(mount);
     name = malloc(name_len);
 
-    /* Read in all the directory data. */
-    buf = malloc(handle->handle.size);
-    ret = iso9660_read(_handle, buf, handle->handle.size, 0);
-    if (ret != STATUS_SUCCESS)
-        return ret;
-
-    /* Iterate through each entry. */
+    ret = STATUS_SUCCESS;
     cont = true;
-    offset = 0;
-    while (cont && offset < handle->handle.size) {
-        iso9660_directory_record_t *record = (iso9660_directory_record_t *)(buf + offset);
-        iso9660_entry_t entry;
+    for (start = 0; cont && start < handle->handle.size; start += ISO9660_BLOCK_SIZE) {
+        uint32_t size = min(handle->handle.size - start, ISO9660_BLOCK_SIZE);
+        uint32_t offset;
+
+        ret = iso9660_read(_handle, buf, size, start);
+        if (ret != STATUS_SUCCESS)
+            break;
+
+        /* A zero record length means we should move on to the next block. */
+        offset = 0;
+        while (cont && offset + sizeof(iso9660_directory_record_t) <= size) {
+            iso9660_directory_record_t *record = (iso9660_directory_record_t *)(buf + offset);
+            iso9660_entry_t entry;
+
+            if (!record->rec_len || offset + record->rec_len > size)
+                break;
 
-        if (record->rec_len) {
             offset += record->rec_len;
+
+            /* Bit 0 indicates that this is not a user-visible record. */
+            if (record->file_flags & (1<<0))
+                continue;
+
+            /* If this is a directory, check for '.' and '..'. */
+            name[0] = 0;
+            if (record->file_flags & (1<<1) && record->file_ident_len == 1) {
+                if (record->file_ident[0] == 0) {
+                    snprintf(name, name_len, ".");
+                } else if (record->file_ident[0] == 1) {
+                    snprintf(name, name_len, "..");
+                }
+            }
+
+            if (!name[0])
+                parse_name(record->file_ident, record->file_ident_len, name, mount->joliet_level);
+
+            entry.entry.owner = &handle->handle;
+            entry.entry.name = name;
+            entry.entry.type = (record->file_flags & (1<<1)) ? FILE_TYPE_DIR : FILE_TYPE_REGULAR;
+            entry.entry.size = le32_to_cpu(record->data_len_le);
+            entry.record = record;
+
+            cont = cb(&entry.entry, arg);
+        }
+    }
+
+    if (buf == mount->dir_buf)
+        mount->dir_buf_busy = false;
+
+    return ret;
+}
+
+/** Find a directory in the path table by its extent.
+ * @param mount         Mount to search.
+ * @param extent        Extent block number of the directory.
+ * @return              Index of the directory (1-based), or 0 if not found. */
+static size_t find_path(iso9660_mount_t *mount, uint32_t extent) {
+    for (size_t i = 0; i < mount->path_count; i++) {
+        if (mount->paths[i].extent == extent)
+            return i + 1;
+    }
+
+    return 0;
+}
+
+/** Find a subdirectory in the path table.
+ * @param mount         Mount to search.
+ * @param parent        Index of the parent directory.
+ * @param name          Name of the subdirectory.
+ * @return              Index of the directory (1-based), or 0 if not found. */
+static size_t find_child_path(iso9660_mount_t *mount, size_t parent, const char *name) {
+    /* Skip the root directory, which is its own parent. */
+    for (size_t i = 1; i < mount->path_count; i++) {
+        if (mount->paths[i].parent == parent && strcmp(mount->paths[i].name, name) == 0)
+            return i + 1;
+    }
+
+    return 0;
+}
+
+/** Comparison function for sorting a directory name index.
+ * @param a             Pointer to first entry.
+ * @param b             Pointer to second entry.
+ * @return              Comparison result. */
+static int compare_name(const void *a, const void *b) {
+    const iso9660_name_t *first = a;
+    const iso9660_name_t *second = b;
+    int ret;
+
+    /* Keep duplicate names in directory order, so that lookups find the same
+     * entry that iterating over the directory would. */
+    ret = strcmp(first->name, second->name);
+    return (ret) ? ret : (first->pos < second->pos) ? -1 : 1;
+}
+
+/** Find an entry in a directory name index.
+ * @param dir           Directory to search.
+ * @param name          Name of the entry.
+ * @return              Pointer to entry if found, NULL if not. */
+static iso9660_name_t *find_name(iso9660_dir_t *dir, const char *name) {
+    size_t low = 0, high = dir->count;
+
+    while (low < high) {
+        size_t mid = low + ((high - low) / 2);
+
+        if (strcmp(dir->entries[mid].name, name) < 0) {
+            low = mid + 1;
         } else {
-            /* A zero record length means we should move on to the next block.
-             * If this is the end, this will cause us to break out of the while
-             * loop if offset becomes >= size. */
-            offset = round_up(offset, ISO9660_BLOCK_SIZE);
-            continue;
+            high = mid;
         }
+    }
+
+    return (low < dir->count && strcmp(dir->entries[low].name, name) == 0)
+        ? &dir->entries[low]
+        : NULL;
+}
+
+/** Scan a directory's records to build its name index.
+ * @param mount         Mount the directory is on.
+ * @param dir           Directory being indexed. If entries is NULL, entries
+ *                      are only counted, otherwise they are filled in up to
+ *                      the given limits.
+ * @param buf           Block-sized buffer to read into.
+ * @param name          Temporary name buffer (of size name_buf_size()).
+ * @param max_count     Number of entries that there is space for.
+ * @param _names_size   On input, the space available for names. On output,
+ *                      the space used (or needed) for names.
+ * @return              Status code describing the result of the operation. */
+static status_t scan_dir(
+    iso9660_mount_t *mount, iso9660_dir_t *dir, uint8_t *buf, char *name,
+    size_t max_count, size_t *_names_size)
+{
+    offset_t start = (offset_t)dir->extent * ISO9660_BLOCK_SIZE;
+    char *names = (dir->entries) ? (char *)&dir->entries[max_count] : NULL;
+    size_t names_max = *_names_size;
+    uint32_t pos = 0;
+    status_t ret;
+
+    dir->count = 0;
+    *_names_size = 0;
+
+    for (uint32_t block = 0; block < dir->size; block += ISO9660_BLOCK_SIZE) {
+        uint32_t size = min(dir->size - block, ISO9660_BLOCK_SIZE);
+        uint32_t offset;
 
-        /* Bit 0 indicates that this is not a user-visible record. */
-        if (record->file_flags & (1<<0))
+        ret = device_read(mount->mount.device, buf, size, start + block);
+        if (ret != STATUS_SUCCESS)
+            return ret;
+
+        /* A zero record length means we should move on to the next block. */
+        offset = 0;
+        while (offset + sizeof(iso9660_directory_record_t) <= size) {
+            iso9660_directory_record_t *record = (iso9660_directory_record_t *)(buf + offset);
+            iso9660_name_t *entry;
+            size_t len;
+
+            if (!record->rec_len || offset + record->rec_len > size) {
+                break;
+            } else if (sizeof(*record) + record->file_ident_len > record->rec_len) {
+                return STATUS_CORRUPT_FS;
+            }
+
+            offset += record->rec_len;
+            pos++;
+
+            /* Bit 0 indicates that this is not a user-visible record. */
+            if (record->file_flags & (1<<0))
+                continue;
+
+            /* Don't index '.' and '..', but remember the parent for lookups of
+             * '..' on directories that are not in the path table. */
+            if (record->file_flags & (1<<1) && record->file_ident_len == 1) {
+                if (record->file_ident[0] == 1)
+                    dir->parent = le32_to_cpu(record->extent_loc_le);
+                if (record->file_ident[0] <= 1)
+                    continue;
+            }
+
+            parse_name(record->file_ident, record->file_ident_len, name, mount->joliet_level);
+            len = strlen(name) + 1;
+
+            if (dir->entries) {
+                /* Should not happen as we read the same data twice. */
+                if (dir->count == max_count || *_names_size + len > names_max)
+                    return STATUS_CORRUPT_FS;
+
+                entry = &dir->entries[dir->count];
+                entry->name = memcpy(&names[*_names_size], name, len);
+                entry->extent = le32_to_cpu(record->extent_loc_le);
+                entry->size = le32_to_cpu(record->data_len_le);
+                entry->pos = pos;
+                entry->type = (record->file_flags & (1<<1)) ? FILE_TYPE_DIR : FILE_TYPE_REGULAR;
+            }
+
+            dir->count++;
+            *_names_size += len;
+        }
+    }
+
+    return STATUS_SUCCESS;
+}
+
+/**
+ * Get the name index for a directory, building it if necessary.
+ *
+ * The directory is scanned a block at a time, twice: once to size the index,
+ * and once to fill it in (which should be satisfied by the disk block cache).
+ * The entries and their names are stored in a single allocation.
+ *
+ * @param mount         Mount the directory is on.
+ * @param extent        Extent block number of the directory.
+ * @param _dir          Where to store pointer to directory index.
+ *
+ * @return              Status code describing the result of the operation.
+ */
+static status_t get_dir(iso9660_mount_t *mount, uint32_t extent, iso9660_dir_t **_dir) {
+    uint8_t *buf __cleanup_free = NULL;
+    char *name __cleanup_free = NULL;
+    iso9660_directory_record_t *record;
+    iso9660_dir_t *dir;
+    size_t count, names_size;
+    status_t ret;
+
+    list_foreach(&mount->dirs, iter) {
+        dir = list_entry(iter, iso9660_dir_t, link);
+
+        if (dir->extent == extent) {
+            *_dir = dir;
+            return STATUS_SUCCESS;
+        }
+    }
+
+    /* Directories found via the path table have no size recorded, so get it
+     * from the "." record at the start of the directory. */
+    buf = malloc(ISO9660_BLOCK_SIZE);
+    ret = device_read(mount->mount.device, buf, ISO9660_BLOCK_SIZE, (offset_t)extent * ISO9660_BLOCK_SIZE);
+    if (ret != STATUS_SUCCESS)
+        return ret;
+
+    record = (iso9660_directory_record_t *)buf;
+    if (record->rec_len < sizeof(*record) + 1 || record->file_ident_len != 1 || record->file_ident[0] != 0)
+        return STATUS_CORRUPT_FS;
+
+    dir = malloc(sizeof(*dir));
+    dir->extent = extent;
+    dir->size = le32_to_cpu(record->data_len_le);
+    dir->parent = extent;
+    dir->entries = NULL;
+
+    if (dir->size < record->rec_len) {
+        ret = STATUS_CORRUPT_FS;
+        goto err;
+    }
+
+    name = malloc(name_buf_size(mount));
+
+    names_size = 0;
+    ret = scan_dir(mount, dir, buf, name, 0, &names_size);
+    if (ret != STATUS_SUCCESS)
+        goto err;
+
+    if (dir->count) {
+        count = dir->count;
+        dir->entries = malloc((count * sizeof(*dir->entries)) + names_size);
+
+        ret = scan_dir(mount, dir, buf, name, count, &names_size);
+        if (ret != STATUS_SUCCESS)
+            goto err;
+
+        qsort(dir->entries, dir->count, sizeof(*dir->entries), compare_name);
+    }
+
+    list_init(&dir->link);
+    list_append(&mount->dirs, &dir->link);
+
+    *_dir = dir;
+    return STATUS_SUCCESS;
+
+err:
+    free(dir->entries);
+    free(dir);
+    return ret;
+}
+
+/**
+ * Open a path on an ISO9660 filesystem.
+ *
+ * Directories are resolved using the path table, which is loaded at mount
+ * time, so walking intermediate directories requires no I/O. Files (and any
+ * directories not in the path table) are looked up in a sorted name index of
+ * their parent directory, which is built the first time it is needed and kept
+ * for the lifetime of the mount.
+ *
+ * @param _mount        Mount to open from.
+ * @param path          Path to file/directory to open (can be modified).
+ * @param from          Handle on this FS to open relative to.
+ * @param _handle       Where to store pointer to opened handle.
+ *
+ * @return              Status code describing the result of the operation.
+ */
+static status_t iso9660_open_path(fs_mount_t *_mount, char *path, fs_handle_t *from, fs_handle_t **_handle) {
+    iso9660_mount_t *mount = (iso9660_mount_t *)_mount;
+    iso9660_handle_t *handle = (iso9660_handle_t *)from;
+    iso9660_handle_t *root = (iso9660_handle_t *)_mount->root;
+    file_type_t type = from->type;
+    uint32_t extent = handle->extent;
+    uint32_t size = from->size;
+    size_t index = 0;
+    iso9660_dir_t *dir;
+    char *tok;
+    status_t ret;
+
+    if (type == FILE_TYPE_DIR)
+        index = find_path(mount, extent);
+
+    while ((tok = strsep(&path, "/"))) {
+        iso9660_name_t *entry;
+
+        if (type != FILE_TYPE_DIR) {
+            return STATUS_NOT_DIR;
+        } else if (!tok[0] || (tok[0] == '.' && !tok[1])) {
             continue;
+        }
 
-        /* If this is a directory, check for '.' and '..'. */
-        name[0] = 0;
-        if (record->file_flags & (1<<1) && record->file_ident_len == 1) {
-            if (record->file_ident[0] == 0) {
-                snprintf(name, name_len, ".");
-            } else if (record->file_ident[0] == 1) {
-                snprintf(name, name_len, "..");
+        /* Names are stored lower case if the FS is case insensitive. */
+        if (_mount->case_insensitive) {
+            for (char *ch = tok; *ch; ch++)
+                *ch = tolower(*ch);
+        }
+
+        if (index) {
+            size_t child = (strcmp(tok, "..") == 0)
+                ? mount->paths[index - 1].parent
+                : find_child_path(mount, index, tok);
+
+            if (child) {
+                index = child;
+                extent = mount->paths[index - 1].extent;
+                size = 0;
+                continue;
             }
         }
 
-        if (!name[0])
-            parse_name(record, name, mount->joliet_level);
+        /* Not a directory known to the path table, search the directory. */
+        ret = get_dir(mount, extent, &dir);
+        if (ret != STATUS_SUCCESS)
+            return ret;
+
+        if (strcmp(tok, "..") == 0) {
+            extent = dir->parent;
+            size = 0;
+        } else {
+            entry = find_name(dir, tok);
+            if (!entry)
+                return STATUS_NOT_FOUND;
 
-        entry.entry.owner = &handle->handle;
-        entry.entry.name = name;
-        entry.record = record;
+            type = entry->type;
+            extent = entry->extent;
+            size = entry->size;
+        }
 
-        cont = cb(&entry.entry, arg);
+        index = (type == FILE_TYPE_DIR) ? find_path(mount, extent) : 0;
     }
 
+    /* Return existing handles where possible, as open_entry() does. */
+    if (extent == handle->extent) {
+        fs_retain(from);
+        *_handle = from;
+        return STATUS_SUCCESS;
+    } else if (extent == root->extent) {
+        fs_retain(&root->handle);
+        *_handle = &root->handle;
+        return STATUS_SUCCESS;
+    }
+
+    if (!size) {
+        ret = get_dir(mount, extent, &dir);
+        if (ret != STATUS_SUCCESS)
+            return ret;
+
+        size = dir->size;
+    }
+
+    *_handle = open_extent(mount, type, extent, size);
     return STATUS_SUCCESS;
 }
 
+/** Load the path table for a filesystem.
+ * @param mount         Mount being created.
+ * @param device        Device the filesystem is on.
+ * @param desc          Volume descriptor that the root directory came from. */
+static void load_path_table(iso9660_mount_t *mount, device_t *device, iso9660_primary_volume_desc_t *desc) {
+    iso9660_handle_t *root = (iso9660_handle_t *)mount->mount.root;
+    uint8_t *buf __cleanup_free_large = NULL;
+    char *name __cleanup_free = NULL;
+    iso9660_path_table_record_t *record;
+    uint32_t size, offset;
+    size_t count, names_size;
+    char *names;
+    status_t ret;
+
+    size = le32_to_cpu(desc->path_table_size_le);
+    if (!size || size > ISO9660_MAX_PATH_TABLE_SIZE)
+        return;
+
+    buf = malloc_large(size);
+    ret = device_read(device, buf, size, (offset_t)le32_to_cpu(desc->typel_path_tbl_occur) * ISO9660_BLOCK_SIZE);
+    if (ret != STATUS_SUCCESS)
+        return;
+
+    name = malloc(name_buf_size(mount));
+
+    /* Count the records, checking that they are well formed, and work out the
+     * space needed for their names. Parents always precede their children, so
+     * any other parent number is invalid. Records beyond the limit cannot be
+     * referenced as parents, so the directories they describe are just left to
+     * be found via their parent directory. The root directory has an empty
+     * name. */
+    count = 0;
+    names_size = 1;
+    for (offset = 0; offset + sizeof(*record) <= size && count < ISO9660_MAX_PATH_TABLE_RECORDS; ) {
+        uint16_t parent;
+
+        record = (iso9660_path_table_record_t *)(buf + offset);
+        if (!record->dir_ident_len || offset + sizeof(*record) + record->dir_ident_len > size)
+            break;
+
+        parent = le16_to_cpu(record->parent_dir_num);
+        if (!parent || parent > count + 1)
+            return;
+
+        if (count) {
+            parse_name(record->dir_ident, record->dir_ident_len, name, mount->joliet_level);
+            names_size += strlen(name) + 1;
+        }
+
+        offset += round_up(sizeof(*record) + record->dir_ident_len, 2);
+        count++;
+    }
+
+    /* The first record is the root directory, which must match the root we
+     * already have, otherwise the table is not one we can use. */
+    record = (iso9660_path_table_record_t *)buf;
+    if (!count || le32_to_cpu(record->extent_loc) != root->extent)
+        return;
+
+    /* Store the names after the array in the same allocation. */
+    mount->paths = malloc((count * sizeof(*mount->paths)) + names_size);
+    mount->path_count = count;
+    names = (char *)&mount->paths[count];
+
+    offset = 0;
+    for (size_t i = 0; i < count; i++) {
+        record = (iso9660_path_table_record_t *)(buf + offset);
+
+        if (i) {
+            parse_name(record->dir_ident, record->dir_ident_len, name, mount->joliet_level);
+        } else {
+            name[0] = 0;
+        }
+
+        mount->paths[i].extent = le32_to_cpu(record->extent_loc);
+        mount->paths[i].parent = le16_to_cpu(record->parent_dir_num);
+        mount->paths[i].name = strcpy(names, name);
+
+        names += strlen(name) + 1;
+        offset += round_up(sizeof(*record) + record->dir_ident_len, 2);
+    }
+
+    dprintf("iso9660: loaded path table with %zu directories\n", count);
+}
+
 /** Generate a UUID.
  * @param pri           Primary volume descriptor.
  * @return              Pointer to allocated string for UUID. */
@@ -245,6 +739,17 @@ static char *make_uuid(iso9660_primary_volume_desc_t *pri) {
     return uuid;
 }
 
+/** Check for an ISO9660 filesystem signature.
+ * @param buf           Data from the start of the device.
+ * @param size          Size of the data.
+ * @return              Whether the device might contain an ISO9660 filesystem. */
+static bool iso9660_probe(const void *buf, size_t size) {
+    const iso9660_volume_desc_t *desc = buf + (ISO9660_DATA_START * ISO9660_BLOCK_SIZE);
+
+    return size >= (ISO9660_DATA_START + 1) * ISO9660_BLOCK_SIZE
+        && strncmp((const char *)desc->ident, ISO9660_IDENTIFIER, 5) == 0;
+}
+
 /** Mount an ISO9660 filesystem.
  * @param device        Device to mount.
  * @param _mount        Where to store pointer to mount structure.
@@ -309,6 +814,11 @@ static status_t iso9660_mount(device_t *device, fs_mount_t **_mount) {
     /* If we don't have Joliet, names should not be case sensitive. */
     mount->mount.case_insensitive = !joliet;
     mount->joliet_level = joliet;
+    mount->paths = NULL;
+    mount->path_count = 0;
+    list_init(&mount->dirs);
+    mount->dir_buf = NULL;
+    mount->dir_buf_busy = false;
 
     /* Store the filesystem label and UUID. */
     primary->vol_ident[31] = 0;
@@ -321,6 +831,9 @@ static status_t iso9660_mount(device_t *device, fs_mount_t **_mount) {
         ? (iso9660_directory_record_t *)&supp->root_dir_record
         : (iso9660_directory_record_t *)&primary->root_dir_record);
 
+    /* Load the path table matching the root directory for path lookups. */
+    load_path_table(mount, device, (supp) ? supp : primary);
+
     *_mount = &mount->mount;
     return STATUS_SUCCESS;
 }
@@ -328,8 +841,10 @@ static status_t iso9660_mount(device_t *device, fs_mount_t **_mount) {
 /** ISO9660 filesystem operations structure. */
 BUILTIN_FS_OPS(iso9660_fs_ops) = {
     .name = "ISO9660",
+    .probe = iso9660_probe,
     .read = iso9660_read,
     .open_entry = iso9660_open_entry,
+    .open_path = iso9660_open_path,
     .iterate = iso9660_iterate,
     .mount = iso9660_mount,
 };
@@ -60,6 +60,14 @@ typedef struct device_ops {
      * @param buf           Where to store identification string.
      * @param size          Size of the buffer. */
     void (*identify)(struct device *device, device_identify_t type, char *buf, size_t size);
+
+    /** Probe the contents of the device (optional).
+     * @note                Called by device_mount() the first time that the
+     *                      filesystem on the device is needed. Should set the
+     *                      device's mount if a filesystem is found, and can
+     *                      register child devices (e.g. partitions).
+     * @param device        Device to probe. */
+    void (*probe)(struct device *device);
 } device_ops_t;
 
 /** Base device structure (embedded by device type structures). */
@@ -69,7 +77,9 @@ typedef struct device {
     const char *name;                   /**< Name of the device. */
     device_type_t type;                 /**< Type of the device. */
     const device_ops_t *ops;            /**< Operations for the device (can be NULL). */
-    struct fs_mount *mount;             /**< Filesystem on the device. */
+    struct fs_mount *mount;             /**< Filesystem on the device (use device_mount()). */
+    bool probed;                        /**< Whether the device has been probed. */
+    bool sequential;                    /**< Hint that reads are part of a sequential stream. */
 } device_t;
 
 extern device_t *boot_device;
@@ -77,6 +87,7 @@ extern char *boot_directory;
 
 extern status_t device_read(device_t *device, void *buf, size_t count, offset_t offset);
 
+extern struct fs_mount *device_mount(device_t *device);
 extern device_t *device_lookup(const char *name);
 extern void device_register(device_t *device);
 
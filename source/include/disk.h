@@ -32,8 +32,12 @@ struct disk_device;
  * @param disk          Disk containing the partition.
  * @param id            ID of the partition.
  * @param lba           Start LBA.
- * @param blocks        Size in blocks. */
-typedef void (*partition_iterate_cb_t)(struct disk_device *disk, uint8_t id, uint64_t lba, uint64_t blocks);
+ * @param blocks        Size in blocks.
+ * @param no_fs         Whether the partition type indicates that it does not
+ *                      contain a filesystem (e.g. swap), in which case it will
+ *                      not be probed. */
+typedef void (*partition_iterate_cb_t)(
+    struct disk_device *disk, uint8_t id, uint64_t lba, uint64_t blocks, bool no_fs);
 
 /** Partition operations. */
 typedef struct partition_ops {
@@ -60,6 +64,17 @@ typedef enum disk_type {
     DISK_TYPE_FLOPPY,                   /**< Floppy drive. */
 } disk_type_t;
 
+/** Structure describing an asynchronous disk read. */
+typedef struct disk_request {
+    struct disk_device *disk;           /**< Raw disk the request was submitted to. */
+    void *buf;                          /**< Buffer being read into. */
+    size_t count;                       /**< Number of blocks being read. */
+    uint64_t lba;                       /**< Block number on the raw disk. */
+    bool pending;                       /**< Whether the request is still in progress. */
+    status_t status;                    /**< Result of the request (once complete). */
+    void *data;                         /**< Data for use by the disk backend. */
+} disk_request_t;
+
 /** Structure containing operations for a disk. */
 typedef struct disk_ops {
     /** Read blocks from a disk.
@@ -70,6 +85,25 @@ typedef struct disk_ops {
      * @return              Status code describing the result of the operation. */
     status_t (*read_blocks)(struct disk_device *disk, void *buf, size_t count, uint64_t lba);
 
+    /** Start an asynchronous read of blocks from a disk (optional).
+     * @param disk          Disk device being read from (never a partition).
+     * @param request       Request to start. The buf, count and lba fields
+     *                      are filled in. If the read is started, the pending
+     *                      field should be set to true, otherwise the read can
+     *                      be performed immediately and its result stored in
+     *                      the status field.
+     * @return              Status code describing the result of the operation.
+     *                      STATUS_NOT_SUPPORTED will cause a synchronous read
+     *                      to be performed instead. */
+    status_t (*submit_read)(struct disk_device *disk, disk_request_t *request);
+
+    /** Check whether an asynchronous read has completed.
+     * @param disk          Disk device being read from.
+     * @param request       Request to check. If completed, the pending field
+     *                      should be set to false and the status field set.
+     * @return              Whether the request has completed. */
+    bool (*poll)(struct disk_device *disk, disk_request_t *request);
+
     /** Check if a partition is the boot partition.
      * @param disk          Disk the partition is on.
      * @param id            ID of partition.
@@ -93,10 +127,17 @@ typedef struct disk_device {
     disk_type_t type;                   /**< Type of the disk. */
     const disk_ops_t *ops;              /**< Disk operations structure. */
     size_t block_size;                  /**< Size of a block on the disk. */
+    size_t align;                       /**< Required transfer buffer alignment (power of 2). */
     uint64_t blocks;                    /**< Total number of blocks on the disk. */
 
     /** Fields set internally. */
     uint8_t id;                         /**< ID of the disk. */
+    uint64_t cache_hits;                /**< Block cache hits (raw disk only). */
+    uint64_t cache_misses;              /**< Block cache misses (raw disk only). */
+    uint64_t readahead_next;            /**< Next line expected by a sequential stream (raw disk only). */
+    size_t readahead_window;            /**< Current read-ahead window in lines (raw disk only). */
+    uint64_t readahead_hits;            /**< Read-ahead lines later used (raw disk only). */
+    uint64_t readahead_waste;           /**< Read-ahead lines evicted unused (raw disk only). */
 
     /** Partitioning information. */
     struct disk_device *parent;         /**< Parent disk, or NULL if this is the raw disk. */
@@ -104,6 +145,7 @@ typedef struct disk_device {
     partition_ops_t *partition_ops;     /**< Partitioning scheme used on the disk. */
     list_t link;                        /**< Link to parent's partition list. */
     uint64_t offset;                    /**< LBA offset of the partition. */
+    bool no_fs;                         /**< Partition type indicates no filesystem. */
 } disk_device_t;
 
 /** Return whether a disk device is a partition.
@@ -113,6 +155,10 @@ static inline bool disk_device_is_partition(disk_device_t *disk) {
     return !!disk->parent;
 }
 
+extern status_t disk_device_submit(disk_device_t *disk, disk_request_t *request, void *buf, size_t count, uint64_t lba);
+extern bool disk_device_poll(disk_request_t *request);
+extern status_t disk_device_complete(disk_request_t *request);
+
 extern void disk_device_register(disk_device_t *disk, bool boot);
 
 #endif /* CONFIG_TARGET_HAS_DISK */
@@ -25,6 +25,7 @@
 #include <loader.h>
 
 struct device;
+struct fs_dentry_cache;
 struct fs_entry;
 struct fs_handle;
 struct fs_mount;
@@ -32,6 +33,10 @@ struct fs_mount;
 /** Length of a standard UUID string (including null terminator). */
 #define UUID_STR_LEN    37
 
+/** Amount of data read from the start of a device for probe(). This covers the
+ * ISO9660 volume descriptors, which start at 32KB. */
+#define FS_PROBE_SIZE   0x10000
+
 /** Type of a fs_iterate() callback.
  * @param entry         Details of the entry that was found (only valid in the
  *                      scope of this function).
@@ -39,10 +44,28 @@ struct fs_mount;
  * @return              Whether to continue iteration. */
 typedef bool (*fs_iterate_cb_t)(const struct fs_entry *entry, void *arg);
 
+/** Type of a destination allocation function for fs_load().
+ * @param handle        Handle to the file being loaded.
+ * @param size          Size of the file data.
+ * @param arg           Data argument passed to fs_load().
+ * @return              Pointer to buffer of at least the given size to load
+ *                      the data to. Must not fail. */
+typedef void *(*fs_load_alloc_t)(struct fs_handle *handle, size_t size, void *arg);
+
 /** Structure containing operations for a filesystem. */
 typedef struct fs_ops {
     const char *name;                   /**< Name of the filesystem type. */
 
+    /** Check whether a device might contain this filesystem (optional).
+     * @note                If provided, mount() will only be called if this
+     *                      returns true. This should only perform cheap
+     *                      checks such as for magic numbers, mount() still
+     *                      does full validation.
+     * @param buf           Data from the start of the device.
+     * @param size          Size of the data (FS_PROBE_SIZE).
+     * @return              Whether the device might contain the filesystem. */
+    bool (*probe)(const void *buf, size_t size);
+
     /** Mount an instance of this filesystem.
      * @param device        Device to mount.
      * @param _mount        Where to store pointer to mount structure. Should be
@@ -92,6 +115,30 @@ typedef struct fs_ops {
      * @param arg           Data to pass to callback.
      * @return              Status code describing the result of the operation. */
     status_t (*iterate)(struct fs_handle *handle, fs_iterate_cb_t cb, void *arg);
+
+    /** Look up an entry in a directory (optional).
+     * @note                If not provided, the generic fs_open() path walk
+     *                      will search the directory using iterate(). This
+     *                      can be provided if the filesystem has a faster way
+     *                      to find a single entry.
+     * @param handle        Handle to directory.
+     * @param name          Name of the entry to look up.
+     * @param _handle       Where to store pointer to opened handle.
+     * @return              Status code describing the result of the operation. */
+    status_t (*lookup)(struct fs_handle *handle, const char *name, struct fs_handle **_handle);
+
+    /** Load the whole of a file (optional).
+     * @note                If not provided, fs_load() will allocate the
+     *                      destination itself and read the file into it using
+     *                      read(). This can be provided if the filesystem can
+     *                      place the data in the destination more cheaply.
+     * @param handle        Handle to the file.
+     * @param alloc         Function to allocate the destination, or NULL to
+     *                      use a buffer allocated by malloc_large().
+     * @param arg           Data argument to pass to the allocation function.
+     * @param _buf          Where to store pointer to the loaded data.
+     * @return              Status code describing the result of the operation. */
+    status_t (*load)(struct fs_handle *handle, fs_load_alloc_t alloc, void *arg, void **_buf);
 } fs_ops_t;
 
 /** Define a builtin filesystem operations structure. */
@@ -108,6 +155,7 @@ typedef struct fs_mount {
     bool case_insensitive;              /**< Whether the filesystem is case insensitive. */
     char *label;                        /**< Label of the filesystem. */
     char *uuid;                         /**< UUID of the filesystem. */
+    struct fs_dentry_cache *dentries;   /**< Directory entry cache (allocated on first use). */
 } fs_mount_t;
 
 /** File type enumeration. */
@@ -128,15 +176,31 @@ typedef struct fs_handle {
 
 /** Behaviour flags for a handle. */
 #define FS_HANDLE_COMPRESSED    (1<<0)  /**< Handle is a compressed wrapper. */
+#define FS_HANDLE_CACHED        (1<<1)  /**< Handle is referenced by the directory entry cache. */
+#define FS_HANDLE_SEQUENTIAL    (1<<2)  /**< Handle will be read sequentially. */
 
-/** Filesystem entry information structure. */
+/**
+ * Filesystem entry information structure.
+ *
+ * The type and size are filled in from the directory record where the
+ * filesystem has them there, so that users of fs_iterate() do not need to
+ * open each entry to find them out. Where they are not available they are
+ * set to FILE_TYPE_NONE and FS_ENTRY_SIZE_UNKNOWN, and opening the entry is
+ * the only way to get them.
+ */
 typedef struct fs_entry {
     fs_handle_t *owner;                 /**< Directory containing this entry. */
     const char *name;                   /**< Name of the entry. */
+    file_type_t type;                   /**< Type of the entry (FILE_TYPE_NONE if not known). */
+    offset_t size;                      /**< Size of the entry (FS_ENTRY_SIZE_UNKNOWN if not known). */
 } fs_entry_t;
 
+/** Size of an entry that is not known without opening it. */
+#define FS_ENTRY_SIZE_UNKNOWN   ((offset_t)-1)
+
 /** Behaviour flags for fs_open(). */
 #define FS_OPEN_DECOMPRESS      (1<<0)  /**< If file is compressed, decompress it on the fly. */
+#define FS_OPEN_SEQUENTIAL      (1<<1)  /**< File will be read sequentially from start to end. */
 
 extern void fs_handle_init(fs_handle_t *handle, fs_mount_t *mount, file_type_t type, offset_t size);
 
@@ -153,6 +217,7 @@ extern status_t fs_open(const char *path, fs_handle_t *from, file_type_t type,
 extern void fs_close(fs_handle_t *handle);
 
 extern status_t fs_read(fs_handle_t *handle, void *buf, size_t count, offset_t offset);
+extern status_t fs_load(fs_handle_t *handle, fs_load_alloc_t alloc, void *arg, void **_buf);
 extern status_t fs_iterate(fs_handle_t *handle, fs_iterate_cb_t cb, void *arg);
 
 extern fs_mount_t *fs_probe(struct device *device);
@@ -28,6 +28,9 @@
 /** Ext4 extent header magic number. */
 #define EXT4_EXT_MAGIC          0xf30a
 
+/** Maximum length of an initialized extent (longer means uninitialized). */
+#define EXT4_EXT_INIT_MAX_LEN   32768
+
 /** Special block numbers. */
 #define EXT2_NDIR_BLOCKS        12          /**< Direct blocks. */
 #define EXT2_IND_BLOCK          12          /**< Indirect block. */
@@ -93,8 +96,27 @@
 #define EXT2_NAME_MAX           256         /**< Maximum file name length. */
 
 /** Inode flags. */
+#define EXT2_INDEX_FL           0x1000      /**< Directory is hash indexed. */
 #define EXT4_EXTENTS_FL         0x80000     /**< Inode uses extents. */
 
+/** Superblock flags. */
+#define EXT2_FLAGS_SIGNED_HASH          0x0001  /**< Signed directory hash in use. */
+#define EXT2_FLAGS_UNSIGNED_HASH        0x0002  /**< Unsigned directory hash in use. */
+
+/** Directory hash versions. */
+#define EXT2_HASH_LEGACY                0
+#define EXT2_HASH_HALF_MD4              1
+#define EXT2_HASH_TEA                   2
+#define EXT2_HASH_LEGACY_UNSIGNED       3
+#define EXT2_HASH_HALF_MD4_UNSIGNED     4
+#define EXT2_HASH_TEA_UNSIGNED          5
+
+/** Maximum depth of a hashed directory index tree (including root). */
+#define EXT2_DX_MAX_LEVELS              3
+
+/** Superblock compatible feature flags. */
+#define EXT2_FEATURE_COMPAT_DIR_INDEX           0x0020
+
 /** Superblock backwards-incompatible feature flags. */
 #define EXT2_FEATURE_INCOMPAT_COMPRESSION       0x0001
 #define EXT2_FEATURE_INCOMPAT_FILETYPE          0x0002
@@ -310,6 +332,27 @@ typedef struct ext2_dir_entry {
     char name[];                            /**< Name of the file. */
 } __packed ext2_dir_entry_t;
 
+/** Hashed directory index entry. */
+typedef struct ext2_dx_entry {
+    uint32_t hash;                          /**< Lowest hash value in the block. */
+    uint32_t block;                         /**< Directory block number. */
+} __packed ext2_dx_entry_t;
+
+/** Hashed directory index count/limit (overlays the first entry's hash). */
+typedef struct ext2_dx_countlimit {
+    uint16_t limit;                         /**< Maximum number of entries. */
+    uint16_t count;                         /**< Number of entries (including this). */
+} __packed ext2_dx_countlimit_t;
+
+/** Hashed directory index root information. */
+typedef struct ext2_dx_root_info {
+    uint32_t reserved_zero;                 /**< Always 0. */
+    uint8_t hash_version;                   /**< Hash version. */
+    uint8_t info_length;                    /**< Length of this structure (8). */
+    uint8_t indirect_levels;                /**< Depth of the tree below the root. */
+    uint8_t unused_flags;
+} __packed ext2_dx_root_info_t;
+
 /* Ext4 on-disk extent structure. */
 typedef struct ext4_extent {
     uint32_t ee_block;                      /**< First logical block extent covers. */
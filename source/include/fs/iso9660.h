@@ -39,6 +39,12 @@
 /** Maximum Joliet file name length. */
 #define ISO9660_JOLIET_MAX_NAME_LEN     64
 
+/** Maximum path table size that will be loaded. */
+#define ISO9660_MAX_PATH_TABLE_SIZE     0x100000
+
+/** Maximum number of path table records (parent numbers are 16-bit). */
+#define ISO9660_MAX_PATH_TABLE_RECORDS  0xffff
+
 /** Identifier string separators. */
 #define ISO9660_SEPARATOR1              0x2e    /**< Seperator 1 (.). */
 #define ISO9660_SEPARATOR2              0x3b    /**< Seperator 2 (;). */
@@ -146,4 +152,13 @@ typedef struct iso9660_directory_record {
     uint8_t file_ident[];                       /**< File Identifier. */
 } __packed iso9660_directory_record_t;
 
+/** Path Table Record (ECMA-119 Page 32). */
+typedef struct iso9660_path_table_record {
+    uint8_t dir_ident_len;                      /**< Length of Directory Identifier. */
+    uint8_t ext_attr_rec_len;                   /**< Extended Attribute Record Length. */
+    uint32_t extent_loc;                        /**< Location of Extent. */
+    uint16_t parent_dir_num;                    /**< Parent Directory Number. */
+    uint8_t dir_ident[];                        /**< Directory Identifier. */
+} __packed iso9660_path_table_record_t;
+
 #endif /* __FS_ISO9660_H */
@@ -62,6 +62,7 @@ typedef struct kboot_tag {
 #define KBOOT_TAG_SECTIONS          10      /**< ELF section information. */
 #define KBOOT_TAG_BIOS_E820         11      /**< BIOS address range descriptor (BIOS-specific). */
 #define KBOOT_TAG_EFI               12      /**< EFI firmware information. */
+#define KBOOT_TAG_BOOTSTAT          13      /**< Boot loader timing statistics. */
 
 /** Tag containing core information for the kernel. */
 typedef struct kboot_tag_core {
@@ -267,6 +268,32 @@ typedef struct kboot_log {
     uint8_t buffer[0];                      /**< Log data. */
 } kboot_log_t;
 
+/** Total time spent in a boot loader phase. */
+typedef struct kboot_bootstat_phase {
+    uint64_t time;                          /**< Total time (microseconds). */
+    uint64_t bytes;                         /**< Total bytes transferred. */
+    uint32_t count;                         /**< Number of times the phase was entered. */
+    uint32_t _pad;
+} kboot_bootstat_phase_t;
+
+/** Timing information for a single boot loader operation. */
+typedef struct kboot_bootstat_span {
+    uint64_t start;                         /**< Start time (microseconds since loader start). */
+    uint64_t duration;                      /**< Duration (microseconds). */
+    uint64_t bytes;                         /**< Bytes transferred. */
+    uint32_t phase;                         /**< Phase of the operation. */
+    uint32_t _pad;
+} kboot_bootstat_span_t;
+
+/** Boot loader phases. */
+#define KBOOT_BOOTSTAT_DEVICE       0       /**< Device probing. */
+#define KBOOT_BOOTSTAT_MOUNT        1       /**< Filesystem mounting. */
+#define KBOOT_BOOTSTAT_CONFIG       2       /**< Configuration loading. */
+#define KBOOT_BOOTSTAT_READ         3       /**< File reads. */
+#define KBOOT_BOOTSTAT_DECOMPRESS   4       /**< Decompression. */
+#define KBOOT_BOOTSTAT_LOAD         5       /**< Loading of the kernel and modules. */
+#define KBOOT_BOOTSTAT_MEMORY       6       /**< Memory map finalisation. */
+
 /** Tag describing ELF section headers. */
 typedef struct kboot_tag_sections {
     kboot_tag_t header;                     /**< Tag header. */
@@ -280,6 +307,17 @@ typedef struct kboot_tag_sections {
     uint8_t sections[0];                    /**< Section data. */
 } kboot_tag_sections_t;
 
+/** Tag containing boot loader timing statistics. */
+typedef struct kboot_tag_bootstat {
+    kboot_tag_t header;                     /**< Tag header. */
+
+    uint64_t time;                          /**< Time spent in the boot loader (microseconds). */
+    uint32_t num_phases;                    /**< Number of phase totals. */
+    uint32_t num_spans;                     /**< Number of spans. */
+
+    kboot_bootstat_phase_t phases[0];       /**< Phase totals, followed by spans. */
+} kboot_tag_bootstat_t;
+
 /** Tag containing page table information (IA32). */
 typedef struct kboot_tag_pagetables_ia32 {
     kboot_tag_t header;                     /**< Tag header. */
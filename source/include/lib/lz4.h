@@ -0,0 +1,35 @@
+/*
+ * Copyright (C) 2015 Alex Smith
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/**
+ * @file
+ * @brief               LZ4 decompression functions.
+ */
+
+#ifndef __LIB_LZ4_H
+#define __LIB_LZ4_H
+
+#include <types.h>
+
+/** Maximum distance of an LZ4 match. */
+#define LZ4_WINDOW_SIZE         65536
+
+extern bool lz4_decompress_block(
+    const uint8_t *src, size_t src_size, uint8_t *dest_start, uint8_t *dest,
+    size_t dest_size, size_t *_size);
+extern bool lz4_block_size(const uint8_t *src, size_t src_size, size_t *_size);
+
+#endif /* __LIB_LZ4_H */
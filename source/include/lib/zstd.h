@@ -0,0 +1,113 @@
+/*
+ * Copyright (C) 2015 Alex Smith
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/**
+ * @file
+ * @brief               Zstandard decompression functions.
+ */
+
+#ifndef __LIB_ZSTD_H
+#define __LIB_ZSTD_H
+
+#include <types.h>
+
+/** Zstandard frame magic number. */
+#define ZSTD_MAGIC                  0xfd2fb528
+
+/** Skippable frame magic number (low 4 bits are user-defined). */
+#define ZSTD_SKIPPABLE_MAGIC        0x184d2a50
+#define ZSTD_SKIPPABLE_MAGIC_MASK   0xfffffff0
+
+/** Maximum size of a frame header. */
+#define ZSTD_FRAME_HEADER_MAX       18
+
+/** Block header definitions. */
+#define ZSTD_BLOCK_HEADER_SIZE      3
+#define ZSTD_BLOCK_LAST(h)          ((h) & 1)
+#define ZSTD_BLOCK_TYPE(h)          (((h) >> 1) & 3)
+#define ZSTD_BLOCK_SIZE(h)          ((h) >> 3)
+
+/** Block types. */
+#define ZSTD_BLOCK_RAW              0
+#define ZSTD_BLOCK_RLE              1
+#define ZSTD_BLOCK_COMPRESSED       2
+
+/** Maximum (decompressed or compressed) size of a block. */
+#define ZSTD_BLOCK_SIZE_MAX         (128 * 1024)
+
+/** Size of the content checksum at the end of a frame. */
+#define ZSTD_CHECKSUM_SIZE          4
+
+/** Value of content_size if not known. */
+#define ZSTD_CONTENT_SIZE_UNKNOWN   ((uint64_t)-1)
+
+/** Limits of the entropy tables. */
+#define ZSTD_HUF_MAX_BITS           11
+#define ZSTD_LL_MAX_LOG             9
+#define ZSTD_OF_MAX_LOG             8
+#define ZSTD_ML_MAX_LOG             9
+
+/** Information from a frame header. */
+typedef struct zstd_frame {
+    size_t header_size;                 /**< Size of the frame header. */
+    uint64_t window_size;               /**< Window size required. */
+    uint64_t content_size;              /**< Decompressed size (or ZSTD_CONTENT_SIZE_UNKNOWN). */
+    uint32_t dict_id;                   /**< Dictionary ID (0 if none). */
+    bool checksum;                      /**< Whether a content checksum is present. */
+} zstd_frame_t;
+
+/** FSE decoding table entry. */
+typedef struct zstd_fse_entry {
+    uint16_t baseline;                  /**< Base value of the next state. */
+    uint8_t symbol;                     /**< Decoded symbol. */
+    uint8_t bits;                       /**< Number of bits to read for next state. */
+} zstd_fse_entry_t;
+
+/**
+ * Zstandard decompression context.
+ *
+ * This holds the state that carries between blocks of a frame. It must be
+ * reset with zstd_reset() at the start of each frame.
+ */
+typedef struct zstd_context {
+    uint32_t rep[3];                    /**< Repeat offsets. */
+
+    /** Huffman table for literals. */
+    uint16_t huf_table[1 << ZSTD_HUF_MAX_BITS];
+    uint8_t huf_bits;                   /**< Maximum code length (0 if no table). */
+
+    /** FSE tables for sequences. */
+    zstd_fse_entry_t ll_table[1 << ZSTD_LL_MAX_LOG];
+    zstd_fse_entry_t of_table[1 << ZSTD_OF_MAX_LOG];
+    zstd_fse_entry_t ml_table[1 << ZSTD_ML_MAX_LOG];
+    uint8_t ll_log;                     /**< Literal length table accuracy. */
+    uint8_t of_log;                     /**< Offset table accuracy. */
+    uint8_t ml_log;                     /**< Match length table accuracy. */
+    uint8_t valid_tables;               /**< Bitmap of valid FSE tables. */
+
+    /** Temporary buffers. */
+    uint8_t weights[256];
+    zstd_fse_entry_t weight_table[1 << 6];
+    uint8_t literals[ZSTD_BLOCK_SIZE_MAX];
+} zstd_context_t;
+
+extern bool zstd_parse_frame_header(const uint8_t *buf, size_t size, zstd_frame_t *frame);
+extern void zstd_reset(zstd_context_t *ctx);
+extern bool zstd_decompress_block(
+    zstd_context_t *ctx, const uint8_t *src, size_t src_size, uint8_t *dest_start,
+    uint8_t *dest, size_t dest_size, size_t *_size);
+
+#endif /* __LIB_ZSTD_H */
@@ -61,6 +61,9 @@ typedef struct kboot_loader {
     fs_handle_t *handle;                /**< Handle to kernel image. */
     void *ehdr;                         /**< ELF header. */
     void *phdrs;                        /**< ELF program headers. */
+    void *head;                         /**< Image data read while looking for notes. */
+    offset_t head_offset;               /**< File offset of buffered image data. */
+    size_t head_size;                   /**< Size of buffered image data. */
     load_mode_t mode;                   /**< Whether the kernel is 32- or 64-bit. */
     list_t itags;                       /**< Image tags. */
     kboot_itag_image_t *image;          /**< Main image tag. */
@@ -22,6 +22,8 @@
 #ifndef __NET_H
 #define __NET_H
 
+#include <lib/list.h>
+
 #include <device.h>
 
 struct net_device;
@@ -106,6 +108,34 @@ typedef struct bootp_packet {
 
 #ifdef CONFIG_TARGET_HAS_NET
 
+/** Cached region of a network file. */
+typedef struct net_cache_chunk {
+    offset_t start;                     /**< Offset of the chunk in the file. */
+    size_t size;                        /**< Size of the chunk (0 if unused). */
+    size_t valid;                       /**< Number of bytes cached from the start. */
+    void *data;                         /**< Cached data (allocated when first stored). */
+} net_cache_chunk_t;
+
+/** Network file cache entry. */
+typedef struct net_cache_entry {
+    list_t header;                      /**< Link to LRU list. */
+
+    net_device_t *net;                  /**< Device the file is on. */
+    char *path;                         /**< Path to the file. */
+    offset_t size;                      /**< Size of the file. */
+    unsigned count;                     /**< Number of handles using the entry. */
+    unsigned hits;                      /**< Number of reads satisfied by the cache. */
+
+    /** Either the whole file, or the head and tail of a large file. */
+    net_cache_chunk_t chunks[2];
+} net_cache_entry_t;
+
+extern net_cache_entry_t *net_cache_lookup(net_device_t *net, const char *path);
+extern net_cache_entry_t *net_cache_insert(net_device_t *net, const char *path, offset_t size);
+extern void net_cache_release(net_cache_entry_t *entry);
+extern bool net_cache_read(net_cache_entry_t *entry, void *buf, size_t count, offset_t offset);
+extern void net_cache_store(net_cache_entry_t *entry, const void *buf, size_t count, offset_t offset);
+
 extern void net_device_register(net_device_t *net, bool boot);
 extern void net_device_register_with_bootp(net_device_t *net, bootp_packet_t *packet, bool boot);
 
@@ -60,6 +60,9 @@ typedef struct gpt_header {
 /** GPT signature. */
 #define GPT_HEADER_SIGNATURE    0x5452415020494645ull
 
+/** Maximum size of the partition entry array that we will read. */
+#define GPT_MAX_ENTRY_ARRAY_SIZE    0x100000
+
 /** GPT partition entry. */
 typedef struct gpt_partition_entry {
     gpt_guid_t type_guid;               /**< Partition type GUID. */
@@ -26,7 +26,9 @@
 #define MBR_SIGNATURE               0xaa55
 
 /** MBR partition types. */
-#define MBR_PARTITION_TYPE_GPT      0xee    /**< GPT protective. */
+#define MBR_PARTITION_TYPE_LINUX_SWAP   0x82    /**< Linux swap. */
+#define MBR_PARTITION_TYPE_LINUX_LVM    0x8e    /**< Linux LVM physical volume. */
+#define MBR_PARTITION_TYPE_GPT          0xee    /**< GPT protective. */
 
 /** Offsets in MBR structures. */
 #define MBR_PARTITION_OFF_BOOTABLE  0
@@ -0,0 +1,132 @@
+/*
+ * Copyright (C) 2015 Alex Smith
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/**
+ * @file
+ * @brief               TFTP client.
+ */
+
+#ifndef __TFTP_H
+#define __TFTP_H
+
+#include <net.h>
+#include <status.h>
+#include <time.h>
+
+struct tftp_transfer;
+
+/** TFTP opcodes. */
+#define TFTP_OPCODE_RRQ             1       /**< Read request. */
+#define TFTP_OPCODE_WRQ             2       /**< Write request. */
+#define TFTP_OPCODE_DATA            3       /**< Data. */
+#define TFTP_OPCODE_ACK             4       /**< Acknowledgement. */
+#define TFTP_OPCODE_ERROR           5       /**< Error. */
+#define TFTP_OPCODE_OACK            6       /**< Option acknowledgement (RFC 2347). */
+
+/** TFTP error codes. */
+#define TFTP_ERROR_UNDEFINED        0       /**< Not defined, see message. */
+#define TFTP_ERROR_NOT_FOUND        1       /**< File not found. */
+#define TFTP_ERROR_ACCESS           2       /**< Access violation. */
+#define TFTP_ERROR_UNKNOWN_TID      5       /**< Unknown transfer ID. */
+#define TFTP_ERROR_OPTION           8       /**< Option negotiation failed (RFC 2347). */
+
+/** TFTP block sizes. */
+#define TFTP_DEFAULT_BLOCK_SIZE     512     /**< Block size without negotiation. */
+#define TFTP_MIN_BLOCK_SIZE         8       /**< Minimum block size (RFC 2348). */
+#define TFTP_MAX_BLOCK_SIZE         65464   /**< Maximum block size (RFC 2348). */
+
+/** Overhead of IPv4, UDP and TFTP DATA headers within an MTU. */
+#define TFTP_DATA_OVERHEAD          (20 + 8 + 4)
+
+/** Block size filling an Ethernet frame, for when the MTU is not known. */
+#define TFTP_ETHERNET_BLOCK_SIZE    (1500 - TFTP_DATA_OVERHEAD)
+
+/** Window size that we request (RFC 7440). */
+#define TFTP_WINDOW_SIZE            16
+
+/** Number of recently received blocks to keep. */
+#define TFTP_RECENT_BLOCKS          8
+
+/** Time to wait for a packet before retransmitting (in milliseconds). */
+#define TFTP_TIMEOUT                1000
+
+/** Number of times to retransmit before giving up. */
+#define TFTP_RETRIES                5
+
+/** Transfer size value indicating that the size is not known. */
+#define TFTP_SIZE_UNKNOWN           ((offset_t)-1)
+
+/** TFTP transport operations. */
+typedef struct tftp_ops {
+    /** Send a packet to the server.
+     * @param transfer      Transfer that the packet belongs to.
+     * @param buf           Packet to send.
+     * @param size          Size of the packet.
+     * @param port          Server UDP port to send to.
+     * @return              Status code describing the result of the operation. */
+    status_t (*send)(struct tftp_transfer *transfer, const void *buf, size_t size, uint16_t port);
+
+    /** Receive a packet from the server.
+     * @note                Only packets from the server IP address to the
+     *                      transfer's local port should be returned. Packets
+     *                      that are too large for the buffer should be dropped.
+     * @param transfer      Transfer to receive for.
+     * @param buf           Buffer to receive into.
+     * @param _size         On input, size of the buffer. On output, size of
+     *                      the received packet.
+     * @param _port         Where to store server UDP port the packet is from.
+     * @param timeout       Maximum time to wait (in milliseconds).
+     * @return              Status code describing the result of the operation.
+     *                      STATUS_TIMED_OUT if no packet was received. */
+    status_t (*receive)(
+        struct tftp_transfer *transfer, void *buf, size_t *_size, uint16_t *_port,
+        mstime_t timeout);
+} tftp_ops_t;
+
+/** TFTP transfer state. */
+typedef struct tftp_transfer {
+    /** Fields which should be initialized before use. */
+    const tftp_ops_t *ops;              /**< Transport operations. */
+    net_device_t *net;                  /**< Network device to transfer using. */
+    const char *path;                   /**< Path to the file. */
+    uint16_t max_block_size;            /**< Largest block size to request. */
+
+    /** Fields set internally. */
+    bool active;                        /**< Whether a transfer is in progress. */
+    bool complete;                      /**< Whether the final block has been received. */
+    uint16_t local_port;                /**< Client UDP port (our transfer ID). */
+    uint16_t server_port;               /**< Server UDP port (server transfer ID). */
+    uint16_t block_size;                /**< Negotiated block size. */
+    uint16_t window_size;               /**< Negotiated window size. */
+    uint16_t window_count;              /**< Blocks received since the last ACK. */
+    uint32_t block;                     /**< Number of blocks received in sequence. */
+    offset_t size;                      /**< Transfer size given by the server. */
+    offset_t start;                     /**< File offset of the oldest kept block. */
+    offset_t position;                  /**< File offset following the current block. */
+    unsigned kept;                      /**< Number of blocks kept in the ring. */
+    size_t packet_size;                 /**< Size of each slot in the ring. */
+    uint8_t *blocks;                    /**< Ring of recently received blocks. */
+    uint8_t *packet;                    /**< Slot for the packet being received. */
+} tftp_transfer_t;
+
+extern void tftp_init(
+    tftp_transfer_t *transfer, const tftp_ops_t *ops, net_device_t *net,
+    const char *path, uint16_t max_block_size);
+extern status_t tftp_open(tftp_transfer_t *transfer);
+extern status_t tftp_read(tftp_transfer_t *transfer, void *buf, size_t count, offset_t offset);
+extern void tftp_close(tftp_transfer_t *transfer);
+
+#endif /* __TFTP_H */
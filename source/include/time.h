@@ -24,10 +24,59 @@
 
 #include <lib/utility.h>
 
+/** Boot phases recorded by the tracing functions.
+ * @note                Values match the KBOOT_BOOTSTAT_* phase definitions
+ *                      used in the KBoot boot statistics tag. */
+typedef enum trace_phase {
+    TRACE_PHASE_DEVICE,                 /**< Device probing. */
+    TRACE_PHASE_MOUNT,                  /**< Filesystem mounting. */
+    TRACE_PHASE_CONFIG,                 /**< Configuration loading. */
+    TRACE_PHASE_READ,                   /**< File reads. */
+    TRACE_PHASE_DECOMPRESS,             /**< Decompression. */
+    TRACE_PHASE_LOAD,                   /**< Loading of an OS. */
+    TRACE_PHASE_MEMORY,                 /**< Memory map finalisation. */
+
+    TRACE_PHASE_COUNT,
+} trace_phase_t;
+
+/** Maximum length of a trace span name. */
+#define TRACE_NAME_MAX          16
+
+/** Details of a completed trace span. */
+typedef struct trace_span {
+    uint64_t start;                     /**< Start timestamp. */
+    uint64_t end;                       /**< End timestamp. */
+    uint64_t bytes;                     /**< Bytes transferred during the span. */
+    uint8_t phase;                      /**< Phase that the span is for. */
+    char name[TRACE_NAME_MAX];          /**< Name of object operated on (device, etc.). */
+} trace_span_t;
+
+/** Accumulated statistics for a boot phase. */
+typedef struct trace_total {
+    uint64_t time;                      /**< Total time spent (in timestamp units). */
+    uint64_t bytes;                     /**< Total bytes transferred. */
+    uint32_t count;                     /**< Number of spans recorded. */
+} trace_total_t;
+
+/** Number of spans kept in the trace ring. */
+#define TRACE_SPANS_MAX         128
+
 extern mstime_t current_time(void);
+extern uint64_t current_timestamp(void);
+extern uint64_t timestamp_to_usecs(uint64_t timestamp);
 
 extern void delay(mstime_t time);
 
+/** Begin a trace span.
+ * @return              Start timestamp to pass to trace_end(). */
+static inline uint64_t trace_begin(void) {
+    return current_timestamp();
+}
+
+extern void trace_end(trace_phase_t phase, uint64_t start, uint64_t bytes, const char *name);
+extern size_t trace_spans(const trace_span_t **_spans, size_t *_first);
+extern const trace_total_t *trace_totals(void);
+
 /** Convert seconds to milliseconds.
  * @param secs          Seconds value to convert.
  * @return              Equivalent time in milliseconds. */
@@ -0,0 +1,166 @@
+/*
+ * Copyright (C) 2015 Alex Smith
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/**
+ * @file
+ * @brief               LZ4 decompression functions.
+ *
+ * This implements decompression of the LZ4 block format. Parsing of the frame
+ * format that blocks are contained in is left to the caller.
+ */
+
+#include <lib/lz4.h>
+#include <lib/string.h>
+
+/** Minimum length of an LZ4 match. */
+#define LZ4_MIN_MATCH           4
+
+/** Read an extended LZ4 length.
+ * @param src           Source buffer pointer (updated).
+ * @param end           End of source buffer.
+ * @param _len          Length to add to.
+ * @return              Whether the length was read successfully. */
+static inline bool read_length(const uint8_t **src, const uint8_t *end, size_t *_len) {
+    uint8_t byte;
+
+    do {
+        if (*src >= end)
+            return false;
+
+        byte = *(*src)++;
+        *_len += byte;
+    } while (byte == 255);
+
+    return true;
+}
+
+/**
+ * Decompress an LZ4 block.
+ *
+ * Decompresses an LZ4 block. Matches are allowed to refer back to data that
+ * precedes the destination, as far back as the given start of the output
+ * buffer, so that dependent blocks can be decompressed.
+ *
+ * @param src           Compressed block data.
+ * @param src_size      Size of the compressed data.
+ * @param dest_start    Start of the output buffer.
+ * @param dest          Location in the output buffer to decompress to.
+ * @param dest_size     Space available at the destination.
+ * @param _size         Where to store decompressed size.
+ *
+ * @return              Whether the block was successfully decompressed.
+ */
+bool lz4_decompress_block(
+    const uint8_t *src, size_t src_size, uint8_t *dest_start, uint8_t *dest,
+    size_t dest_size, size_t *_size)
+{
+    const uint8_t *src_end = src + src_size;
+    uint8_t *out = dest;
+    uint8_t *out_end = dest + dest_size;
+
+    while (src < src_end) {
+        uint8_t token = *src++;
+        size_t len = token >> 4;
+        size_t offset;
+        const uint8_t *match;
+
+        /* Copy literals. */
+        if (len == 15 && !read_length(&src, src_end, &len))
+            return false;
+
+        if (len > (size_t)(src_end - src) || len > (size_t)(out_end - out))
+            return false;
+
+        memcpy(out, src, len);
+        src += len;
+        out += len;
+
+        /* The last sequence consists only of literals. */
+        if (src == src_end)
+            break;
+
+        if (src_end - src < 2)
+            return false;
+
+        offset = src[0] | (src[1] << 8);
+        src += 2;
+
+        if (!offset || offset > (size_t)(out - dest_start))
+            return false;
+
+        len = token & 0xf;
+        if (len == 15 && !read_length(&src, src_end, &len))
+            return false;
+
+        len += LZ4_MIN_MATCH;
+        if (len > (size_t)(out_end - out))
+            return false;
+
+        /* Matches may overlap the output, copy byte by byte in that case. */
+        match = out - offset;
+        if (offset >= len) {
+            memcpy(out, match, len);
+            out += len;
+        } else {
+            while (len--)
+                *out++ = *match++;
+        }
+    }
+
+    *_size = out - dest;
+    return true;
+}
+
+/** Get the decompressed size of an LZ4 block without decompressing it.
+ * @param src           Compressed block data.
+ * @param src_size      Size of the compressed data.
+ * @param _size         Where to store decompressed size.
+ * @return              Whether the block was successfully parsed. */
+bool lz4_block_size(const uint8_t *src, size_t src_size, size_t *_size) {
+    const uint8_t *src_end = src + src_size;
+    size_t size = 0;
+
+    while (src < src_end) {
+        uint8_t token = *src++;
+        size_t len = token >> 4;
+
+        if (len == 15 && !read_length(&src, src_end, &len))
+            return false;
+
+        if (len > (size_t)(src_end - src))
+            return false;
+
+        src += len;
+        size += len;
+
+        if (src == src_end)
+            break;
+
+        if (src_end - src < 2)
+            return false;
+
+        src += 2;
+
+        len = token & 0xf;
+        if (len == 15 && !read_length(&src, src_end, &len))
+            return false;
+
+        size += len + LZ4_MIN_MATCH;
+    }
+
+    *_size = size;
+    return true;
+}
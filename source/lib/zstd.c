@@ -0,0 +1,945 @@
+/*
+ * Copyright (C) 2015 Alex Smith
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/**
+ * @file
+ * @brief               Zstandard decompression functions.
+ *
+ * This implements decompression of Zstandard (RFC 8878) blocks, along with
+ * parsing of frame headers. Handling of the block structure of a frame is left
+ * to the caller, which allows it to be streamed from a file. Dictionaries are
+ * not supported, and the content checksum is not verified.
+ */
+
+#include <lib/string.h>
+#include <lib/utility.h>
+#include <lib/zstd.h>
+
+#include <endian.h>
+
+/** Maximum number of symbols in an FSE table we decode. */
+#define FSE_MAX_SYMBOLS         64
+
+/** Limits of the Huffman weight table. */
+#define HUF_WEIGHT_MAX_LOG      6
+#define HUF_WEIGHT_MAX          12
+
+/** Maximum symbol values for sequence codes. */
+#define LL_MAX_SYMBOL           35
+#define OF_MAX_SYMBOL           31
+#define ML_MAX_SYMBOL           52
+
+/** Bits in valid_tables. */
+#define LL_TABLE_VALID          (1<<0)
+#define OF_TABLE_VALID          (1<<1)
+#define ML_TABLE_VALID          (1<<2)
+
+/** Sequence table compression modes. */
+#define SEQ_MODE_PREDEFINED     0
+#define SEQ_MODE_RLE            1
+#define SEQ_MODE_FSE            2
+#define SEQ_MODE_REPEAT         3
+
+/** Literals block types. */
+#define LITERALS_RAW            0
+#define LITERALS_RLE            1
+#define LITERALS_COMPRESSED     2
+#define LITERALS_TREELESS       3
+
+/** Backward bitstream reader. */
+typedef struct bitstream {
+    const uint8_t *start;               /**< Start of the stream. */
+    size_t size;                        /**< Size of the stream. */
+    int32_t pos;                        /**< Bits remaining (negative if overread). */
+} bitstream_t;
+
+/** Description of a sequence code table. */
+typedef struct seq_table_desc {
+    const int16_t *default_norm;        /**< Predefined distribution. */
+    uint8_t default_symbols;            /**< Number of symbols in predefined distribution. */
+    uint8_t default_log;                /**< Predefined accuracy log. */
+    uint8_t max_log;                    /**< Maximum accuracy log. */
+    uint8_t max_symbol;                 /**< Maximum symbol value. */
+    uint8_t valid;                      /**< Bit in valid_tables. */
+} seq_table_desc_t;
+
+/** Predefined literal length distribution. */
+static const int16_t ll_default_norm[LL_MAX_SYMBOL + 1] = {
+    4, 3, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 1, 1, 1,
+    2, 2, 2, 2, 2, 2, 2, 2, 2, 3, 2, 1, 1, 1, 1, 1,
+    -1, -1, -1, -1,
+};
+
+/** Predefined offset distribution. */
+static const int16_t of_default_norm[29] = {
+    1, 1, 1, 1, 1, 1, 2, 2, 2, 1, 1, 1, 1, 1, 1, 1,
+    1, 1, 1, 1, 1, 1, 1, 1, -1, -1, -1, -1, -1,
+};
+
+/** Predefined match length distribution. */
+static const int16_t ml_default_norm[ML_MAX_SYMBOL + 1] = {
+    1, 4, 3, 2, 2, 2, 2, 2, 2, 1, 1, 1, 1, 1, 1, 1,
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, -1, -1,
+    -1, -1, -1, -1, -1,
+};
+
+/** Sequence code table descriptions. */
+static const seq_table_desc_t ll_desc = {
+    ll_default_norm, array_size(ll_default_norm), 6, ZSTD_LL_MAX_LOG, LL_MAX_SYMBOL, LL_TABLE_VALID,
+};
+static const seq_table_desc_t of_desc = {
+    of_default_norm, array_size(of_default_norm), 5, ZSTD_OF_MAX_LOG, OF_MAX_SYMBOL, OF_TABLE_VALID,
+};
+static const seq_table_desc_t ml_desc = {
+    ml_default_norm, array_size(ml_default_norm), 6, ZSTD_ML_MAX_LOG, ML_MAX_SYMBOL, ML_TABLE_VALID,
+};
+
+/** Literal length code baselines and extra bits. */
+static const uint32_t ll_base[LL_MAX_SYMBOL + 1] = {
+    0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15,
+    16, 18, 20, 22, 24, 28, 32, 40, 48, 64, 128, 256, 512, 1024, 2048, 4096,
+    8192, 16384, 32768, 65536,
+};
+static const uint8_t ll_bits[LL_MAX_SYMBOL + 1] = {
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    1, 1, 1, 1, 2, 2, 3, 3, 4, 6, 7, 8, 9, 10, 11, 12,
+    13, 14, 15, 16,
+};
+
+/** Match length code baselines and extra bits. */
+static const uint32_t ml_base[ML_MAX_SYMBOL + 1] = {
+    3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15, 16, 17, 18,
+    19, 20, 21, 22, 23, 24, 25, 26, 27, 28, 29, 30, 31, 32, 33, 34,
+    35, 37, 39, 41, 43, 47, 51, 59, 67, 83, 99, 131, 259, 515, 1027, 2051,
+    4099, 8195, 16387, 32771, 65539,
+};
+static const uint8_t ml_bits[ML_MAX_SYMBOL + 1] = {
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    1, 1, 1, 1, 2, 2, 3, 3, 4, 4, 5, 7, 8, 9, 10, 11,
+    12, 13, 14, 15, 16,
+};
+
+/** Unaligned 64-bit value. */
+typedef struct unaligned64 {
+    uint64_t val;
+} __packed unaligned64_t;
+
+/** Get the index of the highest set bit in a value. */
+static inline unsigned highbit(uint32_t val) {
+    return fls(val) - 1;
+}
+
+/** Read a little-endian value of up to 8 bytes. */
+static inline uint64_t read_le(const uint8_t *buf, size_t size) {
+    uint64_t val = 0;
+
+    for (size_t i = 0; i < size; i++)
+        val |= (uint64_t)buf[i] << (i * 8);
+
+    return val;
+}
+
+/** Initialize a backward bitstream.
+ * @param bits          Bitstream to initialize.
+ * @param src           Stream data.
+ * @param size          Size of the stream.
+ * @return              Whether the stream is valid. */
+static bool bits_init(bitstream_t *bits, const uint8_t *src, size_t size) {
+    /* The last byte contains a marker bit indicating where the stream starts. */
+    if (!size || !src[size - 1])
+        return false;
+
+    bits->start = src;
+    bits->size = size;
+    bits->pos = ((size - 1) * 8) + highbit(src[size - 1]);
+    return true;
+}
+
+/** Get the next bits from a backward bitstream without consuming them.
+ * @param bits          Bitstream to read from.
+ * @param count         Number of bits (up to 32).
+ * @return              Value of the bits. Bits beyond the start of the stream
+ *                      read as zero. */
+static inline uint32_t bits_peek(const bitstream_t *bits, unsigned count) {
+    int32_t low = bits->pos - (int32_t)count;
+    uint64_t mask = ((uint64_t)1 << count) - 1;
+    uint64_t val;
+
+    if (low >= 0 && (size_t)(low >> 3) + sizeof(uint64_t) <= bits->size) {
+        val = le64_to_cpu(((const unaligned64_t *)&bits->start[low >> 3])->val);
+        return (val >> (low & 7)) & mask;
+    } else if (low >= 0) {
+        val = read_le(&bits->start[low >> 3], bits->size - (low >> 3));
+        return (val >> (low & 7)) & mask;
+    } else if (bits->pos <= 0) {
+        return 0;
+    } else {
+        val = read_le(bits->start, min(bits->size, sizeof(uint64_t)));
+        return (val & (((uint64_t)1 << bits->pos) - 1)) << -low;
+    }
+}
+
+/** Read bits from a backward bitstream.
+ * @param bits          Bitstream to read from.
+ * @param count         Number of bits (up to 32).
+ * @return              Value of the bits. */
+static inline uint32_t bits_read(bitstream_t *bits, unsigned count) {
+    uint32_t val = bits_peek(bits, count);
+
+    bits->pos -= count;
+    return val;
+}
+
+/** Decode a symbol from an FSE state and move to the next state.
+ * @param bits          Bitstream to read from.
+ * @param table         Decoding table.
+ * @param state         State to update.
+ * @return              Decoded symbol. */
+static inline uint8_t fse_decode(bitstream_t *bits, const zstd_fse_entry_t *table, uint16_t *state) {
+    const zstd_fse_entry_t *entry = &table[*state];
+
+    *state = entry->baseline + bits_read(bits, entry->bits);
+    return entry->symbol;
+}
+
+/** Read bits from a forward bitstream.
+ * @param src           Stream data.
+ * @param size          Size of the stream.
+ * @param pos           Bit position to read from.
+ * @param count         Number of bits (up to 16).
+ * @return              Value of the bits. Bits beyond the end read as zero. */
+static uint32_t read_forward(const uint8_t *src, size_t size, size_t pos, unsigned count) {
+    size_t byte = pos >> 3;
+    uint32_t val;
+
+    if (byte >= size)
+        return 0;
+
+    val = read_le(&src[byte], min(size - byte, (size_t)3));
+    return (val >> (pos & 7)) & ((1 << count) - 1);
+}
+
+/** Read an FSE table description.
+ * @param src           Source data.
+ * @param size          Size of source data.
+ * @param max_symbol    Maximum symbol value.
+ * @param max_log       Maximum accuracy log.
+ * @param norm          Array to store normalized distribution in.
+ * @param _symbols      Where to store number of symbols.
+ * @param _log          Where to store accuracy log.
+ * @param _consumed     Where to store number of bytes consumed.
+ * @return              Whether the description is valid. */
+static bool fse_read_norm(
+    const uint8_t *src, size_t size, unsigned max_symbol, unsigned max_log,
+    int16_t *norm, unsigned *_symbols, unsigned *_log, size_t *_consumed)
+{
+    int32_t remaining, threshold;
+    unsigned log, num_bits, symbol;
+    size_t pos;
+
+    if (!size)
+        return false;
+
+    log = (src[0] & 0xf) + 5;
+    if (log > max_log)
+        return false;
+
+    pos = 4;
+    remaining = (1 << log) + 1;
+    threshold = 1 << log;
+    num_bits = log + 1;
+    symbol = 0;
+
+    while (remaining > 1) {
+        int32_t max = (2 * threshold - 1) - remaining;
+        int32_t count;
+        uint32_t val;
+
+        if (symbol > max_symbol)
+            return false;
+
+        val = read_forward(src, size, pos, num_bits);
+        if ((int32_t)(val & (threshold - 1)) < max) {
+            count = val & (threshold - 1);
+            pos += num_bits - 1;
+        } else {
+            count = val & (2 * threshold - 1);
+            if (count >= threshold)
+                count -= max;
+            pos += num_bits;
+        }
+
+        /* Value is probability + 1, -1 means "less than 1". */
+        count--;
+        remaining -= abs(count);
+        norm[symbol++] = count;
+
+        if (!count) {
+            uint32_t repeat;
+
+            /* A zero probability is followed by 2-bit repeat counts of
+             * further zero probabilities. */
+            do {
+                repeat = read_forward(src, size, pos, 2);
+                pos += 2;
+
+                if (symbol + repeat > max_symbol + 1)
+                    return false;
+
+                for (uint32_t i = 0; i < repeat; i++)
+                    norm[symbol++] = 0;
+            } while (repeat == 3);
+        }
+
+        while (remaining < threshold) {
+            num_bits--;
+            threshold >>= 1;
+        }
+    }
+
+    if (remaining != 1 || pos > size * 8)
+        return false;
+
+    *_symbols = symbol;
+    *_log = log;
+    *_consumed = (pos + 7) / 8;
+    return true;
+}
+
+/** Build an FSE decoding table.
+ * @param norm          Normalized distribution.
+ * @param symbols       Number of symbols.
+ * @param log           Accuracy log.
+ * @param table         Table to fill in. */
+static void fse_build_table(const int16_t *norm, unsigned symbols, unsigned log, zstd_fse_entry_t *table) {
+    uint16_t next[FSE_MAX_SYMBOLS];
+    uint32_t size = 1 << log;
+    uint32_t high = size - 1;
+    uint32_t step = (size >> 1) + (size >> 3) + 3;
+    uint32_t pos = 0;
+
+    /* "Less than 1" probability symbols go at the end of the table. */
+    for (unsigned i = 0; i < symbols; i++) {
+        if (norm[i] == -1) {
+            table[high--].symbol = i;
+            next[i] = 1;
+        } else {
+            next[i] = norm[i];
+        }
+    }
+
+    /* Spread the remaining symbols. */
+    for (unsigned i = 0; i < symbols; i++) {
+        for (int j = 0; j < norm[i]; j++) {
+            table[pos].symbol = i;
+
+            do {
+                pos = (pos + step) & (size - 1);
+            } while (pos > high);
+        }
+    }
+
+    /* Calculate state transitions. */
+    for (uint32_t i = 0; i < size; i++) {
+        uint16_t state = next[table[i].symbol]++;
+
+        table[i].bits = log - highbit(state);
+        table[i].baseline = (state << table[i].bits) - size;
+    }
+}
+
+/** Read a Huffman tree description.
+ * @param ctx           Context to store table in.
+ * @param src           Source data.
+ * @param size          Size of source data.
+ * @param _consumed     Where to store number of bytes consumed.
+ * @return              Whether the description is valid. */
+static bool huf_read_table(zstd_context_t *ctx, const uint8_t *src, size_t size, size_t *_consumed) {
+    uint8_t *weights = ctx->weights;
+    unsigned count, max_bits;
+    uint32_t total, rest, pos;
+    size_t consumed;
+
+    if (!size)
+        return false;
+
+    if (src[0] < 128) {
+        int16_t norm[HUF_WEIGHT_MAX + 1];
+        unsigned symbols, log;
+        size_t table_size;
+        bitstream_t bits;
+        uint16_t state1, state2;
+
+        /* Weights are FSE compressed, with 2 interleaved states. */
+        consumed = 1 + src[0];
+        if (consumed > size)
+            return false;
+
+        if (!fse_read_norm(&src[1], src[0], HUF_WEIGHT_MAX, HUF_WEIGHT_MAX_LOG, norm, &symbols, &log, &table_size))
+            return false;
+
+        fse_build_table(norm, symbols, log, ctx->weight_table);
+
+        if (table_size >= src[0] || !bits_init(&bits, &src[1 + table_size], src[0] - table_size))
+            return false;
+
+        state1 = bits_read(&bits, log);
+        state2 = bits_read(&bits, log);
+        count = 0;
+
+        /* Decoding ends when the stream is overread. */
+        while (true) {
+            if (count >= 254)
+                return false;
+
+            weights[count++] = fse_decode(&bits, ctx->weight_table, &state1);
+            if (bits.pos < 0) {
+                weights[count++] = ctx->weight_table[state2].symbol;
+                break;
+            }
+
+            weights[count++] = fse_decode(&bits, ctx->weight_table, &state2);
+            if (bits.pos < 0) {
+                weights[count++] = ctx->weight_table[state1].symbol;
+                break;
+            }
+        }
+    } else {
+        /* Weights are stored directly as 4-bit values. */
+        count = src[0] - 127;
+        consumed = 1 + ((count + 1) / 2);
+        if (consumed > size)
+            return false;
+
+        for (unsigned i = 0; i < count; i++)
+            weights[i] = (i & 1) ? src[1 + (i / 2)] & 0xf : src[1 + (i / 2)] >> 4;
+    }
+
+    /* The weight of the last symbol is implied, it brings the total up to the
+     * next power of 2. */
+    total = 0;
+    for (unsigned i = 0; i < count; i++) {
+        if (weights[i] > HUF_WEIGHT_MAX)
+            return false;
+
+        if (weights[i])
+            total += 1 << (weights[i] - 1);
+    }
+
+    if (!total)
+        return false;
+
+    max_bits = highbit(total) + 1;
+    if (max_bits > ZSTD_HUF_MAX_BITS)
+        return false;
+
+    rest = (1 << max_bits) - total;
+    if (!is_pow2(rest))
+        return false;
+
+    weights[count++] = highbit(rest) + 1;
+
+    /* Build the decoding table. Symbols are ordered by increasing weight, and
+     * by symbol value within the same weight. */
+    pos = 0;
+    for (unsigned weight = 1; weight <= max_bits; weight++) {
+        for (unsigned i = 0; i < count; i++) {
+            if (weights[i] == weight) {
+                uint16_t entry = i | ((max_bits + 1 - weight) << 8);
+
+                for (uint32_t j = 0; j < (1u << (weight - 1)); j++)
+                    ctx->huf_table[pos++] = entry;
+            }
+        }
+    }
+
+    ctx->huf_bits = max_bits;
+    *_consumed = consumed;
+    return true;
+}
+
+/** Decode a Huffman-coded literals stream.
+ * @param ctx           Context containing Huffman table.
+ * @param src           Stream data.
+ * @param size          Size of the stream.
+ * @param dest          Where to store decoded literals.
+ * @param count         Number of literals to decode.
+ * @return              Whether the stream was decoded successfully. */
+static bool huf_decode_stream(zstd_context_t *ctx, const uint8_t *src, size_t size, uint8_t *dest, size_t count) {
+    bitstream_t bits;
+
+    if (!bits_init(&bits, src, size))
+        return false;
+
+    for (size_t i = 0; i < count; i++) {
+        uint16_t entry = ctx->huf_table[bits_peek(&bits, ctx->huf_bits)];
+
+        dest[i] = entry & 0xff;
+        bits.pos -= entry >> 8;
+    }
+
+    return bits.pos == 0;
+}
+
+/** Decode a literals section.
+ * @param ctx           Decompression context.
+ * @param src           Source data.
+ * @param size          Size of source data.
+ * @param _literals     Where to store pointer to literals.
+ * @param _count        Where to store number of literals.
+ * @param _consumed     Where to store number of bytes consumed.
+ * @return              Whether the section was decoded successfully. */
+static bool decode_literals(
+    zstd_context_t *ctx, const uint8_t *src, size_t size, const uint8_t **_literals,
+    size_t *_count, size_t *_consumed)
+{
+    unsigned type, format;
+    size_t header_size, regen_size;
+
+    if (!size)
+        return false;
+
+    type = src[0] & 3;
+    format = (src[0] >> 2) & 3;
+
+    if (type == LITERALS_RAW || type == LITERALS_RLE) {
+        switch (format) {
+        case 1:
+            header_size = 2;
+            break;
+        case 3:
+            header_size = 3;
+            break;
+        default:
+            header_size = 1;
+            break;
+        }
+
+        if (header_size > size)
+            return false;
+
+        regen_size = (header_size == 1)
+            ? src[0] >> 3
+            : read_le(src, header_size) >> 4;
+
+        if (type == LITERALS_RAW) {
+            if (regen_size > size - header_size)
+                return false;
+
+            *_literals = &src[header_size];
+            *_consumed = header_size + regen_size;
+        } else {
+            if (header_size == size || regen_size > ZSTD_BLOCK_SIZE_MAX)
+                return false;
+
+            memset(ctx->literals, src[header_size], regen_size);
+            *_literals = ctx->literals;
+            *_consumed = header_size + 1;
+        }
+    } else {
+        unsigned size_bits, streams;
+        size_t compressed_size, consumed;
+        uint64_t header;
+
+        streams = (format == 0) ? 1 : 4;
+        header_size = (format < 2) ? 3 : format + 2;
+        size_bits = (format < 2) ? 10 : (format == 2) ? 14 : 18;
+
+        if (header_size > size)
+            return false;
+
+        header = read_le(src, header_size);
+        regen_size = (header >> 4) & ((1 << size_bits) - 1);
+        compressed_size = (header >> (4 + size_bits)) & ((1 << size_bits) - 1);
+
+        if (regen_size > ZSTD_BLOCK_SIZE_MAX || compressed_size > size - header_size)
+            return false;
+
+        src += header_size;
+        *_consumed = header_size + compressed_size;
+
+        if (type == LITERALS_COMPRESSED) {
+            if (!huf_read_table(ctx, src, compressed_size, &consumed))
+                return false;
+
+            src += consumed;
+            compressed_size -= consumed;
+        } else if (!ctx->huf_bits) {
+            return false;
+        }
+
+        if (streams == 1) {
+            if (!huf_decode_stream(ctx, src, compressed_size, ctx->literals, regen_size))
+                return false;
+        } else {
+            size_t stream_sizes[4], stream_regen, offset;
+
+            /* Jump table gives the sizes of the first 3 streams. */
+            if (compressed_size < 6)
+                return false;
+
+            stream_sizes[0] = src[0] | (src[1] << 8);
+            stream_sizes[1] = src[2] | (src[3] << 8);
+            stream_sizes[2] = src[4] | (src[5] << 8);
+            src += 6;
+            compressed_size -= 6;
+
+            offset = stream_sizes[0] + stream_sizes[1] + stream_sizes[2];
+            if (offset > compressed_size)
+                return false;
+
+            stream_sizes[3] = compressed_size - offset;
+
+            stream_regen = (regen_size + 3) / 4;
+            if (stream_regen * 3 > regen_size)
+                return false;
+
+            offset = 0;
+            for (unsigned i = 0; i < 4; i++) {
+                size_t count = (i < 3) ? stream_regen : regen_size - (stream_regen * 3);
+
+                if (!huf_decode_stream(ctx, src, stream_sizes[i], &ctx->literals[offset], count))
+                    return false;
+
+                src += stream_sizes[i];
+                offset += count;
+            }
+        }
+
+        *_literals = ctx->literals;
+    }
+
+    *_count = regen_size;
+    return true;
+}
+
+/** Read a sequence code table.
+ * @param ctx           Decompression context.
+ * @param desc          Description of the table.
+ * @param mode          Compression mode of the table.
+ * @param src           Source data.
+ * @param size          Size of source data.
+ * @param table         Table to fill in.
+ * @param _log          Accuracy log of the table.
+ * @param _consumed     Where to store number of bytes consumed.
+ * @return              Whether the table is valid. */
+static bool read_seq_table(
+    zstd_context_t *ctx, const seq_table_desc_t *desc, unsigned mode, const uint8_t *src,
+    size_t size, zstd_fse_entry_t *table, uint8_t *_log, size_t *_consumed)
+{
+    int16_t norm[FSE_MAX_SYMBOLS];
+    unsigned symbols, log;
+
+    *_consumed = 0;
+
+    switch (mode) {
+    case SEQ_MODE_PREDEFINED:
+        fse_build_table(desc->default_norm, desc->default_symbols, desc->default_log, table);
+        *_log = desc->default_log;
+        break;
+    case SEQ_MODE_RLE:
+        if (!size || src[0] > desc->max_symbol)
+            return false;
+
+        table[0].symbol = src[0];
+        table[0].bits = 0;
+        table[0].baseline = 0;
+        *_log = 0;
+        *_consumed = 1;
+        break;
+    case SEQ_MODE_FSE:
+        if (!fse_read_norm(src, size, desc->max_symbol, desc->max_log, norm, &symbols, &log, _consumed))
+            return false;
+
+        fse_build_table(norm, symbols, log, table);
+        *_log = log;
+        break;
+    default:
+        if (!(ctx->valid_tables & desc->valid))
+            return false;
+
+        return true;
+    }
+
+    ctx->valid_tables |= desc->valid;
+    return true;
+}
+
+/** Parse a Zstandard frame header.
+ * @param buf           Buffer containing the frame header.
+ * @param size          Size of data in the buffer.
+ * @param frame         Where to store frame information.
+ * @return              Whether the header is valid. */
+bool zstd_parse_frame_header(const uint8_t *buf, size_t size, zstd_frame_t *frame) {
+    static const uint8_t dict_id_sizes[] = { 0, 1, 2, 4 };
+    static const uint8_t content_size_sizes[] = { 0, 2, 4, 8 };
+    uint8_t descriptor;
+    size_t pos, content_size_size;
+
+    if (size < 5 || read_le(buf, 4) != ZSTD_MAGIC)
+        return false;
+
+    descriptor = buf[4];
+    pos = 5;
+
+    /* Reserved bit must be 0. */
+    if (descriptor & (1<<3))
+        return false;
+
+    frame->checksum = descriptor & (1<<2);
+
+    /* Window descriptor is present unless the single segment flag is set. */
+    if (!(descriptor & (1<<5))) {
+        uint8_t exponent, mantissa;
+        uint64_t base;
+
+        if (pos >= size)
+            return false;
+
+        exponent = buf[pos] >> 3;
+        mantissa = buf[pos] & 7;
+        pos++;
+
+        base = (uint64_t)1 << (10 + exponent);
+        frame->window_size = base + ((base / 8) * mantissa);
+    }
+
+    if (pos + dict_id_sizes[descriptor & 3] > size)
+        return false;
+
+    frame->dict_id = read_le(&buf[pos], dict_id_sizes[descriptor & 3]);
+    pos += dict_id_sizes[descriptor & 3];
+
+    content_size_size = content_size_sizes[descriptor >> 6];
+    if (!content_size_size && descriptor & (1<<5))
+        content_size_size = 1;
+
+    if (pos + content_size_size > size)
+        return false;
+
+    if (content_size_size) {
+        frame->content_size = read_le(&buf[pos], content_size_size);
+        if (content_size_size == 2)
+            frame->content_size += 256;
+
+        pos += content_size_size;
+    } else {
+        frame->content_size = ZSTD_CONTENT_SIZE_UNKNOWN;
+    }
+
+    if (descriptor & (1<<5))
+        frame->window_size = frame->content_size;
+
+    frame->header_size = pos;
+    return true;
+}
+
+/** Reset a Zstandard context for the start of a frame.
+ * @param ctx           Context to reset. */
+void zstd_reset(zstd_context_t *ctx) {
+    ctx->rep[0] = 1;
+    ctx->rep[1] = 4;
+    ctx->rep[2] = 8;
+    ctx->huf_bits = 0;
+    ctx->valid_tables = 0;
+}
+
+/**
+ * Decompress a compressed Zstandard block.
+ *
+ * Decompresses a block of type ZSTD_BLOCK_COMPRESSED. Matches are allowed to
+ * refer back to data preceding the destination, as far back as the given start
+ * of the output buffer, which must contain the previous output of the frame
+ * within the frame's window size.
+ *
+ * @param ctx           Decompression context.
+ * @param src           Block data (excluding block header).
+ * @param src_size      Size of block data.
+ * @param dest_start    Start of the output buffer.
+ * @param dest          Location in the output buffer to decompress to.
+ * @param dest_size     Space available at the destination.
+ * @param _size         Where to store decompressed size.
+ *
+ * @return              Whether the block was successfully decompressed.
+ */
+bool zstd_decompress_block(
+    zstd_context_t *ctx, const uint8_t *src, size_t src_size, uint8_t *dest_start,
+    uint8_t *dest, size_t dest_size, size_t *_size)
+{
+    const uint8_t *literals, *literals_end;
+    uint8_t *out = dest;
+    uint8_t *out_end = dest + dest_size;
+    uint32_t num_seqs;
+    size_t count, consumed;
+
+    if (!decode_literals(ctx, src, src_size, &literals, &count, &consumed))
+        return false;
+
+    literals_end = literals + count;
+    src += consumed;
+    src_size -= consumed;
+
+    /* Get the number of sequences. */
+    if (!src_size)
+        return false;
+
+    if (src[0] < 128) {
+        num_seqs = src[0];
+        consumed = 1;
+    } else if (src[0] < 255) {
+        if (src_size < 2)
+            return false;
+
+        num_seqs = ((src[0] - 128) << 8) + src[1];
+        consumed = 2;
+    } else {
+        if (src_size < 3)
+            return false;
+
+        num_seqs = src[1] + (src[2] << 8) + 0x7f00;
+        consumed = 3;
+    }
+
+    src += consumed;
+    src_size -= consumed;
+
+    if (num_seqs) {
+        bitstream_t bits;
+        uint16_t ll_state, of_state, ml_state;
+        uint8_t modes;
+
+        if (!src_size)
+            return false;
+
+        modes = src[0];
+        src++;
+        src_size--;
+
+        if (modes & 3)
+            return false;
+
+        if (!read_seq_table(ctx, &ll_desc, modes >> 6, src, src_size, ctx->ll_table, &ctx->ll_log, &consumed))
+            return false;
+
+        src += consumed;
+        src_size -= consumed;
+
+        if (!read_seq_table(ctx, &of_desc, (modes >> 4) & 3, src, src_size, ctx->of_table, &ctx->of_log, &consumed))
+            return false;
+
+        src += consumed;
+        src_size -= consumed;
+
+        if (!read_seq_table(ctx, &ml_desc, (modes >> 2) & 3, src, src_size, ctx->ml_table, &ctx->ml_log, &consumed))
+            return false;
+
+        src += consumed;
+        src_size -= consumed;
+
+        if (!bits_init(&bits, src, src_size))
+            return false;
+
+        ll_state = bits_read(&bits, ctx->ll_log);
+        of_state = bits_read(&bits, ctx->of_log);
+        ml_state = bits_read(&bits, ctx->ml_log);
+
+        for (uint32_t i = 0; i < num_seqs; i++) {
+            uint8_t ll_code = ctx->ll_table[ll_state].symbol;
+            uint8_t of_code = ctx->of_table[of_state].symbol;
+            uint8_t ml_code = ctx->ml_table[ml_state].symbol;
+            uint32_t offset, match_len, literal_len;
+            const uint8_t *match;
+
+            if (of_code > OF_MAX_SYMBOL)
+                return false;
+
+            /* Extra bits are read in the order offset, match length, literal
+             * length. */
+            offset = ((uint32_t)1 << of_code) + bits_read(&bits, of_code);
+            match_len = ml_base[ml_code] + bits_read(&bits, ml_bits[ml_code]);
+            literal_len = ll_base[ll_code] + bits_read(&bits, ll_bits[ll_code]);
+
+            /* Handle repeat offsets. */
+            if (offset > 3) {
+                offset -= 3;
+                ctx->rep[2] = ctx->rep[1];
+                ctx->rep[1] = ctx->rep[0];
+                ctx->rep[0] = offset;
+            } else {
+                unsigned idx = offset - 1 + (literal_len == 0);
+
+                if (idx == 0) {
+                    offset = ctx->rep[0];
+                } else {
+                    offset = (idx == 3) ? ctx->rep[0] - 1 : ctx->rep[idx];
+
+                    if (idx != 1)
+                        ctx->rep[2] = ctx->rep[1];
+
+                    ctx->rep[1] = ctx->rep[0];
+                    ctx->rep[0] = offset;
+                }
+            }
+
+            /* States are updated in the order literal length, match length,
+             * offset. There is no update after the last sequence. */
+            if (i + 1 < num_seqs) {
+                fse_decode(&bits, ctx->ll_table, &ll_state);
+                fse_decode(&bits, ctx->ml_table, &ml_state);
+                fse_decode(&bits, ctx->of_table, &of_state);
+            }
+
+            if (bits.pos < 0)
+                return false;
+
+            /* Execute the sequence. */
+            if (literal_len > (size_t)(literals_end - literals) || literal_len > (size_t)(out_end - out))
+                return false;
+
+            memcpy(out, literals, literal_len);
+            literals += literal_len;
+            out += literal_len;
+
+            if (!offset || offset > (size_t)(out - dest_start) || match_len > (size_t)(out_end - out))
+                return false;
+
+            match = out - offset;
+            if (offset >= match_len) {
+                memcpy(out, match, match_len);
+                out += match_len;
+            } else {
+                while (match_len--)
+                    *out++ = *match++;
+            }
+        }
+
+        if (bits.pos != 0)
+            return false;
+    }
+
+    /* Copy any remaining literals. */
+    count = literals_end - literals;
+    if (count > (size_t)(out_end - out))
+        return false;
+
+    memcpy(out, literals, count);
+    out += count;
+
+    *_size = out - dest;
+    return true;
+}
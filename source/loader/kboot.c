@@ -31,6 +31,7 @@
 #include <loader.h>
 #include <memory.h>
 #include <net.h>
+#include <time.h>
 #include <ui.h>
 #include <video.h>
 
@@ -39,6 +40,9 @@
 /** Size to use for tag list area. */
 #define KBOOT_TAGS_SIZE     16384
 
+/** Maximum number of spans to include in the boot statistics tag. */
+#define KBOOT_BOOTSTAT_SPANS_MAX    64
+
 /**
  * Helper functions.
  */
@@ -267,6 +271,15 @@ static bool check_virt_map_params(kboot_loader_t *loader, kboot_itag_load_t *loa
     return true;
 }
 
+/** Allocate memory to load a module to.
+ * @param handle        Handle to the module.
+ * @param size          Size of the module.
+ * @param _phys         Where to store physical address of allocation.
+ * @return              Virtual address of allocation. */
+static void *alloc_module(fs_handle_t *handle, size_t size, void *_phys) {
+    return memory_alloc(round_up(size, PAGE_SIZE), 0, 0, 0, MEMORY_TYPE_MODULES, MEMORY_ALLOC_HIGH, _phys);
+}
+
 /** Load kernel modules.
  * @param loader        Loader internal data. */
 static void load_modules(kboot_loader_t *loader) {
@@ -274,22 +287,19 @@ static void load_modules(kboot_loader_t *loader) {
         kboot_module_t *module = list_entry(iter, kboot_module_t, header);
         void *dest;
         phys_ptr_t phys;
-        size_t size, name_size;
+        size_t name_size;
         kboot_tag_module_t *tag;
         status_t ret;
 
-        /* Allocate a chunk of memory to load to. */
-        size = round_up(module->handle->size, PAGE_SIZE);
-        dest = memory_alloc(size, 0, 0, 0, MEMORY_TYPE_MODULES, MEMORY_ALLOC_HIGH, &phys);
+        /* Load the module straight into a chunk of memory allocated for it. */
+        ret = fs_load(module->handle, alloc_module, &phys, &dest);
+        if (ret != STATUS_SUCCESS)
+            boot_error("Error reading module '%s': %pS", module->name, ret);
 
         dprintf(
-            "kboot: loading module '%s' to 0x%" PRIxPHYS " (size: %" PRIu64 ")\n",
+            "kboot: loaded module '%s' to 0x%" PRIxPHYS " (size: %" PRIu64 ")\n",
             module->name, phys, module->handle->size);
 
-        ret = fs_read(module->handle, dest, module->handle->size, 0);
-        if (ret != STATUS_SUCCESS)
-            boot_error("Error reading module '%s': %pS", module->name, ret);
-
         name_size = strlen(module->name) + 1;
 
         tag = kboot_alloc_tag(loader, KBOOT_TAG_MODULE, round_up(sizeof(*tag), 8) + name_size);
@@ -524,7 +534,7 @@ static void add_bootdev_tag(kboot_loader_t *loader) {
         return;
     }
 
-    if (device->mount && device->mount->uuid) {
+    if (device_mount(device) && device->mount->uuid) {
         add_fs_bootdev_tag(loader, device->mount->uuid);
         return;
     }
@@ -574,10 +584,52 @@ static void add_vmem_tags(kboot_loader_t *loader) {
     }
 }
 
+/** Add boot timing statistics to the tag list.
+ * @param loader        Loader internal data. */
+static void add_bootstat_tag(kboot_loader_t *loader) {
+    const trace_total_t *totals = trace_totals();
+    const trace_span_t *spans;
+    kboot_tag_bootstat_t *tag;
+    kboot_bootstat_span_t *tag_spans;
+    size_t count, first;
+
+    /* Only pass the most recent spans, the tag list has limited space. */
+    count = trace_spans(&spans, &first);
+    if (count > KBOOT_BOOTSTAT_SPANS_MAX) {
+        first = (first + count - KBOOT_BOOTSTAT_SPANS_MAX) % TRACE_SPANS_MAX;
+        count = KBOOT_BOOTSTAT_SPANS_MAX;
+    }
+
+    tag = kboot_alloc_tag(
+        loader, KBOOT_TAG_BOOTSTAT,
+        sizeof(*tag) + (TRACE_PHASE_COUNT * sizeof(*tag->phases)) + (count * sizeof(*tag_spans)));
+
+    tag->time = timestamp_to_usecs(current_timestamp());
+    tag->num_phases = TRACE_PHASE_COUNT;
+    tag->num_spans = count;
+
+    for (size_t i = 0; i < TRACE_PHASE_COUNT; i++) {
+        tag->phases[i].time = timestamp_to_usecs(totals[i].time);
+        tag->phases[i].bytes = totals[i].bytes;
+        tag->phases[i].count = totals[i].count;
+    }
+
+    tag_spans = (kboot_bootstat_span_t *)&tag->phases[TRACE_PHASE_COUNT];
+    for (size_t i = 0; i < count; i++) {
+        const trace_span_t *span = &spans[(first + i) % TRACE_SPANS_MAX];
+
+        tag_spans[i].start = timestamp_to_usecs(span->start);
+        tag_spans[i].duration = timestamp_to_usecs(span->end - span->start);
+        tag_spans[i].bytes = span->bytes;
+        tag_spans[i].phase = span->phase;
+    }
+}
+
 /** Load a KBoot kernel.
  * @param _loader       Pointer to loader internal data. */
 static __noreturn void kboot_loader_load(void *_loader) {
     kboot_loader_t *loader = _loader;
+    uint64_t start = trace_begin();
     phys_ptr_t phys;
 
     dprintf(
@@ -652,11 +704,14 @@ static __noreturn void kboot_loader_load(void *_loader) {
         set_video_mode(loader);
     #endif
 
+    trace_end(TRACE_PHASE_LOAD, start, 0, "kboot");
+
     /* Add other information tags. All memory allocation is done at this point. */
     add_option_tags(loader);
     add_bootdev_tag(loader);
     add_memory_tags(loader);
     add_vmem_tags(loader);
+    add_bootstat_tag(loader);
 
     dprintf(
         "kboot: entry point at 0x%" PRIxLOAD ", stack at 0x%" PRIx64 "\n",
@@ -905,7 +960,7 @@ static bool add_module_list(kboot_loader_t *loader, const value_list_t *list) {
 
         module = malloc(sizeof(*module));
 
-        ret = fs_open(path, NULL, FILE_TYPE_REGULAR, FS_OPEN_DECOMPRESS, &module->handle);
+        ret = fs_open(path, NULL, FILE_TYPE_REGULAR, FS_OPEN_DECOMPRESS | FS_OPEN_SEQUENTIAL, &module->handle);
         if (ret != STATUS_SUCCESS) {
             config_error("Error opening module '%s': %pS", path, ret);
             free(module);
@@ -1002,6 +1057,7 @@ static bool config_cmd_kboot(value_list_t *args) {
     list_init(&loader->modules);
     list_init(&loader->itags);
     list_init(&loader->mappings);
+    loader->head = NULL;
     loader->path = args->values[0].string;
 
     /* Open the kernel image. */
@@ -1102,6 +1158,7 @@ err_itags:
         free(itag);
     }
 
+    free(loader->head);
     free(loader->phdrs);
     free(loader->ehdr);
 
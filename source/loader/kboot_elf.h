@@ -96,6 +96,29 @@ static void *allocate_segment(kboot_loader_t *loader, load_ptr_t virt, phys_ptr_
     return dest;
 }
 
+/** Maximum amount of image data to keep from the note search. */
+#define KBOOT_HEAD_MAX      0x100000
+
+/** Read data from the kernel image.
+ * @param loader        Loader internal data.
+ * @param buf           Buffer to read into.
+ * @param count         Number of bytes to read.
+ * @param offset        Offset in the file to read from.
+ * @return              Status code describing the result of the operation. */
+static status_t kboot_elf_read(kboot_loader_t *loader, void *buf, size_t count, offset_t offset) {
+    /* Take whatever we can from the data kept while looking for notes. */
+    if (loader->head && offset >= loader->head_offset && offset < loader->head_offset + loader->head_size) {
+        size_t size = min(count, (loader->head_offset + loader->head_size) - offset);
+
+        memcpy(buf, loader->head + (offset - loader->head_offset), size);
+        buf += size;
+        count -= size;
+        offset += size;
+    }
+
+    return fs_read(loader->handle, buf, count, offset);
+}
+
 #if CONFIG_TARGET_HAS_KBOOT32
 #   define KBOOT_LOAD_ELF32
 #   include "kboot_elfxx.h"
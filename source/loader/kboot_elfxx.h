@@ -35,6 +35,22 @@
 #   define FUNC(name)       kboot_elf32_##name
 #endif
 
+/** Compare program headers by file offset. */
+static int FUNC(compare_phdrs)(const void *a, const void *b) {
+    const kboot_elf_phdr_t *first = a;
+    const kboot_elf_phdr_t *second = b;
+
+    return (first->p_offset > second->p_offset) - (first->p_offset < second->p_offset);
+}
+
+/** Compare pointers to section headers by file offset. */
+static int FUNC(compare_shdrs)(const void *a, const void *b) {
+    const kboot_elf_shdr_t *first = *(kboot_elf_shdr_t *const *)a;
+    const kboot_elf_shdr_t *second = *(kboot_elf_shdr_t *const *)b;
+
+    return (first->sh_offset > second->sh_offset) - (first->sh_offset < second->sh_offset);
+}
+
 /** Read in program headers. */
 static status_t FUNC(identify)(kboot_loader_t *loader) {
     kboot_elf_ehdr_t *ehdr = loader->ehdr;
@@ -51,27 +67,67 @@ static status_t FUNC(identify)(kboot_loader_t *loader) {
     if (ret != STATUS_SUCCESS) {
         free(loader->phdrs);
         free(loader->ehdr);
+        return ret;
     }
 
-    return ret;
+    /* Keep the program headers in file order so that notes and segments are
+     * read in a single forward pass. Going backwards is expensive on some
+     * sources: TFTP must restart the transfer and compressed images must be
+     * decompressed again from the start. */
+    qsort(loader->phdrs, ehdr->e_phnum, sizeof(kboot_elf_phdr_t), FUNC(compare_phdrs));
+    return STATUS_SUCCESS;
 }
 
 /** Iterate over note sections in an ELF file. */
 static status_t FUNC(iterate_notes)(kboot_loader_t *loader, kboot_note_cb_t cb) {
     kboot_elf_ehdr_t *ehdr = loader->ehdr;
     kboot_elf_phdr_t *phdrs = loader->phdrs;
+    offset_t start, data, end;
+    status_t ret;
+
+    /* Find the span of the file covered by the notes, and where the segment
+     * data that we load later starts. */
+    start = end = 0;
+    data = ~(offset_t)0;
+    for (size_t i = 0; i < ehdr->e_phnum; i++) {
+        if (phdrs[i].p_type == ELF_PT_NOTE) {
+            if (!end)
+                start = phdrs[i].p_offset;
+
+            end = max(end, phdrs[i].p_offset + phdrs[i].p_filesz);
+        } else if (phdrs[i].p_type == ELF_PT_LOAD && phdrs[i].p_filesz) {
+            data = min(data, phdrs[i].p_offset);
+        }
+    }
+
+    /* Notes are usually within a segment, in which case the segment data
+     * before them would have to be read again when loading the kernel. Keep
+     * everything from the start of the segment data to the end of the notes
+     * so that the kernel can be loaded without going back in the file, if it
+     * is not too large to hold on to. */
+    if (end > data && end - min(start, data) <= KBOOT_HEAD_MAX) {
+        loader->head_offset = min(start, data);
+        loader->head_size = end - loader->head_offset;
+        loader->head = malloc(loader->head_size);
+
+        ret = fs_read(loader->handle, loader->head, loader->head_size, loader->head_offset);
+        if (ret != STATUS_SUCCESS) {
+            free(loader->head);
+            loader->head = NULL;
+            return ret;
+        }
+    }
 
     for (size_t i = 0; i < ehdr->e_phnum; i++) {
         char *buf __cleanup_free = NULL;
         size_t offset;
-        status_t ret;
 
         if (phdrs[i].p_type != ELF_PT_NOTE)
             continue;
 
         buf = malloc(phdrs[i].p_filesz);
 
-        ret = fs_read(loader->handle, buf, phdrs[i].p_filesz, phdrs[i].p_offset);
+        ret = kboot_elf_read(loader, buf, phdrs[i].p_filesz, phdrs[i].p_offset);
         if (ret != STATUS_SUCCESS)
             return ret;
 
@@ -131,7 +187,7 @@ static void FUNC(load_kernel)(kboot_loader_t *loader) {
         load_base = allocate_kernel(loader, virt_base, virt_end);
     }
 
-    /* Load in the image data. */
+    /* Load in the image data, in file order. */
     for (size_t i = 0; i < ehdr->e_phnum; i++) {
         if (phdrs[i].p_type == ELF_PT_LOAD) {
             void *dest;
@@ -148,7 +204,7 @@ static void FUNC(load_kernel)(kboot_loader_t *loader) {
             }
 
             if (phdrs[i].p_filesz) {
-                ret = fs_read(loader->handle, dest, phdrs[i].p_filesz, phdrs[i].p_offset);
+                ret = kboot_elf_read(loader, dest, phdrs[i].p_filesz, phdrs[i].p_offset);
                 if (ret != STATUS_SUCCESS)
                     boot_error("Error reading kernel image: %pS", ret);
             }
@@ -158,14 +214,22 @@ static void FUNC(load_kernel)(kboot_loader_t *loader) {
         }
     }
 
+    free(loader->head);
+    loader->head = NULL;
+
     loader->entry = ehdr->e_entry;
 }
 
 /** Load additional ELF sections. */
 static void FUNC(load_sections)(kboot_loader_t *loader) {
     kboot_elf_ehdr_t *ehdr = loader->ehdr;
+    kboot_elf_phdr_t *phdrs = loader->phdrs;
     kboot_tag_sections_t *tag;
-    size_t size;
+    kboot_elf_shdr_t **load __cleanup_free;
+    offset_t start, base, end;
+    phys_ptr_t span_phys;
+    void *span;
+    size_t size, count;
     status_t ret;
 
     size = ehdr->e_shnum * ehdr->e_shentsize;
@@ -175,12 +239,42 @@ static void FUNC(load_sections)(kboot_loader_t *loader) {
     tag->entsize = ehdr->e_shentsize;
     tag->shstrndx = ehdr->e_shstrndx;
 
-    /* Read the section headers into the tag. */
-    ret = fs_read(loader->handle, tag->sections, size, ehdr->e_shoff);
-    if (ret != STATUS_SUCCESS)
-        boot_error("Error reading kernel sections: %pS", ret);
+    /* Everything up to the end of the segment data has already been read. The
+     * sections we load and the section header table normally come after that,
+     * with the header table last. Rather than reading the header table and
+     * then going back for the sections, read everything from here to the end
+     * of the header table into one block and load sections from within it. */
+    start = ehdr->e_phoff + (ehdr->e_phnum * ehdr->e_phentsize);
+    for (size_t i = 0; i < ehdr->e_phnum; i++) {
+        if (phdrs[i].p_type == ELF_PT_LOAD || phdrs[i].p_type == ELF_PT_NOTE)
+            start = max(start, phdrs[i].p_offset + phdrs[i].p_filesz);
+    }
+
+    span = NULL;
+    span_phys = 0;
+    base = round_down(start, PAGE_SIZE);
+    end = ehdr->e_shoff + size;
+    if (size && ehdr->e_shoff >= start) {
+        span = memory_alloc(
+            round_up(end - base, PAGE_SIZE), 0, 0, 0, MEMORY_TYPE_ALLOCATED,
+            MEMORY_ALLOC_HIGH, &span_phys);
+
+        ret = fs_read(loader->handle, span + (start - base), end - start, start);
+        if (ret != STATUS_SUCCESS)
+            boot_error("Error reading kernel sections: %pS", ret);
 
-    /* Iterate through the headers and load in additional loadable sections. */
+        memcpy(tag->sections, span + (ehdr->e_shoff - base), size);
+    } else {
+        ret = fs_read(loader->handle, tag->sections, size, ehdr->e_shoff);
+        if (ret != STATUS_SUCCESS)
+            boot_error("Error reading kernel sections: %pS", ret);
+    }
+
+    load = malloc(ehdr->e_shnum * sizeof(*load));
+    count = 0;
+
+    /* Iterate through the headers and find space for additional loadable
+     * sections. */
     for (size_t i = 0; i < ehdr->e_shnum; i++) {
         kboot_elf_shdr_t *shdr = (kboot_elf_shdr_t *)&tag->sections[i * ehdr->e_shentsize];
         size_t align;
@@ -200,6 +294,20 @@ static void FUNC(load_sections)(kboot_loader_t *loader) {
             continue;
         }
 
+        /* Use the data already read if the section is within it and the
+         * address it ends up at meets the section's alignment. */
+        if (span && shdr->sh_type != ELF_SHT_NOBITS
+            && shdr->sh_offset >= start && shdr->sh_offset + shdr->sh_size <= end)
+        {
+            phys = span_phys + (shdr->sh_offset - base);
+            if (shdr->sh_addralign <= 1 || !(phys % shdr->sh_addralign)) {
+                shdr->sh_addr = phys;
+
+                dprintf("kboot: loading ELF section %zu to 0x%" PRIxPHYS " (size: %zu)\n", i, phys, (size_t)shdr->sh_size);
+                continue;
+            }
+        }
+
         /* Allocate memory to load the section data to. */
         size = round_up(shdr->sh_size, PAGE_SIZE);
         align = round_up(shdr->sh_addralign, PAGE_SIZE);
@@ -208,11 +316,25 @@ static void FUNC(load_sections)(kboot_loader_t *loader) {
 
         dprintf("kboot: loading ELF section %zu to 0x%" PRIxPHYS " (size: %zu)\n", i, phys, (size_t)shdr->sh_size);
 
-        /* Load in the section data. */
         if (shdr->sh_type == ELF_SHT_NOBITS) {
             memset(dest, 0, shdr->sh_size);
         } else {
-            ret = fs_read(loader->handle, dest, shdr->sh_size, shdr->sh_offset);
+            load[count++] = shdr;
+        }
+    }
+
+    /* Get the data for the remaining sections. Those within the block read
+     * above but not suitably aligned there are copied from it. Others are read
+     * straight into place, in file order for the same reason that the program
+     * headers are sorted, but this does still go back in the file. */
+    qsort(load, count, sizeof(*load), FUNC(compare_shdrs));
+    for (size_t i = 0; i < count; i++) {
+        void *dest = (void *)phys_to_virt(load[i]->sh_addr);
+
+        if (span && load[i]->sh_offset >= start && load[i]->sh_offset + load[i]->sh_size <= end) {
+            memcpy(dest, span + (load[i]->sh_offset - base), load[i]->sh_size);
+        } else {
+            ret = fs_read(loader->handle, dest, load[i]->sh_size, load[i]->sh_offset);
             if (ret != STATUS_SUCCESS)
                 boot_error("Error reading kernel sections: %pS", ret);
         }
@@ -85,15 +85,25 @@ static loader_ops_t linux_loader_ops = {
     #endif
 };
 
+/** Get the destination to load an initrd to.
+ * @param handle        Handle to the initrd.
+ * @param size          Size of the initrd.
+ * @param addr          Address to load to.
+ * @return              Address to load to. */
+static void *initrd_dest(fs_handle_t *handle, size_t size, void *addr) {
+    return addr;
+}
+
 /** Load Linux kernel initrd data.
  * @param loader        Loader internal data.
  * @param addr          Allocated address to load to. */
 void linux_initrd_load(linux_loader_t *loader, void *addr) {
     list_foreach(&loader->initrds, iter) {
         linux_initrd_t *initrd = list_entry(iter, linux_initrd_t, header);
+        void *dest;
         status_t ret;
 
-        ret = fs_read(initrd->handle, addr, initrd->handle->size, 0);
+        ret = fs_load(initrd->handle, initrd_dest, addr, &dest);
         if (ret != STATUS_SUCCESS)
             boot_error("Error loading initrd: %pS", ret);
 
@@ -112,7 +122,7 @@ static bool add_initrd(linux_loader_t *loader, const char *path) {
     initrd = malloc(sizeof(*initrd));
     list_init(&initrd->header);
 
-    ret = fs_open(path, NULL, FILE_TYPE_REGULAR, 0, &initrd->handle);
+    ret = fs_open(path, NULL, FILE_TYPE_REGULAR, FS_OPEN_SEQUENTIAL, &initrd->handle);
     if (ret != STATUS_SUCCESS) {
         config_error("Error opening '%s': %pS", path, ret);
         free(initrd);
@@ -28,23 +28,82 @@
 #include <config.h>
 #include <loader.h>
 #include <memory.h>
+#include <time.h>
 
-/** Structure representing an area on the heap. */
+/**
+ * Structure representing a chunk of the heap.
+ *
+ * Chunks within an arena are laid out back to back, and each records the size
+ * of the one before it so that a freed chunk can be merged with both of its
+ * neighbours without searching. The free list link is only used while a chunk
+ * is free, and overlaps the data of an allocated chunk.
+ */
 typedef struct heap_chunk {
-    list_t header;                  /**< Link to chunk list. */
-    size_t size;                    /**< Size of chunk including struct. */
-    union {
-        bool allocated;             /**< Whether the chunk is allocated. */
-        void *addr;                 /**< Base address (for large allocations). */
-    };
+    size_t prev_size;               /**< Size of previous chunk (0 if first in arena). */
+    size_t size;                    /**< Size of chunk including header, plus flags. */
+    list_t header;                  /**< Link to free list. */
 } heap_chunk_t;
 
-/** Size of the heap (128KB). */
-#define HEAP_SIZE       131072
+/** Alignment of all heap allocations. */
+#define HEAP_ALIGN          8
+
+/** Heap chunk flags (stored in the low bits of the size). */
+#define HEAP_CHUNK_USED     (1<<0)  /**< Chunk is allocated. */
+#define HEAP_CHUNK_LARGE    (1<<1)  /**< Chunk was allocated directly from memory_alloc(). */
+#define HEAP_CHUNK_FLAGS    (HEAP_ALIGN - 1)
+
+/** Size of a chunk header preceding allocated data. */
+#define HEAP_HEADER_SIZE    offsetof(heap_chunk_t, header)
+
+/** Minimum size of a chunk (must be able to hold the free list link). */
+#define HEAP_MIN_CHUNK      sizeof(heap_chunk_t)
+
+/** Size of the initial, statically allocated heap arena (128KB). */
+#define HEAP_SIZE           131072
+
+/** Minimum size of additional heap arenas. */
+#define HEAP_GROW_SIZE      131072
+
+/** Heap space held back for memory_alloc() to use while growing the heap. */
+#define HEAP_RESERVE_SIZE   16384
+
+/** Chunks of at least this size are allocated directly from memory_alloc(). */
+#define HEAP_LARGE_SIZE     65536
+
+/** Largest chunk size with an exact size free list. */
+#define HEAP_SMALL_MAX      1024
+
+/** Number of free lists for chunks larger than HEAP_SMALL_MAX. */
+#define HEAP_LARGE_BINS     8
+
+/** Total number of free lists. */
+#define HEAP_BIN_COUNT      ((HEAP_SMALL_MAX / HEAP_ALIGN) + 1 + HEAP_LARGE_BINS)
+
+/** Bitmap of non-empty free lists. */
+#define HEAP_BITMAP_BITS    (sizeof(unsigned long) * 8)
+#define HEAP_BITMAP_COUNT   ((HEAP_BIN_COUNT + HEAP_BITMAP_BITS - 1) / HEAP_BITMAP_BITS)
+
+/** Structure tracking an allocation made by malloc_large(). */
+typedef struct large_chunk {
+    list_t header;                  /**< Link to chunk list. */
+    size_t size;                    /**< Size of the allocation. */
+    void *addr;                     /**< Base address. */
+} large_chunk_t;
 
-/** Statically allocated heap. */
+/** Statically allocated initial heap arena. */
 static uint8_t heap[HEAP_SIZE] __aligned(PAGE_SIZE);
-static LIST_DECLARE(heap_chunks);
+
+/** Heap free lists. */
+static list_t heap_bins[HEAP_BIN_COUNT];
+static unsigned long heap_bitmap[HEAP_BITMAP_COUNT];
+
+/** Heap statistics. */
+static size_t heap_arena_count;
+static size_t heap_arena_size;
+static size_t heap_used;
+static size_t heap_peak;
+static bool heap_growing;
+static heap_chunk_t *heap_reserve;
 
 /** Large allocations. */
 static LIST_DECLARE(large_chunks);
@@ -58,66 +117,256 @@ static LIST_DECLARE(memory_ranges);
 
 /**
  * Heap allocator.
+ *
+ * The heap is made up of one or more arenas: the first is statically
+ * allocated so that the heap is usable before the memory manager is, and
+ * further arenas are allocated with memory_alloc() when the heap runs out of
+ * space. memory_alloc() needs heap space for its own bookkeeping, so a reserve
+ * chunk is held back and released for it to use while growing.
+ *
+ * Free chunks are kept on segregated free lists. Small sizes each have an
+ * exact size list, so that an allocation can take the first chunk from the
+ * first non-empty list that is large enough, found via a bitmap. Larger sizes
+ * are grouped into power of 2 ranges. Freed chunks are merged with free
+ * neighbours straight away. Allocations too large to sensibly come from an
+ * arena are made directly from memory_alloc().
  */
 
+/** Get the size of a heap chunk.
+ * @param chunk         Chunk to get size of.
+ * @return              Size of the chunk including its header. */
+static inline size_t heap_chunk_size(heap_chunk_t *chunk) {
+    return chunk->size & ~(size_t)HEAP_CHUNK_FLAGS;
+}
+
+/** Get the chunk following a heap chunk.
+ * @param chunk         Chunk to get following chunk of.
+ * @return              Following chunk. */
+static inline heap_chunk_t *heap_chunk_next(heap_chunk_t *chunk) {
+    return (heap_chunk_t *)((char *)chunk + heap_chunk_size(chunk));
+}
+
+/** Get the free list index for a chunk size.
+ * @param size          Size of the chunk.
+ * @return              Free list index. */
+static inline size_t heap_bin_index(size_t size) {
+    if (size <= HEAP_SMALL_MAX)
+        return size / HEAP_ALIGN;
+
+    return (HEAP_SMALL_MAX / HEAP_ALIGN) + 1 +
+        min(fls(size - 1) - fls(HEAP_SMALL_MAX), (unsigned long)HEAP_LARGE_BINS - 1);
+}
+
+/** Add a chunk to the heap free lists.
+ * @param chunk         Chunk to add. */
+static void heap_insert(heap_chunk_t *chunk) {
+    size_t index = heap_bin_index(heap_chunk_size(chunk));
+
+    list_init(&chunk->header);
+    list_prepend(&heap_bins[index], &chunk->header);
+    heap_bitmap[index / HEAP_BITMAP_BITS] |= 1ul << (index % HEAP_BITMAP_BITS);
+}
+
+/** Remove a chunk from the heap free lists.
+ * @param chunk         Chunk to remove. */
+static void heap_remove(heap_chunk_t *chunk) {
+    size_t index = heap_bin_index(heap_chunk_size(chunk));
+
+    list_remove(&chunk->header);
+    if (list_empty(&heap_bins[index]))
+        heap_bitmap[index / HEAP_BITMAP_BITS] &= ~(1ul << (index % HEAP_BITMAP_BITS));
+}
+
+/** Find a free chunk of at least the given size.
+ * @param size          Required chunk size.
+ * @return              Free chunk, or NULL if none large enough. */
+static heap_chunk_t *heap_find(size_t size) {
+    size_t index = heap_bin_index(size);
+
+    /* Small lists only contain chunks of exactly their size, so we can take
+     * the first chunk from any non-empty list from here on. Larger lists hold
+     * a range of sizes, so must be searched. */
+    if (index > HEAP_SMALL_MAX / HEAP_ALIGN) {
+        list_foreach(&heap_bins[index], iter) {
+            heap_chunk_t *chunk = list_entry(iter, heap_chunk_t, header);
+
+            if (heap_chunk_size(chunk) >= size)
+                return chunk;
+        }
+
+        index++;
+    }
+
+    for (size_t i = index / HEAP_BITMAP_BITS; i < HEAP_BITMAP_COUNT; i++) {
+        unsigned long bits = heap_bitmap[i];
+
+        if (i == index / HEAP_BITMAP_BITS)
+            bits &= ~0ul << (index % HEAP_BITMAP_BITS);
+
+        if (bits) {
+            index = (i * HEAP_BITMAP_BITS) + ffs(bits) - 1;
+            return list_first(&heap_bins[index], heap_chunk_t, header);
+        }
+    }
+
+    return NULL;
+}
+
+/** Add an arena to the heap.
+ * @param base          Base of the arena.
+ * @param size          Size of the arena. */
+static void heap_add_arena(void *base, size_t size) {
+    heap_chunk_t *chunk = base;
+    heap_chunk_t *fence;
+
+    heap_arena_count++;
+    heap_arena_size += size;
+
+    /* Place a permanently allocated header at the end of the arena so that
+     * merging never goes past it. */
+    size -= HEAP_HEADER_SIZE;
+    fence = (heap_chunk_t *)((char *)base + size);
+    fence->prev_size = size;
+    fence->size = HEAP_CHUNK_USED;
+
+    chunk->prev_size = 0;
+    chunk->size = size;
+    heap_insert(chunk);
+}
+
+/** Take a free chunk from the heap free lists.
+ * @param size          Required chunk size.
+ * @return              Allocated chunk, or NULL if none large enough. */
+static heap_chunk_t *heap_take(size_t size) {
+    heap_chunk_t *chunk;
+
+    chunk = heap_find(size);
+    if (!chunk)
+        return NULL;
+
+    heap_remove(chunk);
+
+    /* Split off the remainder if it is big enough to be a chunk. */
+    if (heap_chunk_size(chunk) - size >= HEAP_MIN_CHUNK) {
+        heap_chunk_t *split = (heap_chunk_t *)((char *)chunk + size);
+
+        split->prev_size = size;
+        split->size = heap_chunk_size(chunk) - size;
+        heap_chunk_next(split)->prev_size = split->size;
+        chunk->size = size;
+
+        heap_insert(split);
+    }
+
+    chunk->size |= HEAP_CHUNK_USED;
+    return chunk;
+}
+
+/** Return a chunk to the heap free lists, merging it with free neighbours.
+ * @param chunk         Chunk to return. */
+static void heap_release(heap_chunk_t *chunk) {
+    heap_chunk_t *adj;
+    size_t size;
+
+    size = heap_chunk_size(chunk);
+
+    adj = heap_chunk_next(chunk);
+    if (!(adj->size & HEAP_CHUNK_USED)) {
+        heap_remove(adj);
+        size += heap_chunk_size(adj);
+    }
+
+    if (chunk->prev_size) {
+        adj = (heap_chunk_t *)((char *)chunk - chunk->prev_size);
+        if (!(adj->size & HEAP_CHUNK_USED)) {
+            heap_remove(adj);
+            size += heap_chunk_size(adj);
+            chunk = adj;
+        }
+    }
+
+    chunk->size = size;
+    heap_chunk_next(chunk)->prev_size = size;
+    heap_insert(chunk);
+}
+
+/** Initialize the heap. */
+static void heap_init(void) {
+    for (size_t i = 0; i < HEAP_BIN_COUNT; i++)
+        list_init(&heap_bins[i]);
+
+    heap_add_arena(heap, HEAP_SIZE);
+    heap_reserve = heap_take(HEAP_RESERVE_SIZE);
+}
+
+/** Add a new arena to the heap.
+ * @param size          Size of chunk that the arena must fit. */
+static void heap_grow(size_t size) {
+    void *base;
+
+    /* memory_alloc() itself uses the heap, which is full. Give it the reserve
+     * to use, so that it does not need to grow the heap itself. If that isn't
+     * enough, we really are out of space. */
+    if (heap_growing)
+        internal_error("Exhausted heap space (want %zu bytes)", size);
+
+    size = round_up(max(size + HEAP_HEADER_SIZE + HEAP_RESERVE_SIZE, HEAP_GROW_SIZE), PAGE_SIZE);
+
+    heap_release(heap_reserve);
+    heap_reserve = NULL;
+
+    heap_growing = true;
+    base = memory_alloc(size, 0, 0, 0, MEMORY_TYPE_INTERNAL, MEMORY_ALLOC_HIGH, NULL);
+    heap_growing = false;
+
+    heap_add_arena(base, size);
+
+    /* Set aside a new reserve. The new arena has space for it. */
+    heap_reserve = heap_take(HEAP_RESERVE_SIZE);
+}
+
 /**
  * Allocate memory from the heap.
  *
  * Allocates temporary memory from the heap. This memory will never reach the
- * kernel. This should only be used for smaller allocations as it allocates
- * from a small, fixed-size heap. An internal error will be raised if the heap
- * is full. For large allocations use memory_alloc_internal().
+ * kernel. The heap grows as needed, so this can be used for allocations of any
+ * size, although for large buffers that do not need to be resized,
+ * malloc_large() should be preferred.
  *
  * @param size          Size of allocation to make.
  *
  * @return              Address of allocation.
  */
 void *malloc(size_t size) {
-    heap_chunk_t *chunk = NULL, *new;
+    heap_chunk_t *chunk;
     size_t total;
 
     if (size == 0)
         internal_error("Zero-sized allocation!");
 
-    /* Align all allocations to 8 bytes. */
-    size = round_up(size, 8);
-    total = size + sizeof(heap_chunk_t);
-
-    /* Create the initial free segment if necessary. */
-    if (list_empty(&heap_chunks)) {
-        chunk = (heap_chunk_t *)heap;
-        chunk->size = HEAP_SIZE;
-        chunk->allocated = false;
-        list_init(&chunk->header);
-        list_append(&heap_chunks, &chunk->header);
+    if (!heap_arena_count)
+        heap_init();
+
+    total = max(round_up(size, HEAP_ALIGN) + HEAP_HEADER_SIZE, HEAP_MIN_CHUNK);
+
+    if (total >= HEAP_LARGE_SIZE) {
+        total = round_up(total, PAGE_SIZE);
+
+        chunk = memory_alloc(total, 0, 0, 0, MEMORY_TYPE_INTERNAL, MEMORY_ALLOC_HIGH, NULL);
+        chunk->prev_size = 0;
+        chunk->size = total | HEAP_CHUNK_USED | HEAP_CHUNK_LARGE;
     } else {
-        /* Search for a free chunk. */
-        list_foreach(&heap_chunks, iter) {
-            chunk = list_entry(iter, heap_chunk_t, header);
-            if (!chunk->allocated && chunk->size >= total) {
-                break;
-            } else {
-                chunk = NULL;
-            }
+        chunk = heap_take(total);
+        if (!chunk) {
+            heap_grow(total);
+            chunk = heap_take(total);
         }
-
-        if (!chunk)
-            internal_error("Exhausted heap space (want %zu bytes)", size);
     }
 
-    /* Resize the segment if it is too big. There must be space for a second
-     * chunk header afterwards. */
-    if (chunk->size >= (total + sizeof(heap_chunk_t))) {
-        new = (heap_chunk_t *)((char *)chunk + total);
-        new->size = chunk->size - total;
-        new->allocated = false;
-        list_init(&new->header);
-        list_add_after(&chunk->header, &new->header);
-        chunk->size = total;
-    }
+    heap_used += heap_chunk_size(chunk);
+    heap_peak = max(heap_peak, heap_used);
 
-    chunk->allocated = true;
-    return ((char *)chunk + sizeof(heap_chunk_t));
+    return (char *)chunk + HEAP_HEADER_SIZE;
 }
 
 /** Resize a memory allocation.
@@ -125,80 +374,69 @@ void *malloc(size_t size) {
  * @param size          New size of allocation.
  * @return              Address of new allocation, or NULL if size is 0. */
 void *realloc(void *addr, size_t size) {
-    heap_chunk_t *chunk = NULL;
+    size_t current = 0;
     void *new;
 
     if (size == 0) {
         free(addr);
         return NULL;
-    } else {
-        size = round_up(size, 8);
+    }
 
-        if (addr) {
-            chunk = (heap_chunk_t *)((char *)addr - sizeof(heap_chunk_t));
-            if (chunk->size - sizeof(heap_chunk_t) == size)
-                return addr;
-        }
+    if (addr) {
+        heap_chunk_t *chunk = (heap_chunk_t *)((char *)addr - HEAP_HEADER_SIZE);
 
-        new = malloc(size);
+        current = heap_chunk_size(chunk) - HEAP_HEADER_SIZE;
+        if (size <= current)
+            return addr;
+    }
 
-        if (addr) {
-            memcpy(new, addr, min(chunk->size - sizeof(heap_chunk_t), size));
-            free(addr);
-        }
+    new = malloc(size);
 
-        return new;
+    if (addr) {
+        memcpy(new, addr, current);
+        free(addr);
     }
+
+    return new;
 }
 
 /** Free memory allocated with free().
  * @param addr          Address of allocation. */
 void free(void *addr) {
-    heap_chunk_t *chunk, *adj;
+    heap_chunk_t *chunk;
+    size_t size;
 
     if (!addr)
         return;
 
-    /* Get the chunk and free it. */
-    chunk = (heap_chunk_t *)((char *)addr - sizeof(heap_chunk_t));
-    if (!chunk->allocated)
+    chunk = (heap_chunk_t *)((char *)addr - HEAP_HEADER_SIZE);
+    if (!(chunk->size & HEAP_CHUNK_USED))
         internal_error("Double free on address %p", addr);
-    chunk->allocated = false;
-
-    /* Coalesce adjacent free segments. */
-    if (chunk != list_last(&heap_chunks, heap_chunk_t, header)) {
-        adj = list_next(chunk, header);
-        if (!adj->allocated) {
-            assert(adj == (heap_chunk_t *)((char *)chunk + chunk->size));
-            chunk->size += adj->size;
-            list_remove(&adj->header);
-        }
-    }
-    if (chunk != list_first(&heap_chunks, heap_chunk_t, header)) {
-        adj = list_prev(chunk, header);
-        if (!adj->allocated) {
-            assert(chunk == (heap_chunk_t *)((char *)adj + adj->size));
-            adj->size += chunk->size;
-            list_remove(&chunk->header);
-        }
+
+    size = heap_chunk_size(chunk);
+    heap_used -= size;
+
+    if (chunk->size & HEAP_CHUNK_LARGE) {
+        memory_free(chunk, size);
+        return;
     }
-}
 
+    heap_release(chunk);
+}
 
 /**
  * Allocate a large chunk of memory.
  *
- * Allocates a large chunk of memory via memory_alloc() rather than the fixed-
- * size internal heap. The allocation size will be rounded up to the nearest
- * page size boundary. Memory allocated through this function must be freed with
- * free_large().
+ * Allocates a large chunk of memory via memory_alloc() rather than the heap.
+ * The allocation size will be rounded up to the nearest page size boundary.
+ * Memory allocated through this function must be freed with free_large().
  *
  * @param size          Size to allocate.
  */
 void *malloc_large(size_t size) {
-    heap_chunk_t *chunk;
+    large_chunk_t *chunk;
 
-    chunk = malloc(sizeof(heap_chunk_t));
+    chunk = malloc(sizeof(*chunk));
     chunk->size = round_up(size, PAGE_SIZE);
     chunk->addr = memory_alloc(chunk->size, 0, 0, 0, MEMORY_TYPE_INTERNAL, MEMORY_ALLOC_HIGH, NULL);
 
@@ -215,7 +453,7 @@ void free_large(void *addr) {
         return;
 
     list_foreach(&large_chunks, iter) {
-        heap_chunk_t *chunk = list_entry(iter, heap_chunk_t, header);
+        large_chunk_t *chunk = list_entry(iter, large_chunk_t, header);
 
         if (chunk->addr == addr) {
             memory_free(addr, chunk->size);
@@ -264,20 +502,32 @@ static inline void merge_ranges(list_t *maps, memory_range_t *range) {
     }
 }
 
-/** Add a range of physical memory.
+/**
+ * Add a range of physical memory using preallocated structures.
+ *
+ * Adds a range to a memory map, using range structures that have already been
+ * allocated. This allows the caller to allocate them before examining the map,
+ * since allocating can cause the heap to grow, which changes the map.
+ *
  * @param map           Memory map to add to.
  * @param start         Start of the range (must be page-aligned).
  * @param size          Size of the range (must be page-aligned).
- * @param type          Type of the range. */
-void memory_map_insert(list_t *map, phys_ptr_t start, phys_size_t size, uint8_t type) {
-    memory_range_t *range, *other, *split;
+ * @param type          Type of the range.
+ * @param range         Structure for the new range.
+ * @param split         Structure for the second half of a range that must be
+ *                      split, freed if not needed.
+ */
+static void insert_range(
+    list_t *map, phys_ptr_t start, phys_size_t size, uint8_t type,
+    memory_range_t *range, memory_range_t *split)
+{
+    memory_range_t *other;
     phys_ptr_t range_end, other_end;
 
     assert(!(start % PAGE_SIZE));
     assert(!(size % PAGE_SIZE));
     assert(size);
 
-    range = malloc(sizeof(*range));
     list_init(&range->header);
     range->start = start;
     range->size = size;
@@ -306,12 +556,12 @@ void memory_map_insert(list_t *map, phys_ptr_t start, phys_size_t size, uint8_t
         if (range->start <= other_end) {
             if (other_end > range_end) {
                 /* Must split the range. */
-                split = malloc(sizeof(*split));
                 list_init(&split->header);
                 split->start = range_end + 1;
                 split->size = other_end - range_end;
                 split->type = other->type;
                 list_add_after(&range->header, &split->header);
+                split = NULL;
             }
 
             other->size = range->start - other->start;
@@ -340,10 +590,24 @@ void memory_map_insert(list_t *map, phys_ptr_t start, phys_size_t size, uint8_t
         }
     }
 
+    free(split);
+
     /* Finally, merge the region with adjacent ranges of the same type. */
     merge_ranges(map, range);
 }
 
+/** Add a range of physical memory.
+ * @param map           Memory map to add to.
+ * @param start         Start of the range (must be page-aligned).
+ * @param size          Size of the range (must be page-aligned).
+ * @param type          Type of the range. */
+void memory_map_insert(list_t *map, phys_ptr_t start, phys_size_t size, uint8_t type) {
+    memory_range_t *range = malloc(sizeof(*range));
+    memory_range_t *split = malloc(sizeof(*split));
+
+    insert_range(map, start, size, type, range, split);
+}
+
 /** Print a memory map.
  * @param map           Memory map to print.
  * @param func          Print function to use.
@@ -469,6 +733,7 @@ void *memory_alloc(
     phys_size_t size, phys_size_t align, phys_ptr_t min_addr, phys_ptr_t max_addr,
     uint8_t type, unsigned flags, phys_ptr_t *_phys)
 {
+    memory_range_t *entry, *split;
     list_t *iter;
 
     assert(!(size % PAGE_SIZE));
@@ -487,6 +752,12 @@ void *memory_alloc(
 
     assert((max_addr - min_addr) >= (size - 1));
 
+    /* Allocate the structures for updating the memory map now. Doing so can
+     * grow the heap, which allocates memory itself, so the free range we pick
+     * must not be chosen until afterwards. */
+    entry = malloc(sizeof(*entry));
+    split = malloc(sizeof(*split));
+
     /* Find a free range that is large enough to hold the new range. */
     iter = (flags & MEMORY_ALLOC_HIGH) ? memory_ranges.prev : memory_ranges.next;
     while (iter != &memory_ranges) {
@@ -495,7 +766,7 @@ void *memory_alloc(
 
         if (is_suitable_range(range, size, align, min_addr, max_addr, flags, &start)) {
             /* Insert a new range over the top of the allocation. */
-            memory_map_insert(&memory_ranges, start, size, type);
+            insert_range(&memory_ranges, start, size, type, entry, split);
 
             dprintf(
                 "memory: allocated 0x%" PRIxPHYS "-0x%" PRIxPHYS " (align: 0x%" PRIxPHYS ", type: %u)\n",
@@ -510,6 +781,9 @@ void *memory_alloc(
         iter = (flags & MEMORY_ALLOC_HIGH) ? range->header.prev : range->header.next;
     }
 
+    free(entry);
+    free(split);
+
     if (flags & MEMORY_ALLOC_CAN_FAIL) {
         return NULL;
     } else {
@@ -627,6 +901,8 @@ void memory_snapshot(list_t *map) {
  * @param map           Head of list to place the memory map into.
  */
 void memory_finalize(list_t *map) {
+    uint64_t start = trace_begin();
+
     /* Reclaim all internal memory ranges. */
     list_foreach(&memory_ranges, iter) {
         memory_range_t *range = list_entry(iter, memory_range_t, header);
@@ -639,6 +915,8 @@ void memory_finalize(list_t *map) {
 
     list_init(map);
     list_splice_before(map, &memory_ranges);
+
+    trace_end(TRACE_PHASE_MEMORY, start, 0, NULL);
 }
 
 #endif /* TARGET_HAS_MM */
@@ -661,6 +939,11 @@ static bool config_cmd_lsmemory(value_list_t *args) {
     memory_snapshot(&map);
     print_memory_map(&map, printf, 0);
     memory_map_free(&map);
+
+    printf(
+        "\nHeap: %zu KiB used (peak %zu KiB), %zu KiB in %zu arena(s)\n",
+        heap_used / 1024, heap_peak / 1024, heap_arena_size / 1024, heap_arena_count);
+
     return true;
 }
 
@@ -17,17 +17,222 @@
 /**
  * @file
  * @brief               Network device support.
+ *
+ * Network filesystems have no way to keep data around between opens, so every
+ * open of a file transfers it again. To avoid this when the same files are
+ * opened repeatedly (e.g. reloading the configuration, or the Linux loader
+ * checking and then loading a kernel), we keep a cache of network files here
+ * which network filesystem implementations use. Files up to a threshold size
+ * are cached whole, and for larger files we cache the head and tail, which is
+ * where headers that get re-read live. The cache is bounded in size, and the
+ * least recently used unreferenced entries are evicted to make space.
  */
 
 #include <lib/string.h>
+#include <lib/utility.h>
 
+#include <assert.h>
+#include <config.h>
 #include <loader.h>
 #include <memory.h>
 #include <net.h>
 
+/** Maximum amount of data held by the network file cache. */
+#define NET_CACHE_MAX_SIZE      (8 * 1024 * 1024)
+
+/** Maximum number of entries in the network file cache. */
+#define NET_CACHE_MAX_ENTRIES   64
+
+/** Files up to this size are cached whole. */
+#define NET_CACHE_WHOLE_SIZE    (1024 * 1024)
+
+/** Size of the head and tail chunks cached for larger files. */
+#define NET_CACHE_CHUNK_SIZE    (64 * 1024)
+
+/** Network file cache state. */
+static LIST_DECLARE(net_cache_lru);
+static size_t net_cache_used;
+static size_t net_cache_entries;
+
 /** Next network device ID. */
 static unsigned next_net_id;
 
+/** Free a network file cache entry.
+ * @param entry         Entry to free (must be unreferenced). */
+static void net_cache_free(net_cache_entry_t *entry) {
+    for (size_t i = 0; i < array_size(entry->chunks); i++) {
+        if (entry->chunks[i].data) {
+            free_large(entry->chunks[i].data);
+            net_cache_used -= entry->chunks[i].size;
+        }
+    }
+
+    list_remove(&entry->header);
+    net_cache_entries--;
+
+    free(entry->path);
+    free(entry);
+}
+
+/** Evict unreferenced entries from the network file cache.
+ * @param size          Amount of data that needs to fit.
+ * @param entries       Number of entries that need to fit.
+ * @return              Whether enough space could be freed. */
+static bool net_cache_evict(size_t size, size_t entries) {
+    list_t *iter = net_cache_lru.prev;
+
+    while (net_cache_used + size > NET_CACHE_MAX_SIZE || net_cache_entries + entries > NET_CACHE_MAX_ENTRIES) {
+        net_cache_entry_t *entry;
+
+        if (iter == &net_cache_lru)
+            return false;
+
+        entry = list_entry(iter, net_cache_entry_t, header);
+        iter = iter->prev;
+
+        if (!entry->count)
+            net_cache_free(entry);
+    }
+
+    return true;
+}
+
+/**
+ * Look up a file in the network file cache.
+ *
+ * Looks up a file in the network file cache. If found, the entry is referenced
+ * and must be released with net_cache_release() once no longer needed. The
+ * size of the file is available from the entry, but not all of its data may
+ * be cached.
+ *
+ * @param net           Device the file is on.
+ * @param path          Path to the file.
+ *
+ * @return              Cache entry, or NULL if not found.
+ */
+net_cache_entry_t *net_cache_lookup(net_device_t *net, const char *path) {
+    list_foreach(&net_cache_lru, iter) {
+        net_cache_entry_t *entry = list_entry(iter, net_cache_entry_t, header);
+
+        if (entry->net == net && strcmp(entry->path, path) == 0) {
+            list_remove(&entry->header);
+            list_prepend(&net_cache_lru, &entry->header);
+            entry->count++;
+            return entry;
+        }
+    }
+
+    return NULL;
+}
+
+/**
+ * Add a file to the network file cache.
+ *
+ * Adds an entry for a file to the network file cache. Data from the file
+ * should be passed to net_cache_store() as it is read. The entry is referenced
+ * and must be released with net_cache_release() once no longer needed.
+ *
+ * @param net           Device the file is on.
+ * @param path          Path to the file.
+ * @param size          Size of the file.
+ *
+ * @return              Cache entry.
+ */
+net_cache_entry_t *net_cache_insert(net_device_t *net, const char *path, offset_t size) {
+    net_cache_entry_t *entry;
+
+    net_cache_evict(0, 1);
+
+    entry = malloc(sizeof(*entry));
+    memset(entry, 0, sizeof(*entry));
+    entry->net = net;
+    entry->path = strdup(path);
+    entry->size = size;
+    entry->count = 1;
+
+    if (size <= NET_CACHE_WHOLE_SIZE) {
+        entry->chunks[0].size = size;
+    } else {
+        entry->chunks[0].size = NET_CACHE_CHUNK_SIZE;
+        entry->chunks[1].start = size - NET_CACHE_CHUNK_SIZE;
+        entry->chunks[1].size = NET_CACHE_CHUNK_SIZE;
+    }
+
+    list_prepend(&net_cache_lru, &entry->header);
+    net_cache_entries++;
+    return entry;
+}
+
+/** Release a network file cache entry.
+ * @param entry         Entry to release (can be NULL). */
+void net_cache_release(net_cache_entry_t *entry) {
+    if (entry) {
+        assert(entry->count);
+        entry->count--;
+    }
+}
+
+/** Read data from the network file cache.
+ * @param entry         Entry for the file (can be NULL).
+ * @param buf           Buffer to read into.
+ * @param count         Number of bytes to read.
+ * @param offset        Offset to read from.
+ * @return              Whether the whole range was cached and has been read. */
+bool net_cache_read(net_cache_entry_t *entry, void *buf, size_t count, offset_t offset) {
+    if (!entry)
+        return false;
+
+    for (size_t i = 0; i < array_size(entry->chunks); i++) {
+        net_cache_chunk_t *chunk = &entry->chunks[i];
+
+        if (offset >= chunk->start && offset + count <= chunk->start + chunk->valid) {
+            memcpy(buf, chunk->data + (offset - chunk->start), count);
+            entry->hits++;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+/**
+ * Store data in the network file cache.
+ *
+ * Stores data read from a file in the network file cache. Each chunk of the
+ * file is only filled contiguously from its start, which matches how network
+ * files are normally read. Data that does not continue on from what a chunk
+ * already has is ignored.
+ *
+ * @param entry         Entry for the file (can be NULL).
+ * @param buf           Data that was read.
+ * @param count         Number of bytes read.
+ * @param offset        Offset the data was read from.
+ */
+void net_cache_store(net_cache_entry_t *entry, const void *buf, size_t count, offset_t offset) {
+    if (!entry)
+        return;
+
+    for (size_t i = 0; i < array_size(entry->chunks); i++) {
+        net_cache_chunk_t *chunk = &entry->chunks[i];
+        offset_t start = chunk->start + chunk->valid;
+        offset_t end = min(offset + count, chunk->start + chunk->size);
+
+        if (offset > start || end <= start)
+            continue;
+
+        if (!chunk->data) {
+            if (!net_cache_evict(chunk->size, 0))
+                continue;
+
+            chunk->data = malloc_large(chunk->size);
+            net_cache_used += chunk->size;
+        }
+
+        memcpy(chunk->data + chunk->valid, buf + (start - offset), end - start);
+        chunk->valid += end - start;
+    }
+}
+
 /** Get network device identification information.
  * @param device        Device to identify.
  * @param type          Type of the information to get.
@@ -121,3 +326,34 @@ void net_device_register_with_bootp(net_device_t *net, bootp_packet_t *packet, b
     dprintf(" server IP:  %pI4\n", &net->server_ip.v4);
     dprintf(" client MAC: %pM\n", net->hw_addr);
 }
+
+/**
+ * Configuration commands.
+ */
+
+/** List the contents of the network file cache.
+ * @param args          Argument list.
+ * @return              Whether successful. */
+static bool config_cmd_lscache(value_list_t *args) {
+    if (args->count != 0) {
+        config_error("Invalid arguments");
+        return false;
+    }
+
+    printf(
+        "%zu entries, %zu KiB / %u KiB used\n",
+        net_cache_entries, net_cache_used / 1024, NET_CACHE_MAX_SIZE / 1024);
+
+    list_foreach(&net_cache_lru, iter) {
+        net_cache_entry_t *entry = list_entry(iter, net_cache_entry_t, header);
+        size_t cached = entry->chunks[0].valid + entry->chunks[1].valid;
+
+        printf(
+            "%-6s %10" PRIu64 " %10zu %5u  %s\n",
+            entry->net->device.name, entry->size, cached, entry->hits, entry->path);
+    }
+
+    return true;
+}
+
+BUILTIN_COMMAND("lscache", "List the contents of the network file cache", config_cmd_lscache);
@@ -20,6 +20,7 @@
  */
 
 #include <lib/string.h>
+#include <lib/utility.h>
 
 #include <partition/gpt.h>
 #include <partition/mbr.h>
@@ -32,16 +33,55 @@
 /** Zero GUID (for easy comparison). */
 static gpt_guid_t zero_guid;
 
+/** Partition type GUIDs for partitions which do not contain a filesystem. */
+static const gpt_guid_t no_fs_type_guids[] = {
+    /* Linux swap. */
+    { 0x0657fd6d, 0xa4ab, 0x43c4, 0x84, 0xe5, 0x09, 0x33, 0xc8, 0x4b, 0x4f, 0x4f },
+
+    /* Linux LVM physical volume. */
+    { 0xe6d6d379, 0xf507, 0x44c2, 0xa2, 0x3c, 0x23, 0x8f, 0x2a, 0x3d, 0xf9, 0x28 },
+
+    /* BIOS boot partition. */
+    { 0x21686148, 0x6449, 0x6e6f, 0x74, 0x4e, 0x65, 0x65, 0x64, 0x45, 0x46, 0x49 },
+
+    /* Microsoft reserved partition. */
+    { 0xe3c9e316, 0x0b5c, 0x4db8, 0x81, 0x7d, 0xf9, 0x2d, 0xf0, 0x02, 0x15, 0xae },
+
+    /* Windows LDM metadata partition. */
+    { 0x5808c8aa, 0x7e8f, 0x42e0, 0x85, 0xd2, 0xe1, 0xe9, 0x04, 0x34, 0xcf, 0xb3 },
+};
+
+/** Check whether a partition's type indicates that it has no filesystem.
+ * @param entry         Partition entry.
+ * @return              Whether the partition has no filesystem. */
+static bool is_no_fs(gpt_partition_entry_t *entry) {
+    for (size_t i = 0; i < array_size(no_fs_type_guids); i++) {
+        const gpt_guid_t *guid = &no_fs_type_guids[i];
+
+        if (le32_to_cpu(entry->type_guid.data1) == guid->data1 &&
+            le16_to_cpu(entry->type_guid.data2) == guid->data2 &&
+            le16_to_cpu(entry->type_guid.data3) == guid->data3 &&
+            memcmp(&entry->type_guid.data4, &guid->data4, 8) == 0)
+        {
+            return true;
+        }
+    }
+
+    return false;
+}
+
 /** Iterate over the partitions on a device.
  * @param disk          Disk to iterate over.
  * @param cb            Callback function.
  * @return              Whether the device contained a GPT partition table. */
 static bool gpt_partition_iterate(disk_device_t *disk, partition_iterate_cb_t cb) {
     void *buf __cleanup_free = NULL;
+    void *entries __cleanup_free_large = NULL;
     mbr_t *mbr;
     gpt_header_t *header;
     uint64_t offset;
     uint32_t num_entries, entry_size;
+    size_t size;
 
     /* Allocate a temporary buffer. */
     buf = malloc(disk->block_size);
@@ -74,16 +114,28 @@ static bool gpt_partition_iterate(disk_device_t *disk, partition_iterate_cb_t cb
     entry_size = le32_to_cpu(header->partition_entry_size);
     header = NULL;
 
+    if (entry_size < sizeof(gpt_partition_entry_t) ||
+        (uint64_t)num_entries * entry_size > GPT_MAX_ENTRY_ARRAY_SIZE)
+    {
+        dprintf(
+            "gpt: invalid partition entry array (%" PRIu32 " entries of size %" PRIu32 ")\n",
+            num_entries, entry_size);
+        return false;
+    }
+
+    /* Read in the whole partition entry array at once. */
+    size = num_entries * entry_size;
+    entries = malloc_large(size);
+    if (device_read(&disk->device, entries, size, offset) != STATUS_SUCCESS) {
+        dprintf("gpt: failed to read GPT partition entries at %" PRIu64 "\n", offset);
+        return false;
+    }
+
     /* Iterate over partition entries. */
-    for (uint32_t i = 0; i < num_entries; i++, offset += entry_size) {
-        gpt_partition_entry_t *entry = buf;
+    for (uint32_t i = 0; i < num_entries; i++) {
+        gpt_partition_entry_t *entry = entries + (i * entry_size);
         uint64_t lba, count;
 
-        if (device_read(&disk->device, buf, entry_size, offset) != STATUS_SUCCESS) {
-            dprintf("gpt: failed to read GPT partition entry at %" PRIu64 "\n", offset);
-            return false;
-        }
-
         /* Ignore unused entries. */
         if (memcmp(&entry->type_guid, &zero_guid, sizeof(entry->type_guid)) == 0)
             continue;
@@ -96,7 +148,7 @@ static bool gpt_partition_iterate(disk_device_t *disk, partition_iterate_cb_t cb
             continue;
         }
 
-        cb(disk, i, lba, count);
+        cb(disk, i, lba, count, is_no_fs(entry));
     }
 
     return true;
@@ -58,6 +58,19 @@ static bool is_valid(disk_device_t *disk, mbr_partition_t *partition) {
         && (partition->start_lba + partition->num_sectors <= disk->blocks);
 }
 
+/** Check whether a partition's type indicates that it has no filesystem.
+ * @param partition     Partition record.
+ * @return              Whether the partition has no filesystem. */
+static bool is_no_fs(mbr_partition_t *partition) {
+    switch (partition->type) {
+    case MBR_PARTITION_TYPE_LINUX_SWAP:
+    case MBR_PARTITION_TYPE_LINUX_LVM:
+        return true;
+    default:
+        return false;
+    }
+}
+
 /** Check whether a partition is an extended partition.
  * @param partition     Partition record.
  * @return              Whether the partition is extended. */
@@ -115,7 +128,7 @@ static void handle_extended(disk_device_t *disk, uint32_t lba, partition_iterate
         if (!is_valid(disk, partition))
             continue;
 
-        cb(disk, i++, partition->start_lba, partition->num_sectors);
+        cb(disk, i++, partition->start_lba, partition->num_sectors, is_no_fs(partition));
     }
 }
 
@@ -155,7 +168,7 @@ static bool mbr_partition_iterate(disk_device_t *disk, partition_iterate_cb_t cb
             handle_extended(disk, partition->start_lba, cb);
             seen_extended = true;
         } else {
-            cb(disk, i, partition->start_lba, partition->num_sectors);
+            cb(disk, i, partition->start_lba, partition->num_sectors, is_no_fs(partition));
         }
     }
 
@@ -34,10 +34,90 @@
 typedef struct bios_disk {
     disk_device_t disk;                 /**< Disk device header. */
     uint8_t id;                         /**< BIOS device ID. */
+    bool flat;                          /**< Whether 64-bit flat buffer addresses work. */
 } bios_disk_t;
 
-/** Maximum number of blocks per transfer. */
-#define blocks_per_transfer(disk) ((BIOS_MEM_SIZE / disk->disk.block_size) - 1)
+/** Size of the low memory bounce buffer. */
+#define BOUNCE_BUFFER_SIZE      0x10000
+
+/** Range reserved while testing flat buffer address support. A BIOS that does
+ * not support flat addresses would treat the buffer as FFFF:FFFF, so we make
+ * sure that there is nothing there. */
+#define FLAT_TEST_RESERVE_BASE  0x10f000
+#define FLAT_TEST_RESERVE_SIZE  0x3000
+
+/** Minimum address of the buffer used to test flat buffer address support. */
+#define FLAT_TEST_MIN_ADDR      0x1000000
+
+/** Low memory bounce buffer for transfers. */
+static void *bounce_buffer;
+static size_t bounce_buffer_size;
+
+/** Get the bounce buffer for transfers.
+ * @param _size         Where to store size of the buffer.
+ * @return              Pointer to bounce buffer. */
+static void *get_bounce_buffer(size_t *_size) {
+    if (!bounce_buffer) {
+        /* Try to get a dedicated buffer in low memory that is large enough for
+         * the biggest transfer the BIOS allows. Failing that, use the space in
+         * the BIOS data area after the disk address packet. */
+        bounce_buffer = memory_alloc(
+            BOUNCE_BUFFER_SIZE, 0, 0, 0xfffff, MEMORY_TYPE_INTERNAL,
+            MEMORY_ALLOC_CAN_FAIL, NULL);
+        if (bounce_buffer) {
+            bounce_buffer_size = BOUNCE_BUFFER_SIZE;
+        } else {
+            bounce_buffer = (void *)(BIOS_MEM_BASE + PAGE_SIZE);
+            bounce_buffer_size = BIOS_MEM_SIZE - PAGE_SIZE;
+        }
+    }
+
+    *_size = bounce_buffer_size;
+    return bounce_buffer;
+}
+
+/** Perform a single INT13 extended read.
+ * @param disk          Disk device being read from.
+ * @param dest          Buffer to read into. If not using a flat address, must
+ *                      be below 1MB and must not cross a 64KB boundary
+ *                      relative to its segment.
+ * @param count         Number of blocks to read.
+ * @param lba           Block number to start reading from.
+ * @param flat          Whether to use a 64-bit flat buffer address.
+ * @return              Status code describing the result of the operation. */
+static status_t do_extended_read(bios_disk_t *disk, void *dest, size_t count, uint64_t lba, bool flat) {
+    disk_address_packet_t *dap = (disk_address_packet_t *)BIOS_MEM_BASE;
+    bios_regs_t regs;
+
+    /* Fill in a disk address packet for the transfer. */
+    dap->reserved1 = 0;
+    dap->block_count = count;
+    dap->start_lba = lba;
+
+    if (flat) {
+        dap->size = sizeof(*dap);
+        dap->buffer_offset = 0xffff;
+        dap->buffer_segment = 0xffff;
+        dap->buffer_flat = (ptr_t)dest;
+    } else {
+        dap->size = DISK_ADDRESS_PACKET_SIZE;
+        dap->buffer_offset = (ptr_t)dest & 0xf;
+        dap->buffer_segment = (ptr_t)dest >> 4;
+    }
+
+    /* Perform the transfer. */
+    bios_regs_init(&regs);
+    regs.eax = INT13_EXT_READ;
+    regs.edx = disk->id;
+    regs.esi = BIOS_MEM_BASE;
+    bios_call(0x13, &regs);
+    if (regs.eflags & X86_FLAGS_CF) {
+        dprintf("bios: read from device 0x%x failed with status 0x%x\n", disk->id, regs.ax >> 8);
+        return STATUS_DEVICE_ERROR;
+    }
+
+    return STATUS_SUCCESS;
+}
 
 /** Read blocks from a BIOS disk device.
  * @param _disk         Disk device being read from.
@@ -47,46 +127,86 @@ typedef struct bios_disk {
  * @return              Status code describing the result of the operation. */
 static status_t bios_disk_read_blocks(disk_device_t *_disk, void *buf, size_t count, uint64_t lba) {
     bios_disk_t *disk = (bios_disk_t *)_disk;
-    size_t transfers;
-
-    /* Split large transfers up as we have limited space to transfer to. */
-    transfers = round_up(count, blocks_per_transfer(disk)) / blocks_per_transfer(disk);
-
-    for (size_t i = 0; i < transfers; i++) {
-        disk_address_packet_t *dap = (disk_address_packet_t *)BIOS_MEM_BASE;
-        void *dest = (void *)(BIOS_MEM_BASE + disk->disk.block_size);
-        size_t num = min(count, blocks_per_transfer(disk));
-        bios_regs_t regs;
+    size_t max_blocks, bounce_size;
+    void *bounce = NULL;
+    status_t ret;
+
+    /* If the BIOS supports flat buffer addresses we can transfer directly to
+     * the destination, otherwise we must go through a bounce buffer in low
+     * memory. Transfers from the bounce buffer must not reach the end of the
+     * segment. */
+    if (disk->flat) {
+        max_blocks = INT13_MAX_TRANSFER_BLOCKS;
+    } else {
+        bounce = get_bounce_buffer(&bounce_size);
+        max_blocks = min((bounce_size - 1) / disk->disk.block_size, INT13_MAX_TRANSFER_BLOCKS);
+    }
 
-        /* Fill in a disk address packet for the transfer. */
-        dap->size = sizeof(*dap);
-        dap->reserved1 = 0;
-        dap->block_count = num;
-        dap->buffer_offset = (ptr_t)dest;
-        dap->buffer_segment = 0;
-        dap->start_lba = lba + (i * blocks_per_transfer(disk));
+    while (count) {
+        size_t num = min(count, max_blocks);
 
-        /* Perform the transfer. */
-        bios_regs_init(&regs);
-        regs.eax = INT13_EXT_READ;
-        regs.edx = disk->id;
-        regs.esi = BIOS_MEM_BASE;
-        bios_call(0x13, &regs);
-        if (regs.eflags & X86_FLAGS_CF) {
-            dprintf("bios: read from %s failed with status 0x%x\n", disk->disk.device.name, regs.ax >> 8);
-            return STATUS_DEVICE_ERROR;
-        }
+        ret = do_extended_read(disk, (disk->flat) ? buf : bounce, num, lba, disk->flat);
+        if (ret != STATUS_SUCCESS)
+            return ret;
 
         /* Copy the transferred blocks to the buffer. */
-        memcpy(buf, dest, disk->disk.block_size * num);
+        if (!disk->flat)
+            memcpy(buf, bounce, disk->disk.block_size * num);
 
         buf += disk->disk.block_size * num;
+        lba += num;
         count -= num;
     }
 
     return STATUS_SUCCESS;
 }
 
+/**
+ * Check whether a disk supports 64-bit flat buffer addresses.
+ *
+ * EDD 3.0 allows a 64-bit flat buffer address to be given in the disk address
+ * packet, which allows us to read directly into memory above 1MB. Not all
+ * BIOSes claiming EDD 3.0 support actually implement this, so we verify that
+ * it works by reading the first block through both methods and comparing the
+ * results.
+ *
+ * @param disk          Disk to check.
+ *
+ * @return              Whether flat buffer addresses can be used.
+ */
+static bool check_flat_addressing(bios_disk_t *disk) {
+    void *reserve, *test, *bounce;
+    size_t bounce_size;
+    bool ret = false;
+
+    if (disk->disk.block_size > PAGE_SIZE)
+        return false;
+
+    reserve = memory_alloc(
+        FLAT_TEST_RESERVE_SIZE, 0, FLAT_TEST_RESERVE_BASE,
+        FLAT_TEST_RESERVE_BASE + FLAT_TEST_RESERVE_SIZE - 1, MEMORY_TYPE_INTERNAL,
+        MEMORY_ALLOC_CAN_FAIL, NULL);
+    if (!reserve)
+        return false;
+
+    test = memory_alloc(PAGE_SIZE, 0, FLAT_TEST_MIN_ADDR, 0, MEMORY_TYPE_INTERNAL, MEMORY_ALLOC_CAN_FAIL, NULL);
+    if (test) {
+        bounce = get_bounce_buffer(&bounce_size);
+        memset(test, 0xa5, disk->disk.block_size);
+
+        if (do_extended_read(disk, bounce, 1, 0, false) == STATUS_SUCCESS &&
+            do_extended_read(disk, test, 1, 0, true) == STATUS_SUCCESS)
+        {
+            ret = memcmp(test, bounce, disk->disk.block_size) == 0;
+        }
+
+        memory_free(test, PAGE_SIZE);
+    }
+
+    memory_free(reserve, FLAT_TEST_RESERVE_SIZE);
+    return ret;
+}
+
 /** Check if a partition is the boot partition.
  * @param disk          Disk the partition resides on.
  * @param id            ID of partition.
@@ -146,11 +266,14 @@ static void add_disk(uint8_t id) {
     drive_parameters_t *params = (drive_parameters_t *)BIOS_MEM_BASE;
     bios_regs_t regs;
     bios_disk_t *disk;
+    uint32_t version;
 
     /* Create a data structure for the device. */
     disk = malloc(sizeof(bios_disk_t));
     disk->disk.ops = &bios_disk_ops;
+    disk->disk.align = 1;
     disk->id = id;
+    disk->flat = false;
 
     /* If this is the boot device, check if it is a CD drive. */
     if (id == bios_boot_device) {
@@ -192,6 +315,8 @@ static void add_disk(uint8_t id) {
         return;
     }
 
+    version = regs.eax;
+
     /* Get drive parameters. According to RBIL, some Phoenix BIOSes fail to
      * correctly handle the function if the flags word is not 0. Clear the
      * entire structure to be on the safe side. */
@@ -208,10 +333,18 @@ static void add_disk(uint8_t id) {
         return;
     }
 
-    /* Add the drive. */
     disk->disk.type = DISK_TYPE_HD;
     disk->disk.block_size = params->sector_size;
     disk->disk.blocks = params->sector_count;
+
+    /* Major version of 0x30 or higher indicates EDD 3.0. */
+    if (((version >> 8) & 0xff) >= 0x30) {
+        disk->flat = check_flat_addressing(disk);
+        if (disk->flat)
+            dprintf("bios: device 0x%x supports flat buffer addresses\n", id);
+    }
+
+    /* Add the drive. */
     disk_device_register(&disk->disk, id == bios_boot_device);
 }
 
@@ -52,8 +52,15 @@ typedef struct disk_address_packet {
     uint16_t buffer_offset;
     uint16_t buffer_segment;
     uint64_t start_lba;
+    uint64_t buffer_flat;               /**< 64-bit flat buffer address (EDD 3.0). */
 } __packed disk_address_packet_t;
 
+/** Size of the disk address packet without the EDD 3.0 flat address field. */
+#define DISK_ADDRESS_PACKET_SIZE        16
+
+/** Maximum number of blocks that can be transferred by a single call. */
+#define INT13_MAX_TRANSFER_BLOCKS       127
+
 /** Bootable CD-ROM Specification Packet. */
 typedef struct specification_packet {
     uint8_t size;
@@ -31,10 +31,11 @@
 /** PXE function numbers. */
 #define PXENV_UNDI_SHUTDOWN             0x05    /**< Reset the network adapter. */
 #define PXENV_STOP_UNDI                 0x15    /**< Shutdown the UNDI stack. */
-#define PXENV_TFTP_OPEN                 0x20    /**< Open TFTP connection. */
-#define PXENV_TFTP_CLOSE                0x21    /**< Close TFTP connection. */
-#define PXENV_TFTP_READ                 0x22    /**< Read from TFTP connection. */
 #define PXENV_TFTP_GET_FSIZE            0x25    /**< Get TFTP file size. */
+#define PXENV_UDP_OPEN                  0x30    /**< Open UDP connection. */
+#define PXENV_UDP_CLOSE                 0x31    /**< Close UDP connection. */
+#define PXENV_UDP_READ                  0x32    /**< Read a UDP packet. */
+#define PXENV_UDP_WRITE                 0x33    /**< Write a UDP packet. */
 #define PXENV_UNLOAD_STACK              0x70    /**< Unload PXE stack. */
 #define PXENV_GET_CACHED_INFO           0x71    /**< Get cached information. */
 
@@ -53,7 +54,6 @@
 
 /** TFTP definitions. */
 #define PXENV_TFTP_PORT                 69      /**< Port number. */
-#define PXENV_TFTP_PACKET_SIZE          512     /**< Requested packet size. */
 #define PXENV_TFTP_PATH_SIZE            128     /**< Size of the file path buffers. */
 
 /** Type of a MAC address. */
@@ -108,37 +108,47 @@ typedef struct pxe {
 /** !PXE structure signature. */
 #define PXE_SIGNATURE                 "!PXE"
 
-/** Input structure for PXENV_TFTP_OPEN. */
-typedef struct pxenv_tftp_open {
+/** Input structure for PXENV_TFTP_GET_FSIZE. */
+typedef struct pxenv_tftp_get_fsize {
     pxenv_status_t status;                      /**< Status code. */
     ipv4_addr_t server_ip;                      /**< Server IP address. */
     ipv4_addr_t gateway_ip;                     /**< Gateway IP address. */
     uint8_t filename[PXENV_TFTP_PATH_SIZE];     /**< File name to open. */
-    uint16_t udp_port;                          /**< Port that TFTP server is listening on. */
-    uint16_t packet_size;                       /**< Requested packet size. */
-} __packed pxenv_tftp_open_t;
+    uint32_t file_size;                         /**< Size of the file. */
+} __packed pxenv_tftp_get_fsize_t;
 
-/** Input structure for PXENV_TFTP_CLOSE. */
-typedef struct pxenv_tftp_close {
+/** Input structure for PXENV_UDP_OPEN. */
+typedef struct pxenv_udp_open {
     pxenv_status_t status;                      /**< Status code. */
-} __packed pxenv_tftp_close_t;
+    ipv4_addr_t src_ip;                         /**< Our IP address. */
+} __packed pxenv_udp_open_t;
 
-/** Input structure for PXENV_TFTP_READ. */
-typedef struct pxenv_tftp_read {
+/** Input structure for PXENV_UDP_CLOSE. */
+typedef struct pxenv_udp_close {
     pxenv_status_t status;                      /**< Status code. */
-    uint16_t packet_number;                     /**< Packet number sent by server. */
-    uint16_t buffer_size;                       /**< Number of bytes read. */
+} __packed pxenv_udp_close_t;
+
+/** Input structure for PXENV_UDP_READ. */
+typedef struct pxenv_udp_read {
+    pxenv_status_t status;                      /**< Status code. */
+    ipv4_addr_t src_ip;                         /**< Source IP address (output). */
+    ipv4_addr_t dest_ip;                        /**< Destination IP address (0 for any). */
+    uint16_t src_port;                          /**< Source port (output, network byte order). */
+    uint16_t dest_port;                         /**< Destination port (0 for any, network byte order). */
+    uint16_t buffer_size;                       /**< Size of buffer/number of bytes read. */
     uint32_t buffer;                            /**< Buffer address. */
-} __packed pxenv_tftp_read_t;
+} __packed pxenv_udp_read_t;
 
-/** Input structure for PXENV_TFTP_GET_FSIZE. */
-typedef struct pxenv_tftp_get_fsize {
+/** Input structure for PXENV_UDP_WRITE. */
+typedef struct pxenv_udp_write {
     pxenv_status_t status;                      /**< Status code. */
-    ipv4_addr_t server_ip;                      /**< Server IP address. */
+    ipv4_addr_t ip;                             /**< Destination IP address. */
     ipv4_addr_t gateway_ip;                     /**< Gateway IP address. */
-    uint8_t filename[PXENV_TFTP_PATH_SIZE];     /**< File name to open. */
-    uint32_t file_size;                         /**< Size of the file. */
-} __packed pxenv_tftp_get_fsize_t;
+    uint16_t src_port;                          /**< Source port (network byte order). */
+    uint16_t dest_port;                         /**< Destination port (network byte order). */
+    uint16_t buffer_size;                       /**< Size of the packet. */
+    uint32_t buffer;                            /**< Buffer address. */
+} __packed pxenv_udp_write_t;
 
 /** Input structure for PXENV_GET_CACHED_INFO. */
 typedef struct pxenv_get_cached_info {
@@ -216,6 +216,8 @@ static void generate_config(multiboot_device_t *multiboot) {
     fs_handle_init(&file->handle, &multiboot->mount, FILE_TYPE_REGULAR, offset);
     file->entry.owner = multiboot->mount.root;
     file->entry.name = "kboot.cfg";
+    file->entry.type = FILE_TYPE_REGULAR;
+    file->entry.size = offset;
     file->addr = buf;
     file->cmdline = NULL;
 
@@ -243,13 +245,12 @@ static void load_modules(void) {
     multiboot->mount.ops = &multiboot_fs_ops;
     multiboot->mount.label = NULL;
     multiboot->mount.uuid = NULL;
+    multiboot->mount.dentries = NULL;
     list_init(&multiboot->files);
 
     /* Create the root directory. */
     multiboot->mount.root = malloc(sizeof(*multiboot->mount.root));
-    multiboot->mount.root->mount = &multiboot->mount;
-    multiboot->mount.root->type = FILE_TYPE_DIR;
-    multiboot->mount.root->count = 1;
+    fs_handle_init(multiboot->mount.root, &multiboot->mount, FILE_TYPE_DIR, 0);
 
     modules = (multiboot_module_info_t *)((ptr_t)multiboot_info.mods_addr);
     found_config = false;
@@ -267,6 +268,8 @@ static void load_modules(void) {
             modules[i].mod_end - modules[i].mod_start);
 
         file->entry.owner = multiboot->mount.root;
+        file->entry.type = FILE_TYPE_REGULAR;
+        file->entry.size = file->handle.size;
 
         /* Get the name and command line. Strip off any path prefix. */
         file->cmdline = (char *)modules[i].cmdline;
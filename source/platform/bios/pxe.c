@@ -31,6 +31,7 @@
 #include <fs.h>
 #include <loader.h>
 #include <memory.h>
+#include <tftp.h>
 
 /** PXE entry point. */
 uint32_t pxe_entry_point;
@@ -39,18 +40,19 @@ uint32_t pxe_entry_point;
 typedef struct pxe_device {
     net_device_t net;                   /**< Network device header. */
     fs_mount_t mount;                   /**< Mount header. */
+
+    bool udp_open;                      /**< Whether the UDP connection is open. */
 } pxe_device_t;
 
 /** Structure containing details of a PXE handle. */
 typedef struct pxe_handle {
     fs_handle_t handle;                 /**< Handle to the file. */
-
-    uint16_t packet_size;               /**< Negotiated packet size. */
-    uint32_t packet_number;             /**< Current packet number. */
+    tftp_transfer_t transfer;           /**< TFTP transfer state. */
+    net_cache_entry_t *cache;           /**< Network file cache entry. */
     char path[];                        /**< Path to the file. */
 } pxe_handle_t;
 
-/** Current PXE handle. */
+/** Handle with a transfer in progress. */
 static pxe_handle_t *current_pxe_handle = NULL;
 
 /** Call a PXE function.
@@ -76,64 +78,131 @@ static net_ops_t pxe_net_ops = {
     .identify = pxe_net_identify,
 };
 
-/** Set the current PXE handle.
- * @param handle        Handle to set to. If NULL, current will be closed.
+/** Open the UDP connection if it is not already open.
+ * @param device        Device to open on.
  * @return              Status code describing the result of the operation. */
-static status_t set_current_handle(pxe_handle_t *handle) {
-    if (current_pxe_handle) {
-        pxenv_tftp_close_t close;
-
-        pxe_call(PXENV_TFTP_CLOSE, &close);
-        current_pxe_handle = NULL;
-    }
+static status_t open_udp(pxe_device_t *device) {
+    pxenv_udp_open_t open;
 
-    if (handle) {
-        pxe_device_t *device = container_of(handle->handle.mount, pxe_device_t, mount);
-        pxenv_tftp_open_t open;
-
-        strcpy((char *)open.filename, handle->path);
-        memcpy(&open.server_ip, &device->net.server_ip, sizeof(open.server_ip));
-        memcpy(&open.gateway_ip, &device->net.gateway_ip, sizeof(open.gateway_ip));
-        open.udp_port = cpu_to_be16(device->net.server_port);
-        open.packet_size = PXENV_TFTP_PACKET_SIZE;
-
-        if (pxe_call(PXENV_TFTP_OPEN, &open) != PXENV_EXIT_SUCCESS || open.status) {
-            if (open.status == PXENV_STATUS_TFTP_NOT_FOUND) {
-                return STATUS_NOT_FOUND;
-            } else {
-                dprintf("pxe: open request for '%s' failed: 0x%x\n", handle->path, open.status);
-                return STATUS_DEVICE_ERROR;
-            }
-        }
+    if (device->udp_open)
+        return STATUS_SUCCESS;
 
-        handle->packet_size = open.packet_size;
-        handle->packet_number = 0;
+    memcpy(&open.src_ip, &device->net.ip, sizeof(open.src_ip));
 
-        current_pxe_handle = handle;
+    if (pxe_call(PXENV_UDP_OPEN, &open) != PXENV_EXIT_SUCCESS || open.status) {
+        dprintf("pxe: failed to open UDP connection: 0x%x\n", open.status);
+        return STATUS_DEVICE_ERROR;
     }
 
+    device->udp_open = true;
     return STATUS_SUCCESS;
 }
 
-/** Read the next packet from a TFTP file.
- * @note                Reads to BIOS_MEM_BASE.
- * @param handle        Handle to read from.
+/** Close the UDP connection if it is open.
+ * @param device        Device to close on. */
+static void close_udp(pxe_device_t *device) {
+    pxenv_udp_close_t close;
+
+    if (device->udp_open) {
+        pxe_call(PXENV_UDP_CLOSE, &close);
+        device->udp_open = false;
+    }
+}
+
+/** Send a TFTP packet.
+ * @param transfer      Transfer that the packet belongs to.
+ * @param buf           Packet to send.
+ * @param size          Size of the packet.
+ * @param port          Server UDP port to send to.
  * @return              Status code describing the result of the operation. */
-static status_t read_packet(pxe_handle_t *handle) {
-    pxenv_tftp_read_t read;
+static status_t pxe_tftp_send(tftp_transfer_t *transfer, const void *buf, size_t size, uint16_t port) {
+    pxe_device_t *device = container_of(transfer->net, pxe_device_t, net);
+    pxenv_udp_write_t write;
+    status_t ret;
+
+    ret = open_udp(device);
+    if (ret != STATUS_SUCCESS)
+        return ret;
+
+    /* The buffer must be addressable from real mode. */
+    memcpy((void *)BIOS_MEM_BASE, buf, size);
 
-    read.buffer = BIOS_MEM_BASE;
-    read.buffer_size = handle->packet_size;
+    memcpy(&write.ip, &device->net.server_ip, sizeof(write.ip));
+    memcpy(&write.gateway_ip, &device->net.gateway_ip, sizeof(write.gateway_ip));
+    write.src_port = cpu_to_be16(transfer->local_port);
+    write.dest_port = cpu_to_be16(port);
+    write.buffer_size = size;
+    write.buffer = linear_to_segoff(BIOS_MEM_BASE);
 
-    if (pxe_call(PXENV_TFTP_READ, &read) != PXENV_EXIT_SUCCESS || read.status) {
-        dprintf("pxe: reading packet %u in '%s' failed: 0x%x\n", handle->packet_number, handle->path, read.status);
+    if (pxe_call(PXENV_UDP_WRITE, &write) != PXENV_EXIT_SUCCESS || write.status) {
+        dprintf("pxe: failed to send UDP packet: 0x%x\n", write.status);
         return STATUS_DEVICE_ERROR;
     }
 
-    handle->packet_number++;
     return STATUS_SUCCESS;
 }
 
+/** Receive a TFTP packet.
+ * @param transfer      Transfer to receive for.
+ * @param buf           Buffer to receive into.
+ * @param _size         On input, size of the buffer. On output, size of the
+ *                      received packet.
+ * @param _port         Where to store server UDP port the packet is from.
+ * @param timeout       Maximum time to wait (in milliseconds).
+ * @return              Status code describing the result of the operation. */
+static status_t pxe_tftp_receive(
+    tftp_transfer_t *transfer, void *buf, size_t *_size, uint16_t *_port,
+    mstime_t timeout)
+{
+    pxe_device_t *device = container_of(transfer->net, pxe_device_t, net);
+    mstime_t deadline = current_time() + timeout;
+    status_t ret;
+
+    ret = open_udp(device);
+    if (ret != STATUS_SUCCESS)
+        return ret;
+
+    /* PXENV_UDP_READ does not wait for a packet, so poll until we time out. */
+    do {
+        pxenv_udp_read_t read;
+
+        memcpy(&read.dest_ip, &device->net.ip, sizeof(read.dest_ip));
+        read.dest_port = cpu_to_be16(transfer->local_port);
+        read.buffer_size = min(*_size, BIOS_MEM_SIZE);
+        read.buffer = linear_to_segoff(BIOS_MEM_BASE);
+
+        if (pxe_call(PXENV_UDP_READ, &read) == PXENV_EXIT_SUCCESS && !read.status) {
+            if (read.src_ip.val != device->net.server_ip.v4.val)
+                continue;
+
+            memcpy(buf, (void *)BIOS_MEM_BASE, read.buffer_size);
+            *_size = read.buffer_size;
+            *_port = be16_to_cpu(read.src_port);
+            return STATUS_SUCCESS;
+        }
+    } while (current_time() < deadline);
+
+    return STATUS_TIMED_OUT;
+}
+
+/** PXE TFTP transport operations. */
+static const tftp_ops_t pxe_tftp_ops = {
+    .send = pxe_tftp_send,
+    .receive = pxe_tftp_receive,
+};
+
+/** Set the handle with a transfer in progress.
+ * @param handle        Handle to set to. If NULL, current will be closed. */
+static void set_current_handle(pxe_handle_t *handle) {
+    /* The PXE stack only gives us one UDP connection, and packets for any other
+     * transfer would be discarded while we wait for ours, so end it now rather
+     * than leaving the server to time out. */
+    if (current_pxe_handle && current_pxe_handle != handle)
+        tftp_close(&current_pxe_handle->transfer);
+
+    current_pxe_handle = handle;
+}
+
 /** Read from a file.
  * @param _handle       Handle to read from.
  * @param buf           Buffer to read into.
@@ -142,39 +211,47 @@ static status_t read_packet(pxe_handle_t *handle) {
  * @return              Status code describing the result of the operation. */
 static status_t pxe_fs_read(fs_handle_t *_handle, void *buf, size_t count, offset_t offset) {
     pxe_handle_t *handle = container_of(_handle, pxe_handle_t, handle);
-    uint32_t start;
     status_t ret;
 
-    start = offset / handle->packet_size;
+    if (net_cache_read(handle->cache, buf, count, offset))
+        return STATUS_SUCCESS;
 
-    /* If the file is not already open, just open it - we will be at the
-     * beginning of the file. If it is open, and the current packet is greater
-     * than the start packet, we must re-open it. */
-    if (handle != current_pxe_handle || handle->packet_number > start) {
-        ret = set_current_handle(handle);
-        if (ret != STATUS_SUCCESS)
-            return ret;
-    }
+    set_current_handle(handle);
+    ret = tftp_read(&handle->transfer, buf, count, offset);
+    if (ret == STATUS_SUCCESS)
+        net_cache_store(handle->cache, buf, count, offset);
 
-    while (count) {
-        uint32_t current = handle->packet_number;
+    return ret;
+}
 
-        ret = read_packet(handle);
-        if (ret != STATUS_SUCCESS)
-            return ret;
+/** Get the size of a file for a server that does not support tsize.
+ * @param device        Device to get from.
+ * @param path          Path to the file.
+ * @param _size         Where to store size of the file.
+ * @return              Status code describing the result of the operation. */
+static status_t get_file_size(pxe_device_t *device, const char *path, uint32_t *_size) {
+    pxenv_tftp_get_fsize_t fsize;
+
+    if (strlen(path) >= PXENV_TFTP_PATH_SIZE)
+        return STATUS_NOT_FOUND;
 
-        /* If the current packet number is less than the start packet, do
-         * nothing - we're seeking to the start packet. */
-        if (current >= start) {
-            uint32_t size = min(count, handle->packet_size - (offset % handle->packet_size));
+    /* The TFTP API cannot be used while a UDP connection is open. */
+    close_udp(device);
 
-            memcpy(buf, (void *)(ptr_t)(BIOS_MEM_BASE + (offset % handle->packet_size)), size);
-            buf += size;
-            offset += size;
-            count -= size;
+    strcpy((char *)fsize.filename, path);
+    memcpy(&fsize.server_ip, &device->net.server_ip, sizeof(fsize.server_ip));
+    memcpy(&fsize.gateway_ip, &device->net.gateway_ip, sizeof(fsize.gateway_ip));
+
+    if (pxe_call(PXENV_TFTP_GET_FSIZE, &fsize) != PXENV_EXIT_SUCCESS || fsize.status) {
+        if (fsize.status == PXENV_STATUS_TFTP_NOT_FOUND) {
+            return STATUS_NOT_FOUND;
+        } else {
+            dprintf("pxe: file size request for '%s' failed: 0x%x\n", path, fsize.status);
+            return STATUS_DEVICE_ERROR;
         }
     }
 
+    *_size = fsize.file_size;
     return STATUS_SUCCESS;
 }
 
@@ -186,7 +263,6 @@ static status_t pxe_fs_read(fs_handle_t *_handle, void *buf, size_t count, offse
  * @return              Status code describing the result of the operation. */
 static status_t pxe_fs_open_path(fs_mount_t *mount, char *path, fs_handle_t *from, fs_handle_t **_handle) {
     pxe_device_t *device = container_of(mount, pxe_device_t, mount);
-    pxenv_tftp_get_fsize_t fsize;
     pxe_handle_t *handle;
     size_t len;
     status_t ret;
@@ -195,36 +271,49 @@ static status_t pxe_fs_open_path(fs_mount_t *mount, char *path, fs_handle_t *fro
         return STATUS_NOT_SUPPORTED;
 
     len = strlen(path);
-    if (len >= PXENV_TFTP_PATH_SIZE)
-        return STATUS_NOT_FOUND;
-
-    /* Get the file size. I'm not actually sure whether it's necessary to close
-     * the current handle beforehand, but I'm doing it to be on the safe side. */
-    set_current_handle(NULL);
-    strcpy((char *)fsize.filename, path);
-    memcpy(&fsize.server_ip, &device->net.server_ip, sizeof(fsize.server_ip));
-    memcpy(&fsize.gateway_ip, &device->net.gateway_ip, sizeof(fsize.gateway_ip));
-
-    if (pxe_call(PXENV_TFTP_GET_FSIZE, &fsize) != PXENV_EXIT_SUCCESS || fsize.status) {
-        if (fsize.status == PXENV_STATUS_TFTP_NOT_FOUND) {
-            return STATUS_NOT_FOUND;
-        } else {
-            dprintf("pxe: file size request for '%s' failed: 0x%x\n", path, fsize.status);
-            return STATUS_DEVICE_ERROR;
-        }
-    }
-
     handle = malloc(sizeof(*handle) + len + 1);
-    fs_handle_init(&handle->handle, mount, FILE_TYPE_REGULAR, fsize.file_size);
+    fs_handle_init(&handle->handle, mount, FILE_TYPE_REGULAR, 0);
     strcpy(handle->path, path);
+    tftp_init(&handle->transfer, &pxe_tftp_ops, &device->net, handle->path, TFTP_ETHERNET_BLOCK_SIZE);
+
+    /* If we have seen the file before we know it exists and its size, so we
+     * do not need to go to the server until we read something not cached. */
+    handle->cache = net_cache_lookup(&device->net, path);
+    if (handle->cache) {
+        handle->handle.size = handle->cache->size;
+        *_handle = &handle->handle;
+        return STATUS_SUCCESS;
+    }
+
+    /* Start the transfer now. This tells us whether the file exists and, if
+     * the server supports tsize, its size in the same round trip. Reads from
+     * the start of the file then continue on from here. */
+    set_current_handle(handle);
+    ret = tftp_open(&handle->transfer);
+    if (ret == STATUS_SUCCESS && handle->transfer.size == TFTP_SIZE_UNKNOWN) {
+        uint32_t size;
+
+        /* Getting the size needs the PXE stack's own TFTP client, which
+         * cannot be used alongside ours. The transfer is restarted when the
+         * file is read. */
+        tftp_close(&handle->transfer);
+
+        ret = get_file_size(device, path, &size);
+        if (ret == STATUS_SUCCESS)
+            handle->handle.size = size;
+    } else if (ret == STATUS_SUCCESS) {
+        handle->handle.size = handle->transfer.size;
+    }
 
-    /* Try to open the file as the current. */
-    ret = set_current_handle(handle);
     if (ret != STATUS_SUCCESS) {
+        tftp_close(&handle->transfer);
+        current_pxe_handle = NULL;
         free(handle);
         return ret;
     }
 
+    handle->cache = net_cache_insert(&device->net, path, handle->handle.size);
+
     *_handle = &handle->handle;
     return STATUS_SUCCESS;
 }
@@ -234,8 +323,11 @@ static status_t pxe_fs_open_path(fs_mount_t *mount, char *path, fs_handle_t *fro
 static void pxe_fs_close(fs_handle_t *_handle) {
     pxe_handle_t *handle = container_of(_handle, pxe_handle_t, handle);
 
+    tftp_close(&handle->transfer);
+    net_cache_release(handle->cache);
+
     if (handle == current_pxe_handle)
-        set_current_handle(NULL);
+        current_pxe_handle = NULL;
 }
 
 /** PXE filesystem operations structure. */
@@ -297,8 +389,14 @@ static bootp_packet_t *get_bootp_packet(void) {
     return (bootp_packet_t *)segoff_to_linear(ci.buffer);
 }
 
+/** PXE device (only one, the boot device). */
+static pxe_device_t *pxe_device;
+
 /** Shut down PXE before booting an OS. */
 static void shutdown_pxe(void) {
+    set_current_handle(NULL);
+    close_udp(pxe_device);
+
     if (pxe_call(PXENV_UNDI_SHUTDOWN, (void *)BIOS_MEM_BASE) != PXENV_EXIT_SUCCESS)
         dprintf("pxe: warning: PXENV_UNDI_SHUTDOWN failed\n");
     if (pxe_call(PXENV_UNLOAD_STACK, (void *)BIOS_MEM_BASE) != PXENV_EXIT_SUCCESS)
@@ -341,6 +439,7 @@ void pxe_init(void) {
     pxe->mount.ops = &pxe_fs_ops;
     net_device_register_with_bootp(&pxe->net, bootp, true);
     pxe->net.device.mount = &pxe->mount;
+    pxe_device = pxe;
 
     /* Register a pre-boot hook to shut down the PXE stack. */
     loader_register_preboot_hook(shutdown_pxe);
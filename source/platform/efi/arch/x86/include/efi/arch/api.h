@@ -48,6 +48,7 @@ extern uint64_t __efi_call7(uint64_t, uint64_t, uint64_t, uint64_t, uint64_t, ui
 extern uint64_t __efi_call8(uint64_t, uint64_t, uint64_t, uint64_t, uint64_t, uint64_t, uint64_t, uint64_t);
 extern uint64_t __efi_call9(uint64_t, uint64_t, uint64_t, uint64_t, uint64_t, uint64_t, uint64_t, uint64_t, uint64_t);
 extern uint64_t __efi_call10(uint64_t, uint64_t, uint64_t, uint64_t, uint64_t, uint64_t, uint64_t, uint64_t, uint64_t, uint64_t);
+extern uint64_t __efi_call11(uint64_t, uint64_t, uint64_t, uint64_t, uint64_t, uint64_t, uint64_t, uint64_t, uint64_t, uint64_t, uint64_t);
 
 #else /* __LP64__ */
 
@@ -64,8 +65,8 @@ extern void *__efi_call_func;
  * http://stackoverflow.com/questions/11761703/overloading-macro-on-number-of-arguments */
 #define __VA_NARG(...) __VA_NARG_I(_0, ## __VA_ARGS__, __RSEQ_N())
 #define __VA_NARG_I(...) __VA_NARG_N(__VA_ARGS__)
-#define __VA_NARG_N(_0, _1, _2, _3, _4, _5, _6, _7, _8, _9, _10, N, ...) N
-#define __RSEQ_N() 10, 9, 8, 7, 6, 5, 4, 3, 2, 1, 0
+#define __VA_NARG_N(_0, _1, _2, _3, _4, _5, _6, _7, _8, _9, _10, _11, N, ...) N
+#define __RSEQ_N() 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1, 0
 
 /**
  * EFI call wrapper.
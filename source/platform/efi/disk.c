@@ -38,13 +38,15 @@ typedef struct efi_disk {
     efi_handle_t handle;                /**< Handle to disk. */
     efi_device_path_t *path;            /**< Device path. */
     efi_block_io_protocol_t *block;     /**< Block I/O protocol. */
+    efi_block_io2_protocol_t *block2;   /**< Block I/O 2 protocol (if supported). */
     efi_uint32_t media_id;              /**< Media ID. */
     bool boot;                          /**< Whether the device is the boot device. */
     uint64_t boot_partition_lba;        /**< LBA of the boot partition. */
 } efi_disk_t;
 
-/** Block I/O protocol GUID. */
+/** Block I/O protocol GUIDs. */
 static efi_guid_t block_io_guid = EFI_BLOCK_IO_PROTOCOL_GUID;
+static efi_guid_t block_io2_guid = EFI_BLOCK_IO2_PROTOCOL_GUID;
 
 /** Read blocks from an EFI disk.
  * @param _disk         Disk device being read from.
@@ -65,6 +67,67 @@ static status_t efi_disk_read_blocks(disk_device_t *_disk, void *buf, size_t cou
     return STATUS_SUCCESS;
 }
 
+/** Start an asynchronous read from an EFI disk.
+ * @param _disk         Disk device being read from.
+ * @param request       Request to start.
+ * @return              Status code describing the result of the operation. */
+static status_t efi_disk_submit_read(disk_device_t *_disk, disk_request_t *request) {
+    efi_disk_t *disk = (efi_disk_t *)_disk;
+    efi_block_io2_token_t *token;
+    efi_status_t ret;
+
+    token = malloc(sizeof(*token));
+    token->transaction_status = EFI_SUCCESS;
+
+    ret = efi_call(efi_boot_services->create_event, 0, EFI_TPL_CALLBACK, NULL, NULL, &token->event);
+    if (ret != EFI_SUCCESS) {
+        free(token);
+        return STATUS_NOT_SUPPORTED;
+    }
+
+    ret = efi_call(
+        disk->block2->read_blocks_ex, disk->block2, disk->media_id, request->lba, token,
+        request->count * disk->disk.block_size, request->buf);
+    if (ret != EFI_SUCCESS) {
+        dprintf("efi: read from %s failed: 0x%zx\n", disk->disk.device.name, ret);
+        efi_call(efi_boot_services->close_event, token->event);
+        free(token);
+        return efi_convert_status(ret);
+    }
+
+    request->data = token;
+    request->pending = true;
+    return STATUS_SUCCESS;
+}
+
+/** Check whether an asynchronous read from an EFI disk has completed.
+ * @param _disk         Disk device being read from.
+ * @param request       Request to check.
+ * @return              Whether the request has completed. */
+static bool efi_disk_poll(disk_device_t *_disk, disk_request_t *request) {
+    efi_disk_t *disk = (efi_disk_t *)_disk;
+    efi_block_io2_token_t *token = request->data;
+    efi_status_t ret;
+
+    ret = efi_call(efi_boot_services->check_event, token->event);
+    if (ret == EFI_NOT_READY)
+        return false;
+
+    if (ret == EFI_SUCCESS)
+        ret = token->transaction_status;
+
+    if (ret != EFI_SUCCESS)
+        dprintf("efi: read from %s failed: 0x%zx\n", disk->disk.device.name, ret);
+
+    efi_call(efi_boot_services->close_event, token->event);
+    free(token);
+
+    request->data = NULL;
+    request->pending = false;
+    request->status = efi_convert_status(ret);
+    return true;
+}
+
 /** Check if a partition is the boot partition.
  * @param _disk         Disk the partition resides on.
  * @param id            ID of partition.
@@ -95,6 +158,15 @@ static disk_ops_t efi_disk_ops = {
     .identify = efi_disk_identify,
 };
 
+/** EFI disk operations structure for disks supporting asynchronous I/O. */
+static disk_ops_t efi_disk_async_ops = {
+    .read_blocks = efi_disk_read_blocks,
+    .submit_read = efi_disk_submit_read,
+    .poll = efi_disk_poll,
+    .is_boot_partition = efi_disk_is_boot_partition,
+    .identify = efi_disk_identify,
+};
+
 /**
  * Gets an EFI handle from a disk device.
  *
@@ -114,7 +186,7 @@ efi_handle_t efi_disk_get_handle(disk_device_t *_disk) {
         _disk = _disk->parent;
     }
 
-    if (_disk->ops != &efi_disk_ops)
+    if (_disk->ops != &efi_disk_ops && _disk->ops != &efi_disk_async_ops)
         return NULL;
 
     disk = (efi_disk_t *)_disk;
@@ -225,13 +297,23 @@ void efi_disk_init(void) {
             continue;
         }
 
+        /* Use the block I/O 2 protocol if available to allow multiple reads
+         * to be in flight at once. */
+        ret = efi_open_protocol(handles[i], &block_io2_guid, EFI_OPEN_PROTOCOL_GET_PROTOCOL, (void **)&disk->block2);
+        if (ret != EFI_SUCCESS)
+            disk->block2 = NULL;
+
         media = disk->block->media;
 
         disk->handle = handles[i];
         disk->media_id = media->media_id;
         disk->boot = handles[i] == efi_loaded_image->device_handle;
-        disk->disk.ops = &efi_disk_ops;
+        disk->disk.ops = (disk->block2) ? &efi_disk_async_ops : &efi_disk_ops;
         disk->disk.block_size = media->block_size;
+
+        /* IoAlign of 0 or 1 means any buffer will do, but we have always used
+         * 8 byte aligned buffers so keep that as a minimum. */
+        disk->disk.align = max(media->io_align, 8);
         disk->disk.blocks = (media->media_present) ? media->last_block + 1 : 0;
 
         if (disk->boot)
@@ -0,0 +1,715 @@
+/*
+ * Copyright (C) 2015 Alex Smith
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/**
+ * @file
+ * @brief               EFI HTTP filesystem support.
+ *
+ * This provides a filesystem on top of the EFI HTTP protocol, for each network
+ * interface which supports it. Each interface is registered as a device named
+ * "http<N>". Paths on the device are relative to a base URL, which is the
+ * directory of the boot URI if we were loaded by HTTP boot, or the directory
+ * of a DHCP-provided boot file URL. Absolute URLs ("http://...") can also be
+ * opened, see fs_open().
+ *
+ * File sizes are found with a HEAD request. Reads use range requests, with
+ * small reads going through a read-ahead buffer, and loading a whole file
+ * streams the response body straight into its destination. If the server
+ * ignores range requests, we keep the whole file from the first response.
+ */
+
+#include <efi/device.h>
+#include <efi/efi.h>
+#include <efi/net.h>
+#include <efi/services.h>
+
+#include <lib/string.h>
+#include <lib/utility.h>
+
+#include <device.h>
+#include <fs.h>
+#include <loader.h>
+#include <memory.h>
+#include <time.h>
+
+/** Maximum time to wait for an HTTP operation (in milliseconds). */
+#define HTTP_TIMEOUT        10000
+
+/** Size of the read-ahead buffer. */
+#define HTTP_READ_AHEAD     0x10000
+
+/** Size of the buffer used to discard unwanted response data. */
+#define HTTP_DISCARD_SIZE   0x1000
+
+/** EFI HTTP device structure. */
+typedef struct efi_http {
+    device_t device;                    /**< Device header. */
+    fs_mount_t mount;                   /**< Mount header. */
+
+    efi_handle_t handle;                /**< Handle to the network interface. */
+    efi_device_path_t *path;            /**< Device path. */
+    efi_http_protocol_t *http;          /**< HTTP protocol instance. */
+    char *base;                         /**< Base URL for relative paths (NULL if none). */
+} efi_http_t;
+
+/** EFI HTTP file handle structure. */
+typedef struct efi_http_handle {
+    fs_handle_t handle;                 /**< Handle to the file. */
+
+    void *data;                         /**< Whole file (if the server ignores ranges). */
+    void *buf;                          /**< Read-ahead buffer. */
+    offset_t buf_offset;                /**< Offset of the data in the read-ahead buffer. */
+    size_t buf_size;                    /**< Size of the data in the read-ahead buffer. */
+
+    efi_char16_t *url;                  /**< URL of the file. */
+    char *host;                         /**< Host name (and port) from the URL. */
+} efi_http_handle_t;
+
+/** Information from a response. */
+typedef struct http_response {
+    efi_http_status_code_t status;      /**< Status code. */
+    offset_t length;                    /**< Content-Length (HTTP_UNKNOWN if not present). */
+    offset_t range_start;               /**< Start of the returned range (HTTP_UNKNOWN if not a range). */
+} http_response_t;
+
+/** Value for response fields that were not present. */
+#define HTTP_UNKNOWN        ((offset_t)-1)
+
+/** HTTP service binding protocol GUID. */
+static efi_guid_t http_service_binding_guid = EFI_HTTP_SERVICE_BINDING_PROTOCOL_GUID;
+
+/** HTTP protocol GUID. */
+static efi_guid_t http_guid = EFI_HTTP_PROTOCOL_GUID;
+
+/** Next HTTP device ID. */
+static unsigned next_http_id;
+
+/** Wait for an HTTP token to complete.
+ * @param http          HTTP device.
+ * @param token         Token to wait for.
+ * @return              Status code describing the result of the operation. */
+static status_t wait_token(efi_http_t *http, efi_http_token_t *token) {
+    mstime_t deadline = current_time() + HTTP_TIMEOUT;
+    efi_status_t ret;
+
+    while (true) {
+        efi_call(http->http->poll, http->http);
+
+        ret = efi_call(efi_boot_services->check_event, token->event);
+        if (ret != EFI_NOT_READY)
+            break;
+
+        if (current_time() >= deadline) {
+            efi_call(http->http->cancel, http->http, token);
+            dprintf("efi: HTTP request on %s timed out\n", http->device.name);
+            return STATUS_TIMED_OUT;
+        }
+    }
+
+    if (ret == EFI_SUCCESS)
+        ret = token->status;
+
+    if (ret != EFI_SUCCESS) {
+        dprintf("efi: HTTP request on %s failed: 0x%zx\n", http->device.name, ret);
+        return efi_convert_status(ret);
+    }
+
+    return STATUS_SUCCESS;
+}
+
+/** Perform an HTTP operation (request or response) and wait for it.
+ * @param http          HTTP device.
+ * @param request       Whether this is a request.
+ * @param message       Message to send/receive into.
+ * @return              Status code describing the result of the operation. */
+static status_t do_http(efi_http_t *http, bool request, efi_http_message_t *message) {
+    efi_http_token_t token;
+    efi_status_t ret;
+    status_t err;
+
+    ret = efi_call(efi_boot_services->create_event, 0, EFI_TPL_CALLBACK, NULL, NULL, &token.event);
+    if (ret != EFI_SUCCESS)
+        return efi_convert_status(ret);
+
+    token.status = EFI_SUCCESS;
+    token.message = message;
+
+    ret = (request)
+        ? efi_call(http->http->request, http->http, &token)
+        : efi_call(http->http->response, http->http, &token);
+    if (ret == EFI_SUCCESS) {
+        err = wait_token(http, &token);
+    } else {
+        dprintf("efi: HTTP %s on %s failed: 0x%zx\n", (request) ? "request" : "response", http->device.name, ret);
+        err = efi_convert_status(ret);
+    }
+
+    efi_call(efi_boot_services->close_event, token.event);
+    return err;
+}
+
+/** Send a request.
+ * @param http          HTTP device.
+ * @param handle        Handle to the file.
+ * @param method        Request method.
+ * @param start         Start of the range to request.
+ * @param count         Size of the range to request (0 for the whole file).
+ * @return              Status code describing the result of the operation. */
+static status_t send_request(
+    efi_http_t *http, efi_http_handle_t *handle, efi_http_method_t method,
+    offset_t start, size_t count)
+{
+    efi_http_request_data_t request;
+    efi_http_message_t message;
+    efi_http_header_t headers[3];
+    char range[48];
+
+    request.method = method;
+    request.url = handle->url;
+
+    headers[0].field_name = (efi_char8_t *)"Host";
+    headers[0].field_value = (efi_char8_t *)handle->host;
+    headers[1].field_name = (efi_char8_t *)"Accept";
+    headers[1].field_value = (efi_char8_t *)"*/*";
+
+    message.data.request = &request;
+    message.headers = headers;
+    message.header_count = 2;
+    message.body = NULL;
+    message.body_length = 0;
+
+    if (count) {
+        snprintf(range, sizeof(range), "bytes=%" PRIu64 "-%" PRIu64, start, start + count - 1);
+        headers[2].field_name = (efi_char8_t *)"Range";
+        headers[2].field_value = (efi_char8_t *)range;
+        message.header_count++;
+    }
+
+    return do_http(http, true, &message);
+}
+
+/** Parse response headers.
+ * @param message       Response message.
+ * @param response      Response information to fill in. */
+static void parse_headers(efi_http_message_t *message, http_response_t *response) {
+    for (efi_uintn_t i = 0; i < message->header_count; i++) {
+        const char *name = (const char *)message->headers[i].field_name;
+        const char *value = (const char *)message->headers[i].field_value;
+
+        if (strcasecmp(name, "Content-Length") == 0) {
+            response->length = strtoull(value, NULL, 10);
+        } else if (strcasecmp(name, "Content-Range") == 0) {
+            /* "bytes <start>-<end>/<total>". */
+            if (strncasecmp(value, "bytes ", 6) == 0)
+                response->range_start = strtoull(&value[6], NULL, 10);
+        }
+    }
+}
+
+/** Free response headers (allocated by the firmware).
+ * @param message       Response message. */
+static void free_headers(efi_http_message_t *message) {
+    for (efi_uintn_t i = 0; i < message->header_count; i++) {
+        efi_free_pool(message->headers[i].field_name);
+        efi_free_pool(message->headers[i].field_value);
+    }
+
+    efi_free_pool(message->headers);
+}
+
+/** Receive the start of a response.
+ * @param http          HTTP device.
+ * @param response      Where to store response information.
+ * @return              Status code describing the result of the operation. */
+static status_t receive_response(efi_http_t *http, http_response_t *response) {
+    efi_http_response_data_t data;
+    efi_http_message_t message;
+    status_t ret;
+
+    data.status_code = 0;
+
+    message.data.response = &data;
+    message.headers = NULL;
+    message.header_count = 0;
+    message.body = NULL;
+    message.body_length = 0;
+
+    ret = do_http(http, false, &message);
+    if (ret != STATUS_SUCCESS)
+        return ret;
+
+    response->status = data.status_code;
+    response->length = HTTP_UNKNOWN;
+    response->range_start = HTTP_UNKNOWN;
+
+    if (message.headers) {
+        parse_headers(&message, response);
+        free_headers(&message);
+    }
+
+    return STATUS_SUCCESS;
+}
+
+/** Receive response body data.
+ * @param http          HTTP device.
+ * @param buf           Buffer to receive into (NULL to discard).
+ * @param count         Number of bytes to receive.
+ * @return              Status code describing the result of the operation. */
+static status_t receive_body(efi_http_t *http, void *buf, offset_t count) {
+    void *discard __cleanup_free = (buf) ? NULL : malloc(HTTP_DISCARD_SIZE);
+    efi_http_message_t message;
+    status_t ret;
+
+    while (count) {
+        message.data.response = NULL;
+        message.headers = NULL;
+        message.header_count = 0;
+        message.body = (buf) ? buf : discard;
+        message.body_length = (buf) ? count : min(count, HTTP_DISCARD_SIZE);
+
+        ret = do_http(http, false, &message);
+        if (ret != STATUS_SUCCESS) {
+            return ret;
+        } else if (!message.body_length) {
+            return STATUS_DEVICE_ERROR;
+        }
+
+        if (buf)
+            buf += message.body_length;
+
+        count -= message.body_length;
+    }
+
+    return STATUS_SUCCESS;
+}
+
+/** Read part of a file with a range request.
+ * @param handle        Handle to the file.
+ * @param buf           Buffer to read into.
+ * @param count         Number of bytes to read.
+ * @param offset        Offset to read from.
+ * @return              Status code describing the result of the operation. */
+static status_t read_range(efi_http_handle_t *handle, void *buf, size_t count, offset_t offset) {
+    efi_http_t *http = container_of(handle->handle.mount, efi_http_t, mount);
+    http_response_t response;
+    bool whole;
+    status_t ret;
+
+    whole = !offset && count == handle->handle.size;
+
+    ret = send_request(http, handle, EFI_HTTP_METHOD_GET, offset, (whole) ? 0 : count);
+    if (ret != STATUS_SUCCESS)
+        return ret;
+
+    ret = receive_response(http, &response);
+    if (ret != STATUS_SUCCESS)
+        return ret;
+
+    if (response.status == EFI_HTTP_STATUS_206_PARTIAL_CONTENT
+        && response.range_start == offset
+        && response.length != HTTP_UNKNOWN
+        && response.length >= count)
+    {
+        ret = receive_body(http, buf, count);
+        if (ret == STATUS_SUCCESS)
+            ret = receive_body(http, NULL, response.length - count);
+    } else if (response.status == EFI_HTTP_STATUS_200_OK) {
+        if (response.length != handle->handle.size) {
+            dprintf("efi: HTTP response length for %s does not match file size\n", handle->host);
+            return STATUS_DEVICE_ERROR;
+        }
+
+        if (whole) {
+            ret = receive_body(http, buf, count);
+        } else {
+            /* Server ignored the range, and we've got the whole file coming.
+             * Keep it, rather than fetching it every time we're asked for a
+             * bit of it. */
+            handle->data = malloc_large(handle->handle.size);
+
+            ret = receive_body(http, handle->data, handle->handle.size);
+            if (ret != STATUS_SUCCESS) {
+                free_large(handle->data);
+                handle->data = NULL;
+                return ret;
+            }
+
+            memcpy(buf, handle->data + offset, count);
+        }
+    } else {
+        dprintf("efi: unexpected HTTP status %u reading %s\n", response.status, handle->host);
+
+        /* The body must be consumed before the next request. */
+        if (response.length != HTTP_UNKNOWN)
+            receive_body(http, NULL, response.length);
+
+        ret = STATUS_DEVICE_ERROR;
+    }
+
+    return ret;
+}
+
+/** Read from a file.
+ * @param _handle       Handle to read from.
+ * @param buf           Buffer to read into.
+ * @param count         Number of bytes to read.
+ * @param offset        Offset to read from.
+ * @return              Status code describing the result of the operation. */
+static status_t efi_http_fs_read(fs_handle_t *_handle, void *buf, size_t count, offset_t offset) {
+    efi_http_handle_t *handle = container_of(_handle, efi_http_handle_t, handle);
+    status_t ret;
+
+    if (handle->data) {
+        memcpy(buf, handle->data + offset, count);
+        return STATUS_SUCCESS;
+    }
+
+    /* Large reads go straight into the destination. */
+    if (count >= HTTP_READ_AHEAD)
+        return read_range(handle, buf, count, offset);
+
+    /* Otherwise, a request is expensive compared to reading some more data
+     * while we're at it, so go through the read-ahead buffer. */
+    if (offset < handle->buf_offset || offset + count > handle->buf_offset + handle->buf_size) {
+        size_t size = min(HTTP_READ_AHEAD, handle->handle.size - offset);
+
+        if (!handle->buf)
+            handle->buf = malloc(HTTP_READ_AHEAD);
+
+        handle->buf_size = 0;
+
+        ret = read_range(handle, handle->buf, size, offset);
+        if (ret != STATUS_SUCCESS) {
+            return ret;
+        } else if (handle->data) {
+            return efi_http_fs_read(_handle, buf, count, offset);
+        }
+
+        handle->buf_offset = offset;
+        handle->buf_size = size;
+    }
+
+    memcpy(buf, handle->buf + (offset - handle->buf_offset), count);
+    return STATUS_SUCCESS;
+}
+
+/** Load the whole of a file.
+ * @param _handle       Handle to the file.
+ * @param alloc         Function to allocate the destination, or NULL to use a
+ *                      buffer allocated by malloc_large().
+ * @param arg           Data argument to pass to the allocation function.
+ * @param _buf          Where to store pointer to the loaded data.
+ * @return              Status code describing the result of the operation. */
+static status_t efi_http_fs_load(fs_handle_t *_handle, fs_load_alloc_t alloc, void *arg, void **_buf) {
+    efi_http_handle_t *handle = container_of(_handle, efi_http_handle_t, handle);
+    void *buf;
+    status_t ret;
+
+    buf = (alloc) ? alloc(_handle, handle->handle.size, arg) : malloc_large(handle->handle.size);
+
+    if (handle->data) {
+        memcpy(buf, handle->data, handle->handle.size);
+    } else {
+        ret = read_range(handle, buf, handle->handle.size, 0);
+        if (ret != STATUS_SUCCESS) {
+            if (!alloc)
+                free_large(buf);
+
+            return ret;
+        }
+    }
+
+    *_buf = buf;
+    return STATUS_SUCCESS;
+}
+
+/** Get the host part of a URL.
+ * @param url           URL (must begin with "http://").
+ * @return              Allocated string containing the host (and port). */
+static char *get_url_host(const char *url) {
+    const char *host = url + 7;
+    const char *end = strchr(host, '/');
+    size_t len = (end) ? (size_t)(end - host) : strlen(host);
+    char *str = malloc(len + 1);
+
+    memcpy(str, host, len);
+    str[len] = 0;
+    return str;
+}
+
+/** Open a path on the filesystem.
+ * @param mount         Mount to open from.
+ * @param path          Path to file to open, or a URL.
+ * @param from          Handle on this FS to open relative to.
+ * @param _handle       Where to store pointer to opened handle.
+ * @return              Status code describing the result of the operation. */
+static status_t efi_http_fs_open_path(fs_mount_t *mount, char *path, fs_handle_t *from, fs_handle_t **_handle) {
+    efi_http_t *http = container_of(mount, efi_http_t, mount);
+    char *url __cleanup_free = NULL;
+    efi_http_handle_t *handle;
+    http_response_t response;
+    size_t len;
+    status_t ret;
+
+    if (from)
+        return STATUS_NOT_SUPPORTED;
+
+    if (strncmp(path, "http://", 7) == 0) {
+        url = strdup(path);
+    } else if (http->base && path[0]) {
+        len = strlen(http->base) + strlen(path) + 1;
+        url = malloc(len);
+        snprintf(url, len, "%s%s", http->base, path);
+    } else {
+        return STATUS_NOT_FOUND;
+    }
+
+    len = strlen(url);
+    handle = malloc(sizeof(*handle));
+    fs_handle_init(&handle->handle, mount, FILE_TYPE_REGULAR, 0);
+    handle->data = handle->buf = NULL;
+    handle->buf_offset = handle->buf_size = 0;
+    handle->host = get_url_host(url);
+
+    /* URLs are ASCII. */
+    handle->url = malloc((len + 1) * sizeof(*handle->url));
+    for (size_t i = 0; i <= len; i++)
+        handle->url[i] = url[i];
+
+    ret = send_request(http, handle, EFI_HTTP_METHOD_HEAD, 0, 0);
+    if (ret == STATUS_SUCCESS)
+        ret = receive_response(http, &response);
+
+    if (ret == STATUS_SUCCESS) {
+        if (response.status == EFI_HTTP_STATUS_404_NOT_FOUND) {
+            ret = STATUS_NOT_FOUND;
+        } else if (response.status != EFI_HTTP_STATUS_200_OK) {
+            dprintf("efi: unexpected HTTP status %u for '%s'\n", response.status, url);
+            ret = STATUS_DEVICE_ERROR;
+        } else if (response.length == HTTP_UNKNOWN) {
+            dprintf("efi: HTTP server did not give size of '%s'\n", url);
+            ret = STATUS_NOT_SUPPORTED;
+        }
+    }
+
+    if (ret != STATUS_SUCCESS) {
+        free(handle->url);
+        free(handle->host);
+        free(handle);
+        return ret;
+    }
+
+    handle->handle.size = response.length;
+    *_handle = &handle->handle;
+    return STATUS_SUCCESS;
+}
+
+/** Close a handle.
+ * @param _handle       Handle to close. */
+static void efi_http_fs_close(fs_handle_t *_handle) {
+    efi_http_handle_t *handle = container_of(_handle, efi_http_handle_t, handle);
+
+    free_large(handle->data);
+    free(handle->buf);
+    free(handle->url);
+    free(handle->host);
+}
+
+/** EFI HTTP filesystem operations structure. */
+static fs_ops_t efi_http_fs_ops = {
+    .name = "HTTP",
+    .read = efi_http_fs_read,
+    .load = efi_http_fs_load,
+    .open_path = efi_http_fs_open_path,
+    .close = efi_http_fs_close,
+};
+
+/** Get identification information for an EFI HTTP device.
+ * @param device        Device to identify.
+ * @param type          Type of the information to get.
+ * @param buf           Where to store identification string.
+ * @param size          Size of the buffer. */
+static void efi_http_identify(device_t *device, device_identify_t type, char *buf, size_t size) {
+    efi_http_t *http = container_of(device, efi_http_t, device);
+
+    if (type == DEVICE_IDENTIFY_SHORT) {
+        snprintf(buf, size, "EFI HTTP device %pE", http->path);
+    } else if (http->base) {
+        snprintf(buf, size, "base URL = %s\n", http->base);
+    }
+}
+
+/** EFI HTTP device operations. */
+static device_ops_t efi_http_device_ops = {
+    .identify = efi_http_identify,
+};
+
+/** Get a base URL from a boot URL.
+ * @param url           Boot URL (need not be NUL-terminated).
+ * @param len           Length of the URL.
+ * @return              Allocated base URL (the URL up to its last '/'), or
+ *                      NULL if the URL is not usable. */
+static char *get_base_url(const char *url, size_t len) {
+    char *base;
+
+    len = strnlen(url, len);
+    if (len < 8 || strncmp(url, "http://", 7) != 0)
+        return NULL;
+
+    base = malloc(len + 2);
+    memcpy(base, url, len);
+    base[len] = 0;
+
+    if (strchr(&base[7], '/')) {
+        strrchr(base, '/')[1] = 0;
+    } else {
+        strcat(base, "/");
+    }
+
+    return base;
+}
+
+/** Find a boot URL for a network interface.
+ * @param handle        Handle to the network interface.
+ * @param path          Device path of the interface.
+ * @param _boot         Where to store whether we were loaded from the URL.
+ * @return              Allocated base URL, or NULL if none found. */
+static char *find_base_url(efi_handle_t handle, efi_device_path_t *path, bool *_boot) {
+    efi_device_path_t *boot_path;
+    efi_pxe_base_code_protocol_t *bc;
+    efi_guid_t pxe_base_code_guid = EFI_PXE_BASE_CODE_PROTOCOL_GUID;
+    efi_status_t ret;
+
+    /* If we were loaded by HTTP boot, our device path ends in the boot URI. */
+    boot_path = efi_get_device_path(efi_loaded_image->device_handle);
+    if (boot_path && efi_is_child_device_node(path, boot_path)) {
+        for (efi_device_path_t *node = boot_path; node; node = efi_next_device_node(node)) {
+            if (node->type == EFI_DEVICE_PATH_TYPE_MESSAGING
+                && node->subtype == EFI_DEVICE_PATH_MESSAGING_SUBTYPE_URI
+                && node->length > sizeof(*node))
+            {
+                efi_device_path_uri_t *uri = (efi_device_path_uri_t *)node;
+
+                *_boot = true;
+                return get_base_url((const char *)uri->uri, node->length - sizeof(*node));
+            }
+        }
+    }
+
+    /* Otherwise, try a URL given as the DHCP boot file name. */
+    ret = efi_open_protocol(handle, &pxe_base_code_guid, EFI_OPEN_PROTOCOL_GET_PROTOCOL, (void **)&bc);
+    if (ret == EFI_SUCCESS && bc->mode->started && !bc->mode->using_ipv6) {
+        bootp_packet_t *packet = NULL;
+
+        if (bc->mode->pxe_reply_received) {
+            packet = (bootp_packet_t *)&bc->mode->pxe_reply;
+        } else if (bc->mode->proxy_offer_received) {
+            packet = (bootp_packet_t *)&bc->mode->proxy_offer;
+        } else if (bc->mode->dhcp_ack_received) {
+            packet = (bootp_packet_t *)&bc->mode->dhcp_ack;
+        }
+
+        if (packet)
+            return get_base_url((const char *)packet->boot_file, sizeof(packet->boot_file));
+    }
+
+    return NULL;
+}
+
+/** Detect EFI HTTP devices. */
+void efi_http_init(void) {
+    efi_handle_t *handles __cleanup_free = NULL;
+    efi_uintn_t num_handles;
+    efi_status_t ret;
+
+    /* The HTTP service binding is installed on each network interface which
+     * supports HTTP. */
+    ret = efi_locate_handle(EFI_BY_PROTOCOL, &http_service_binding_guid, NULL, &handles, &num_handles);
+    if (ret != EFI_SUCCESS)
+        return;
+
+    for (efi_uintn_t i = 0; i < num_handles; i++) {
+        efi_service_binding_protocol_t *binding;
+        efi_httpv4_access_point_t access;
+        efi_http_config_data_t config;
+        efi_handle_t child = NULL;
+        efi_device_path_t *path;
+        efi_http_t *http;
+        char *name;
+        bool boot = false;
+
+        path = efi_get_device_path(handles[i]);
+        if (!path)
+            continue;
+
+        ret = efi_open_protocol(handles[i], &http_service_binding_guid, EFI_OPEN_PROTOCOL_GET_PROTOCOL, (void **)&binding);
+        if (ret != EFI_SUCCESS)
+            continue;
+
+        ret = efi_call(binding->create_child, binding, &child);
+        if (ret != EFI_SUCCESS) {
+            dprintf("efi: warning: failed to create HTTP instance for %pE: 0x%zx\n", path, ret);
+            continue;
+        }
+
+        http = malloc(sizeof(*http));
+        memset(http, 0, sizeof(*http));
+        http->handle = handles[i];
+        http->path = path;
+
+        ret = efi_open_protocol(child, &http_guid, EFI_OPEN_PROTOCOL_GET_PROTOCOL, (void **)&http->http);
+        if (ret != EFI_SUCCESS) {
+            efi_call(binding->destroy_child, binding, child);
+            free(http);
+            continue;
+        }
+
+        /* Use the address configured by DHCP (by the firmware). */
+        memset(&access, 0, sizeof(access));
+        access.use_default_address = true;
+        config.http_version = EFI_HTTP_VERSION_11;
+        config.timeout_millisec = HTTP_TIMEOUT;
+        config.local_address_is_ipv6 = false;
+        config.access_point.ipv4_node = &access;
+
+        ret = efi_call(http->http->configure, http->http, &config);
+        if (ret != EFI_SUCCESS) {
+            dprintf("efi: warning: failed to configure HTTP for %pE: 0x%zx\n", path, ret);
+            efi_call(binding->destroy_child, binding, child);
+            free(http);
+            continue;
+        }
+
+        http->base = find_base_url(handles[i], path, &boot);
+
+        name = malloc(8);
+        snprintf(name, 8, "http%u", next_http_id++);
+
+        http->device.type = DEVICE_TYPE_VIRTUAL;
+        http->device.ops = &efi_http_device_ops;
+        http->device.name = name;
+        http->mount.device = &http->device;
+        http->mount.ops = &efi_http_fs_ops;
+        device_register(&http->device);
+        http->device.mount = &http->mount;
+
+        dprintf("efi: registered %s for %pE (base URL: %s)\n", name, path, (http->base) ? http->base : "none");
+
+        /* Boot from here if we were loaded by HTTP boot. */
+        if (boot && http->base)
+            boot_device = &http->device;
+    }
+}
@@ -174,6 +174,9 @@ typedef struct efi_guid {
 /** EFI end device path subtypes. */
 #define EFI_DEVICE_PATH_END_SUBTYPE_WHOLE   0xff
 
+/** EFI messaging device path subtypes. */
+#define EFI_DEVICE_PATH_MESSAGING_SUBTYPE_URI   24
+
 /** EFI media device path subtypes. */
 #define EFI_DEVICE_PATH_MEDIA_SUBTYPE_HD    1
 #define EFI_DEVICE_PATH_MEDIA_SUBTYPE_CDROM 2
@@ -204,6 +207,12 @@ typedef struct efi_device_path_hd {
     efi_uint8_t signature_type;
 } __packed efi_device_path_hd_t;
 
+/** URI device path structure. */
+typedef struct efi_device_path_uri {
+    efi_device_path_t header;
+    efi_char8_t uri[];
+} __packed efi_device_path_uri_t;
+
 /** File device path structure. */
 typedef struct efi_device_path_file {
     efi_device_path_t header;
@@ -491,6 +500,30 @@ typedef struct efi_block_io_protocol {
     efi_status_t (*flush_blocks)(struct efi_block_io_protocol *this) __efiapi;
 } efi_block_io_protocol_t;
 
+/** Block I/O 2 protocol GUID. */
+#define EFI_BLOCK_IO2_PROTOCOL_GUID \
+    { 0xa77b2472, 0xe282, 0x4e9f, 0xa2, 0x45, 0xc2, 0xc0, 0xe2, 0x7b, 0xbc, 0xc1 }
+
+/** Block I/O 2 request token. */
+typedef struct efi_block_io2_token {
+    efi_event_t event;
+    efi_status_t transaction_status;
+} efi_block_io2_token_t;
+
+/** Block I/O 2 protocol. */
+typedef struct efi_block_io2_protocol {
+    efi_block_io_media_t *media;
+
+    efi_status_t (*reset)(struct efi_block_io2_protocol *this, bool extended_verification) __efiapi;
+    efi_status_t (*read_blocks_ex)(
+        struct efi_block_io2_protocol *this, efi_uint32_t media_id, efi_lba_t lba,
+        efi_block_io2_token_t *token, efi_uintn_t buffer_size, void *buffer) __efiapi;
+    efi_status_t (*write_blocks_ex)(
+        struct efi_block_io2_protocol *this, efi_uint32_t media_id, efi_lba_t lba,
+        efi_block_io2_token_t *token, efi_uintn_t buffer_size, const void *buffer) __efiapi;
+    efi_status_t (*flush_blocks_ex)(struct efi_block_io2_protocol *this, efi_block_io2_token_t *token) __efiapi;
+} efi_block_io2_protocol_t;
+
 /**
  * EFI simple network protocol definitions.
  */
@@ -687,6 +720,14 @@ typedef struct efi_pxe_base_code_discover_info {
     efi_pxe_base_code_srvlist_t srv_list[1];
 } efi_pxe_base_code_discover_info_t;
 
+/** UDP operation flags. */
+#define EFI_PXE_BASE_CODE_UDP_OPFLAGS_ANY_SRC_IP    0x1
+#define EFI_PXE_BASE_CODE_UDP_OPFLAGS_ANY_SRC_PORT  0x2
+#define EFI_PXE_BASE_CODE_UDP_OPFLAGS_ANY_DEST_IP   0x4
+#define EFI_PXE_BASE_CODE_UDP_OPFLAGS_ANY_DEST_PORT 0x8
+#define EFI_PXE_BASE_CODE_UDP_OPFLAGS_USE_FILTER    0x10
+#define EFI_PXE_BASE_CODE_UDP_OPFLAGS_MAY_FRAGMENT  0x20
+
 /** TFTP opcode definitions. */
 typedef enum efi_pxe_base_code_tftp_opcode {
     EFI_PXE_BASE_CODE_TFTP_FIRST,
@@ -840,6 +881,129 @@ typedef struct efi_pxe_base_code_protocol {
     efi_pxe_base_code_mode_t *mode;
 } efi_pxe_base_code_protocol_t;
 
+/**
+ * EFI HTTP protocol definitions.
+ */
+
+/** Service binding protocol (used to create HTTP protocol instances). */
+typedef struct efi_service_binding_protocol {
+    efi_status_t (*create_child)(
+        struct efi_service_binding_protocol *this,
+        efi_handle_t *child_handle) __efiapi;
+    efi_status_t (*destroy_child)(
+        struct efi_service_binding_protocol *this,
+        efi_handle_t child_handle) __efiapi;
+} efi_service_binding_protocol_t;
+
+/** HTTP service binding protocol GUID. */
+#define EFI_HTTP_SERVICE_BINDING_PROTOCOL_GUID \
+    { 0xbdc8e6af, 0xd9bc, 0x4379, 0xa7, 0x2a, 0xe0, 0xc4, 0xe7, 0x5d, 0xae, 0x1c }
+
+/** HTTP protocol GUID. */
+#define EFI_HTTP_PROTOCOL_GUID \
+    { 0x7a59b29b, 0x910b, 0x4171, 0x82, 0x42, 0xa8, 0x5a, 0x0d, 0xf2, 0x5b, 0x5b }
+
+/** HTTP versions. */
+typedef enum efi_http_version {
+    EFI_HTTP_VERSION_10,
+    EFI_HTTP_VERSION_11,
+    EFI_HTTP_VERSION_UNSUPPORTED,
+} efi_http_version_t;
+
+/** HTTP methods. */
+typedef enum efi_http_method {
+    EFI_HTTP_METHOD_GET,
+    EFI_HTTP_METHOD_POST,
+    EFI_HTTP_METHOD_PATCH,
+    EFI_HTTP_METHOD_OPTIONS,
+    EFI_HTTP_METHOD_CONNECT,
+    EFI_HTTP_METHOD_HEAD,
+    EFI_HTTP_METHOD_PUT,
+    EFI_HTTP_METHOD_DELETE,
+    EFI_HTTP_METHOD_TRACE,
+} efi_http_method_t;
+
+/** HTTP status codes (subset, these are enumeration values). */
+typedef efi_uint32_t efi_http_status_code_t;
+#define EFI_HTTP_STATUS_200_OK                  3
+#define EFI_HTTP_STATUS_206_PARTIAL_CONTENT     9
+#define EFI_HTTP_STATUS_404_NOT_FOUND           21
+
+/** HTTP IPv4 access point structure. */
+typedef struct efi_httpv4_access_point {
+    efi_boolean_t use_default_address;
+    efi_ipv4_address_t local_address;
+    efi_ipv4_address_t local_subnet;
+    efi_uint16_t local_port;
+} efi_httpv4_access_point_t;
+
+/** HTTP configuration data structure. */
+typedef struct efi_http_config_data {
+    efi_http_version_t http_version;
+    efi_uint32_t timeout_millisec;
+    efi_boolean_t local_address_is_ipv6;
+    union {
+        efi_httpv4_access_point_t *ipv4_node;
+        void *ipv6_node;
+    } access_point;
+} efi_http_config_data_t;
+
+/** HTTP request data structure. */
+typedef struct efi_http_request_data {
+    efi_http_method_t method;
+    efi_char16_t *url;
+} efi_http_request_data_t;
+
+/** HTTP response data structure. */
+typedef struct efi_http_response_data {
+    efi_http_status_code_t status_code;
+} efi_http_response_data_t;
+
+/** HTTP header structure. */
+typedef struct efi_http_header {
+    efi_char8_t *field_name;
+    efi_char8_t *field_value;
+} efi_http_header_t;
+
+/** HTTP message structure. */
+typedef struct efi_http_message {
+    union {
+        efi_http_request_data_t *request;
+        efi_http_response_data_t *response;
+    } data;
+    efi_uintn_t header_count;
+    efi_http_header_t *headers;
+    efi_uintn_t body_length;
+    void *body;
+} efi_http_message_t;
+
+/** HTTP token structure. */
+typedef struct efi_http_token {
+    efi_event_t event;
+    efi_status_t status;
+    efi_http_message_t *message;
+} efi_http_token_t;
+
+/** HTTP protocol. */
+typedef struct efi_http_protocol {
+    efi_status_t (*get_mode_data)(
+        struct efi_http_protocol *this,
+        efi_http_config_data_t *http_config_data) __efiapi;
+    efi_status_t (*configure)(
+        struct efi_http_protocol *this,
+        efi_http_config_data_t *http_config_data) __efiapi;
+    efi_status_t (*request)(
+        struct efi_http_protocol *this,
+        efi_http_token_t *token) __efiapi;
+    efi_status_t (*cancel)(
+        struct efi_http_protocol *this,
+        efi_http_token_t *token) __efiapi;
+    efi_status_t (*response)(
+        struct efi_http_protocol *this,
+        efi_http_token_t *token) __efiapi;
+    efi_status_t (*poll)(struct efi_http_protocol *this) __efiapi;
+} efi_http_protocol_t;
+
 /**
  * EFI boot services definitions.
  */
@@ -912,6 +1076,12 @@ typedef void (*efi_event_notify_t)(efi_event_t event, void *context) __efiapi;
 #define EFI_EVT_SIGNAL_EXIT_BOOT_SERVICES       0x00000201
 #define EFI_EVT_SIGNAL_VIRTUAL_ADDRESS_CHANGE   0x60000202
 
+/** Task priority levels. */
+#define EFI_TPL_APPLICATION                     4
+#define EFI_TPL_CALLBACK                        8
+#define EFI_TPL_NOTIFY                          16
+#define EFI_TPL_HIGH_LEVEL                      31
+
 /** Timer delay type. */
 typedef enum efi_timer_delay {
     EFI_TIMER_CANCEL,
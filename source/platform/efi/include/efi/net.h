@@ -28,5 +28,6 @@ extern bool efi_net_is_net_device(efi_handle_t handle);
 extern efi_handle_t efi_net_get_handle(net_device_t *net);
 
 extern void efi_net_init(void);
+extern void efi_http_init(void);
 
 #endif /* __EFI_NET_H */
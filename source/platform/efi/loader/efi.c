@@ -55,11 +55,8 @@ static __noreturn void efi_loader_load(void *_loader) {
     efi_status_t status;
     status_t ret;
 
-    /* Allocate a buffer to read the image into. */
-    buf = malloc_large(loader->handle->size);
-
-    /* Read it in. */
-    ret = fs_read(loader->handle, buf, loader->handle->size, 0);
+    /* Read the image in. */
+    ret = fs_load(loader->handle, NULL, NULL, &buf);
     if (ret != STATUS_SUCCESS)
         boot_error("Error reading EFI image: %pS", ret);
 
@@ -27,9 +27,15 @@
  *
  * The AllocatePages boot service cannot provide all the functionality of
  * memory_alloc() (no alignment or minimum address constraints). Therefore,
- * we implement memory_alloc() by getting the current memory map each time it
- * is called and scanning it for a suitable range, and then allocating an exact
- * range with AllocatePages.
+ * we implement memory_alloc() by scanning for a suitable free range, and then
+ * allocating an exact range with AllocatePages. Fetching and sorting the
+ * memory map for every allocation is slow, so we keep a sorted index of free
+ * ranges built from the memory map, and update it ourself as we allocate and
+ * free memory. The firmware can also allocate memory behind our back, so the
+ * index may say that a range is free when it is not: in this case the exact
+ * AllocatePages fails, and we rebuild the index from the memory map and try
+ * again. Likewise, before giving up on an allocation, the index is rebuilt in
+ * case memory has been freed since.
  *
  * There is a widespread bug which prevents the use of user-defined memory type
  * values, which causes the firmware to crash if a value outside of the pre-
@@ -49,12 +55,25 @@
 #include <config.h>
 #include <loader.h>
 #include <memory.h>
+#include <time.h>
+
+/** Structure describing a free range in the free range index. */
+typedef struct efi_free_range {
+    phys_ptr_t start;                   /**< Start of the range. */
+    phys_ptr_t end;                     /**< Last byte of the range. */
+} efi_free_range_t;
 
 /** List of allocated memory ranges. */
 static LIST_DECLARE(efi_memory_ranges);
 
+/** Index of free memory ranges, sorted by address. */
+static efi_free_range_t *efi_free_ranges;
+static size_t efi_free_count;
+static size_t efi_free_capacity;
+static bool efi_free_valid;
+
 /** Check whether a range can satisfy an allocation.
- * @param range         Memory descriptor for range to check.
+ * @param range         Free range to check.
  * @param size          Size of the allocation.
  * @param align         Alignment of the allocation.
  * @param min_addr      Minimum address for the start of the allocated range.
@@ -63,20 +82,15 @@ static LIST_DECLARE(efi_memory_ranges);
  * @param _phys         Where to store address for allocation.
  * @return              Whether the range can satisfy the allocation. */
 static bool is_suitable_range(
-    efi_memory_descriptor_t *range, phys_size_t size, phys_size_t align,
+    efi_free_range_t *range, phys_size_t size, phys_size_t align,
     phys_ptr_t min_addr, phys_ptr_t max_addr, unsigned flags,
     efi_physical_address_t *_phys)
 {
-    phys_ptr_t start, range_end, match_start, match_end;
-
-    if (range->type != EFI_CONVENTIONAL_MEMORY)
-        return false;
-
-    range_end = range->physical_start + (range->num_pages * EFI_PAGE_SIZE) - 1;
+    phys_ptr_t start, match_start, match_end;
 
     /* Check if this range contains addresses in the requested range. */
-    match_start = max(min_addr, range->physical_start);
-    match_end = min(max_addr, range_end);
+    match_start = max(min_addr, range->start);
+    match_end = min(max_addr, range->end);
     if (match_end <= match_start)
         return false;
 
@@ -109,20 +123,185 @@ static int forward_sort_compare(const void *a, const void *b) {
     }
 }
 
-/** Reverse sort comparison function for the EFI memory map. */
-static int reverse_sort_compare(const void *a, const void *b) {
-    const efi_memory_descriptor_t *first = a;
-    const efi_memory_descriptor_t *second = b;
+/** Ensure that the free range index has space for a number of entries.
+ * @note                This may recursively allocate memory, so should be
+ *                      done before looking anything up in the index.
+ * @param count         Number of entries needed. */
+static void reserve_free_ranges(size_t count) {
+    while (efi_free_capacity < count) {
+        size_t capacity = max(max(efi_free_capacity * 2, count), 32);
+        efi_free_range_t *ranges = malloc(capacity * sizeof(*ranges));
+
+        /* Allocating may have recursed and grown the index already. */
+        if (capacity > efi_free_capacity) {
+            memcpy(ranges, efi_free_ranges, efi_free_count * sizeof(*ranges));
+            free(efi_free_ranges);
+            efi_free_ranges = ranges;
+            efi_free_capacity = capacity;
+        } else {
+            free(ranges);
+        }
+    }
+}
 
-    if (second->physical_start > first->physical_start) {
-        return 1;
-    } else if (second->physical_start < first->physical_start) {
-        return -1;
+/** Rebuild the free range index from the firmware memory map. */
+static void sync_free_ranges(void) {
+    efi_memory_descriptor_t *memory_map __cleanup_free = NULL;
+    efi_uintn_t num_entries, map_key;
+    efi_status_t ret;
+
+    while (true) {
+        ret = efi_get_memory_map(&memory_map, &num_entries, &map_key);
+        if (ret != EFI_SUCCESS)
+            internal_error("Failed to get memory map (0x%zx)", ret);
+
+        if (efi_free_capacity >= num_entries)
+            break;
+
+        /* Growing the index may allocate memory, which would make the map we
+         * have out of date, so get it again afterwards. */
+        free(memory_map);
+        memory_map = NULL;
+        reserve_free_ranges(num_entries);
+    }
+
+    /* EFI does not specify that the memory map is sorted, so make sure it is. */
+    qsort(memory_map, num_entries, sizeof(*memory_map), forward_sort_compare);
+
+    /* Merge adjacent ranges so that allocations can span them. */
+    efi_free_count = 0;
+    for (efi_uintn_t i = 0; i < num_entries; i++) {
+        phys_ptr_t start = memory_map[i].physical_start;
+        phys_ptr_t end = start + (memory_map[i].num_pages * EFI_PAGE_SIZE) - 1;
+
+        if (memory_map[i].type != EFI_CONVENTIONAL_MEMORY || !memory_map[i].num_pages)
+            continue;
+
+        if (efi_free_count && efi_free_ranges[efi_free_count - 1].end + 1 == start) {
+            efi_free_ranges[efi_free_count - 1].end = end;
+        } else {
+            efi_free_ranges[efi_free_count].start = start;
+            efi_free_ranges[efi_free_count].end = end;
+            efi_free_count++;
+        }
+    }
+
+    efi_free_valid = true;
+}
+
+/** Find the first free range ending at or after an address.
+ * @param addr          Address to search for.
+ * @return              Index of the range (efi_free_count if none). */
+static size_t find_free_range(phys_ptr_t addr) {
+    size_t low = 0, high = efi_free_count;
+
+    while (low < high) {
+        size_t mid = low + ((high - low) / 2);
+
+        if (efi_free_ranges[mid].end < addr) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+
+    return low;
+}
+
+/** Remove an allocated range from the free range index.
+ * @param start         Start of the range.
+ * @param size          Size of the range. */
+static void remove_free_range(phys_ptr_t start, phys_size_t size) {
+    phys_ptr_t end = start + size - 1;
+    efi_free_range_t *range;
+    size_t index;
+
+    reserve_free_ranges(efi_free_count + 1);
+
+    index = find_free_range(start);
+    range = &efi_free_ranges[index];
+
+    /* If the index is out of date, the next allocation will resync it. */
+    if (index == efi_free_count || range->start > start || range->end < end) {
+        efi_free_valid = false;
+        return;
+    }
+
+    if (range->start == start && range->end == end) {
+        memmove(range, range + 1, (efi_free_count - index - 1) * sizeof(*range));
+        efi_free_count--;
+    } else if (range->start == start) {
+        range->start = end + 1;
+    } else if (range->end == end) {
+        range->end = start - 1;
     } else {
-        return 0;
+        memmove(range + 1, range, (efi_free_count - index) * sizeof(*range));
+        efi_free_count++;
+        range[0].end = start - 1;
+        range[1].start = end + 1;
     }
 }
 
+/** Add a freed range to the free range index.
+ * @param start         Start of the range.
+ * @param size          Size of the range. */
+static void insert_free_range(phys_ptr_t start, phys_size_t size) {
+    phys_ptr_t end = start + size - 1;
+    efi_free_range_t *range;
+    size_t index;
+
+    reserve_free_ranges(efi_free_count + 1);
+
+    index = find_free_range(start);
+    range = &efi_free_ranges[index];
+
+    if (index < efi_free_count && range->start <= end) {
+        efi_free_valid = false;
+        return;
+    }
+
+    /* Merge with the neighbouring ranges if they are adjacent. */
+    if (index > 0 && range[-1].end + 1 == start) {
+        range[-1].end = end;
+
+        if (index < efi_free_count && range->start == end + 1) {
+            range[-1].end = range->end;
+            memmove(range, range + 1, (efi_free_count - index - 1) * sizeof(*range));
+            efi_free_count--;
+        }
+    } else if (index < efi_free_count && range->start == end + 1) {
+        range->start = start;
+    } else {
+        memmove(range + 1, range, (efi_free_count - index) * sizeof(*range));
+        efi_free_count++;
+        range->start = start;
+        range->end = end;
+    }
+}
+
+/** Search the free range index for a range to allocate.
+ * @param size          Size of the allocation.
+ * @param align         Alignment of the allocation.
+ * @param min_addr      Minimum address for the start of the allocated range.
+ * @param max_addr      Maximum address of the end of the allocated range.
+ * @param flags         Behaviour flags.
+ * @param _phys         Where to store address for allocation.
+ * @return              Whether a suitable range was found. */
+static bool find_allocation(
+    phys_size_t size, phys_size_t align, phys_ptr_t min_addr, phys_ptr_t max_addr,
+    unsigned flags, efi_physical_address_t *_phys)
+{
+    /* Search backwards if we want the highest possible address. */
+    for (size_t i = 0; i < efi_free_count; i++) {
+        size_t index = (flags & MEMORY_ALLOC_HIGH) ? efi_free_count - i - 1 : i;
+
+        if (is_suitable_range(&efi_free_ranges[index], size, align, min_addr, max_addr, flags, _phys))
+            return true;
+    }
+
+    return false;
+}
+
 /** Allocate a range of physical memory.
  * @param size          Size of the range (multiple of PAGE_SIZE).
  * @param align         Alignment of the range (power of 2, at least PAGE_SIZE).
@@ -136,9 +315,8 @@ void *memory_alloc(
     phys_size_t size, phys_size_t align, phys_ptr_t min_addr, phys_ptr_t max_addr,
     uint8_t type, unsigned flags, phys_ptr_t *_phys)
 {
-    efi_memory_descriptor_t *memory_map __cleanup_free = NULL;
-    efi_uintn_t num_entries, map_key;
     efi_status_t ret;
+    bool synced;
 
     assert(!(size % PAGE_SIZE));
     assert(!(align % PAGE_SIZE));
@@ -155,49 +333,60 @@ void *memory_alloc(
     assert((max_addr - min_addr) >= (size - 1));
     assert(type != MEMORY_TYPE_FREE);
 
-    /* Get the current memory map. */
-    ret = efi_get_memory_map(&memory_map, &num_entries, &map_key);
-    if (ret != EFI_SUCCESS)
-        internal_error("Failed to get memory map (0x%zx)", ret);
+    /* Make sure updating the index after allocating won't need to allocate. */
+    reserve_free_ranges(efi_free_count + 1);
 
-    /* EFI does not specify that the memory map is sorted, so make sure it is.
-     * Sort in forward or reverse order depending on whether we want to allocate
-     * highest possible address first. */
-    qsort(memory_map, num_entries, sizeof(*memory_map),
-        (flags & MEMORY_ALLOC_HIGH) ? reverse_sort_compare : forward_sort_compare);
+    synced = false;
+    if (!efi_free_valid) {
+        sync_free_ranges();
+        synced = true;
+    }
 
-    /* Find a free range that is large enough to hold the new range. */
-    for (efi_uintn_t i = 0; i < num_entries; i++) {
+    while (true) {
         efi_physical_address_t start;
         memory_range_t *range;
 
-        if (is_suitable_range(&memory_map[i], size, align, min_addr, max_addr, flags, &start)) {
-            /* Ask the firmware to allocate this exact address. Should succeed
-             * as it is marked in the memory map as free, so raise an error if
-             * this fails. */
-            ret = efi_call(
-                efi_boot_services->allocate_pages,
-                EFI_ALLOCATE_ADDRESS, EFI_LOADER_DATA, size / EFI_PAGE_SIZE, &start);
-            if (ret != STATUS_SUCCESS)
+        if (!find_allocation(size, align, min_addr, max_addr, flags, &start)) {
+            if (synced)
+                break;
+
+            sync_free_ranges();
+            synced = true;
+            continue;
+        }
+
+        /* Ask the firmware to allocate this exact address. If it is not free
+         * then the index is out of date, so rebuild it and try again. */
+        ret = efi_call(
+            efi_boot_services->allocate_pages,
+            EFI_ALLOCATE_ADDRESS, EFI_LOADER_DATA, size / EFI_PAGE_SIZE, &start);
+        if (ret != EFI_SUCCESS) {
+            if (ret != EFI_NOT_FOUND || synced)
                 internal_error("Failed to allocate memory (0x%zx)", ret);
 
-            /* Add a structure to track the allocation type (see comment at top). */
-            range = malloc(sizeof(*range));
-            range->start = start;
-            range->size = size;
-            range->type = type;
-            list_init(&range->header);
-            list_append(&efi_memory_ranges, &range->header);
+            sync_free_ranges();
+            synced = true;
+            continue;
+        }
 
-            dprintf(
-                "memory: allocated 0x%" PRIxPHYS "-0x%" PRIxPHYS " (align: 0x%" PRIxPHYS ", type: %u)\n",
-                start, start + size, align, type);
+        remove_free_range(start, size);
 
-            if (_phys)
-                *_phys = start;
+        /* Add a structure to track the allocation type (see comment at top). */
+        range = malloc(sizeof(*range));
+        range->start = start;
+        range->size = size;
+        range->type = type;
+        list_init(&range->header);
+        list_append(&efi_memory_ranges, &range->header);
 
-            return (void *)phys_to_virt(start);
-        }
+        dprintf(
+            "memory: allocated 0x%" PRIxPHYS "-0x%" PRIxPHYS " (align: 0x%" PRIxPHYS ", type: %u)\n",
+            start, start + size, align, type);
+
+        if (_phys)
+            *_phys = start;
+
+        return (void *)phys_to_virt(start);
     }
 
     if (flags & MEMORY_ALLOC_CAN_FAIL) {
@@ -234,6 +423,8 @@ void memory_free(void *addr, phys_size_t size) {
 
             list_remove(&range->header);
             free(range);
+
+            insert_free_range(phys, size);
             return;
         }
     }
@@ -291,7 +482,10 @@ void memory_snapshot(list_t *map) {
 /** Finalize the memory map.
  * @param map           Head of list to place the memory map into. */
 void memory_finalize(list_t *map) {
+    uint64_t start = trace_begin();
+
     get_memory_map(map, true);
+    trace_end(TRACE_PHASE_MEMORY, start, 0, NULL);
 }
 
 /** Initialize the EFI memory allocator. */
@@ -334,4 +528,6 @@ void efi_memory_cleanup(void) {
         list_remove(&range->header);
         free(range);
     }
+
+    efi_free_valid = false;
 }
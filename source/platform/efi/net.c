@@ -18,13 +18,16 @@
  * @file
  * @brief               EFI network device support.
  *
- * TODO:
- *  - Annoyingly the PXE TFTP API provided by EFI is a regression compared to
- *    legacy PXE: it is only able to transfer a whole file, not packet by
- *    packet. This means we have to read a whole file in and buffer it somewhere
- *    in order to not have terrible performance. In future, it may be a better
- *    solution to implement TFTP ourselves over the UdpRead/UdpWrite functions
- *    provided by the PXE BC protocol.
+ * The PXE TFTP API provided by EFI is a regression compared to legacy PXE: it
+ * is only able to transfer a whole file, not packet by packet, and it does not
+ * let us negotiate the block size or window size. Instead we implement TFTP
+ * ourselves over the UdpRead/UdpWrite functions provided by the PXE BC
+ * protocol, which lets us stream files straight into their destination.
+ *
+ * If our own client fails for any reason other than a missing file, we fall
+ * back to the firmware's Mtftp() function for the rest of the session. This
+ * has to read a whole file in and buffer it somewhere in order to not have
+ * terrible performance.
  */
 
 #include <efi/device.h>
@@ -37,6 +40,7 @@
 #include <fs.h>
 #include <loader.h>
 #include <memory.h>
+#include <tftp.h>
 
 /** EFI PXE network device structure. */
 typedef struct efi_net {
@@ -46,12 +50,19 @@ typedef struct efi_net {
     efi_pxe_base_code_protocol_t *bc;   /**< PXE base code protocol. */
     efi_handle_t handle;                /**< Handle to network device. */
     efi_device_path_t *path;            /**< Device path. */
+
+    uint16_t max_block_size;            /**< Largest TFTP block size to request. */
+    bool native;                        /**< Whether to use our own TFTP client. */
+    struct efi_net_handle *current;     /**< Handle with a transfer in progress. */
 } efi_net_t;
 
 /** EFI PXE file handle structure. */
 typedef struct efi_net_handle {
     fs_handle_t handle;                 /**< Handle to the file. */
-    void *data;                         /**< Data for the file. */
+    bool native;                        /**< Whether the file is read with our client. */
+    tftp_transfer_t transfer;           /**< TFTP transfer state. */
+    void *data;                         /**< Data for the file (firmware TFTP only). */
+    net_cache_entry_t *cache;           /**< Network file cache entry. */
     char path[];                        /**< Path to the file. */
 } efi_net_handle_t;
 
@@ -81,6 +92,122 @@ static net_ops_t efi_net_ops = {
     .identify = efi_net_identify,
 };
 
+/** Send a TFTP packet.
+ * @param transfer      Transfer that the packet belongs to.
+ * @param buf           Packet to send.
+ * @param size          Size of the packet.
+ * @param port          Server UDP port to send to.
+ * @return              Status code describing the result of the operation. */
+static status_t efi_tftp_send(tftp_transfer_t *transfer, const void *buf, size_t size, uint16_t port) {
+    efi_net_t *net = container_of(transfer->net, efi_net_t, net);
+    efi_pxe_base_code_udp_port_t dest_port = port;
+    efi_pxe_base_code_udp_port_t src_port = transfer->local_port;
+    efi_ip_address_t *gateway_ip;
+    efi_uintn_t buf_size = size;
+    efi_status_t ret;
+
+    gateway_ip = (net->net.gateway_ip.v4.val) ? (efi_ip_address_t *)&net->net.gateway_ip : NULL;
+
+    ret = efi_call(net->bc->udp_write,
+        net->bc, 0, (efi_ip_address_t *)&net->net.server_ip, &dest_port, gateway_ip,
+        NULL, &src_port, NULL, NULL, &buf_size, (void *)buf);
+    if (ret != EFI_SUCCESS) {
+        dprintf("efi: failed to send UDP packet: 0x%zx\n", ret);
+        return efi_convert_status(ret);
+    }
+
+    return STATUS_SUCCESS;
+}
+
+/** Receive a TFTP packet.
+ * @param transfer      Transfer to receive for.
+ * @param buf           Buffer to receive into.
+ * @param _size         On input, size of the buffer. On output, size of the
+ *                      received packet.
+ * @param _port         Where to store server UDP port the packet is from.
+ * @param timeout       Maximum time to wait (in milliseconds).
+ * @return              Status code describing the result of the operation. */
+static status_t efi_tftp_receive(
+    tftp_transfer_t *transfer, void *buf, size_t *_size, uint16_t *_port,
+    mstime_t timeout)
+{
+    efi_net_t *net = container_of(transfer->net, efi_net_t, net);
+    mstime_t deadline = current_time() + timeout;
+
+    do {
+        efi_ip_address_t dest_ip = net->bc->mode->station_ip;
+        efi_ip_address_t src_ip = *(efi_ip_address_t *)&net->net.server_ip;
+        efi_pxe_base_code_udp_port_t dest_port = transfer->local_port;
+        efi_pxe_base_code_udp_port_t src_port;
+        efi_uintn_t size = *_size;
+        efi_status_t ret;
+
+        ret = efi_call(net->bc->udp_read,
+            net->bc, EFI_PXE_BASE_CODE_UDP_OPFLAGS_ANY_SRC_PORT, &dest_ip, &dest_port,
+            &src_ip, &src_port, NULL, NULL, &size, buf);
+        if (ret == EFI_SUCCESS) {
+            *_size = size;
+            *_port = src_port;
+            return STATUS_SUCCESS;
+        } else if (ret != EFI_TIMEOUT && ret != EFI_BUFFER_TOO_SMALL) {
+            dprintf("efi: failed to receive UDP packet: 0x%zx\n", ret);
+            return efi_convert_status(ret);
+        }
+    } while (current_time() < deadline);
+
+    return STATUS_TIMED_OUT;
+}
+
+/** EFI TFTP transport operations. */
+static const tftp_ops_t efi_tftp_ops = {
+    .send = efi_tftp_send,
+    .receive = efi_tftp_receive,
+};
+
+/** Make a handle the one with a transfer in progress.
+ * @param handle        Handle to switch to. */
+static void set_current(efi_net_handle_t *handle) {
+    efi_net_t *net = container_of(handle->handle.mount, efi_net_t, mount);
+
+    /* We only keep one transfer going at a time. Packets for any other transfer
+     * would be discarded while we wait for ours, so end it now rather than
+     * leaving the server to time out. */
+    if (net->current && net->current != handle)
+        tftp_close(&net->current->transfer);
+
+    net->current = handle;
+}
+
+/** Read a whole file using TFTP.
+ * @param handle        Handle to the file.
+ * @param buf           Buffer to read into (must be the size of the file).
+ * @return              Status code describing the result of the operation. */
+static status_t read_file(efi_net_handle_t *handle, void *buf) {
+    efi_net_t *net = container_of(handle->handle.mount, efi_net_t, mount);
+    efi_uint64_t size;
+    efi_status_t ret;
+
+    size = handle->handle.size;
+
+    ret = efi_call(net->bc->mtftp,
+        net->bc, EFI_PXE_BASE_CODE_TFTP_READ_FILE, buf, false, &size, NULL,
+        (efi_ip_address_t *)&net->net.server_ip, (efi_char8_t *)handle->path,
+        NULL, false);
+    if (ret != STATUS_SUCCESS) {
+        if (ret == EFI_TFTP_ERROR) {
+            uint8_t error = net->bc->mode->tftp_error.error_code;
+
+            dprintf("efi: TFTP error reading '%s': %u\n", handle->path, error);
+            return STATUS_DEVICE_ERROR;
+        } else {
+            dprintf("efi: failed to read '%s': 0x%zx\n", handle->path, ret);
+            return efi_convert_status(ret);
+        }
+    }
+
+    return STATUS_SUCCESS;
+}
+
 /** Read from a file.
  * @param _handle       Handle to read from.
  * @param buf           Buffer to read into.
@@ -89,70 +216,117 @@ static net_ops_t efi_net_ops = {
  * @return              Status code describing the result of the operation. */
 static status_t efi_net_fs_read(fs_handle_t *_handle, void *buf, size_t count, offset_t offset) {
     efi_net_handle_t *handle = container_of(_handle, efi_net_handle_t, handle);
-    efi_net_t *net = container_of(_handle->mount, efi_net_t, mount);
-    void *data;
+    status_t ret;
+
+    if (net_cache_read(handle->cache, buf, count, offset))
+        return STATUS_SUCCESS;
+
+    if (handle->native) {
+        set_current(handle);
+        ret = tftp_read(&handle->transfer, buf, count, offset);
+        if (ret == STATUS_SUCCESS)
+            net_cache_store(handle->cache, buf, count, offset);
+
+        return ret;
+    }
 
     /* See the note at the top of the file. EFI only gives us an API to read a
      * whole file. Allocate a buffer for it and read it in, then keep it so we
      * don't have to re-read every read call. This is super nasty... */
     if (!handle->data) {
-        efi_uint64_t size;
-        efi_status_t ret;
+        if (!offset && count == handle->handle.size) {
+            /* Assume this is a single read of the whole file. */
+            ret = read_file(handle, buf);
+            if (ret == STATUS_SUCCESS)
+                net_cache_store(handle->cache, buf, count, 0);
 
-        size = handle->handle.size;
+            return ret;
+        }
 
-        if (!offset && count == size) {
-            /* Assume this is a single read of the whole file. */
-            data = buf;
-        } else {
-            handle->data = malloc_large(size);
-            data = handle->data;
+        handle->data = malloc_large(handle->handle.size);
+
+        ret = read_file(handle, handle->data);
+        if (ret != STATUS_SUCCESS) {
+            free_large(handle->data);
+            handle->data = NULL;
+            return ret;
         }
 
-        ret = efi_call(net->bc->mtftp,
-            net->bc, EFI_PXE_BASE_CODE_TFTP_READ_FILE, data, false, &size, NULL,
-            (efi_ip_address_t *)&net->net.server_ip, (efi_char8_t *)handle->path,
-            NULL, false);
+        net_cache_store(handle->cache, handle->data, handle->handle.size, 0);
+    }
+
+    memcpy(buf, handle->data + offset, count);
+    return STATUS_SUCCESS;
+}
+
+/** Load the whole of a file.
+ * @param _handle       Handle to the file.
+ * @param alloc         Function to allocate the destination, or NULL to use a
+ *                      buffer allocated by malloc_large().
+ * @param arg           Data argument to pass to the allocation function.
+ * @param _buf          Where to store pointer to the loaded data.
+ * @return              Status code describing the result of the operation. */
+static status_t efi_net_fs_load(fs_handle_t *_handle, fs_load_alloc_t alloc, void *arg, void **_buf) {
+    efi_net_handle_t *handle = container_of(_handle, efi_net_handle_t, handle);
+    void *buf;
+    status_t ret;
+
+    if (handle->cache && handle->cache->chunks[0].valid == handle->handle.size) {
+        buf = (alloc) ? alloc(_handle, handle->handle.size, arg) : malloc_large(handle->handle.size);
+        net_cache_read(handle->cache, buf, handle->handle.size, 0);
+    } else if (handle->native) {
+        buf = (alloc) ? alloc(_handle, handle->handle.size, arg) : malloc_large(handle->handle.size);
+
+        set_current(handle);
+        ret = tftp_read(&handle->transfer, buf, handle->handle.size, 0);
         if (ret != STATUS_SUCCESS) {
-            if (ret == EFI_TFTP_ERROR) {
-                uint8_t error = net->bc->mode->tftp_error.error_code;
+            if (!alloc)
+                free_large(buf);
 
-                dprintf("efi: TFTP error reading '%s': %u\n", handle->path, error);
-                return STATUS_DEVICE_ERROR;
-            } else {
-                dprintf("efi: failed to read '%s': 0x%zx\n", handle->path, ret);
-                return efi_convert_status(ret);
-            }
+            return ret;
+        }
+
+        net_cache_store(handle->cache, buf, handle->handle.size, 0);
+    } else if (handle->data) {
+        /* We already have the whole file from an earlier partial read. If the
+         * caller is happy with a malloc_large() buffer, give it ours. */
+        if (!alloc) {
+            *_buf = handle->data;
+            handle->data = NULL;
+            return STATUS_SUCCESS;
         }
+
+        buf = alloc(_handle, handle->handle.size, arg);
+        memcpy(buf, handle->data, handle->handle.size);
     } else {
-        data = handle->data;
-    }
+        /* Transfer straight into the destination. */
+        buf = (alloc) ? alloc(_handle, handle->handle.size, arg) : malloc_large(handle->handle.size);
+
+        ret = read_file(handle, buf);
+        if (ret != STATUS_SUCCESS) {
+            if (!alloc)
+                free_large(buf);
+
+            return ret;
+        }
 
-    if (data != buf)
-        memcpy(buf, data + offset, count);
+        net_cache_store(handle->cache, buf, handle->handle.size, 0);
+    }
 
+    *_buf = buf;
     return STATUS_SUCCESS;
 }
 
-/** Open a path on the filesystem.
- * @param mount         Mount to open from.
- * @param path          Path to file/directory to open (can be modified).
- * @param from          Handle on this FS to open relative to.
- * @param _handle       Where to store pointer to opened handle.
+/** Get the size of a file using the firmware TFTP client.
+ * @param net           Network device.
+ * @param path          Path to the file.
+ * @param _size         Where to store size of the file.
  * @return              Status code describing the result of the operation. */
-static status_t efi_net_fs_open_path(fs_mount_t *mount, char *path, fs_handle_t *from, fs_handle_t **_handle) {
-    efi_net_t *net = container_of(mount, efi_net_t, mount);
-    uint64_t size;
-    size_t len;
-    efi_net_handle_t *handle;
+static status_t get_file_size(efi_net_t *net, const char *path, uint64_t *_size) {
     efi_status_t ret;
 
-    if (from)
-        return STATUS_NOT_SUPPORTED;
-
-    /* Get the file size. */
     ret = efi_call(net->bc->mtftp,
-        net->bc, EFI_PXE_BASE_CODE_TFTP_GET_FILE_SIZE, NULL, false, &size, NULL,
+        net->bc, EFI_PXE_BASE_CODE_TFTP_GET_FILE_SIZE, NULL, false, _size, NULL,
         (efi_ip_address_t *)&net->net.server_ip, (efi_char8_t *)path,
         NULL, false);
     if (ret != STATUS_SUCCESS) {
@@ -171,12 +345,87 @@ static status_t efi_net_fs_open_path(fs_mount_t *mount, char *path, fs_handle_t
         }
     }
 
+    return STATUS_SUCCESS;
+}
+
+/** Open a path on the filesystem.
+ * @param mount         Mount to open from.
+ * @param path          Path to file/directory to open (can be modified).
+ * @param from          Handle on this FS to open relative to.
+ * @param _handle       Where to store pointer to opened handle.
+ * @return              Status code describing the result of the operation. */
+static status_t efi_net_fs_open_path(fs_mount_t *mount, char *path, fs_handle_t *from, fs_handle_t **_handle) {
+    efi_net_t *net = container_of(mount, efi_net_t, mount);
+    uint64_t size = TFTP_SIZE_UNKNOWN;
+    size_t len;
+    efi_net_handle_t *handle;
+    status_t ret;
+
+    if (from)
+        return STATUS_NOT_SUPPORTED;
+
     len = strlen(path);
     handle = malloc(sizeof(*handle) + len + 1);
-    fs_handle_init(&handle->handle, mount, FILE_TYPE_REGULAR, size);
+    fs_handle_init(&handle->handle, mount, FILE_TYPE_REGULAR, 0);
+    handle->native = false;
     handle->data = NULL;
     strcpy(handle->path, path);
 
+    /* If we have seen the file before we know it exists and its size, so we
+     * do not need to go to the server until we read something not cached. */
+    handle->cache = net_cache_lookup(&net->net, path);
+    if (handle->cache) {
+        if (net->native) {
+            tftp_init(&handle->transfer, &efi_tftp_ops, &net->net, handle->path, net->max_block_size);
+            handle->native = true;
+        }
+
+        handle->handle.size = handle->cache->size;
+        *_handle = &handle->handle;
+        return STATUS_SUCCESS;
+    }
+
+    if (net->native) {
+        tftp_init(&handle->transfer, &efi_tftp_ops, &net->net, handle->path, net->max_block_size);
+
+        /* Start the transfer now: this tells us whether the file exists and,
+         * if the server supports tsize, its size. Reads from the start of the
+         * file then continue on from here. */
+        set_current(handle);
+        ret = tftp_open(&handle->transfer);
+        if (ret == STATUS_SUCCESS) {
+            handle->native = true;
+            size = handle->transfer.size;
+        } else {
+            tftp_close(&handle->transfer);
+            net->current = NULL;
+
+            if (ret == STATUS_NOT_FOUND) {
+                free(handle);
+                return ret;
+            }
+
+            dprintf("efi: TFTP failed on %pE (%pS), using firmware TFTP\n", net->path, ret);
+            net->native = false;
+        }
+    }
+
+    /* Without tsize we have no choice but to ask the firmware. */
+    if (size == TFTP_SIZE_UNKNOWN) {
+        ret = get_file_size(net, path, &size);
+        if (ret != STATUS_SUCCESS) {
+            if (handle->native) {
+                tftp_close(&handle->transfer);
+                net->current = NULL;
+            }
+
+            free(handle);
+            return ret;
+        }
+    }
+
+    handle->handle.size = size;
+    handle->cache = net_cache_insert(&net->net, path, size);
     *_handle = &handle->handle;
     return STATUS_SUCCESS;
 }
@@ -185,7 +434,16 @@ static status_t efi_net_fs_open_path(fs_mount_t *mount, char *path, fs_handle_t
  * @param _handle       Handle to close. */
 static void efi_net_fs_close(fs_handle_t *_handle) {
     efi_net_handle_t *handle = container_of(_handle, efi_net_handle_t, handle);
+    efi_net_t *net = container_of(_handle->mount, efi_net_t, mount);
+
+    if (handle->native) {
+        tftp_close(&handle->transfer);
 
+        if (net->current == handle)
+            net->current = NULL;
+    }
+
+    net_cache_release(handle->cache);
     free_large(handle->data);
 }
 
@@ -193,6 +451,7 @@ static void efi_net_fs_close(fs_handle_t *_handle) {
 static fs_ops_t efi_net_fs_ops = {
     .name = "TFTP",
     .read = efi_net_fs_read,
+    .load = efi_net_fs_load,
     .open_path = efi_net_fs_open_path,
     .close = efi_net_fs_close,
 };
@@ -242,6 +501,7 @@ void efi_net_init(void) {
         efi_net_t *net;
         efi_pxe_base_code_mode_t *mode;
         efi_pxe_base_code_packet_t *packet;
+        efi_simple_network_protocol_t *snp;
 
         net = malloc(sizeof(*net));
         memset(net, 0, sizeof(*net));
@@ -292,6 +552,14 @@ void efi_net_init(void) {
             continue;
         }
 
+        /* Size TFTP blocks to fill a packet if we can find the MTU. */
+        net->native = true;
+        net->max_block_size = TFTP_ETHERNET_BLOCK_SIZE;
+
+        ret = efi_open_protocol(handles[i], &simple_network_guid, EFI_OPEN_PROTOCOL_GET_PROTOCOL, (void **)&snp);
+        if (ret == EFI_SUCCESS && snp->mode->max_packet_size > TFTP_DATA_OVERHEAD + TFTP_DEFAULT_BLOCK_SIZE)
+            net->max_block_size = min(snp->mode->max_packet_size - TFTP_DATA_OVERHEAD, TFTP_MAX_BLOCK_SIZE);
+
         /* Register a device. */
         net_device_register_with_bootp(
             &net->net,
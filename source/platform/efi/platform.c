@@ -81,6 +81,7 @@ __noreturn void efi_main(efi_handle_t image_handle, efi_system_table_t *system_t
 void target_device_probe(void) {
     efi_disk_init();
     efi_net_init();
+    efi_http_init();
 }
 
 /** Reboot the system. */
@@ -0,0 +1,504 @@
+/*
+ * Copyright (C) 2015 Alex Smith
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/**
+ * @file
+ * @brief               TFTP client.
+ *
+ * This implements the client side of TFTP read transfers on top of a UDP
+ * transport provided by the platform. The blksize (RFC 2348), tsize
+ * (RFC 2349) and windowsize (RFC 7440) options are negotiated where the server
+ * supports them, and we fall back to plain lock-step 512 byte blocks where it
+ * does not.
+ *
+ * A transfer is streamed: data is copied out of each block as it arrives, and
+ * reads at increasing offsets continue the same transfer. The last few blocks
+ * received are kept in a ring buffer, so that re-reading a header or a
+ * structure straddling a block boundary does not need to go back to the
+ * server. Reading at an offset before that restarts the transfer from the
+ * beginning, since TFTP has no way to seek.
+ */
+
+#include <lib/string.h>
+#include <lib/utility.h>
+
+#include <endian.h>
+#include <loader.h>
+#include <memory.h>
+#include <tftp.h>
+
+/** First and number of client UDP ports (the dynamic port range). */
+#define TFTP_PORT_BASE      49152
+#define TFTP_PORT_COUNT     16384
+
+/** Next client port to use. */
+static uint16_t next_tftp_port;
+
+/** Get a client port for a new transfer.
+ * @return              Port number. */
+static uint16_t alloc_port(void) {
+    /* Each transfer should use a different port (RFC 1350), and we'd rather not
+     * reuse the ports used by a previous boot attempt. */
+    if (!next_tftp_port)
+        next_tftp_port = current_timestamp() % TFTP_PORT_COUNT;
+
+    return TFTP_PORT_BASE + (next_tftp_port++ % TFTP_PORT_COUNT);
+}
+
+/** Send an acknowledgement.
+ * @param transfer      Transfer to send for.
+ * @param block         Block number to acknowledge.
+ * @return              Status code describing the result of the operation. */
+static status_t send_ack(tftp_transfer_t *transfer, uint16_t block) {
+    uint16_t packet[2];
+
+    packet[0] = cpu_to_be16(TFTP_OPCODE_ACK);
+    packet[1] = cpu_to_be16(block);
+
+    transfer->window_count = 0;
+    return transfer->ops->send(transfer, packet, sizeof(packet), transfer->server_port);
+}
+
+/** Send an error to terminate a transfer.
+ * @param transfer      Transfer to send for.
+ * @param code          Error code.
+ * @param msg           Error message. */
+static void send_error(tftp_transfer_t *transfer, uint16_t code, const char *msg) {
+    uint8_t packet[32];
+    size_t len;
+
+    len = min(strlen(msg), sizeof(packet) - 5);
+
+    *(uint16_t *)&packet[0] = cpu_to_be16(TFTP_OPCODE_ERROR);
+    *(uint16_t *)&packet[2] = cpu_to_be16(code);
+    memcpy(&packet[4], msg, len);
+    packet[4 + len] = 0;
+
+    transfer->ops->send(transfer, packet, 5 + len, transfer->server_port);
+}
+
+/** Append a string to a request packet.
+ * @param transfer      Transfer being built.
+ * @param offset        Current offset in the packet.
+ * @param str           String to append (including its terminator).
+ * @return              New offset in the packet. */
+static size_t append_string(tftp_transfer_t *transfer, size_t offset, const char *str) {
+    size_t len = strlen(str) + 1;
+
+    memcpy(&transfer->packet[offset], str, len);
+    return offset + len;
+}
+
+/** Build and send a read request.
+ * @param transfer      Transfer to send for.
+ * @return              Status code describing the result of the operation. */
+static status_t send_request(tftp_transfer_t *transfer) {
+    char value[8];
+    size_t offset;
+
+    *(uint16_t *)transfer->packet = cpu_to_be16(TFTP_OPCODE_RRQ);
+    offset = append_string(transfer, 2, transfer->path);
+    offset = append_string(transfer, offset, "octet");
+
+    offset = append_string(transfer, offset, "blksize");
+    snprintf(value, sizeof(value), "%u", transfer->max_block_size);
+    offset = append_string(transfer, offset, value);
+
+    offset = append_string(transfer, offset, "tsize");
+    offset = append_string(transfer, offset, "0");
+
+    offset = append_string(transfer, offset, "windowsize");
+    snprintf(value, sizeof(value), "%u", TFTP_WINDOW_SIZE);
+    offset = append_string(transfer, offset, value);
+
+    /* Requests always go to the well-known port. */
+    return transfer->ops->send(transfer, transfer->packet, offset, transfer->net->server_port);
+}
+
+/** Parse an option acknowledgement.
+ * @param transfer      Transfer the packet was received for.
+ * @param size          Size of the packet.
+ * @return              Whether the options were acceptable. */
+static bool parse_oack(tftp_transfer_t *transfer, size_t size) {
+    char *opt = (char *)&transfer->packet[2];
+    char *end = (char *)&transfer->packet[size];
+
+    while (opt < end) {
+        char *value;
+        unsigned long num;
+        size_t len;
+
+        len = strnlen(opt, end - opt);
+        value = opt + len + 1;
+        if (value >= end)
+            return false;
+
+        len = strnlen(value, end - value);
+        if (value + len >= end)
+            return false;
+
+        num = strtoul(value, NULL, 10);
+
+        /* The server is only allowed to reduce values that we request. */
+        if (strcasecmp(opt, "blksize") == 0) {
+            if (num < TFTP_MIN_BLOCK_SIZE || num > transfer->max_block_size)
+                return false;
+
+            transfer->block_size = num;
+        } else if (strcasecmp(opt, "tsize") == 0) {
+            transfer->size = num;
+        } else if (strcasecmp(opt, "windowsize") == 0) {
+            if (!num || num > TFTP_WINDOW_SIZE)
+                return false;
+
+            transfer->window_size = num;
+        }
+
+        opt = value + len + 1;
+    }
+
+    return true;
+}
+
+/** Convert an error packet to a status code.
+ * @param transfer      Transfer the packet was received for.
+ * @param size          Size of the packet.
+ * @return              Status code corresponding to the error. */
+static status_t handle_error(tftp_transfer_t *transfer, size_t size) {
+    uint16_t code = (size >= 4) ? be16_to_cpu(*(uint16_t *)&transfer->packet[2]) : TFTP_ERROR_UNDEFINED;
+
+    transfer->active = false;
+
+    if (code == TFTP_ERROR_NOT_FOUND)
+        return STATUS_NOT_FOUND;
+
+    transfer->packet[size - 1] = 0;
+    dprintf(
+        "tftp: error %u reading '%s': %s\n", code, transfer->path,
+        (size > 4) ? (char *)&transfer->packet[4] : "");
+    return STATUS_DEVICE_ERROR;
+}
+
+/** Receive a packet from the server.
+ * @param transfer      Transfer to receive for.
+ * @param _size         Where to store size of the packet.
+ * @param _port         Where to store port the packet came from.
+ * @return              Status code describing the result of the operation. */
+static status_t receive_packet(tftp_transfer_t *transfer, size_t *_size, uint16_t *_port) {
+    size_t size = transfer->packet_size;
+    status_t ret;
+
+    ret = transfer->ops->receive(transfer, transfer->packet, &size, _port, TFTP_TIMEOUT);
+    if (ret != STATUS_SUCCESS)
+        return ret;
+
+    /* Ignore anything too short to be a valid packet. */
+    *_size = size;
+    return (size >= 4) ? STATUS_SUCCESS : STATUS_TIMED_OUT;
+}
+
+/** Start a transfer.
+ * @param transfer      Transfer to start.
+ * @return              Status code describing the result of the operation. */
+static status_t start_transfer(tftp_transfer_t *transfer) {
+    status_t ret;
+
+    if (!transfer->blocks)
+        transfer->blocks = malloc(transfer->packet_size * TFTP_RECENT_BLOCKS);
+
+    transfer->local_port = alloc_port();
+    transfer->server_port = transfer->net->server_port;
+    transfer->block_size = TFTP_DEFAULT_BLOCK_SIZE;
+    transfer->window_size = 1;
+    transfer->window_count = 0;
+    transfer->block = 0;
+    transfer->size = TFTP_SIZE_UNKNOWN;
+    transfer->start = 0;
+    transfer->position = 0;
+    transfer->kept = 0;
+    transfer->complete = false;
+
+    /* Block 1 goes in the first slot, so receive the reply to the request
+     * there as well. */
+    transfer->packet = transfer->blocks;
+
+    for (unsigned retries = 0; retries <= TFTP_RETRIES; retries++) {
+        size_t size;
+        uint16_t port, opcode;
+
+        ret = send_request(transfer);
+        if (ret != STATUS_SUCCESS)
+            return ret;
+
+        ret = receive_packet(transfer, &size, &port);
+        if (ret == STATUS_TIMED_OUT) {
+            continue;
+        } else if (ret != STATUS_SUCCESS) {
+            return ret;
+        }
+
+        /* The reply comes from the port the server will use for the rest of
+         * the transfer. */
+        transfer->server_port = port;
+        opcode = be16_to_cpu(*(uint16_t *)transfer->packet);
+
+        if (opcode == TFTP_OPCODE_ERROR) {
+            return handle_error(transfer, size);
+        } else if (opcode == TFTP_OPCODE_OACK) {
+            if (!parse_oack(transfer, size)) {
+                send_error(transfer, TFTP_ERROR_OPTION, "Invalid option value");
+                return STATUS_DEVICE_ERROR;
+            }
+
+            dprintf(
+                "tftp: reading '%s' (blksize: %u, windowsize: %u, tsize: %" PRId64 ")\n",
+                transfer->path, transfer->block_size, transfer->window_size,
+                (transfer->size != TFTP_SIZE_UNKNOWN) ? (int64_t)transfer->size : -1);
+
+            /* Acknowledging the options starts the data transfer. */
+            transfer->active = true;
+            return send_ack(transfer, 0);
+        } else if (opcode == TFTP_OPCODE_DATA && be16_to_cpu(*(uint16_t *)&transfer->packet[2]) == 1) {
+            /* Server does not support options, this is the first block. */
+            dprintf("tftp: reading '%s' (server does not support options)\n", transfer->path);
+
+            transfer->active = true;
+            transfer->block = 1;
+            transfer->kept = 1;
+            transfer->position = size - 4;
+            transfer->complete = transfer->position < transfer->block_size;
+            return send_ack(transfer, 1);
+        }
+
+        /* Anything else is a stray packet, just ask again. */
+    }
+
+    dprintf("tftp: timed out requesting '%s'\n", transfer->path);
+    return STATUS_TIMED_OUT;
+}
+
+/** Get the ring buffer slot for a block.
+ * @param transfer      Transfer to get from.
+ * @param block         Block number (starting from 1).
+ * @return              Pointer to the slot (containing the whole packet). */
+static inline uint8_t *get_slot(tftp_transfer_t *transfer, uint32_t block) {
+    return &transfer->blocks[((block - 1) % TFTP_RECENT_BLOCKS) * transfer->packet_size];
+}
+
+/** Receive the next block of a transfer.
+ * @param transfer      Transfer to receive for.
+ * @return              Status code describing the result of the operation. */
+static status_t next_block(tftp_transfer_t *transfer) {
+    uint16_t expected = transfer->block + 1;
+    bool gap_acked = false;
+    unsigned retries = 0;
+    status_t ret;
+
+    /* Receive into the slot for the next block. If the ring is full, this
+     * holds the oldest block we have, which is about to be overwritten. */
+    transfer->packet = get_slot(transfer, expected);
+    if (transfer->kept == TFTP_RECENT_BLOCKS) {
+        transfer->start += transfer->block_size;
+        transfer->kept--;
+    }
+
+    while (true) {
+        size_t size;
+        uint16_t port, opcode, num;
+
+        ret = receive_packet(transfer, &size, &port);
+        if (ret == STATUS_TIMED_OUT) {
+            if (++retries > TFTP_RETRIES) {
+                dprintf("tftp: timed out waiting for block %u of '%s'\n", expected, transfer->path);
+                return STATUS_TIMED_OUT;
+            }
+
+            /* Acknowledging the last block we got in sequence makes the server
+             * resend from the following block. */
+            ret = send_ack(transfer, transfer->block);
+            if (ret != STATUS_SUCCESS)
+                return ret;
+
+            continue;
+        } else if (ret != STATUS_SUCCESS) {
+            return ret;
+        } else if (port != transfer->server_port) {
+            continue;
+        }
+
+        opcode = be16_to_cpu(*(uint16_t *)transfer->packet);
+        num = be16_to_cpu(*(uint16_t *)&transfer->packet[2]);
+
+        if (opcode == TFTP_OPCODE_ERROR) {
+            return handle_error(transfer, size);
+        } else if (opcode != TFTP_OPCODE_DATA || size - 4 > transfer->block_size) {
+            continue;
+        }
+
+        if (num == expected) {
+            transfer->block++;
+            transfer->kept++;
+            transfer->window_count++;
+            transfer->position += size - 4;
+
+            /* A short block ends the transfer. Otherwise, the server waits for
+             * an acknowledgement at the end of each window. */
+            if (size - 4 < transfer->block_size) {
+                transfer->complete = true;
+                return send_ack(transfer, transfer->block);
+            } else if (transfer->window_count >= transfer->window_size) {
+                return send_ack(transfer, transfer->block);
+            }
+
+            return STATUS_SUCCESS;
+        } else if ((uint16_t)(num - expected) < 0x8000 && !gap_acked) {
+            /* We've missed a block within the window. Tell the server where we
+             * got up to straight away rather than waiting to time out. Blocks
+             * that we have already received are just ignored. */
+            ret = send_ack(transfer, transfer->block);
+            if (ret != STATUS_SUCCESS)
+                return ret;
+
+            gap_acked = true;
+        }
+    }
+}
+
+/** Abort a transfer if it is in progress.
+ * @param transfer      Transfer to abort. */
+static void abort_transfer(tftp_transfer_t *transfer) {
+    if (transfer->active && !transfer->complete)
+        send_error(transfer, TFTP_ERROR_UNDEFINED, "Transfer aborted");
+
+    transfer->active = false;
+    transfer->start = transfer->position;
+    transfer->kept = 0;
+}
+
+/** Initialize a TFTP transfer.
+ * @param transfer      Transfer to initialize.
+ * @param ops           Transport operations.
+ * @param net           Network device to transfer using.
+ * @param path          Path to the file (must remain valid while the transfer
+ *                      is in use).
+ * @param max_block_size Largest block size to request, usually determined by
+ *                      the MTU of the network. */
+void tftp_init(
+    tftp_transfer_t *transfer, const tftp_ops_t *ops, net_device_t *net,
+    const char *path, uint16_t max_block_size)
+{
+    size_t request_size;
+
+    transfer->ops = ops;
+    transfer->net = net;
+    transfer->path = path;
+    transfer->max_block_size = min(max(max_block_size, TFTP_DEFAULT_BLOCK_SIZE), TFTP_MAX_BLOCK_SIZE);
+    transfer->active = false;
+    transfer->complete = false;
+    transfer->size = TFTP_SIZE_UNKNOWN;
+    transfer->start = 0;
+    transfer->position = 0;
+    transfer->kept = 0;
+
+    /* Each slot must hold both a data block and the request. */
+    request_size = 2 + strlen(path) + 1 + 64;
+    transfer->packet_size = max((size_t)transfer->max_block_size + 4, request_size);
+    transfer->blocks = NULL;
+    transfer->packet = NULL;
+}
+
+/**
+ * Open a TFTP transfer.
+ *
+ * Starts a transfer of a file, negotiating options with the server. The
+ * transfer size is available in the size field upon success if the server
+ * supports the tsize option, otherwise it is set to TFTP_SIZE_UNKNOWN.
+ *
+ * @param transfer      Transfer to open.
+ *
+ * @return              Status code describing the result of the operation.
+ */
+status_t tftp_open(tftp_transfer_t *transfer) {
+    abort_transfer(transfer);
+    return start_transfer(transfer);
+}
+
+/**
+ * Read from a TFTP transfer.
+ *
+ * Reads data from a file being transferred. Data is copied out of blocks as
+ * they are received, so reading sequentially through a file streams it from
+ * the server. Reads within the last TFTP_RECENT_BLOCKS blocks are satisfied
+ * from those. If the offset is before that, or the transfer is not in
+ * progress, it is restarted.
+ *
+ * @param transfer      Transfer to read from.
+ * @param buf           Buffer to read into.
+ * @param count         Number of bytes to read.
+ * @param offset        Offset in the file to read from.
+ *
+ * @return              Status code describing the result of the operation.
+ */
+status_t tftp_read(tftp_transfer_t *transfer, void *buf, size_t count, offset_t offset) {
+    status_t ret;
+
+    if ((!transfer->active && !transfer->complete) || offset < transfer->start) {
+        ret = tftp_open(transfer);
+        if (ret != STATUS_SUCCESS)
+            return ret;
+    }
+
+    while (count) {
+        if (offset >= transfer->start && offset < transfer->position) {
+            /* Only the last block can be short, so we can find the block
+             * from the start of the oldest one we have. */
+            size_t index = (offset - transfer->start) / transfer->block_size;
+            size_t block_offset = (offset - transfer->start) % transfer->block_size;
+            uint32_t block = transfer->block - transfer->kept + 1 + index;
+            size_t size = min(
+                min(count, transfer->block_size - block_offset),
+                transfer->position - offset);
+
+            memcpy(buf, &get_slot(transfer, block)[4 + block_offset], size);
+            buf += size;
+            offset += size;
+            count -= size;
+        } else if (transfer->complete) {
+            return STATUS_END_OF_FILE;
+        } else {
+            ret = next_block(transfer);
+            if (ret != STATUS_SUCCESS) {
+                abort_transfer(transfer);
+                return ret;
+            }
+        }
+    }
+
+    return STATUS_SUCCESS;
+}
+
+/** Close a TFTP transfer.
+ * @param transfer      Transfer to close. The block buffer is freed, but the
+ *                      transfer can be reopened with tftp_open() or
+ *                      tftp_read(). */
+void tftp_close(tftp_transfer_t *transfer) {
+    abort_transfer(transfer);
+
+    transfer->complete = false;
+    free(transfer->blocks);
+    transfer->blocks = NULL;
+    transfer->packet = NULL;
+}
@@ -19,9 +19,31 @@
  * @brief               Timing functions.
  */
 
+#include <lib/string.h>
+
+#include <config.h>
 #include <loader.h>
 #include <time.h>
 
+/** Ring of recently completed trace spans. */
+static trace_span_t trace_ring[TRACE_SPANS_MAX];
+static size_t trace_ring_next;
+static size_t trace_ring_count;
+
+/** Per-phase trace totals. */
+static trace_total_t trace_phase_totals[TRACE_PHASE_COUNT];
+
+/** Names of trace phases. */
+static const char *const trace_phase_names[TRACE_PHASE_COUNT] = {
+    [TRACE_PHASE_DEVICE]     = "device",
+    [TRACE_PHASE_MOUNT]      = "mount",
+    [TRACE_PHASE_CONFIG]     = "config",
+    [TRACE_PHASE_READ]       = "read",
+    [TRACE_PHASE_DECOMPRESS] = "decompress",
+    [TRACE_PHASE_LOAD]       = "load",
+    [TRACE_PHASE_MEMORY]     = "memory",
+};
+
 /** Delay for a number of milliseconds.
  * @param msecs         Milliseconds to delay for. */
 void delay(mstime_t msecs) {
@@ -30,3 +52,123 @@ void delay(mstime_t msecs) {
     while (current_time() < target)
         arch_pause();
 }
+
+/** End a trace span.
+ * @param phase         Phase that the span is for.
+ * @param start         Start timestamp returned from trace_begin().
+ * @param bytes         Number of bytes transferred during the span.
+ * @param name          Name of the object operated on (can be NULL). */
+void trace_end(trace_phase_t phase, uint64_t start, uint64_t bytes, const char *name) {
+    trace_span_t *span = &trace_ring[trace_ring_next];
+    trace_total_t *total = &trace_phase_totals[phase];
+
+    span->start = start;
+    span->end = current_timestamp();
+    span->bytes = bytes;
+    span->phase = phase;
+
+    if (name) {
+        strncpy(span->name, name, TRACE_NAME_MAX - 1);
+        span->name[TRACE_NAME_MAX - 1] = 0;
+    } else {
+        span->name[0] = 0;
+    }
+
+    total->time += span->end - span->start;
+    total->bytes += bytes;
+    total->count++;
+
+    trace_ring_next = (trace_ring_next + 1) % TRACE_SPANS_MAX;
+    if (trace_ring_count < TRACE_SPANS_MAX)
+        trace_ring_count++;
+}
+
+/** Get the recorded trace spans.
+ * @param _spans        Where to store pointer to span ring.
+ * @param _first        Where to store index of the oldest span in the ring.
+ *                      Following spans are at subsequent indices modulo
+ *                      TRACE_SPANS_MAX.
+ * @return              Number of spans recorded. */
+size_t trace_spans(const trace_span_t **_spans, size_t *_first) {
+    *_spans = trace_ring;
+    *_first = (trace_ring_next + TRACE_SPANS_MAX - trace_ring_count) % TRACE_SPANS_MAX;
+    return trace_ring_count;
+}
+
+/** Get the per-phase trace totals.
+ * @return              Array of totals, indexed by phase. */
+const trace_total_t *trace_totals(void) {
+    return trace_phase_totals;
+}
+
+/** Print a time in milliseconds with microsecond precision.
+ * @param timestamp     Timestamp difference to print. */
+static void print_trace_time(uint64_t timestamp) {
+    uint64_t usecs = timestamp_to_usecs(timestamp);
+
+    printf("%6" PRIu64 ".%03u", usecs / 1000, (unsigned)(usecs % 1000));
+}
+
+/** Print a transfer rate.
+ * @param bytes         Number of bytes transferred.
+ * @param timestamp     Time taken to transfer. */
+static void print_trace_rate(uint64_t bytes, uint64_t timestamp) {
+    uint64_t usecs = timestamp_to_usecs(timestamp);
+
+    if (bytes && usecs) {
+        printf("  %8" PRIu64 "\n", (bytes * 1000000 / usecs) / 1024);
+    } else {
+        printf("  %8s\n", "-");
+    }
+}
+
+/** Print boot timing statistics.
+ * @param args          Argument list.
+ * @return              Whether successful. */
+static bool config_cmd_bootstat(value_list_t *args) {
+    const trace_span_t *spans;
+    size_t count, first;
+
+    if (args->count != 0) {
+        config_error("Invalid arguments");
+        return false;
+    }
+
+    printf("Phase         Count   Time (ms)        Bytes     KiB/s\n");
+    printf("-----         -----   ---------        -----     -----\n");
+
+    for (size_t i = 0; i < TRACE_PHASE_COUNT; i++) {
+        const trace_total_t *total = &trace_phase_totals[i];
+
+        printf("%-12s %6" PRIu32 " ", trace_phase_names[i], total->count);
+        print_trace_time(total->time);
+        printf(" %12" PRIu64, total->bytes);
+        print_trace_rate(total->bytes, total->time);
+    }
+
+    printf("\nTime since loader start: ");
+    print_trace_time(current_timestamp());
+    printf(" ms\n");
+
+    count = trace_spans(&spans, &first);
+    if (!count)
+        return true;
+
+    printf("\n  Start (ms) Phase       Name              Time (ms)        Bytes     KiB/s\n");
+    printf("  ---------- -----       ----              ---------        -----     -----\n");
+
+    for (size_t i = 0; i < count; i++) {
+        const trace_span_t *span = &spans[(first + i) % TRACE_SPANS_MAX];
+
+        printf(" ");
+        print_trace_time(span->start);
+        printf(" %-11s %-15s ", trace_phase_names[span->phase], span->name);
+        print_trace_time(span->end - span->start);
+        printf(" %12" PRIu64, span->bytes);
+        print_trace_rate(span->bytes, span->end - span->start);
+    }
+
+    return true;
+}
+
+BUILTIN_COMMAND("bootstat", "Show boot timing statistics", config_cmd_bootstat);